@@ -1,9 +1,11 @@
 #include "arguments.h"
 #include <assert.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "diagnostics.h"
+#include "eval.h"
 
 int parse_arguments(arguments* args, size_t argc, char** argv) {
     size_t argi;
@@ -11,8 +13,33 @@ int parse_arguments(arguments* args, size_t argc, char** argv) {
 
     /* setup default values */
     args->file = 0;
+    args->eval_step_budget = EVAL_DEFAULT_STEP_BUDGET;
     args->dump_tokens = 0;
+    args->num_threads = 0;
     args->dump_syntax_tree = 0;
+    args->dump_sema_times = 0;
+    args->dump_declarations = 0;
+    args->lazy_bodies = 0;
+    args->headers_only = 0;
+    args->stream = 0;
+    args->dump_memory = 0;
+    args->pipeline = 0;
+    args->dump_front_end_times = 0;
+    args->dump_counters = 0;
+    args->no_io_uring = 0;
+    args->trace_file = 0;
+    args->parallel_lex = 0;
+    args->emit_object = 0;
+    args->output_file = 0;
+    args->no_inline = 0;
+    args->dump_inlining = 0;
+    args->no_vectorize = 0;
+    args->dump_vectorization = 0;
+    args->dump_layout = 0;
+    args->error_limit = 0;
+    args->json_diagnostics = 0;
+    args->num_imports = 0;
+    args->emit_interface = 0;
 
     for (argi = 0; argi != argc; ++argi) {
         char* arg = argv[argi];
@@ -25,6 +52,140 @@ int parse_arguments(arguments* args, size_t argc, char** argv) {
             args->dump_syntax_tree = 1;
             continue;
         }
+        if (strcmp(arg, "-compiler-dump=declarations") == 0) {
+            args->dump_declarations = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-lazy-bodies") == 0) {
+            args->lazy_bodies = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-headers-only") == 0) {
+            /* the bodies are never needed */
+            args->lazy_bodies = 1;
+            args->headers_only = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=memory") == 0) {
+            args->dump_memory = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=front-end-times") == 0) {
+            args->dump_front_end_times = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=counters") == 0) {
+            args->dump_counters = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-no-io-uring") == 0) {
+            args->no_io_uring = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-pipeline") == 0) {
+            args->pipeline = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-parallel-lex") == 0) {
+            args->parallel_lex = 1;
+            continue;
+        }
+        if (strcmp(arg, "-c") == 0) {
+            args->emit_object = 1;
+            continue;
+        }
+        if (strcmp(arg, "-o") == 0) {
+            if (argi + 1 == argc) {
+                print_error("Output file not specified");
+                return -1;
+            }
+            args->output_file = argv[++argi];
+            continue;
+        }
+        if (strcmp(arg, "-compiler-no-inline") == 0) {
+            args->no_inline = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=inlining") == 0) {
+            args->dump_inlining = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-no-vectorize") == 0) {
+            args->no_vectorize = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=vectorization") == 0) {
+            args->dump_vectorization = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=layout") == 0) {
+            args->dump_layout = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-diagnostics=json") == 0) {
+            args->json_diagnostics = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-stream") == 0) {
+            args->stream = 1;
+            continue;
+        }
+        if (strcmp(arg, "-compiler-dump=sema-times") == 0) {
+            args->dump_sema_times = 1;
+            continue;
+        }
+        if (strncmp(arg, "-compiler-threads=", 18) == 0) {
+            char* end;
+            args->num_threads = strtoul(arg + 18, &end, 10);
+            if (end == arg + 18 || *end) {
+                print_error("Invalid number of threads %s", arg + 18);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(arg, "-compiler-emit-interface") == 0) {
+            args->emit_interface = 1;
+            continue;
+        }
+        if (strncmp(arg, "-compiler-import=", 17) == 0) {
+            if (!arg[17]) {
+                print_error("Interface file not specified");
+                return -1;
+            }
+            if (args->num_imports == MAX_IMPORTS) {
+                print_error("Cannot import more than %d interfaces",
+                            MAX_IMPORTS);
+                return -1;
+            }
+            args->imports[args->num_imports++] = arg + 17;
+            continue;
+        }
+        if (strncmp(arg, "-compiler-error-limit=", 22) == 0) {
+            char* end;
+            args->error_limit = strtoul(arg + 22, &end, 10);
+            if (end == arg + 22 || *end) {
+                print_error("Invalid error limit %s", arg + 22);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(arg, "-compiler-trace=", 16) == 0) {
+            if (!arg[16]) {
+                print_error("Trace file not specified");
+                return -1;
+            }
+            args->trace_file = arg + 16;
+            continue;
+        }
+        if (strncmp(arg, "-compiler-eval-budget=", 22) == 0) {
+            char* end;
+            args->eval_step_budget = strtoul(arg + 22, &end, 10);
+            if (end == arg + 22 || *end) {
+                print_error("Invalid evaluation budget %s", arg + 22);
+                return -1;
+            }
+            continue;
+        }
         if (arg[0] == '-') {
             print_error("Unknown option %s", arg);
             return -1;
@@ -42,5 +203,14 @@ int parse_arguments(arguments* args, size_t argc, char** argv) {
         print_error("File not specified to compile.");
         return -1;
     }
+    if (args->output_file && !args->emit_object) {
+        print_error("Linking is not supported, use -c to write an object");
+        return -1;
+    }
+    if (args->emit_object && (args->stream || args->headers_only)) {
+        print_error("-c cannot be used with -compiler-stream or "
+                    "-compiler-headers-only");
+        return -1;
+    }
     return 0;
 }
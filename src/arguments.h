@@ -4,6 +4,7 @@
 #define HEADER_GUARD_ARGUMENTS_H
 
 #include <stddef.h>
+#include "module.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,8 +12,63 @@ extern "C" {
 
 struct arguments {
     const char* file;
+    unsigned long eval_step_budget;
+    /* Write a Chrome trace of the compilation here if not null. */
+    const char* trace_file;
+    /* Where -c writes the object, null to name it after the source
+     * file. */
+    const char* output_file;
+    /* 0 picks the number of processors */
+    size_t num_threads;
+    /* Stop printing errors after this many, 0 for no limit. */
+    size_t error_limit;
+    /* The interfaces of the modules the file uses. */
+    const char* imports[MAX_IMPORTS];
+    size_t num_imports;
     int dump_tokens : 1;
     int dump_syntax_tree : 1;
+    int dump_sema_times : 1;
+    int dump_declarations : 1;
+    /* Print the peak memory use. */
+    int dump_memory : 1;
+    /* Print how long lexing and parsing took. */
+    int dump_front_end_times : 1;
+    /* Print hardware performance counters for each phase. */
+    int dump_counters : 1;
+    /* Read the files of a directory with pread on threads rather
+     * than with io_uring. */
+    int no_io_uring : 1;
+    /* Skip over function bodies while parsing and only parse them
+     * once they are needed. */
+    int lazy_bodies : 1;
+    /* Only check declarations, never function bodies. */
+    int headers_only : 1;
+    /* Process one top level declaration at a time, releasing it
+     * before reading the next. */
+    int stream : 1;
+    /* Lex on a separate thread while parsing. */
+    int pipeline : 1;
+    /* Read the whole file and lex chunks of it on multiple
+     * threads. */
+    int parallel_lex : 1;
+    /* Generate code and write a relocatable object. */
+    int emit_object : 1;
+    /* Don't inline calls when generating code. */
+    int no_inline : 1;
+    /* Print what the inliner did. */
+    int dump_inlining : 1;
+    /* Don't vectorize loops when generating code. */
+    int no_vectorize : 1;
+    /* Print which loops were vectorized and why the others
+     * weren't. */
+    int dump_vectorization : 1;
+    /* Print where each structure puts its fields. */
+    int dump_layout : 1;
+    /* Print diagnostics as JSON lines. */
+    int json_diagnostics : 1;
+    /* Write the interface of the file for other modules to
+     * import. */
+    int emit_interface : 1;
 };
 typedef struct arguments arguments;
 
@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef HEADER_GUARD_BUILTIN_HASH_H
+#define HEADER_GUARD_BUILTIN_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The hash of the builtin type names, shared by gen_builtins and the
+ * compiler.  It can be computed a piece of the name at a time. */
+static inline uint32_t
+builtin_hash(uint32_t hash, const char* piece, size_t len) {
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        hash = (hash ^ (unsigned char) piece[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static inline size_t
+builtin_slot(uint32_t hash, size_t table_size) {
+    return (hash ^ (hash >> 15)) & (table_size - 1);
+}
+
+#endif
@@ -0,0 +1,2026 @@
+#include "codegen.h"
+#include <assert.h>
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+#include "object.h"
+#include "parse.h"
+#include "pool.h"
+#include "symtab.h"
+#include "types.h"
+#include "vectorize.h"
+
+/* Every value is computed in rax as 64 bits.  Variables hold values
+ * already truncated and extended according to their type.  Binary
+ * operators push their first operand while computing the second and
+ * variables live in 8 byte slots below rbp.  Vectors are the
+ * exception: they are computed in xmm registers and get 16 or 32 byte
+ * slots. */
+
+enum reg {
+    rax = 0,
+    rcx = 1,
+    rdx = 2,
+    rsp = 4,
+    rbp = 5,
+    rsi = 6,
+    rdi = 7,
+    r8 = 8,
+    r9 = 9,
+};
+
+/* The System V registers for the first integer arguments. */
+static const unsigned char argument_registers[] = {
+    rdi, rsi, rdx, rcx, r8, r9,
+};
+#define MAX_REGISTER_ARGUMENTS \
+    (sizeof(argument_registers) / sizeof(*argument_registers))
+
+struct int_type {
+    unsigned char size;
+    unsigned char is_signed;
+};
+
+/* Variables without a type hold 64 bit integers. */
+static const struct int_type inferred_type = {8, 1};
+
+struct slot {
+    const char* name;
+    int32_t offset;
+    struct int_type type;
+    /* The type of vector variables, which take 16 or 32 bytes, null
+     * for integers. */
+    const builtin_type_info* vector;
+};
+
+struct codegen {
+    const vec_var_decl* toplevels;
+    symtab names;
+    /* The symbol of each top level declaration or -1 for constants
+     * and structures. */
+    long* symbols;
+    object_file* object;
+    /* codegen_flags */
+    int flags;
+    /* The function being generated. */
+    const var_decl* fun;
+    struct {
+        struct slot* slots;
+        size_t len, cap;
+    } scope;
+    /* The number of bytes of slots below rbp. */
+    int32_t frame_size;
+    /* The number of temporaries pushed, to align calls. */
+    size_t pushed;
+    /* The rel32 fields of jumps to the epilogue. */
+    struct {
+        size_t* offsets;
+        size_t len, cap;
+    } returns;
+    /* Set on errors and when out of memory.  Generation carries on
+     * to find more errors but nothing is written. */
+    int failed;
+};
+typedef struct codegen codegen;
+
+static int
+lookup_int_type(const char* name, struct int_type* type) {
+    const builtin_type_info* info = find_builtin_type(name, strlen(name));
+    /* bytes and bools are held like unsigned integers */
+    if (!info || info->type < type_byte || info->type > type_u64) {
+        return -1;
+    }
+    type->size = info->size;
+    type->is_signed = info->is_signed;
+    return 0;
+}
+
+/* The vector type called `name`, null if it isn't one. */
+static const builtin_type_info*
+lookup_vector_type(const char* name) {
+    const builtin_type_info* info = find_builtin_type(name, strlen(name));
+    return info && info->lanes > 1 ? info : 0;
+}
+
+int
+get_int_type(const char* name, size_t* size, int* is_signed) {
+    struct int_type type;
+    if (lookup_int_type(name, &type)) {
+        return -1;
+    }
+    *size = type.size;
+    *is_signed = type.is_signed;
+    return 0;
+}
+
+/* The type of a variable or parameter. */
+static int
+variable_type(codegen* gen, const var_decl* var, struct int_type* type) {
+    if (var->type.type != dtype_name && var->type.type != dtype_const_name) {
+        *type = inferred_type;
+        return 0;
+    }
+    if (lookup_int_type(str_cbegin(&var->type.data.name), type)) {
+        print_error_pos(&var->fpos, "Code generation for variables of "
+                        "type %s is not supported yet",
+                        str_cbegin(&var->type.data.name));
+        gen->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+emit(codegen* gen, const void* bytes, size_t len) {
+    if (append_bytes(&gen->object->text, bytes, len)) {
+        gen->failed = 1;
+    }
+}
+
+static void
+emit_byte(codegen* gen, unsigned char byte) {
+    emit(gen, &byte, 1);
+}
+
+static void
+emit_u32(codegen* gen, uint32_t value) {
+    unsigned char bytes[4];
+    bytes[0] = (unsigned char) value;
+    bytes[1] = (unsigned char) (value >> 8);
+    bytes[2] = (unsigned char) (value >> 16);
+    bytes[3] = (unsigned char) (value >> 24);
+    emit(gen, bytes, 4);
+}
+
+static void
+patch_u32(codegen* gen, size_t offset, uint32_t value) {
+    unsigned char* bytes = gen->object->text.bytes + offset;
+    if (offset + 4 > gen->object->text.len) {
+        /* the code wasn't emitted as memory ran out */
+        return;
+    }
+    bytes[0] = (unsigned char) value;
+    bytes[1] = (unsigned char) (value >> 8);
+    bytes[2] = (unsigned char) (value >> 16);
+    bytes[3] = (unsigned char) (value >> 24);
+}
+
+/* Emit a rel32 field to be patched with patch_jump and return its
+ * offset. */
+static size_t
+emit_jump_field(codegen* gen) {
+    size_t offset = gen->object->text.len;
+    emit_u32(gen, 0);
+    return offset;
+}
+
+/* Make the rel32 at `field` jump to the current position. */
+static void
+patch_jump(codegen* gen, size_t field) {
+    patch_u32(gen, field,
+              (uint32_t) (gen->object->text.len - (field + 4)));
+}
+
+/* Emit a rel32 field relocated against `symbol`. */
+static void
+emit_relocated(codegen* gen, long symbol, uint32_t type) {
+    if (add_object_relocation(gen->object, gen->object->text.len,
+                              (uint32_t) symbol, type, -4)) {
+        gen->failed = 1;
+    }
+    emit_u32(gen, 0);
+}
+
+static void
+emit_push_rax(codegen* gen) {
+    emit_byte(gen, 0x50);
+    ++gen->pushed;
+}
+
+static void
+emit_pop(codegen* gen, unsigned char reg) {
+    if (reg >= 8) {
+        emit_byte(gen, 0x41);
+    }
+    emit_byte(gen, 0x58 + (reg & 7));
+    --gen->pushed;
+}
+
+/* Truncate rax to `type` and extend it back to 64 bits. */
+static void
+emit_normalize(codegen* gen, struct int_type type) {
+    static const unsigned char movsx8[] = {0x48, 0x0f, 0xbe, 0xc0};
+    static const unsigned char movsx16[] = {0x48, 0x0f, 0xbf, 0xc0};
+    static const unsigned char movsxd[] = {0x48, 0x63, 0xc0};
+    static const unsigned char movzx8[] = {0x0f, 0xb6, 0xc0};
+    static const unsigned char movzx16[] = {0x0f, 0xb7, 0xc0};
+    static const unsigned char mov32[] = {0x89, 0xc0};
+    switch (type.size) {
+    case 1:
+        if (type.is_signed) {
+            emit(gen, movsx8, sizeof(movsx8));
+        } else {
+            emit(gen, movzx8, sizeof(movzx8));
+        }
+        break;
+    case 2:
+        if (type.is_signed) {
+            emit(gen, movsx16, sizeof(movsx16));
+        } else {
+            emit(gen, movzx16, sizeof(movzx16));
+        }
+        break;
+    case 4:
+        if (type.is_signed) {
+            emit(gen, movsxd, sizeof(movsxd));
+        } else {
+            emit(gen, mov32, sizeof(mov32));
+        }
+        break;
+    }
+}
+
+static void
+emit_load_immediate(codegen* gen, unsigned long long value) {
+    if (value <= 0xFFFFFFFF) {
+        /* mov eax, imm32 clears the upper half */
+        emit_byte(gen, 0xb8);
+        emit_u32(gen, (uint32_t) value);
+    } else {
+        emit_byte(gen, 0x48);
+        emit_byte(gen, 0xb8);
+        emit_u32(gen, (uint32_t) value);
+        emit_u32(gen, (uint32_t) (value >> 32));
+    }
+}
+
+/* mov rax, [rbp + offset] */
+static void
+emit_load_slot(codegen* gen, int32_t offset) {
+    static const unsigned char mov[] = {0x48, 0x8b, 0x85};
+    emit(gen, mov, sizeof(mov));
+    emit_u32(gen, (uint32_t) offset);
+}
+
+/* mov [rbp + offset], reg */
+static void
+emit_store_slot(codegen* gen, int32_t offset, unsigned char reg) {
+    emit_byte(gen, reg >= 8 ? 0x4c : 0x48);
+    emit_byte(gen, 0x89);
+    emit_byte(gen, 0x85 | (reg & 7) << 3);
+    emit_u32(gen, (uint32_t) offset);
+}
+
+static void
+emit_load_global(codegen* gen, long symbol, struct int_type type) {
+    static const unsigned char loads[2][4][4] = {
+        /* unsigned: movzx eax, byte; movzx eax, word; mov eax;
+         * mov rax */
+        {{0x0f, 0xb6, 0x05}, {0x0f, 0xb7, 0x05}, {0x8b, 0x05},
+         {0x48, 0x8b, 0x05}},
+        /* signed: movsx rax, byte; movsx rax, word; movsxd rax;
+         * mov rax */
+        {{0x48, 0x0f, 0xbe, 0x05}, {0x48, 0x0f, 0xbf, 0x05},
+         {0x48, 0x63, 0x05}, {0x48, 0x8b, 0x05}},
+    };
+    size_t size_index = type.size == 1 ? 0 : type.size == 2 ? 1
+                      : type.size == 4 ? 2 : 3;
+    const unsigned char* load = loads[type.is_signed][size_index];
+    /* the ModRM byte 0x05 ends each encoding */
+    size_t len = load[2] == 0x05 ? 3 : load[3] == 0x05 ? 4 : 2;
+    emit(gen, load, len);
+    emit_relocated(gen, symbol, R_X86_64_PC32);
+}
+
+static void
+emit_store_global(codegen* gen, long symbol, struct int_type type) {
+    static const unsigned char stores[4][3] = {
+        /* mov [rip + disp], al; ax; eax; rax */
+        {0x88, 0x05}, {0x66, 0x89, 0x05}, {0x89, 0x05},
+        {0x48, 0x89, 0x05},
+    };
+    size_t size_index = type.size == 1 ? 0 : type.size == 2 ? 1
+                      : type.size == 4 ? 2 : 3;
+    emit(gen, stores[size_index], size_index == 0 || size_index == 2
+                                      ? 2 : 3);
+    emit_relocated(gen, symbol, R_X86_64_PC32);
+}
+
+/* Emit the SSE instruction `prefix` [REX] 0F `op` between the
+ * registers `reg` and `rm`, without a prefix if it is 0.  `wide` sets
+ * REX.W, which moves between xmm and general purpose registers
+ * need. */
+static void
+emit_xmm(codegen* gen, unsigned char prefix, unsigned char op,
+         unsigned char reg, unsigned char rm, int wide) {
+    unsigned char rex = (wide ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0)
+                      | (rm >= 8 ? 0x01 : 0);
+    if (prefix) {
+        emit_byte(gen, prefix);
+    }
+    if (rex) {
+        emit_byte(gen, 0x40 | rex);
+    }
+    emit_byte(gen, 0x0f);
+    emit_byte(gen, op);
+    emit_byte(gen, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* Emit the SSE2 instruction 66 [REX] 0F `op` between the registers
+ * `reg` and `rm`. */
+static void
+emit_sse(codegen* gen, unsigned char op, unsigned char reg,
+         unsigned char rm, int wide) {
+    emit_xmm(gen, 0x66, op, reg, rm, wide);
+}
+
+enum sse_op {
+    sse_movq_to_xmm = 0x6e,
+    sse_movq_from_xmm = 0x7e,
+    sse_movdqa = 0x6f,
+    /* with the prefix F3 */
+    sse_movdqu_load = 0x6f,
+    sse_movdqu_store = 0x7f,
+    sse_paddb = 0xfc,
+    sse_paddw = 0xfd,
+    sse_paddd = 0xfe,
+    sse_paddq = 0xd4,
+    sse_psubb = 0xf8,
+    sse_psubw = 0xf9,
+    sse_psubd = 0xfa,
+    sse_psubq = 0xfb,
+    /* addps and subps without a prefix, addpd and subpd with 66 */
+    sse_addp = 0x58,
+    sse_subp = 0x5c,
+    sse_punpcklqdq = 0x6c,
+    sse_punpckhqdq = 0x6d,
+    sse_pxor = 0xef,
+};
+
+/* movdqu between `xmm` and [base + offset], where base is rbp or
+ * rsp. */
+static void
+emit_movdqu(codegen* gen, unsigned char op, unsigned char xmm,
+            unsigned char base, int32_t offset) {
+    emit_byte(gen, 0xf3);
+    if (xmm >= 8) {
+        emit_byte(gen, 0x44);
+    }
+    emit_byte(gen, 0x0f);
+    emit_byte(gen, op);
+    emit_byte(gen, 0x80 | (xmm & 7) << 3 | base);
+    if (base == rsp) {
+        emit_byte(gen, 0x24);
+    }
+    emit_u32(gen, (uint32_t) offset);
+}
+
+/* Vectors are computed in xmm0, with the upper half of 32 byte
+ * vectors in xmm1 as SSE2 has no wider registers. */
+static void
+emit_load_vector(codegen* gen, const builtin_type_info* vector,
+                 unsigned char base, int32_t offset) {
+    emit_movdqu(gen, sse_movdqu_load, 0, base, offset);
+    if (vector->size == 32) {
+        emit_movdqu(gen, sse_movdqu_load, 1, base, offset + 16);
+    }
+}
+
+static void
+emit_store_vector(codegen* gen, const builtin_type_info* vector,
+                  unsigned char base, int32_t offset) {
+    emit_movdqu(gen, sse_movdqu_store, 0, base, offset);
+    if (vector->size == 32) {
+        emit_movdqu(gen, sse_movdqu_store, 1, base, offset + 16);
+    }
+}
+
+/* sub rsp, bytes */
+static void
+emit_reserve(codegen* gen, unsigned char bytes) {
+    static const unsigned char sub[] = {0x48, 0x83, 0xec};
+    emit(gen, sub, sizeof(sub));
+    emit_byte(gen, bytes);
+}
+
+/* add rsp, bytes */
+static void
+emit_release(codegen* gen, unsigned char bytes) {
+    static const unsigned char add[] = {0x48, 0x83, 0xc4};
+    emit(gen, add, sizeof(add));
+    emit_byte(gen, bytes);
+}
+
+static void
+emit_push_vector(codegen* gen, const builtin_type_info* vector) {
+    emit_reserve(gen, vector->size);
+    emit_store_vector(gen, vector, rsp, 0);
+    gen->pushed += vector->size / 8;
+}
+
+static void
+emit_pop_vector(codegen* gen, const builtin_type_info* vector) {
+    emit_load_vector(gen, vector, rsp, 0);
+    emit_release(gen, vector->size);
+    gen->pushed -= vector->size / 8;
+}
+
+/* Zero the vector. */
+static void
+emit_zero_vector(codegen* gen, const builtin_type_info* vector) {
+    emit_sse(gen, sse_pxor, 0, 0, 0);
+    if (vector->size == 32) {
+        emit_sse(gen, sse_pxor, 1, 1, 0);
+    }
+}
+
+/* Add or subtract the lanes of `rm` to or from those of `reg`. */
+static void
+emit_lanes(codegen* gen, const builtin_type_info* vector, int subtract,
+           unsigned char reg, unsigned char rm) {
+    static const unsigned char adds[] = {sse_paddb, sse_paddw, 0,
+                                         sse_paddd, 0, 0, 0, sse_paddq};
+    static const unsigned char subs[] = {sse_psubb, sse_psubw, 0,
+                                         sse_psubd, 0, 0, 0, sse_psubq};
+    size_t element_size = vector->size / vector->lanes;
+    if (vector->element == type_f32 || vector->element == type_f64) {
+        emit_xmm(gen, vector->element == type_f64 ? 0x66 : 0,
+                 subtract ? sse_subp : sse_addp, reg, rm, 0);
+    } else if (subtract) {
+        emit_sse(gen, subs[element_size - 1], reg, rm, 0);
+    } else {
+        emit_sse(gen, adds[element_size - 1], reg, rm, 0);
+    }
+}
+
+static const struct slot*
+lookup_slot(const codegen* gen, const char* name) {
+    size_t i = gen->scope.len;
+    while (i--) {
+        if (strcmp(gen->scope.slots[i].name, name) == 0) {
+            return &gen->scope.slots[i];
+        }
+    }
+    return 0;
+}
+
+/* Add a slot for `var`, which holds a `vector` if that isn't null. */
+static const struct slot*
+add_slot(codegen* gen, const var_decl* var,
+         const builtin_type_info* vector) {
+    struct slot slot;
+    slot.vector = vector;
+    if (vector) {
+        slot.type = inferred_type;
+        /* aligned as rbp is */
+        gen->frame_size = (gen->frame_size + vector->size + 15) & ~15;
+    } else if (variable_type(gen, var, &slot.type)) {
+        return 0;
+    } else {
+        gen->frame_size += 8;
+    }
+    slot.name = str_cbegin(&var->name);
+    slot.offset = -gen->frame_size;
+    if (vec_push(&gen->scope, sizeof(slot), &slot)) {
+        gen->failed = 1;
+        return 0;
+    }
+    return &gen->scope.slots[gen->scope.len - 1];
+}
+
+/* sema has resolved every name so this only returns null for locals
+ * whose slot couldn't be added after an error. */
+static const var_decl*
+lookup_toplevel(const codegen* gen, const char* name, size_t* index) {
+    *index = symtab_lookup(&gen->names, name);
+    if (*index == SYMTAB_NOT_FOUND) {
+        assert(gen->failed);
+        return 0;
+    }
+    return &gen->toplevels->vars[*index];
+}
+
+static void gen_expression(codegen* gen, const expression_pool* pool,
+                           expr_ref ref);
+
+static void
+gen_name(codegen* gen, const char* name) {
+    const struct slot* slot = lookup_slot(gen, name);
+    const var_decl* decl;
+    size_t index;
+    struct int_type type;
+    if (slot) {
+        emit_load_slot(gen, slot->offset);
+        return;
+    }
+    decl = lookup_toplevel(gen, name, &index);
+    if (!decl) {
+        return;
+    }
+    switch (decl->type.type) {
+    case dtype_const_inferred:
+        /* folded into a literal by eval_constants */
+        gen_expression(gen, &decl->exprs, decl->value);
+        break;
+    case dtype_fun_def:
+        print_error_pos(&gen->fun->fpos, "Cannot use the function %s as "
+                        "a value in %s", name, str_cbegin(&gen->fun->name));
+        gen->failed = 1;
+        break;
+    default:
+        if (variable_type(gen, decl, &type) == 0) {
+            emit_load_global(gen, gen->symbols[index], type);
+        }
+        break;
+    }
+}
+
+/* Store rax into the variable `name`, leaving rax as the value
+ * stored. */
+static void
+gen_store(codegen* gen, const char* name) {
+    const struct slot* slot = lookup_slot(gen, name);
+    const var_decl* decl;
+    size_t index;
+    struct int_type type;
+    if (slot) {
+        emit_normalize(gen, slot->type);
+        emit_store_slot(gen, slot->offset, rax);
+        return;
+    }
+    decl = lookup_toplevel(gen, name, &index);
+    if (decl && variable_type(gen, decl, &type) == 0) {
+        emit_normalize(gen, type);
+        emit_store_global(gen, gen->symbols[index], type);
+    }
+}
+
+/* The vector type of the expression `ref`, null if it is a scalar.
+ * sema has checked both operands of arithmetic have the same type. */
+static const builtin_type_info*
+expression_vector(const codegen* gen, const expression_pool* pool,
+                  expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    const struct slot* slot;
+    const var_decl* decl;
+    const char* name;
+    expr_ref vector;
+    size_t index;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        name = get_expression_name(pool, ref);
+        slot = lookup_slot(gen, name);
+        if (slot) {
+            return slot->vector;
+        }
+        decl = lookup_toplevel(gen, name, &index);
+        if (!decl || (decl->type.type != dtype_name &&
+                      decl->type.type != dtype_const_name)) {
+            return 0;
+        }
+        return lookup_vector_type(str_cbegin(&decl->type.data.name));
+    case expression_call:
+        name = get_expression_name(pool, expr->first);
+        switch (lookup_builtin_function(name)) {
+        case builtin_lane:
+            return 0;
+        case builtin_with_lane:
+            get_call_arguments(pool, ref, &vector, 1);
+            return expression_vector(gen, pool, vector);
+        case builtin_not_a_function:
+            break;
+        }
+        decl = lookup_toplevel(gen, name, &index);
+        if (!decl || decl->type.type != dtype_fun_def) {
+            return 0;
+        }
+        return lookup_vector_type(
+            str_cbegin(&decl->type.data.fun_def.return_type.data.name));
+    case expression_comma:
+        return expression_vector(gen, pool, expr->second);
+    case expression_assign:
+    case expression_minus:
+    case expression_plus:
+        return expression_vector(gen, pool, expr->first);
+    case expression_int:
+    case expression_float:
+        break;
+    }
+    return 0;
+}
+
+static void gen_vector_expression(codegen* gen, const expression_pool* pool,
+                                  expr_ref ref,
+                                  const builtin_type_info* vector);
+
+/* The lane of std::lane and std::with_lane goes through memory below
+ * the temporaries, with room to read 8 bytes from the last lane. */
+#define LANE_SCRATCH 48
+
+/* std::lane(v, i) into rax or std::with_lane(v, i, x) into xmm0.  sema
+ * has checked the lane is a literal in range. */
+static void
+gen_builtin_call(codegen* gen, const expression_pool* pool,
+                 builtin_function function, const expr_ref* arguments) {
+    /* mov rax, [rsp + disp32] */
+    static const unsigned char load[] = {0x48, 0x8b, 0x84, 0x24};
+    static const unsigned char stores[4][4] = {
+        /* mov [rsp + disp32], cl; cx; ecx; rcx */
+        {0x88, 0x8c, 0x24}, {0x66, 0x89, 0x8c, 0x24}, {0x89, 0x8c, 0x24},
+        {0x48, 0x89, 0x8c, 0x24},
+    };
+    const builtin_type_info* vector = expression_vector(gen, pool,
+                                                        arguments[0]);
+    struct int_type element;
+    size_t size_index;
+    if (!vector) {
+        assert(gen->failed);
+        return;
+    }
+    if (is_float_type(vector->element)) {
+        print_error_pos(&gen->fun->fpos, "Code generation for floating "
+                        "point numbers is not supported yet");
+        gen->failed = 1;
+        return;
+    }
+    element.size = (unsigned char) (vector->size / vector->lanes);
+    element.is_signed = vector->is_signed;
+    size_index = element.size == 1 ? 0 : element.size == 2 ? 1
+               : element.size == 4 ? 2 : 3;
+    if (function == builtin_with_lane) {
+        gen_expression(gen, pool, arguments[2]);
+        emit_push_rax(gen);
+    }
+    gen_vector_expression(gen, pool, arguments[0], vector);
+    if (function == builtin_with_lane) {
+        emit_pop(gen, rcx);
+    }
+    emit_reserve(gen, LANE_SCRATCH);
+    emit_store_vector(gen, vector, rsp, 0);
+    if (function == builtin_lane) {
+        emit(gen, load, sizeof(load));
+    } else {
+        emit(gen, stores[size_index], size_index == 0 || size_index == 2
+                                          ? 3 : 4);
+    }
+    emit_u32(gen, (uint32_t) (get_expression_int(pool, arguments[1]) *
+                              element.size));
+    if (function == builtin_with_lane) {
+        emit_load_vector(gen, vector, rsp, 0);
+    }
+    emit_release(gen, LANE_SCRATCH);
+    if (function == builtin_lane) {
+        emit_normalize(gen, element);
+    }
+}
+
+/* Vector arguments and results are passed in xmm registers, which
+ * only fit 16 byte vectors without AVX. */
+static int
+check_passed_vector(codegen* gen, const builtin_type_info* vector) {
+    if (vector && vector->size != 16) {
+        print_error_pos(&gen->fun->fpos, "Code generation for passing "
+                        "%s to functions is not supported yet",
+                        vector->name);
+        gen->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+gen_call(codegen* gen, const expression_pool* pool, expr_ref call) {
+    expr_ref arguments[MAX_CALL_ARGUMENTS];
+    size_t num_arguments = get_call_arguments(pool, call, arguments,
+                                              MAX_CALL_ARGUMENTS);
+    const char* name = get_expression_name(pool, pool->nodes[call].first);
+    builtin_function builtin = lookup_builtin_function(name);
+    const builtin_type_info* vectors[MAX_REGISTER_ARGUMENTS];
+    const builtin_type_info* result;
+    const var_decl* callee;
+    const fun_def* fun;
+    size_t index, i, num_integers = 0, num_vectors = 0;
+    int aligned;
+    struct int_type type;
+    if (builtin != builtin_not_a_function) {
+        gen_builtin_call(gen, pool, builtin, arguments);
+        return;
+    }
+    callee = lookup_toplevel(gen, name, &index);
+    if (!callee) {
+        return;
+    }
+    fun = &callee->type.data.fun_def;
+    if (fun->params.len > MAX_REGISTER_ARGUMENTS) {
+        print_error_pos(&gen->fun->fpos, "Code generation for calls with "
+                        "more than %d arguments is not supported yet",
+                        (int) MAX_REGISTER_ARGUMENTS);
+        gen->failed = 1;
+        return;
+    }
+    result = lookup_vector_type(str_cbegin(&fun->return_type.data.name));
+    if (check_passed_vector(gen, result)) {
+        return;
+    }
+    for (i = 0; i != fun->params.len; ++i) {
+        vectors[i] = lookup_vector_type(
+            str_cbegin(&fun->params.vars[i].type.data.name));
+        if (check_passed_vector(gen, vectors[i])) {
+            return;
+        }
+    }
+    for (i = 0; i != fun->params.len; ++i) {
+        if (vectors[i]) {
+            /* vectors have no literals so they have no default values */
+            gen_vector_expression(gen, pool, arguments[i], vectors[i]);
+            emit_push_vector(gen, vectors[i]);
+            ++num_vectors;
+            continue;
+        }
+        if (i < num_arguments) {
+            gen_expression(gen, pool, arguments[i]);
+        } else {
+            /* default values are folded into literals */
+            gen_expression(gen, &callee->exprs, fun->params.vars[i].value);
+        }
+        emit_push_rax(gen);
+        ++num_integers;
+    }
+    for (i = fun->params.len; i--;) {
+        if (vectors[i]) {
+            emit_movdqu(gen, sse_movdqu_load, (unsigned char) --num_vectors,
+                        rsp, 0);
+            emit_release(gen, 16);
+            gen->pushed -= 2;
+        } else {
+            emit_pop(gen, argument_registers[--num_integers]);
+        }
+    }
+    /* The stack was 16 byte aligned before the temporaries. */
+    aligned = gen->pushed % 2 == 0;
+    if (!aligned) {
+        emit_reserve(gen, 8);
+    }
+    emit_byte(gen, 0xe8);
+    emit_relocated(gen, gen->symbols[index], R_X86_64_PLT32);
+    if (!aligned) {
+        emit_release(gen, 8);
+    }
+    if (strcmp(str_cbegin(&fun->return_type.data.name), "std::void") != 0 &&
+        lookup_int_type(str_cbegin(&fun->return_type.data.name),
+                        &type) == 0) {
+        emit_normalize(gen, type);
+    }
+}
+
+static void
+gen_scalar_expression(codegen* gen, const expression_pool* pool,
+                      expr_ref ref) {
+    static const unsigned char mov_rcx_rax[] = {0x48, 0x89, 0xc1};
+    static const unsigned char add_rax_rcx[] = {0x48, 0x01, 0xc8};
+    static const unsigned char sub_rax_rcx[] = {0x48, 0x29, 0xc8};
+    const expression* expr = &pool->nodes[ref];
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        gen_name(gen, get_expression_name(pool, ref));
+        break;
+    case expression_int:
+        emit_load_immediate(gen, get_expression_int(pool, ref));
+        break;
+    case expression_float:
+        print_error_pos(&gen->fun->fpos, "Code generation for floating "
+                        "point numbers is not supported yet");
+        gen->failed = 1;
+        break;
+    case expression_call:
+        gen_call(gen, pool, ref);
+        break;
+    case expression_comma:
+        gen_expression(gen, pool, expr->first);
+        gen_scalar_expression(gen, pool, expr->second);
+        break;
+    case expression_assign:
+        gen_scalar_expression(gen, pool, expr->second);
+        gen_store(gen, get_expression_name(pool, expr->first));
+        break;
+    case expression_minus:
+    case expression_plus:
+        gen_scalar_expression(gen, pool, expr->first);
+        emit_push_rax(gen);
+        gen_scalar_expression(gen, pool, expr->second);
+        emit(gen, mov_rcx_rax, sizeof(mov_rcx_rax));
+        emit_pop(gen, rax);
+        if (expr->type == expression_plus) {
+            emit(gen, add_rax_rcx, sizeof(add_rax_rcx));
+        } else {
+            emit(gen, sub_rax_rcx, sizeof(sub_rax_rcx));
+        }
+        break;
+    }
+}
+
+/* Vectors only live in local variables for now. */
+static const struct slot*
+vector_slot(codegen* gen, const char* name) {
+    const struct slot* slot = lookup_slot(gen, name);
+    if (!slot) {
+        print_error_pos(&gen->fun->fpos, "Code generation for global "
+                        "vectors is not supported yet");
+        gen->failed = 1;
+    }
+    return slot;
+}
+
+static void
+gen_vector_expression(codegen* gen, const expression_pool* pool,
+                      expr_ref ref, const builtin_type_info* vector) {
+    const expression* expr = &pool->nodes[ref];
+    const struct slot* slot;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        slot = vector_slot(gen, get_expression_name(pool, ref));
+        if (slot) {
+            emit_load_vector(gen, vector, rbp, slot->offset);
+        }
+        break;
+    case expression_int:
+    case expression_float:
+        /* literals never convert to vectors */
+        assert(gen->failed);
+        break;
+    case expression_call:
+        gen_call(gen, pool, ref);
+        break;
+    case expression_comma:
+        gen_expression(gen, pool, expr->first);
+        gen_vector_expression(gen, pool, expr->second, vector);
+        break;
+    case expression_assign:
+        gen_vector_expression(gen, pool, expr->second, vector);
+        slot = vector_slot(gen, get_expression_name(pool, expr->first));
+        if (slot) {
+            emit_store_vector(gen, vector, rbp, slot->offset);
+        }
+        break;
+    case expression_minus:
+    case expression_plus:
+        gen_vector_expression(gen, pool, expr->first, vector);
+        emit_push_vector(gen, vector);
+        gen_vector_expression(gen, pool, expr->second, vector);
+        emit_sse(gen, sse_movdqa, 2, 0, 0);
+        if (vector->size == 32) {
+            emit_sse(gen, sse_movdqa, 3, 1, 0);
+        }
+        emit_pop_vector(gen, vector);
+        emit_lanes(gen, vector, expr->type == expression_minus, 0, 2);
+        if (vector->size == 32) {
+            emit_lanes(gen, vector, expr->type == expression_minus, 1, 3);
+        }
+        break;
+    }
+}
+
+/* Compute `ref` into rax, or into xmm0 and xmm1 if it is a vector. */
+static void
+gen_expression(codegen* gen, const expression_pool* pool, expr_ref ref) {
+    const builtin_type_info* vector = expression_vector(gen, pool, ref);
+    if (vector) {
+        gen_vector_expression(gen, pool, ref, vector);
+    } else {
+        gen_scalar_expression(gen, pool, ref);
+    }
+}
+
+/* Compute rax into both lanes of `xmm`. */
+static void
+emit_broadcast(codegen* gen, unsigned char xmm) {
+    emit_sse(gen, sse_movq_to_xmm, xmm, rax, 1);
+    emit_sse(gen, sse_punpcklqdq, xmm, xmm, 0);
+}
+
+/* The type of the variable `name`, -1 if it isn't a variable. */
+static int
+name_type(codegen* gen, const char* name, struct int_type* type) {
+    const struct slot* slot = lookup_slot(gen, name);
+    const var_decl* decl;
+    size_t index;
+    if (slot) {
+        *type = slot->type;
+        return slot->vector ? -1 : 0;
+    }
+    decl = lookup_toplevel(gen, name, &index);
+    if (!decl || decl->type.type == dtype_fun_def ||
+        decl->type.type == dtype_const_inferred) {
+        return -1;
+    }
+    if ((decl->type.type == dtype_name ||
+         decl->type.type == dtype_const_name) &&
+        lookup_vector_type(str_cbegin(&decl->type.data.name))) {
+        return -1;
+    }
+    return variable_type(gen, decl, type);
+}
+
+/* Check what plan_loop leaves to the types: the variables must be
+ * integers and the induction variables read by reductions must have
+ * 64 bits, as the lanes don't wrap them around like their type
+ * would.  The reductions themselves can be narrower, as truncating
+ * the sum at the end gives the same result as truncating every
+ * step. */
+static int
+check_vector_types(codegen* gen, const expression_pool* pool,
+                   loop_plan* plan, const loop_variable* reduction,
+                   expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    const char* name;
+    struct int_type type;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        name = get_expression_name(pool, ref);
+        if (strcmp(name, reduction->name) != 0 &&
+            find_loop_variable(plan, name) >= 0 &&
+            (name_type(gen, name, &type) ||
+             type.size != 8)) {
+            plan->reason = "%s is narrower than 64 bits";
+            plan->culprit = name;
+            return -1;
+        }
+        return 0;
+    case expression_minus:
+    case expression_plus:
+        return check_vector_types(gen, pool, plan, reduction, expr->first) ||
+               check_vector_types(gen, pool, plan, reduction,
+                                  expr->second) ? -1 : 0;
+    default:
+        return 0;
+    }
+}
+
+/* Compute `ref`, an operand of a reduction, in both lanes of
+ * `xmm`, using the registers after it as temporaries. */
+static void
+gen_vector_operand(codegen* gen, const expression_pool* pool,
+                   const loop_plan* plan, expr_ref ref, unsigned char xmm) {
+    const expression* expr = &pool->nodes[ref];
+    if (is_loop_invariant(plan, pool, ref)) {
+        gen_expression(gen, pool, ref);
+        emit_broadcast(gen, xmm);
+        return;
+    }
+    if (expr->type == expression_name) {
+        long index = find_loop_variable(plan, get_expression_name(pool, ref));
+        emit_sse(gen, sse_movdqa, xmm, plan->variables[index].reg, 0);
+        return;
+    }
+    gen_vector_operand(gen, pool, plan, expr->first, xmm);
+    gen_vector_operand(gen, pool, plan, expr->second, xmm + 1);
+    emit_sse(gen, expr->type == expression_plus ? sse_paddq : sse_psubq,
+             xmm, xmm + 1, 0);
+}
+
+/* Add the operands of `ref`, the value assigned to the reduction in
+ * `reg`, to its lanes. */
+static void
+gen_vector_reduction(codegen* gen, const expression_pool* pool,
+                     const loop_plan* plan, expr_ref ref, unsigned char reg) {
+    const expression* expr = &pool->nodes[ref];
+    const expression* operand;
+    unsigned char xmm = plan->first_temporary;
+    if (expr->type == expression_name) {
+        return;
+    }
+    gen_vector_reduction(gen, pool, plan, expr->first, reg);
+    operand = &pool->nodes[expr->second];
+    if (operand->type == expression_name &&
+        !is_loop_invariant(plan, pool, expr->second)) {
+        xmm = plan->variables[find_loop_variable(
+            plan, get_expression_name(pool, expr->second))].reg;
+    } else {
+        gen_vector_operand(gen, pool, plan, expr->second, xmm);
+    }
+    emit_sse(gen, expr->type == expression_plus ? sse_paddq : sse_psubq,
+             reg, xmm, 0);
+}
+
+/* Advance the induction variable `var` by a step in each lane. */
+static void
+gen_vector_step(codegen* gen, const loop_variable* var) {
+    emit_sse(gen, var->subtract ? sse_psubq : sse_paddq, var->reg,
+             var->step_reg, 0);
+}
+
+static void
+report_loop(codegen* gen, const expression_pool* pool, const statement* loop,
+            const loop_plan* plan) {
+    const fposition* fpos = &loop->data.s_while.fpos;
+    char reason[256];
+    if (!(gen->flags & codegen_report_vectorization)) {
+        return;
+    }
+    if (!plan->reason) {
+        print_warning_pos(fpos, "Vectorized the loop over %s "
+                          "in %s", plan->variables[plan->counter].name,
+                          str_cbegin(&gen->fun->name));
+        return;
+    }
+    snprintf(reason, sizeof(reason), plan->reason, plan->culprit);
+    if (pool->nodes[loop->data.s_while.cond].type == expression_name) {
+        print_warning_pos(fpos, "Did not vectorize the loop "
+                          "over %s in %s: %s",
+                          get_expression_name(pool, loop->data.s_while.cond),
+                          str_cbegin(&gen->fun->name), reason);
+    } else {
+        print_warning_pos(fpos, "Did not vectorize a loop in "
+                          "%s: %s", str_cbegin(&gen->fun->name), reason);
+    }
+}
+
+/* If `loop` counts down a variable n, run its first n / 2 * 2
+ * iterations two at a time, with one in each lane of the SSE
+ * registers, and leave the rest to the scalar loop after it. */
+static void
+gen_vector_loop(codegen* gen, const statement* loop) {
+    static const unsigned char shr_rax[] = {0x48, 0xd1, 0xe8};
+    static const unsigned char mov_r11_rax[] = {0x49, 0x89, 0xc3};
+    static const unsigned char test_rax[] = {0x48, 0x85, 0xc0};
+    static const unsigned char dec_r11[] = {0x49, 0xff, 0xcb};
+    static const unsigned char je[] = {0x0f, 0x84};
+    static const unsigned char jne[] = {0x0f, 0x85};
+    const expression_pool* pool = &gen->fun->exprs;
+    const loop_variable* counter;
+    struct int_type type;
+    loop_plan plan;
+    size_t i, skip, top;
+    unsigned char xmm;
+    int res = plan_loop(pool, loop, &plan);
+    for (i = 0; i != plan.num_variables && res == 0; ++i) {
+        const loop_variable* var = &plan.variables[i];
+        if (name_type(gen, var->name, &type)) {
+            plan.reason = "%s is not a variable";
+            plan.culprit = var->name;
+            res = -1;
+        } else if (var->kind == loop_reduction) {
+            res = check_vector_types(gen, pool, &plan, var, var->value);
+        }
+    }
+    if (res == 0) {
+        plan.reason = 0;
+    }
+    report_loop(gen, pool, loop, &plan);
+    if (res) {
+        return;
+    }
+    xmm = plan.first_temporary;
+
+    /* The trip count is the counter as an unsigned number of its
+     * width, which is how often the scalar loop can decrement it
+     * before reaching zero. */
+    counter = &plan.variables[plan.counter];
+    name_type(gen, counter->name, &type);
+    type.is_signed = 0;
+    gen_name(gen, counter->name);
+    emit_normalize(gen, type);
+    emit(gen, shr_rax, sizeof(shr_rax));
+    emit(gen, mov_r11_rax, sizeof(mov_r11_rax));
+    emit(gen, test_rax, sizeof(test_rax));
+    emit(gen, je, sizeof(je));
+    skip = emit_jump_field(gen);
+
+    /* The lanes start as the first two iterations: induction
+     * variables as v and v + step and reductions as their value and
+     * zero. */
+    for (i = 0; i != plan.num_variables; ++i) {
+        const loop_variable* var = &plan.variables[i];
+        if (var->kind == loop_induction) {
+            gen_expression(gen, pool, var->step);
+            emit_broadcast(gen, var->step_reg);
+        }
+        gen_name(gen, var->name);
+        if (var->kind == loop_reduction) {
+            emit_sse(gen, sse_movq_to_xmm, var->reg, rax, 1);
+        } else {
+            emit_broadcast(gen, var->reg);
+            emit_sse(gen, sse_pxor, xmm, xmm, 0);
+            emit_sse(gen, sse_punpcklqdq, xmm, var->step_reg, 0);
+            emit_sse(gen, var->subtract ? sse_psubq : sse_paddq, var->reg,
+                     xmm, 0);
+        }
+    }
+
+    top = gen->object->text.len;
+    for (i = 0; i != plan.num_variables; ++i) {
+        const loop_variable* var = &plan.variables[i];
+        if (var->kind == loop_induction) {
+            gen_vector_step(gen, var);
+        } else {
+            gen_vector_reduction(gen, pool, &plan, var->value, var->reg);
+        }
+    }
+    /* skip the iteration the other lane did */
+    for (i = 0; i != plan.num_variables; ++i) {
+        if (plan.variables[i].kind == loop_induction) {
+            gen_vector_step(gen, &plan.variables[i]);
+        }
+    }
+    emit(gen, dec_r11, sizeof(dec_r11));
+    emit(gen, jne, sizeof(jne));
+    emit_u32(gen, (uint32_t) (top - (gen->object->text.len + 4)));
+
+    /* The first lane of an induction variable has its value after the
+     * iterations done and a reduction is the sum of its lanes. */
+    for (i = 0; i != plan.num_variables; ++i) {
+        const loop_variable* var = &plan.variables[i];
+        if (var->kind == loop_reduction) {
+            emit_sse(gen, sse_movdqa, xmm, var->reg, 0);
+            emit_sse(gen, sse_punpckhqdq, xmm, xmm, 0);
+            emit_sse(gen, sse_paddq, var->reg, xmm, 0);
+        }
+        emit_sse(gen, sse_movq_from_xmm, var->reg, rax, 1);
+        gen_store(gen, var->name);
+    }
+    patch_jump(gen, skip);
+}
+
+static void gen_statements(codegen* gen, const statements* stmts);
+
+static void
+gen_statement(codegen* gen, const statement* stmt) {
+    static const unsigned char test_rax[] = {0x48, 0x85, 0xc0};
+    static const unsigned char je[] = {0x0f, 0x84};
+    static const unsigned char xor_eax[] = {0x31, 0xc0};
+    const expression_pool* pool = &gen->fun->exprs;
+    switch (stmt->type) {
+    case statement_if:
+        {
+            size_t skip_true, skip_false;
+            gen_expression(gen, pool, stmt->data.s_if.cond);
+            emit(gen, test_rax, sizeof(test_rax));
+            emit(gen, je, sizeof(je));
+            skip_true = emit_jump_field(gen);
+            gen_statements(gen, &stmt->data.s_if.truebranch);
+            if (stmt->data.s_if.falsebranch.len) {
+                emit_byte(gen, 0xe9);
+                skip_false = emit_jump_field(gen);
+                patch_jump(gen, skip_true);
+                gen_statements(gen, &stmt->data.s_if.falsebranch);
+                patch_jump(gen, skip_false);
+            } else {
+                patch_jump(gen, skip_true);
+            }
+        }
+        break;
+    case statement_expression:
+        gen_expression(gen, pool, stmt->data.s_expression);
+        break;
+    case statement_var_decl:
+        {
+            const var_decl* var = &stmt->data.s_var_decl;
+            const builtin_type_info* vector;
+            const struct slot* slot;
+            if (var->type.type == dtype_name ||
+                var->type.type == dtype_const_name) {
+                vector = lookup_vector_type(str_cbegin(&var->type.data.name));
+            } else {
+                vector = var->value != EXPR_NONE
+                             ? expression_vector(gen, pool, var->value) : 0;
+            }
+            if (vector) {
+                if (var->value != EXPR_NONE) {
+                    gen_vector_expression(gen, pool, var->value, vector);
+                } else {
+                    emit_zero_vector(gen, vector);
+                }
+                slot = add_slot(gen, var, vector);
+                if (slot) {
+                    emit_store_vector(gen, vector, rbp, slot->offset);
+                }
+                break;
+            }
+            if (var->value != EXPR_NONE) {
+                gen_expression(gen, pool, var->value);
+            } else {
+                emit(gen, xor_eax, sizeof(xor_eax));
+            }
+            /* the variable is in scope after its initializer */
+            slot = add_slot(gen, var, 0);
+            if (slot) {
+                emit_normalize(gen, slot->type);
+                emit_store_slot(gen, slot->offset, rax);
+            }
+        }
+        break;
+    case statement_return:
+        {
+            const str* type = &gen->fun->type.data.fun_def.return_type
+                                   .data.name;
+            struct int_type return_type;
+            size_t field;
+            if (stmt->data.s_return != EXPR_NONE) {
+                gen_expression(gen, pool, stmt->data.s_return);
+                if (lookup_int_type(str_cbegin(type), &return_type) == 0) {
+                    emit_normalize(gen, return_type);
+                }
+            }
+            emit_byte(gen, 0xe9);
+            field = emit_jump_field(gen);
+            if (vec_push(&gen->returns, sizeof(field), &field)) {
+                gen->failed = 1;
+            }
+        }
+        break;
+    case statement_block:
+        gen_statements(gen, &stmt->data.s_block);
+        break;
+    case statement_while:
+        {
+            size_t top, skip;
+            if (gen->flags & codegen_vectorize) {
+                gen_vector_loop(gen, stmt);
+            }
+            top = gen->object->text.len;
+            gen_expression(gen, pool, stmt->data.s_while.cond);
+            emit(gen, test_rax, sizeof(test_rax));
+            emit(gen, je, sizeof(je));
+            skip = emit_jump_field(gen);
+            gen_statements(gen, &stmt->data.s_while.body);
+            emit_byte(gen, 0xe9);
+            emit_u32(gen, (uint32_t) (top - (gen->object->text.len + 4)));
+            patch_jump(gen, skip);
+        }
+        break;
+    }
+}
+
+static void
+gen_statements(codegen* gen, const statements* stmts) {
+    size_t scope = gen->scope.len;
+    size_t i;
+    for (i = 0; i != stmts->len; ++i) {
+        gen_statement(gen, &stmts->stmts[i]);
+    }
+    gen->scope.len = scope;
+}
+
+static void
+gen_function(codegen* gen, size_t index) {
+    static const unsigned char prologue[] = {
+        0x55,                   /* push rbp */
+        0x48, 0x89, 0xe5,       /* mov rbp, rsp */
+        0x48, 0x81, 0xec,       /* sub rsp, imm32 */
+    };
+    static const unsigned char epilogue[] = {
+        0xc9,                   /* leave */
+        0xc3,                   /* ret */
+    };
+    static const unsigned char xor_eax[] = {0x31, 0xc0};
+    const var_decl* decl = &gen->toplevels->vars[index];
+    const fun_def* fun = &decl->type.data.fun_def;
+    const builtin_type_info* return_vector =
+        lookup_vector_type(str_cbegin(&fun->return_type.data.name));
+    struct int_type return_type;
+    size_t frame_field, i, num_integers = 0, num_vectors = 0;
+
+    gen->fun = decl;
+    gen->scope.len = 0;
+    gen->frame_size = 0;
+    gen->pushed = 0;
+    gen->returns.len = 0;
+
+    if (fun->params.len > MAX_REGISTER_ARGUMENTS) {
+        print_error_pos(&decl->fpos, "Code generation for functions with "
+                        "more than %d parameters is not supported yet",
+                        (int) MAX_REGISTER_ARGUMENTS);
+        gen->failed = 1;
+        return;
+    }
+    if (strcmp(str_cbegin(&fun->return_type.data.name), "std::void") != 0 &&
+        !(return_vector && return_vector->size == 16) &&
+        lookup_int_type(str_cbegin(&fun->return_type.data.name),
+                        &return_type)) {
+        print_error_pos(&decl->fpos, "Code generation for functions "
+                        "returning %s is not supported yet",
+                        str_cbegin(&fun->return_type.data.name));
+        gen->failed = 1;
+        return;
+    }
+    emit(gen, prologue, sizeof(prologue));
+    frame_field = emit_jump_field(gen);
+    for (i = 0; i != fun->params.len; ++i) {
+        const var_decl* param = &fun->params.vars[i];
+        const builtin_type_info* vector =
+            lookup_vector_type(str_cbegin(&param->type.data.name));
+        const struct slot* slot;
+        if (vector && vector->size != 16) {
+            print_error_pos(&param->fpos, "Code generation for parameters "
+                            "of type %s is not supported yet",
+                            vector->name);
+            gen->failed = 1;
+            continue;
+        }
+        slot = add_slot(gen, param, vector);
+        if (!slot) {
+            continue;
+        }
+        if (vector) {
+            /* vectors are passed in xmm0 to xmm7 */
+            emit_movdqu(gen, sse_movdqu_store, (unsigned char) num_vectors++,
+                        rbp, slot->offset);
+            continue;
+        }
+        emit_store_slot(gen, slot->offset,
+                        argument_registers[num_integers++]);
+        if (slot->type.size != 8) {
+            /* the caller leaves the upper bits undefined */
+            emit_load_slot(gen, slot->offset);
+            emit_normalize(gen, slot->type);
+            emit_store_slot(gen, slot->offset, rax);
+        }
+    }
+    gen_statements(gen, &fun->stmts);
+    /* falling off the end returns 0 */
+    emit(gen, xor_eax, sizeof(xor_eax));
+    if (return_vector) {
+        emit_zero_vector(gen, return_vector);
+    }
+    for (i = 0; i != gen->returns.len; ++i) {
+        patch_jump(gen, gen->returns.offsets[i]);
+    }
+    emit(gen, epilogue, sizeof(epilogue));
+    patch_u32(gen, frame_field, (uint32_t) ((gen->frame_size + 15) & ~15));
+    assert(gen->pushed == 0 || gen->failed);
+}
+
+/* A function generated on its own.  Only the text and relocations of
+ * `code` are used, with offsets from the start of the function. */
+struct function_code {
+    object_file code;
+    int failed;
+};
+
+struct function_tasks {
+    const codegen* shared;
+    /* The index of each function in the top level declarations, in
+     * source order. */
+    const size_t* functions;
+    struct function_code* results;
+};
+
+static void
+gen_function_task(void* data, size_t task) {
+    struct function_tasks* tasks = data;
+    struct function_code* result = &tasks->results[task];
+    codegen gen = *tasks->shared;
+    init_object_file(&result->code, gen.object->source_name);
+    gen.object = &result->code;
+    gen.scope.slots = 0;
+    gen.scope.len = 0;
+    gen.scope.cap = 0;
+    gen.returns.offsets = 0;
+    gen.returns.len = 0;
+    gen.returns.cap = 0;
+    gen.failed = 0;
+    gen_function(&gen, tasks->functions[task]);
+    result->failed = gen.failed;
+    rpfree(gen.scope.slots);
+    rpfree(gen.returns.offsets);
+}
+
+/* Append the code of the function `index` to the text of the object,
+ * starting on a 16 byte boundary padded with int3. */
+static void
+append_function(codegen* gen, size_t index,
+                const struct function_code* result) {
+    static const unsigned char int3 = 0xcc;
+    object_file* object = gen->object;
+    object_symbol* symbol;
+    size_t start, i;
+    while (object->text.len % 16) {
+        if (append_bytes(&object->text, &int3, 1)) {
+            gen->failed = 1;
+            return;
+        }
+    }
+    start = object->text.len;
+    if (append_bytes(&object->text, result->code.text.bytes,
+                     result->code.text.len)) {
+        gen->failed = 1;
+        return;
+    }
+    for (i = 0; i != result->code.relocations.len; ++i) {
+        const object_relocation* relocation =
+            &result->code.relocations.relocations[i];
+        if (add_object_relocation(object, start + relocation->offset,
+                                  relocation->symbol, relocation->type,
+                                  relocation->addend)) {
+            gen->failed = 1;
+            return;
+        }
+    }
+    symbol = &object->symbols.symbols[gen->symbols[index]];
+    symbol->value = start;
+    symbol->size = object->text.len - start;
+}
+
+/* Generate each function into its own buffer on up to `num_threads`
+ * threads, then append them in source order so the text is the same
+ * however many threads there are. */
+static void
+gen_functions(codegen* gen, size_t num_threads) {
+    struct function_tasks tasks;
+    size_t* functions;
+    size_t num_functions = 0, i;
+    functions = rpmalloc((gen->toplevels->len + 1) * sizeof(size_t));
+    if (!functions) {
+        gen->failed = 1;
+        return;
+    }
+    for (i = 0; i != gen->toplevels->len; ++i) {
+        const var_decl* decl = &gen->toplevels->vars[i];
+        /* imported functions are defined by the object of their
+         * module */
+        if (!decl->imported && decl->type.type == dtype_fun_def) {
+            functions[num_functions++] = i;
+        }
+    }
+    tasks.shared = gen;
+    tasks.functions = functions;
+    tasks.results = rpmalloc((num_functions + 1) *
+                             sizeof(struct function_code));
+    if (!tasks.results) {
+        rpfree(functions);
+        gen->failed = 1;
+        return;
+    }
+    run_independent(gen_function_task, &tasks, num_functions, num_threads);
+    for (i = 0; i != num_functions; ++i) {
+        if (tasks.results[i].failed) {
+            gen->failed = 1;
+        } else if (!gen->failed) {
+            append_function(gen, functions[i], &tasks.results[i]);
+        }
+        destroy_object_file(&tasks.results[i].code);
+    }
+    rpfree(tasks.results);
+    rpfree(functions);
+}
+
+/* Work out the initial value of a global, which may only use
+ * literals, constants, `+` and `-`. */
+static int
+initial_value(const codegen* gen, const expression_pool* pool,
+              expr_ref ref, unsigned long long* value) {
+    const expression* expr = &pool->nodes[ref];
+    unsigned long long first, second;
+    size_t index;
+    const var_decl* decl;
+    switch ((expression_type) expr->type) {
+    case expression_int:
+        *value = get_expression_int(pool, ref);
+        return 0;
+    case expression_name:
+        index = symtab_lookup(&gen->names, get_expression_name(pool, ref));
+        if (index == SYMTAB_NOT_FOUND) {
+            return -1;
+        }
+        decl = &gen->toplevels->vars[index];
+        if (decl->type.type != dtype_const_inferred) {
+            return -1;
+        }
+        return initial_value(gen, &decl->exprs, decl->value, value);
+    case expression_minus:
+    case expression_plus:
+        if (initial_value(gen, pool, expr->first, &first) ||
+            initial_value(gen, pool, expr->second, &second)) {
+            return -1;
+        }
+        /* wraps around like the generated code */
+        *value = expr->type == expression_plus ? first + second
+                                               : first - second;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void
+gen_global(codegen* gen, size_t index) {
+    static const unsigned char zeros[8];
+    const var_decl* decl = &gen->toplevels->vars[index];
+    byte_buffer* data = &gen->object->data;
+    object_symbol* symbol;
+    unsigned long long value = 0;
+    unsigned char bytes[8];
+    struct int_type type;
+    size_t i;
+    if (variable_type(gen, decl, &type)) {
+        return;
+    }
+    if (decl->value != EXPR_NONE &&
+        initial_value(gen, &decl->exprs, decl->value, &value)) {
+        print_error_pos(&decl->fpos, "The initial value of %s must be a "
+                        "compile time constant",
+                        str_cbegin(&decl->name));
+        gen->failed = 1;
+        return;
+    }
+    for (i = 0; i != type.size; ++i) {
+        bytes[i] = (unsigned char) (value >> (8 * i));
+    }
+    if (append_bytes(data, zeros, (type.size - data->len % type.size) %
+                                      type.size)) {
+        gen->failed = 1;
+        return;
+    }
+    symbol = &gen->object->symbols.symbols[gen->symbols[index]];
+    symbol->value = data->len;
+    symbol->size = type.size;
+    if (append_bytes(data, bytes, type.size)) {
+        gen->failed = 1;
+    }
+}
+
+int
+generate_code(const vec_var_decl* toplevels, object_file* object,
+              int flags, size_t num_threads) {
+    codegen gen;
+    size_t len = toplevels->len;
+    size_t i;
+    int symbols_added;
+    assert(toplevels);
+    assert(object);
+
+    gen.toplevels = toplevels;
+    gen.object = object;
+    gen.flags = flags;
+    gen.fun = 0;
+    gen.scope.slots = 0;
+    gen.scope.len = 0;
+    gen.scope.cap = 0;
+    gen.returns.offsets = 0;
+    gen.returns.len = 0;
+    gen.returns.cap = 0;
+    gen.failed = 0;
+    gen.symbols = rpmalloc((len + 1) * sizeof(long));
+    if (!gen.symbols) {
+        return -1;
+    }
+    if (symtab_init(&gen.names, len)) {
+        rpfree(gen.symbols);
+        return -1;
+    }
+
+    /* Every symbol exists before any code so calls can refer to
+     * functions defined later. */
+    symbols_added = 1;
+    for (i = 0; i != len; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        symtab_insert(&gen.names, str_cbegin(&decl->name), i);
+        gen.symbols[i] = -1;
+        if (decl->type.type == dtype_const_inferred ||
+            decl->type.type == dtype_struct_def) {
+            continue;
+        }
+        gen.symbols[i] = add_object_symbol(
+            object, str_cbegin(&decl->name),
+            decl->imported ? object_undefined
+            : decl->type.type == dtype_fun_def ? object_text : object_data,
+            decl->type.type == dtype_fun_def, 0, 0);
+        if (gen.symbols[i] < 0) {
+            gen.failed = 1;
+            symbols_added = 0;
+        }
+    }
+    /* Carry on after errors in one declaration to report the rest. */
+    if (symbols_added) {
+        gen_functions(&gen, num_threads);
+    }
+    for (i = 0; i != len && symbols_added; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        if (!decl->imported && decl->type.type != dtype_fun_def &&
+            decl->type.type != dtype_const_inferred &&
+            decl->type.type != dtype_struct_def) {
+            gen_global(&gen, i);
+        }
+    }
+
+    symtab_destroy(&gen.names);
+    rpfree(gen.symbols);
+    rpfree(gen.scope.slots);
+    rpfree(gen.returns.offsets);
+    return gen.failed ? -1 : 0;
+}
+
+#if defined(TEST_MODE) || defined(BENCH_MODE)
+#include "eval.h"
+#include "lex.h"
+#include "sema.h"
+
+/* Write `num_functions` functions that loop and call each other, to
+ * give generate_code something to do. */
+static int
+write_functions(byte_buffer* out, size_t num_functions) {
+    size_t i;
+    for (i = 0; i != num_functions; ++i) {
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "f%lu := fun (n : std::i64, k : std::i64) -> std::i64 {\n"
+                 "    s := 0; j := 3;\n"
+                 "    while (n) { s = s + n - k + j; j = j + 1; n = n - 1; }\n"
+                 "    return s + f%lu(s, k);\n"
+                 "}\n",
+                 (unsigned long) i,
+                 (unsigned long) ((i + 1) % num_functions));
+        if (append_bytes(out, line, strlen(line))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Lex, parse and check `text` to be ready for generate_code. */
+static int
+prepare_functions(const byte_buffer* text, vec_token* tokens,
+                  vec_var_decl* toplevels) {
+    if (lex_parallel((const char*) text->bytes, text->len, "codegen.shiv",
+                     tokens, 0) ||
+        parse(tokens, toplevels, 0) ||
+        eval_constants(toplevels, EVAL_DEFAULT_STEP_BUDGET) ||
+        check_semantics(toplevels, 0, 1, 0, 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+same_objects(const object_file* a, const object_file* b) {
+    size_t i;
+    if (a->text.len != b->text.len ||
+        memcmp(a->text.bytes, b->text.bytes, a->text.len) != 0 ||
+        a->relocations.len != b->relocations.len ||
+        a->symbols.len != b->symbols.len) {
+        return 0;
+    }
+    for (i = 0; i != a->relocations.len; ++i) {
+        const object_relocation* x = &a->relocations.relocations[i];
+        const object_relocation* y = &b->relocations.relocations[i];
+        if (x->offset != y->offset || x->symbol != y->symbol ||
+            x->type != y->type || x->addend != y->addend) {
+            return 0;
+        }
+    }
+    for (i = 0; i != a->symbols.len; ++i) {
+        if (a->symbols.symbols[i].value != b->symbols.symbols[i].value ||
+            a->symbols.symbols[i].size != b->symbols.symbols[i].size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+#ifdef TEST_MODE
+#include <elf.h>
+#include <emmintrin.h>
+#include <sys/mman.h>
+#include "../cutil/test.h"
+
+static const char test_vector_source[] =
+    "add := fun (a : std::i32x4, b : std::i32x4) -> std::i32x4 {\n"
+    "    return a + b;\n"
+    "}\n"
+    "sub8 := fun (n : std::u8, a : std::u8x16, b : std::u8x16) -> "
+    "std::u8x16 {\n"
+    "    c := a - b;\n"
+    "    return std::with_lane(c, 15, n);\n"
+    "}\n"
+    "wide := fun (x : std::i64, y : std::i64) -> std::i64 {\n"
+    "    v : std::i64x4;\n"
+    "    v = std::with_lane(v, 3, x);\n"
+    "    v = std::with_lane(v, 0, y);\n"
+    "    w := v + v - v + v;\n"
+    "    return std::lane(w, 3) + std::lane(w, 0) + std::lane(w, 1);\n"
+    "}\n"
+    "fadd := fun (a : std::f32x4, b : std::f32x4) -> std::f32x4 {\n"
+    "    return a + b - a + a;\n"
+    "}\n"
+    "dsub := fun (a : std::f64x2, b : std::f64x2) -> std::f64x2 {\n"
+    "    return a - b;\n"
+    "}\n"
+    "lane16 := fun (a : std::i16x8) -> std::i16 {\n"
+    "    return std::lane(a, 7);\n"
+    "}\n"
+    "twice := fun (k : std::i32, a : std::i32x4) -> std::i32x4 {\n"
+    "    return add(a, add(a, std::with_lane(a, 2, k)));\n"
+    "}\n";
+
+/* The generated code copied where it can run, with the calls between
+ * its functions resolved. */
+struct test_code {
+    unsigned char* bytes;
+    size_t len;
+};
+
+static int
+map_test_code(const object_file* object, struct test_code* code) {
+    size_t i;
+    code->len = object->text.len;
+    code->bytes = mmap(0, code->len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code->bytes == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(code->bytes, object->text.bytes, code->len);
+    for (i = 0; i != object->relocations.len; ++i) {
+        const object_relocation* relocation =
+            &object->relocations.relocations[i];
+        const object_symbol* symbol =
+            &object->symbols.symbols[relocation->symbol];
+        int32_t value;
+        if (symbol->section != object_text ||
+            (relocation->type != R_X86_64_PC32 &&
+             relocation->type != R_X86_64_PLT32)) {
+            return -1;
+        }
+        value = (int32_t) ((int64_t) symbol->value + relocation->addend -
+                           (int64_t) relocation->offset);
+        memcpy(code->bytes + relocation->offset, &value, sizeof(value));
+    }
+    return mprotect(code->bytes, code->len, PROT_READ | PROT_EXEC);
+}
+
+static void*
+find_test_function(const object_file* object,
+                   const struct test_code* code, const char* name) {
+    size_t i;
+    for (i = 0; i != object->symbols.len; ++i) {
+        const object_symbol* symbol = &object->symbols.symbols[i];
+        if (symbol->section == object_text &&
+            strcmp(str_cbegin(&symbol->name), name) == 0) {
+            return code->bytes + symbol->value;
+        }
+    }
+    return 0;
+}
+
+/* Run the vector functions and check what they compute, covering
+ * integer and floating point lanes, reading and replacing lanes and
+ * the 32 byte vectors kept in two halves. */
+TEST(test_vector_codegen) {
+    byte_buffer text = BYTE_BUFFER_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_var_decl toplevels = VEC_INIT;
+    object_file object;
+    struct test_code code = {MAP_FAILED, 0};
+    __m128i (*add)(__m128i, __m128i);
+    __m128i (*sub8)(uint8_t, __m128i, __m128i);
+    int64_t (*wide)(int64_t, int64_t);
+    __m128 (*fadd)(__m128, __m128);
+    __m128d (*dsub)(__m128d, __m128d);
+    int16_t (*lane16)(__m128i);
+    __m128i (*twice)(int32_t, __m128i);
+    int32_t ints[4];
+    uint8_t bytes[16];
+    float floats[4];
+    double doubles[2];
+    init_object_file(&object, "codegen.shiv");
+    ASSERT(append_bytes(&text, test_vector_source,
+                        sizeof(test_vector_source) - 1) == 0, cleanup);
+    ASSERT(prepare_functions(&text, &tokens, &toplevels) == 0, cleanup);
+    ASSERT(generate_code(&toplevels, &object, 0, 1) == 0, cleanup);
+    ASSERT(map_test_code(&object, &code) == 0, cleanup);
+    *(void**) &add = find_test_function(&object, &code, "add");
+    *(void**) &sub8 = find_test_function(&object, &code, "sub8");
+    *(void**) &wide = find_test_function(&object, &code, "wide");
+    *(void**) &fadd = find_test_function(&object, &code, "fadd");
+    *(void**) &dsub = find_test_function(&object, &code, "dsub");
+    *(void**) &lane16 = find_test_function(&object, &code, "lane16");
+    *(void**) &twice = find_test_function(&object, &code, "twice");
+    ASSERT(add && sub8 && wide && fadd && dsub && lane16 && twice, cleanup);
+
+    _mm_storeu_si128((__m128i*) ints, add(_mm_setr_epi32(1, 2, 3, -4),
+                                          _mm_setr_epi32(10, 20, 30, 40)));
+    ASSERT(ints[0] == 11 && ints[1] == 22 && ints[2] == 33 &&
+           ints[3] == 36, cleanup);
+    /* lanes wrap around */
+    _mm_storeu_si128((__m128i*) bytes,
+                     sub8(77, _mm_set1_epi8(5), _mm_set1_epi8(7)));
+    ASSERT(bytes[0] == 254 && bytes[14] == 254 && bytes[15] == 77,
+           cleanup);
+    ASSERT(wide(100, 7) == 214, cleanup);
+    _mm_storeu_ps(floats, fadd(_mm_setr_ps(1, 2, 3, 4),
+                               _mm_setr_ps(.5f, .5f, .5f, .5f)));
+    ASSERT(floats[0] == 1.5f && floats[3] == 4.5f, cleanup);
+    _mm_storeu_pd(doubles, dsub(_mm_setr_pd(3, 4), _mm_setr_pd(.25, 1)));
+    ASSERT(doubles[0] == 2.75 && doubles[1] == 3, cleanup);
+    ASSERT(lane16(_mm_setr_epi16(0, 0, 0, 0, 0, 0, 0, -3)) == -3, cleanup);
+    _mm_storeu_si128((__m128i*) ints, twice(9, _mm_setr_epi32(1, 2, 3, 4)));
+    ASSERT(ints[0] == 3 && ints[1] == 6 && ints[2] == 15 && ints[3] == 12,
+           cleanup);
+cleanup:
+    if (code.bytes != MAP_FAILED) {
+        munmap(code.bytes, code.len);
+    }
+    destroy_object_file(&object);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+static const char test_if_source[] =
+    "pick := fun (a : std::i64, b : std::i64) -> std::i64 {\n"
+    "    r := 0;\n"
+    "    if (a) {\n"
+    "        r = 1;\n"
+    "    } else if (b) {\n"
+    "        r = 2;\n"
+    "    } else {\n"
+    "        r = 3;\n"
+    "    }\n"
+    "    if (b) {\n"
+    "        r = r + 10;\n"
+    "    }\n"
+    "    return r;\n"
+    "}\n";
+
+TEST(test_if_codegen) {
+    byte_buffer text = BYTE_BUFFER_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_var_decl toplevels = VEC_INIT;
+    object_file object;
+    struct test_code code = {MAP_FAILED, 0};
+    int64_t (*pick)(int64_t, int64_t);
+    init_object_file(&object, "codegen.shiv");
+    ASSERT(append_bytes(&text, test_if_source,
+                        sizeof(test_if_source) - 1) == 0, cleanup);
+    ASSERT(prepare_functions(&text, &tokens, &toplevels) == 0, cleanup);
+    ASSERT(generate_code(&toplevels, &object, 0, 1) == 0, cleanup);
+    ASSERT(map_test_code(&object, &code) == 0, cleanup);
+    *(void**) &pick = find_test_function(&object, &code, "pick");
+    ASSERT(pick, cleanup);
+    ASSERT(pick(5, 0) == 1, cleanup);
+    ASSERT(pick(5, 7) == 11, cleanup);
+    ASSERT(pick(0, 7) == 12, cleanup);
+    ASSERT(pick(0, 0) == 3, cleanup);
+cleanup:
+    if (code.bytes != MAP_FAILED) {
+        munmap(code.bytes, code.len);
+    }
+    destroy_object_file(&object);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+static const char test_report_source[] =
+    "sum := fun (n : std::i64, k : std::i64) -> std::i64 {\n"
+    "    s := 0; i := 0;\n"
+    "    while (n) { i = i + k; s = s + i; n = n - 1; }\n"
+    "    m := n;\n"
+    "      while (m) { s = s + i; i = i + s; m = m - 1; }\n"
+    "    return s;\n"
+    "}\n";
+
+/* The remarks point at each loop rather than at its function. */
+TEST(test_vectorization_report) {
+    byte_buffer text = BYTE_BUFFER_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_var_decl toplevels = VEC_INIT;
+    vec_diagnostic reported = VEC_INIT;
+    vec_diagnostic* previous = 0;
+    const diagnostic* d;
+    object_file object;
+    init_object_file(&object, "codegen.shiv");
+    ASSERT(append_bytes(&text, test_report_source,
+                        sizeof(test_report_source) - 1) == 0, cleanup);
+    ASSERT(prepare_functions(&text, &tokens, &toplevels) == 0, cleanup);
+    previous = capture_diagnostics(&reported);
+    ASSERT(generate_code(&toplevels, &object,
+                         codegen_vectorize | codegen_report_vectorization,
+                         1) == 0, cleanup);
+    capture_diagnostics(previous);
+    previous = 0;
+    ASSERT(reported.len == 2, cleanup);
+    d = &reported.diagnostics[0];
+    ASSERT(strcmp(str_cbegin(&d->fname), "codegen.shiv") == 0, cleanup);
+    ASSERT(d->line == 3 && d->column == 5, cleanup);
+    ASSERT(strncmp(str_cbegin(&d->message), "Vectorized the loop over n",
+                   26) == 0, cleanup);
+    d = &reported.diagnostics[1];
+    ASSERT(d->line == 5 && d->column == 7, cleanup);
+    ASSERT(strncmp(str_cbegin(&d->message), "Did not vectorize the loop "
+                   "over m", 33) == 0, cleanup);
+cleanup:
+    if (previous) {
+        capture_diagnostics(previous);
+    }
+    destroy_diagnostics(&reported);
+    destroy_object_file(&object);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+TEST(test_parallel_codegen) {
+    byte_buffer text = BYTE_BUFFER_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_var_decl toplevels = VEC_INIT;
+    object_file serial, parallel;
+    init_object_file(&serial, "codegen.shiv");
+    init_object_file(&parallel, "codegen.shiv");
+    ASSERT(write_functions(&text, 50) == 0, cleanup);
+    ASSERT(prepare_functions(&text, &tokens, &toplevels) == 0, cleanup);
+    ASSERT(generate_code(&toplevels, &serial, 0, 1) == 0, cleanup);
+    ASSERT(generate_code(&toplevels, &parallel, 0, 4) == 0, cleanup);
+    ASSERT(serial.text.len > 0, cleanup);
+    ASSERT(same_objects(&serial, &parallel), cleanup);
+cleanup:
+    destroy_object_file(&parallel);
+    destroy_object_file(&serial);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+void test_codegen(void) {
+    RUN(test_vector_codegen);
+    RUN(test_if_codegen);
+    RUN(test_vectorization_report);
+    RUN(test_parallel_codegen);
+}
+#endif
+
+#ifdef BENCH_MODE
+#define BENCH_FUNCTIONS 20000
+#define BENCH_ROUNDS 5
+
+/* Generate a file of many functions on 1, 2, 4 and so on threads up to
+ * the number of processors and report the speedup over one thread,
+ * checking the object comes out the same each time. */
+void bench_codegen(void) {
+    byte_buffer text = BYTE_BUFFER_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_var_decl toplevels = VEC_INIT;
+    object_file serial;
+    size_t max_threads = default_num_threads();
+    size_t num_threads, round;
+    double serial_ms = 0;
+
+    init_object_file(&serial, "codegen.shiv");
+    if (write_functions(&text, BENCH_FUNCTIONS) ||
+        prepare_functions(&text, &tokens, &toplevels)) {
+        printf("cannot prepare the functions\n");
+        goto cleanup;
+    }
+    flush_diagnostics();
+    for (num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        unsigned long long best = 0;
+        char name[64];
+        for (round = 0; round != BENCH_ROUNDS; ++round) {
+            object_file object;
+            unsigned long long start, elapsed;
+            int failed, same;
+            init_object_file(&object, "codegen.shiv");
+            start = now_nanoseconds();
+            failed = generate_code(&toplevels, &object, 0, num_threads);
+            elapsed = now_nanoseconds() - start;
+            if (!failed && num_threads == 1 && round == 0) {
+                destroy_object_file(&serial);
+                serial = object;
+                same = 1;
+            } else {
+                same = same_objects(&serial, &object);
+                destroy_object_file(&object);
+            }
+            if (failed || !same) {
+                printf("%s\n", failed ? "code generation failed"
+                                      : "the objects differ");
+                goto cleanup;
+            }
+            if (!best || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        if (num_threads == 1) {
+            serial_ms = best / 1e6;
+        }
+        sprintf(name, "generate_code %lu threads",
+                (unsigned long) num_threads);
+        printf("%-32s %8.1f ms %8.2fx\n", name, best / 1e6,
+               serial_ms / (best / 1e6));
+    }
+
+cleanup:
+    flush_diagnostics();
+    destroy_object_file(&serial);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    destroy_byte_buffer(&text);
+}
+#endif
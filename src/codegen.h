@@ -0,0 +1,41 @@
+#pragma once
+
+#ifndef HEADER_GUARD_CODEGEN_H
+#define HEADER_GUARD_CODEGEN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Get the size in bytes and signedness of the builtin integer type
+ * `name`.  Returns -1 if it isn't one. */
+int get_int_type(const char* name, size_t* size, int* is_signed);
+
+enum codegen_flags {
+    /* Run counted loops two iterations at a time in SSE2 registers
+     * before finishing them one at a time. */
+    codegen_vectorize = 1,
+    /* Print which loops were vectorized and why the others weren't. */
+    codegen_report_vectorization = 2,
+};
+
+struct object_file;
+struct vec_var_decl;
+/* Generate x86-64 code for the functions in `toplevels` and data for
+ * its global variables into `object`.  `toplevels` must have passed
+ * eval_constants and check_semantics with the bodies checked.
+ * Functions follow the System V calling convention so they can call
+ * and be called from C.  `flags` are codegen_flags.  The functions
+ * are generated on `num_threads` threads (zero picks a default) but
+ * the object is the same for any number of threads. */
+int generate_code(const struct vec_var_decl* toplevels,
+                  struct object_file* object, int flags,
+                  size_t num_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1189 @@
+#include "compile.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/vec.h"
+#include "../cutil/str.h"
+#include "../cutil/stack_trace.h"
+#include "arguments.h"
+#include "codegen.h"
+#include "counters.h"
+#include "diagnostics.h"
+#include "eval.h"
+#include "fiter.h"
+#include "inline.h"
+#include "layout.h"
+#include "lex.h"
+#include "module.h"
+#include "object.h"
+#include "parse.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "sema.h"
+#include "symtab.h"
+#include "trace.h"
+
+static void dump_tokens(vec_token *tokens) {
+    token* token;
+    for (token = tokens->tokens; token != tokens->tokens + tokens->len;
+         ++token) {
+        switch (token->type) {
+        case token_word:
+            print_warning_pos(&token->fpos, "%s",
+                              str_cbegin(&token->data.s));
+            break;
+        case token_fun:
+            print_warning_pos(&token->fpos, "fun");
+            break;
+        case token_int:
+            print_warning_pos(&token->fpos, "%llu", token->data.integer);
+            break;
+        case token_float:
+            print_warning_pos(&token->fpos, "%.17g", token->data.floating);
+            break;
+        case token_const:
+            print_warning_pos(&token->fpos, "const");
+            break;
+        case token_struct:
+            print_warning_pos(&token->fpos, "struct");
+            break;
+        case token_return:
+            print_warning_pos(&token->fpos, "return");
+            break;
+        case token_while:
+            print_warning_pos(&token->fpos, "while");
+            break;
+        case token_if:
+            print_warning_pos(&token->fpos, "if");
+            break;
+        case token_else:
+            print_warning_pos(&token->fpos, "else");
+            break;
+        case token_namespace:
+            print_warning_pos(&token->fpos, "::");
+            break;
+        case token_colon:
+            print_warning_pos(&token->fpos, ":");
+            break;
+        case token_plus:
+            print_warning_pos(&token->fpos, "+");
+            break;
+        case token_minus:
+            print_warning_pos(&token->fpos, "-");
+            break;
+        case token_semicolon:
+            print_warning_pos(&token->fpos, ";");
+            break;
+        case token_open_curly:
+            print_warning_pos(&token->fpos, "{");
+            break;
+        case token_close_curly:
+            print_warning_pos(&token->fpos, "}");
+            break;
+        case token_open_paren:
+            print_warning_pos(&token->fpos, "(");
+            break;
+        case token_close_paren:
+            print_warning_pos(&token->fpos, ")");
+            break;
+        case token_comma:
+            print_warning_pos(&token->fpos, ",");
+            break;
+        case token_right_arrow:
+            print_warning_pos(&token->fpos, "->");
+            break;
+        case token_assign:
+            print_warning_pos(&token->fpos, "=");
+            break;
+        }
+    }
+}
+
+static void
+append_expression(str* out, const expression_pool* pool, expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        str_push_s(out, get_expression_name(pool, ref));
+        break;
+    case expression_int:
+        {
+            char buffer[32];
+            sprintf(buffer, "%llu", get_expression_int(pool, ref));
+            str_push_s(out, buffer);
+        }
+        break;
+    case expression_float:
+        {
+            char buffer[32];
+            sprintf(buffer, "%.17g", get_expression_float(pool, ref));
+            str_push_s(out, buffer);
+        }
+        break;
+    case expression_call:
+        append_expression(out, pool, expr->first);
+        if (expr->second == EXPR_NONE) {
+            str_push_s(out, "()");
+        } else {
+            /* the arguments are printed in their own parentheses */
+            append_expression(out, pool, expr->second);
+        }
+        break;
+    case expression_comma:
+    case expression_assign:
+    case expression_minus:
+    case expression_plus:
+        str_push(out, '(');
+        append_expression(out, pool, expr->first);
+        str_push_s(out, expr->type == expression_comma ? ", "
+                        : expr->type == expression_assign ? " = "
+                        : expr->type == expression_minus ? " - "
+                        : " + ");
+        append_expression(out, pool, expr->second);
+        str_push(out, ')');
+        break;
+    }
+}
+
+static void
+append_value(str* out, const var_decl* decl, const expression_pool* pool) {
+    if (decl->value != EXPR_NONE) {
+        str_push_s(out, " = ");
+        append_expression(out, pool, decl->value);
+    }
+}
+
+/* Print the header of each top level declaration. */
+static void
+dump_declarations(const vec_var_decl* toplevels) {
+    size_t i, j;
+    for (i = 0; i != toplevels->len; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        str out = STR_INIT;
+        str_push_str(&out, &decl->name);
+        switch (decl->type.type) {
+        case dtype_inferred:
+            str_push_s(&out, " :");
+            append_value(&out, decl, &decl->exprs);
+            break;
+        case dtype_const_inferred:
+            str_push_s(&out, " : const");
+            append_value(&out, decl, &decl->exprs);
+            break;
+        case dtype_name:
+        case dtype_const_name:
+            str_push_s(&out, " : ");
+            str_push_str(&out, &decl->type.data.name);
+            append_value(&out, decl, &decl->exprs);
+            break;
+        case dtype_fun_def:
+            {
+                const fun_def* fun = &decl->type.data.fun_def;
+                str_push_s(&out, " := fun (");
+                for (j = 0; j != fun->params.len; ++j) {
+                    const var_decl* param = &fun->params.vars[j];
+                    if (j) {
+                        str_push_s(&out, ", ");
+                    }
+                    str_push_str(&out, &param->name);
+                    str_push_s(&out, " : ");
+                    str_push_str(&out, &param->type.data.name);
+                    append_value(&out, param, &decl->exprs);
+                }
+                str_push_s(&out, ") -> ");
+                str_push_str(&out, &fun->return_type.data.name);
+            }
+            break;
+        case dtype_struct_def:
+            {
+                const struct_def* def = &decl->type.data.struct_def;
+                str_push_s(&out, def->c_layout ? " := struct (c_layout) {"
+                                               : " := struct {");
+                for (j = 0; j != def->fields.len; ++j) {
+                    const var_decl* field = &def->fields.vars[j];
+                    str_push_s(&out, " ");
+                    str_push_str(&out, &field->name);
+                    str_push_s(&out, " : ");
+                    str_push_str(&out, &field->type.data.name);
+                    str_push_s(&out, ";");
+                }
+                str_push_s(&out, " }");
+            }
+            break;
+        default:
+            break;
+        }
+        print_warning_pos(&decl->fpos, "%s", str_cbegin(&out));
+        str_destroy(&out);
+    }
+}
+
+/* Print where each structure puts its fields, lowest offset first,
+ * and how much padding that leaves. */
+static void
+dump_layouts(const vec_var_decl* toplevels) {
+    layout_cache cache = LAYOUT_CACHE_INIT;
+    symtab names;
+    size_t i, j;
+    if (symtab_init(&names, toplevels->len)) {
+        return;
+    }
+    for (i = 0; i != toplevels->len; ++i) {
+        symtab_insert(&names, str_cbegin(&toplevels->vars[i].name), i);
+    }
+    for (i = 0; i != toplevels->len; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        const char* name = str_cbegin(&decl->name);
+        struct_layout layout;
+        size_t end = 0;
+        if (decl->type.type != dtype_struct_def ||
+            layout_struct(toplevels, &names, &cache, i, &layout, 0)) {
+            continue;
+        }
+        print_warning_pos(&decl->fpos, "%s: size %lu, alignment %lu, "
+                          "padding %lu, size in declaration order %lu",
+                          name, (unsigned long) layout.size,
+                          (unsigned long) layout.alignment,
+                          (unsigned long) layout.padding,
+                          (unsigned long) layout.declared_size);
+        for (j = 0; j != layout.len; ++j) {
+            const var_decl* field =
+                &decl->type.data.struct_def.fields.vars[layout.order[j]];
+            const field_layout* place = &layout.fields[layout.order[j]];
+            if (place->offset != end) {
+                print_warning_pos(&decl->fpos, "%s+%lu: padding, size %lu",
+                                  name, (unsigned long) end,
+                                  (unsigned long) (place->offset - end));
+            }
+            print_warning_pos(&decl->fpos, "%s+%lu: %s : %s, size %lu",
+                              name, (unsigned long) place->offset,
+                              str_cbegin(&field->name),
+                              str_cbegin(&field->type.data.name),
+                              (unsigned long) place->size);
+            end = place->offset + place->size;
+        }
+        if (layout.size != end) {
+            print_warning_pos(&decl->fpos, "%s+%lu: padding, size %lu",
+                              name, (unsigned long) end,
+                              (unsigned long) (layout.size - end));
+        }
+        destroy_struct_layout(&layout);
+    }
+    destroy_layout_cache(&cache);
+    symtab_destroy(&names);
+}
+
+static void
+release_tokens(vec_token* tokens) {
+    if (tokens->tokens) {
+        destroy_tokens(tokens);
+    }
+    *tokens = (vec_token) VEC_INIT;
+}
+
+static void
+report_memory(const arguments* args, size_t max_tokens) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return;
+    }
+    if (args->stream) {
+        print_warning("Peak memory: %ld KiB, the largest declaration "
+                      "has %lu tokens",
+                      usage.ru_maxrss, (unsigned long) max_tokens);
+    } else {
+        print_warning("Peak memory: %ld KiB", usage.ru_maxrss);
+    }
+}
+
+static int
+eval(const arguments* args, vec_var_decl* toplevels) {
+    unsigned long long start = trace_begin();
+    int res = eval_constants(toplevels, args->eval_step_budget);
+    trace_end(start, "eval", 0, 0);
+    flush_diagnostics();
+    return res;
+}
+
+static int
+sema(const arguments* args, vec_var_decl* toplevels, int check_bodies) {
+    unsigned long long start = trace_begin();
+    int res = check_semantics(toplevels, args->num_threads, check_bodies,
+                              args->dump_sema_times, 0);
+    trace_end(start, "sema", 0, 0);
+    if (res == 0 && args->dump_layout) {
+        dump_layouts(toplevels);
+    }
+    flush_diagnostics();
+    return res;
+}
+
+/* Name an output after the source file, so file.shiv becomes
+ * file`extension`. */
+static int
+output_path(str* path, const char* file, const char* extension) {
+    size_t len = strlen(file);
+    size_t i;
+    if (len > 5 && strcmp(file + len - 5, ".shiv") == 0) {
+        len -= 5;
+    }
+    for (i = 0; i != len; ++i) {
+        if (str_push(path, file[i])) {
+            return -1;
+        }
+    }
+    return str_push_s(path, extension);
+}
+
+/* Map the interfaces the file imports and add their declarations to
+ * `toplevels`. */
+static int
+import(const arguments* args, module_interfaces* interfaces,
+       vec_var_decl* toplevels) {
+    unsigned long long start = trace_begin();
+    int res = load_interfaces(args->imports, args->num_imports,
+                              args->num_threads, interfaces, toplevels);
+    trace_end(start, "import", 0, 0);
+    flush_diagnostics();
+    return res;
+}
+
+static int
+emit_interface(const arguments* args, const vec_var_decl* toplevels) {
+    str path = STR_INIT;
+    int res;
+    unsigned long long start = trace_begin();
+    res = output_path(&path, args->file, INTERFACE_EXTENSION) ||
+          write_interface(toplevels, args->file, str_cbegin(&path));
+    trace_end(start, "write_interface", str_cbegin(&path), 0);
+    str_destroy(&path);
+    flush_diagnostics();
+    return res ? -1 : 0;
+}
+
+/* Generate code for `toplevels` and write it to the object file. */
+static int
+emit_object(const arguments* args, vec_var_decl* toplevels) {
+    object_file object;
+    str path = STR_INIT;
+    int res;
+    unsigned long long start = trace_begin();
+    if (args->output_file) {
+        res = str_push_s(&path, args->output_file);
+    } else {
+        res = output_path(&path, args->file, ".o");
+    }
+    if (res) {
+        str_destroy(&path);
+        return -1;
+    }
+    if (!args->no_inline) {
+        unsigned long long inline_start = trace_begin();
+        res = inline_functions(toplevels, args->dump_inlining);
+        trace_end(inline_start, "inline", 0, 0);
+        if (res) {
+            str_destroy(&path);
+            return -1;
+        }
+    }
+    init_object_file(&object, args->file);
+    res = generate_code(toplevels, &object,
+                        (args->no_vectorize ? 0 : codegen_vectorize) |
+                        (args->dump_vectorization
+                             ? codegen_report_vectorization : 0),
+                        args->num_threads);
+    trace_end(start, "codegen", 0, object.text.len);
+    if (res == 0) {
+        start = trace_begin();
+        res = write_elf_file(&object, str_cbegin(&path));
+        trace_end(start, "write_object", str_cbegin(&path), 0);
+    }
+    destroy_object_file(&object);
+    str_destroy(&path);
+    flush_diagnostics();
+    return res;
+}
+
+/* Lex and parse the next top level declaration into `decls`, which
+ * is left empty at the end of the file. */
+static int
+next_declaration(const arguments* args, fiter* fiter, vec_token* tokens,
+                 vec_var_decl* decls, int flags, size_t* max_tokens) {
+    unsigned long long start = trace_begin();
+    int res = lex_declaration(fiter, tokens);
+    trace_end(start, "lex", 0, tokens->len);
+    if (args->dump_tokens) {
+        dump_tokens(tokens);
+    }
+    if (tokens->len > *max_tokens) {
+        *max_tokens = tokens->len;
+    }
+    if (res) {
+        return -1;
+    }
+    start = trace_begin();
+    res = parse(tokens, decls, flags);
+    trace_end(start, "parse", 0, tokens->len);
+    /* don't hold on to the diagnostics of the whole file */
+    flush_diagnostics();
+    return res;
+}
+
+/* Handle one top level declaration at a time so memory is bounded by
+ * the largest declaration rather than the file.  The first pass keeps
+ * only the signatures and initializers, which is all that other
+ * declarations can refer to.  The second pass parses and checks each
+ * function body against them and then throws it away. */
+static int
+compile_streaming(const arguments* args, fiter* fiter) {
+    vec_var_decl headers = VEC_INIT;
+    module_interfaces interfaces = {0, 0};
+    body_checks* checks = 0;
+    size_t max_tokens = 0;
+    size_t index = 0;
+    size_t i;
+    int ret = 0;
+
+    /* Check before the first pass rather than find out after it. */
+    if (!fiter_can_rewind(fiter)) {
+        print_error("-compiler-stream reads the file twice, so it "
+                    "cannot read from a pipe: %s", args->file);
+        return -1;
+    }
+    while (1) {
+        vec_token tokens = VEC_INIT;
+        vec_var_decl decls = VEC_INIT;
+        int res = next_declaration(args, fiter, &tokens, &decls,
+                                   parse_lazy_bodies, &max_tokens);
+        int done = tokens.len == 0;
+        release_tokens(&tokens);
+        if (res) {
+            destroy_var_decls(&decls);
+            STACK_TRACE_PRINT();
+            ret = -1;
+            goto cleanup;
+        }
+        for (i = 0; i != decls.len; ++i) {
+            var_decl* decl = &decls.vars[i];
+            if (decl->type.type == dtype_fun_def) {
+                /* the body's tokens are gone */
+                decl->type.data.fun_def.body_begin = 0;
+                decl->type.data.fun_def.body_end = 0;
+            }
+            if (vec_push(&headers, sizeof(*decl), decl)) {
+                decls.vars += i;
+                decls.len -= i;
+                destroy_var_decls(&decls);
+                ret = -1;
+                goto cleanup;
+            }
+        }
+        /* the declarations are owned by `headers` now */
+        rpfree(decls.vars);
+        if (done) {
+            break;
+        }
+    }
+
+    if (args->dump_declarations) {
+        dump_declarations(&headers);
+    }
+    if (import(args, &interfaces, &headers) || eval(args, &headers) ||
+        sema(args, &headers, 0) ||
+        (args->emit_interface && emit_interface(args, &headers))) {
+        ret = -1;
+        goto cleanup;
+    }
+    if (args->headers_only) {
+        goto cleanup;
+    }
+
+    if (fiter_rewind(fiter)) {
+        print_error("Cannot read %s again", args->file);
+        ret = -1;
+        goto cleanup;
+    }
+    checks = begin_body_checks(&headers);
+    if (!checks) {
+        ret = -1;
+        goto cleanup;
+    }
+    while (1) {
+        vec_token tokens = VEC_INIT;
+        vec_var_decl decls = VEC_INIT;
+        int res = next_declaration(args, fiter, &tokens, &decls, 0,
+                                   &max_tokens);
+        int done = tokens.len == 0;
+        for (i = 0; !res && i != decls.len; ++i) {
+            var_decl* header;
+            assert(index < headers.len);
+            header = &headers.vars[index++];
+            if (header->type.type == dtype_fun_def) {
+                /* The expressions of the body are in the pool of the
+                 * reparsed declaration, so check that one in place of
+                 * the header. */
+                var_decl swap = *header;
+                *header = decls.vars[i];
+                if (check_one_body(checks, index - 1)) {
+                    ret = -1;
+                }
+                decls.vars[i] = *header;
+                *header = swap;
+            } else if (check_one_body(checks, index - 1)) {
+                ret = -1;
+            }
+        }
+        destroy_var_decls(&decls);
+        release_tokens(&tokens);
+        if (res) {
+            ret = -1;
+            break;
+        }
+        if (done) {
+            break;
+        }
+    }
+
+cleanup:
+    end_body_checks(checks);
+    destroy_var_decls(&headers);
+    unload_interfaces(&interfaces);
+    if (args->dump_memory) {
+        report_memory(args, max_tokens);
+    }
+    return ret;
+}
+
+/* Read all of `file` from the beginning. */
+static char*
+read_file(FILE* file, size_t* len) {
+    size_t cap = 64 * 1024;
+    char* text = rpmalloc(cap);
+    *len = 0;
+    rewind(file);
+    while (text) {
+        *len += fread(text + *len, 1, cap - *len, file);
+        if (*len != cap) {
+            if (ferror(file)) {
+                break;
+            }
+            return text;
+        }
+        cap *= 2;
+        {
+            char* grown = rprealloc(text, cap);
+            if (!grown) {
+                break;
+            }
+            text = grown;
+        }
+    }
+    rpfree(text);
+    return 0;
+}
+
+static int
+lex_file(const arguments* args, fiter* fiter, vec_token* tokens) {
+    char* text;
+    size_t len;
+    int res;
+    if (!args->parallel_lex) {
+        return lex(fiter, tokens);
+    }
+    text = read_file(fiter->file, &len);
+    if (!text) {
+        print_error("Cannot read file: %s", args->file);
+        return -1;
+    }
+    res = lex_parallel(text, len, args->file, tokens, args->num_threads);
+    rpfree(text);
+    return res;
+}
+
+static int
+lex_and_parse(const arguments* args, counters* counters, fiter* fiter,
+              vec_var_decl* toplevels, vec_token* tokens, int flags) {
+    unsigned long long start = now_nanoseconds();
+    unsigned long long lexed;
+    unsigned long long span = trace_begin();
+    counter_sample sample;
+    int res;
+    counters_begin(counters, &sample);
+    res = lex_file(args, fiter, tokens);
+    counters_end(counters, &sample, "lex", tokens->len);
+    trace_end(span, "lex", args->file, tokens->len);
+    lexed = now_nanoseconds();
+    if (args->dump_tokens) {
+        dump_tokens(tokens);
+    }
+    if (res) {
+        STACK_TRACE_PRINT();
+        return -1;
+    }
+    span = trace_begin();
+    counters_begin(counters, &sample);
+    res = parse(tokens, toplevels, flags);
+    counters_end(counters, &sample, "parse", tokens->len);
+    trace_end(span, "parse", args->file, tokens->len);
+    if (args->dump_front_end_times) {
+        unsigned long long end = now_nanoseconds();
+        print_warning("Lexing took %llu ns and parsing took %llu ns, "
+                      "%llu ns in total",
+                      lexed - start, end - lexed, end - start);
+    }
+    if (!(flags & parse_lazy_bodies)) {
+        /* lazily parsed bodies still point into the tokens */
+        release_tokens(tokens);
+    }
+    if (res) {
+        STACK_TRACE_PRINT();
+    }
+    return res;
+}
+
+/* Everything after parsing. */
+static int
+compile_declarations(const arguments* args, module_interfaces* interfaces,
+                     vec_var_decl* toplevels) {
+    int res;
+    if (args->dump_declarations) {
+        dump_declarations(toplevels);
+    }
+    if (import(args, interfaces, toplevels) || eval(args, toplevels)) {
+        return -1;
+    }
+    res = sema(args, toplevels, !args->headers_only);
+    if (res == 0 && args->emit_interface) {
+        res = emit_interface(args, toplevels);
+    }
+    if (res == 0 && args->emit_object) {
+        res = emit_object(args, toplevels);
+    }
+    return res;
+}
+
+/* Compile what `fiter` reads.  Returns the exit status. */
+static int
+compile_source(const arguments* args, counters* counters, fiter* fiter) {
+    counter_sample sample;
+
+    if (args->stream) {
+        return compile_streaming(args, fiter) ? 1 : 0;
+    }
+
+    {
+        vec_var_decl toplevels = VEC_INIT;
+        vec_token tokens = VEC_INIT;
+        token_batches batches = VEC_INIT;
+        module_interfaces interfaces = {0, 0};
+        int flags = args->lazy_bodies ? parse_lazy_bodies : 0;
+        int res;
+
+        /* The lexer thread doesn't dump the tokens. */
+        if (args->pipeline && !args->dump_tokens) {
+            struct pipeline_times times;
+            unsigned long long start = now_nanoseconds();
+            /* the lexer thread is joined before this returns, so it
+             * is counted too */
+            counters_begin(counters, &sample);
+            res = lex_and_parse_pipelined(fiter, &toplevels, flags,
+                                          &batches, &times);
+            counters_end(counters, &sample, "lex and parse", 0);
+            if (args->dump_front_end_times) {
+                print_warning("Lexing and parsing took %llu ns, the "
+                              "parser waited %llu ns for tokens and the "
+                              "lexer waited %llu ns for space",
+                              now_nanoseconds() - start,
+                              times.parser_wait, times.lexer_wait);
+            }
+        } else {
+            res = lex_and_parse(args, counters, fiter, &toplevels, &tokens,
+                                flags);
+        }
+        /* the lexer thread's diagnostics are in its own buffer */
+        flush_diagnostics();
+        if (res) {
+            destroy_var_decls(&toplevels);
+            goto cleanup;
+        }
+
+        counters_begin(counters, &sample);
+        res = compile_declarations(args, &interfaces, &toplevels);
+        counters_end(counters, &sample, "check", 0);
+        counters_begin(counters, &sample);
+        destroy_var_decls(&toplevels);
+        counters_end(counters, &sample, "teardown", 0);
+
+    cleanup:
+        counters_begin(counters, &sample);
+        unload_interfaces(&interfaces);
+        release_tokens(&tokens);
+        destroy_token_batches(&batches);
+        counters_end(counters, &sample, "teardown", 0);
+        if (args->dump_memory) {
+            report_memory(args, 0);
+        }
+        if (res) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+compile_file(const arguments* args, counters* counters) {
+    fiter fiter;
+    counter_sample sample;
+    int res;
+
+    {
+        /* Reading the rest of the file is part of lexing. */
+        unsigned long long start = trace_begin();
+        FILE* file;
+        counters_begin(counters, &sample);
+        file = fopen(args->file, "r");
+        if (!file) {
+            print_error("Cannot open file: %s", args->file);
+            return 1;
+        }
+        fiter_init(&fiter, file, args->file);
+        counters_end(counters, &sample, "read", 0);
+        trace_end(start, "read", args->file, 0);
+    }
+    res = compile_source(args, counters, &fiter);
+    fclose(fiter.file);
+    return res;
+}
+
+/* Compile `args->file`, or what `fiter` reads in its place if it
+ * isn't null, with the diagnostics, trace and counters `args` asks
+ * for. */
+static int
+compile_with(const arguments* args, fiter* fiter) {
+    counters counters = COUNTERS_INIT;
+    int res;
+    configure_diagnostics(args->error_limit, args->json_diagnostics);
+    if (args->trace_file) {
+        trace_start();
+        trace_thread_name("main");
+    }
+    if (args->dump_counters) {
+        counters_start(&counters);
+    }
+    res = fiter ? compile_source(args, &counters, fiter)
+                : compile_file(args, &counters);
+    counters_finish(&counters);
+    if (args->trace_file && trace_finish(args->trace_file)) {
+        res = 1;
+    }
+    flush_diagnostics();
+    return res;
+}
+
+int compile(const arguments* args) {
+    return compile_with(args, 0);
+}
+
+int
+compile_text(const arguments* args, const char* text, size_t len,
+             compiled_file* out) {
+    int flags = args->lazy_bodies ? parse_lazy_bodies : 0;
+    unsigned long long span = trace_begin();
+    int res;
+    out->tokens = (vec_token) VEC_INIT;
+    out->toplevels = (vec_var_decl) VEC_INIT;
+    out->interfaces.interfaces = 0;
+    out->interfaces.len = 0;
+    configure_diagnostics(args->error_limit, args->json_diagnostics);
+    res = lex_parallel(text, len, args->file, &out->tokens,
+                       args->num_threads);
+    trace_end(span, "lex", args->file, out->tokens.len);
+    if (args->dump_tokens) {
+        dump_tokens(&out->tokens);
+    }
+    if (res == 0) {
+        span = trace_begin();
+        res = parse(&out->tokens, &out->toplevels, flags);
+        trace_end(span, "parse", args->file, out->tokens.len);
+    }
+    flush_diagnostics();
+    if (res == 0) {
+        res = compile_declarations(args, &out->interfaces, &out->toplevels);
+    }
+    flush_diagnostics();
+    return res ? 1 : 0;
+}
+
+void
+destroy_compiled_file(compiled_file* file) {
+    /* the declarations point into the tokens and interfaces */
+    destroy_var_decls(&file->toplevels);
+    unload_interfaces(&file->interfaces);
+    release_tokens(&file->tokens);
+}
+
+#ifdef TEST_MODE
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../cutil/test.h"
+
+/* Compile `text` as the file named by the last of `words`, with the
+ * arguments before it, and return what was printed, which the caller
+ * frees, or null if it can't be captured.  `*status` is set to the
+ * exit status. */
+static char*
+compile_test_source(const char* text, size_t num_words, const char** words,
+                    int* status) {
+    arguments args;
+    fposition start;
+    fiter iter;
+    char* output = 0;
+    size_t len;
+    FILE* stream;
+    if (parse_arguments(&args, num_words, (char**) words)) {
+        return 0;
+    }
+    stream = open_memstream(&output, &len);
+    if (!stream) {
+        return 0;
+    }
+    set_diagnostics_stream(stream);
+    start.fname = args.file;
+    start.line = 1;
+    start.column = 1;
+    fiter_init_memory(&iter, text, strlen(text), &start);
+    *status = compile_with(&args, &iter);
+    set_diagnostics_stream(0);
+    fclose(stream);
+    return output;
+}
+
+/* Whether compiling `text` with `words` prints `expected` and exits
+ * with `status`. */
+static int
+compiles_to(const char* text, const char* expected, int status,
+            size_t num_words, const char** words) {
+    int got;
+    char* output = compile_test_source(text, num_words, words, &got);
+    int same = output && got == status && strcmp(output, expected) == 0;
+    free(output);
+    return same;
+}
+
+/* Write `copies` groups of declarations with errors in their
+ * bodies, and in their signatures if `bad_signatures`, that refer to
+ * each other, so the checks have a graph to work through. */
+static int
+write_test_program(byte_buffer* out, size_t copies, int bad_signatures) {
+    size_t i;
+    for (i = 0; i != copies; ++i) {
+        char text[512];
+        unsigned long n = (unsigned long) i;
+        snprintf(text, sizeof(text),
+                 "a%lu := fun (x : std::i64) -> std::i64 {\n"
+                 "    return b%lu(x) + c%lu;\n"
+                 "}\n"
+                 "b%lu := fun (x : std::i64) -> std::i32 {\n"
+                 "    return x;\n"
+                 "}\n"
+                 "c%lu : std::i64 = 1;\n"
+                 "d%lu := fun () -> std::i64 {\n"
+                 "    return missing%lu();\n"
+                 "}\n"
+                 "g%lu : std::%s = 2;\n"
+                 "h%lu := fun () -> std::i64 {\n"
+                 "    return g%lu + a%lu(c%lu);\n"
+                 "}\n",
+                 n, n, n, n, n, n, n, n, bad_signatures ? "nope" : "i64",
+                 n, n, n, n);
+        if (append_bytes(out, text, strlen(text))) {
+            return -1;
+        }
+    }
+    return append_bytes(out, "", 1);
+}
+
+/* The checks run as a graph on however many threads but report the
+ * same errors in the same order. */
+TEST(test_parallel_checks_deterministic) {
+    static const char* threads[] = {"-compiler-threads=2",
+                                    "-compiler-threads=4",
+                                    "-compiler-threads=8"};
+    byte_buffer text = BYTE_BUFFER_INIT;
+    const char* words[2];
+    char* expected = 0;
+    int status;
+    size_t i;
+    ASSERT(write_test_program(&text, 40, 1) == 0, cleanup);
+    words[0] = "-compiler-threads=1";
+    words[1] = "graph.shiv";
+    expected = compile_test_source((const char*) text.bytes, 2, words,
+                                   &status);
+    ASSERT(expected && status == 1, cleanup);
+    ASSERT(strstr(expected, "graph.shiv:"), cleanup);
+    for (i = 0; i != sizeof(threads) / sizeof(*threads); ++i) {
+        words[0] = threads[i];
+        ASSERT(compiles_to((const char*) text.bytes, expected, 1, 2, words),
+               cleanup);
+    }
+cleanup:
+    free(expected);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+/* Streaming checks the bodies one declaration at a time as they are
+ * read again but reports the same errors as checking them all at
+ * once, on any number of threads. */
+TEST(test_streaming_deterministic) {
+    static const char* threads[] = {"-compiler-threads=1",
+                                    "-compiler-threads=2",
+                                    "-compiler-threads=8"};
+    byte_buffer text = BYTE_BUFFER_INIT;
+    const char* words[3];
+    char* expected = 0;
+    int status;
+    size_t i;
+    ASSERT(write_test_program(&text, 40, 0) == 0, cleanup);
+    words[0] = "-compiler-threads=1";
+    words[1] = "stream.shiv";
+    expected = compile_test_source((const char*) text.bytes, 2, words,
+                                   &status);
+    ASSERT(expected && status == 1, cleanup);
+    ASSERT(strstr(expected, "stream.shiv:"), cleanup);
+    words[1] = "-compiler-stream";
+    words[2] = "stream.shiv";
+    for (i = 0; i != sizeof(threads) / sizeof(*threads); ++i) {
+        words[0] = threads[i];
+        ASSERT(compiles_to((const char*) text.bytes, expected, 1, 3, words),
+               cleanup);
+    }
+    /* an error in a signature stops it before the bodies are read
+     * again */
+    free(expected);
+    expected = 0;
+    text.len = 0;
+    ASSERT(write_test_program(&text, 2, 1) == 0, cleanup);
+    words[0] = "-compiler-threads=8";
+    ASSERT(compiles_to((const char*) text.bytes,
+                       "stream.shiv:11:1: Error: Unknown type std::nope\n"
+                       "stream.shiv:25:1: Error: Unknown type std::nope\n",
+                       1, 3, words), cleanup);
+cleanup:
+    free(expected);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+static const char* test_pipe_source[] = {"x : std::i64 = 1;", 0};
+
+/* Input that can't be read twice is rejected before streaming
+ * starts.  The strings standing in for a file in tests can't be read
+ * again, like a pipe. */
+TEST(test_streaming_pipe) {
+    static const char* words[] = {"-compiler-stream", "pipe.shiv"};
+    arguments args;
+    fiter iter;
+    char* output = 0;
+    size_t len;
+    FILE* stream = 0;
+    ASSERT(parse_arguments(&args, 2, (char**) words) == 0, end);
+    stream = open_memstream(&output, &len);
+    ASSERT(stream, end);
+    set_diagnostics_stream(stream);
+    fiter_init(&iter, (FILE*) test_pipe_source, "pipe.shiv");
+    ASSERT(!fiter_can_rewind(&iter), end);
+    ASSERT(compile_with(&args, &iter) == 1, end);
+    set_diagnostics_stream(0);
+    fclose(stream);
+    stream = 0;
+    ASSERT(strcmp(output, "Error: -compiler-stream reads the file twice, "
+                  "so it cannot read from a pipe: pipe.shiv\n") == 0, end);
+end:
+    if (stream) {
+        set_diagnostics_stream(0);
+        fclose(stream);
+    }
+    free(output);
+}
+END_TEST
+
+/* Lexing and parsing in a pipeline hands declarations over as they
+ * are parsed but ends up with the same ones, so the errors are the
+ * same as lexing the whole file first, on any number of threads. */
+TEST(test_pipeline_deterministic) {
+    static const char* threads[] = {"-compiler-threads=1",
+                                    "-compiler-threads=2",
+                                    "-compiler-threads=8"};
+    byte_buffer text = BYTE_BUFFER_INIT;
+    const char* words[3];
+    char* expected = 0;
+    int status;
+    size_t i;
+    ASSERT(write_test_program(&text, 40, 1) == 0, cleanup);
+    words[0] = "-compiler-threads=1";
+    words[1] = "pipeline.shiv";
+    expected = compile_test_source((const char*) text.bytes, 2, words,
+                                   &status);
+    ASSERT(expected && status == 1, cleanup);
+    ASSERT(strstr(expected, "pipeline.shiv:"), cleanup);
+    words[1] = "-compiler-pipeline";
+    words[2] = "pipeline.shiv";
+    for (i = 0; i != sizeof(threads) / sizeof(*threads); ++i) {
+        words[0] = threads[i];
+        ASSERT(compiles_to((const char*) text.bytes, expected, 1, 3, words),
+               cleanup);
+    }
+cleanup:
+    free(expected);
+    destroy_byte_buffer(&text);
+}
+END_TEST
+
+/* Recording a trace doesn't change what is reported, on any number
+ * of threads. */
+TEST(test_trace_deterministic) {
+    static const char* threads[] = {"-compiler-threads=1",
+                                    "-compiler-threads=2",
+                                    "-compiler-threads=8"};
+    char trace[] = "-compiler-trace=/tmp/shiv_trace_XXXXXX";
+    char* path = trace + 16;
+    byte_buffer text = BYTE_BUFFER_INIT;
+    const char* words[3];
+    char* expected = 0;
+    struct stat st;
+    int status;
+    size_t i;
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0, end);
+    close(fd);
+    ASSERT(write_test_program(&text, 40, 1) == 0, cleanup);
+    words[0] = "-compiler-threads=1";
+    words[1] = "trace.shiv";
+    expected = compile_test_source((const char*) text.bytes, 2, words,
+                                   &status);
+    ASSERT(expected && status == 1, cleanup);
+    words[1] = trace;
+    words[2] = "trace.shiv";
+    for (i = 0; i != sizeof(threads) / sizeof(*threads); ++i) {
+        words[0] = threads[i];
+        ASSERT(compiles_to((const char*) text.bytes, expected, 1, 3, words),
+               cleanup);
+        ASSERT(stat(path, &st) == 0 && st.st_size > 0, cleanup);
+        ASSERT(truncate(path, 0) == 0, cleanup);
+    }
+cleanup:
+    unlink(path);
+    free(expected);
+    destroy_byte_buffer(&text);
+end:;
+}
+END_TEST
+
+static const char test_lazy_source[] =
+    "f := fun (x : std::i64) -> std::i64 {\n"
+    "    y := x;\n"
+    "    return x +;\n"
+    "}\n"
+    "g := fun () -> std::i64 {\n"
+    "    return f(1);\n"
+    "}\n"
+    "h := fun () -> std::i32 {\n"
+    "    y : std::i64 = 1;\n"
+    "    return y;\n"
+    "}\n"
+    "k := fun () -> std::i64 {\n"
+    "    return 1 2;\n"
+    "}\n";
+
+/* Bodies are parsed by the checks that use them, so only checking the
+ * headers never sees the errors in them, and checking everything
+ * reports every body's errors the same way on any number of
+ * threads. */
+TEST(test_lazy_bodies_deterministic) {
+    static const char* threads[] = {"-compiler-threads=2",
+                                    "-compiler-threads=8"};
+    const char* words[3];
+    char* expected = 0;
+    char* eager = 0;
+    vec_token tokens = VEC_INIT;
+    vec_var_decl toplevels = VEC_INIT;
+    vec_diagnostic errors = VEC_INIT;
+    vec_diagnostic* previous = 0;
+    uint32_t exprs_len;
+    int status;
+    size_t i;
+    words[0] = "-compiler-lazy-bodies";
+    words[1] = "-compiler-threads=1";
+    words[2] = "lazy.shiv";
+    expected = compile_test_source(test_lazy_source, 3, words, &status);
+    ASSERT(expected && status == 1, cleanup);
+    for (i = 0; i != sizeof(threads) / sizeof(*threads); ++i) {
+        words[1] = threads[i];
+        ASSERT(compiles_to(test_lazy_source, expected, 1, 3, words),
+               cleanup);
+    }
+    /* parsing everything up front stops at the first error */
+    eager = compile_test_source(test_lazy_source, 1, words + 2, &status);
+    ASSERT(eager && status == 1, cleanup);
+    ASSERT(strlen(eager) < strlen(expected) &&
+           strncmp(eager, expected, strlen(eager)) == 0, cleanup);
+    words[1] = "-compiler-headers-only";
+    ASSERT(compiles_to(test_lazy_source, "", 0, 3, words), cleanup);
+
+    ASSERT(lex_parallel(test_lazy_source, sizeof(test_lazy_source) - 1,
+                        "lazy.shiv", &tokens, 1) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, parse_lazy_bodies) == 0, cleanup);
+    ASSERT(check_semantics(&toplevels, 1, 0, 0, 0) == 0, cleanup);
+    for (i = 0; i != toplevels.len; ++i) {
+        ASSERT(!toplevels.vars[i].type.data.fun_def.body_parsed, cleanup);
+    }
+    previous = capture_diagnostics(&errors);
+    ASSERT(check_semantics(&toplevels, 1, 1, 0, 0) == -1, cleanup);
+    capture_diagnostics(previous);
+    previous = 0;
+    ASSERT(errors.len == 3, cleanup);
+    ASSERT(toplevels.vars[1].type.data.fun_def.body_parsed, cleanup);
+
+    /* a body that failed to parse is left as it was, so parsing it
+     * again, as a recheck does, gets the same */
+    destroy_diagnostics(&errors);
+    exprs_len = toplevels.vars[0].exprs.len;
+    previous = capture_diagnostics(&errors);
+    for (i = 0; i != 2; ++i) {
+        const fun_def* fun = &toplevels.vars[0].type.data.fun_def;
+        ASSERT(parse_fun_body(&toplevels.vars[0]) == -1, cleanup);
+        ASSERT(!fun->body_parsed && fun->stmts.len == 0, cleanup);
+        ASSERT(toplevels.vars[0].exprs.len == exprs_len, cleanup);
+    }
+    capture_diagnostics(previous);
+    previous = 0;
+    ASSERT(errors.len == 2, cleanup);
+    ASSERT(errors.diagnostics[0].line == errors.diagnostics[1].line &&
+           errors.diagnostics[0].column == errors.diagnostics[1].column,
+           cleanup);
+cleanup:
+    if (previous) {
+        capture_diagnostics(previous);
+    }
+    destroy_diagnostics(&errors);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    free(eager);
+    free(expected);
+}
+END_TEST
+
+void test_compile(void) {
+    RUN(test_parallel_checks_deterministic);
+    RUN(test_lazy_bodies_deterministic);
+    RUN(test_streaming_deterministic);
+    RUN(test_streaming_pipe);
+    RUN(test_pipeline_deterministic);
+    RUN(test_trace_deterministic);
+}
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef HEADER_GUARD_COMPILE_H
+#define HEADER_GUARD_COMPILE_H
+
+#include <stddef.h>
+#include "lex.h"
+#include "module.h"
+#include "parse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct arguments;
+/* Compile the file given in `args`.  Returns the exit status. */
+int compile(const struct arguments* args);
+
+/* What compiling a file leaves behind, kept by the watch mode until
+ * the file changes. */
+struct compiled_file {
+    vec_token tokens;
+    vec_var_decl toplevels;
+    module_interfaces interfaces;
+};
+typedef struct compiled_file compiled_file;
+
+/* Compile `args->file`, whose contents are the `len` bytes at `text`,
+ * into `out`, which must be destroyed with destroy_compiled_file even
+ * if this fails.  Returns the exit status. */
+int compile_text(const struct arguments* args, const char* text,
+                 size_t len, compiled_file* out);
+void destroy_compiled_file(compiled_file*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,346 @@
+#include "counters.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "diagnostics.h"
+
+static const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} events[num_counters] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1D misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static int
+open_event(struct perf_event_attr* attr) {
+    return (int) syscall(SYS_perf_event_open, attr, 0, -1, -1,
+                         PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open the counters with `open`, which returns a file descriptor or
+ * -1 and sets errno like perf_event_open. */
+static void
+start_counters(counters* counters, int (*open)(struct perf_event_attr*)) {
+    char missing[256];
+    size_t i, len = 0;
+    int error = 0;
+    missing[0] = 0;
+    counters->started = 0;
+    counters->num_phases = 0;
+    for (i = 0; i != num_counters; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        /* so it works with perf_event_paranoid at 2 */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* the checks run on threads started after this, which add
+         * their counts when they exit */
+        attr.inherit = 1;
+        /* the counters may be multiplexed if there aren't enough */
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[i] = open(&attr);
+        if (counters->fds[i] < 0) {
+            if (!error) {
+                error = errno;
+            }
+            len += (size_t) snprintf(missing + len, sizeof(missing) - len,
+                                     "%s%s", len ? ", " : "",
+                                     events[i].name);
+        } else {
+            counters->started = 1;
+        }
+    }
+    if (error) {
+        /* ENOENT is how the kernel says there is no such event */
+        print_warning("Cannot count %s: %s", missing,
+                      error == ENOENT || error == EOPNOTSUPP
+                          ? "not supported on this machine"
+                          : strerror(error));
+    }
+}
+
+void
+counters_start(counters* counters) {
+    start_counters(counters, open_event);
+}
+
+static unsigned long long
+read_counter(int fd) {
+    uint64_t values[3];
+    if (read(fd, values, sizeof(values)) != (ssize_t) sizeof(values) ||
+        values[2] == 0) {
+        return 0;
+    }
+    if (values[2] < values[1]) {
+        /* only counted part of the time, so scale it up */
+        return (unsigned long long) ((double) values[0] * values[1] /
+                                     values[2]);
+    }
+    return values[0];
+}
+
+void
+counters_begin(const counters* counters, counter_sample* sample) {
+    size_t i;
+    if (!counters->started) {
+        return;
+    }
+    for (i = 0; i != num_counters; ++i) {
+        int fd = counters->fds[i];
+        sample->values[i] = fd < 0 ? 0 : read_counter(fd);
+    }
+}
+
+void
+counters_end(counters* counters, const counter_sample* sample,
+             const char* name, size_t tokens) {
+    struct counter_phase* phase;
+    size_t i;
+    if (!counters->started) {
+        return;
+    }
+    for (i = 0; i != counters->num_phases; ++i) {
+        if (strcmp(counters->phases[i].name, name) == 0) {
+            break;
+        }
+    }
+    if (i == counters->num_phases) {
+        if (counters->num_phases == MAX_COUNTER_PHASES) {
+            return;
+        }
+        phase = &counters->phases[counters->num_phases++];
+        memset(phase, 0, sizeof(*phase));
+        phase->name = name;
+    } else {
+        phase = &counters->phases[i];
+    }
+    for (i = 0; i != num_counters; ++i) {
+        if (counters->fds[i] >= 0) {
+            phase->counts[i] += read_counter(counters->fds[i]) -
+                                sample->values[i];
+        }
+    }
+    phase->tokens += tokens;
+}
+
+void
+counters_finish(counters* counters) {
+    const int* fds = counters->fds;
+    size_t i, j;
+    if (!counters->started) {
+        return;
+    }
+    for (i = 0; i != counters->num_phases; ++i) {
+        const struct counter_phase* phase = &counters->phases[i];
+        char line[512];
+        size_t len = (size_t) snprintf(line, sizeof(line), "%s:",
+                                       phase->name);
+        for (j = 0; j != num_counters && len < sizeof(line); ++j) {
+            if (fds[j] >= 0) {
+                len += (size_t) snprintf(line + len, sizeof(line) - len,
+                                         " %llu %s,", phase->counts[j],
+                                         events[j].name);
+            }
+        }
+        if (fds[counter_cycles] >= 0 && fds[counter_instructions] >= 0 &&
+            phase->counts[counter_cycles] && len < sizeof(line)) {
+            len += (size_t) snprintf(
+                line + len, sizeof(line) - len, " %.2f IPC,",
+                (double) phase->counts[counter_instructions] /
+                    (double) phase->counts[counter_cycles]);
+        }
+        /* drop the last comma */
+        line[len < sizeof(line) ? len - 1 : sizeof(line) - 1] = 0;
+        print_warning("%s", line);
+        if (!phase->tokens) {
+            continue;
+        }
+        len = (size_t) snprintf(line, sizeof(line), "%s per token:",
+                                phase->name);
+        for (j = 0; j != num_counters && len < sizeof(line); ++j) {
+            if (fds[j] >= 0) {
+                len += (size_t) snprintf(
+                    line + len, sizeof(line) - len, " %.3f %s,",
+                    (double) phase->counts[j] / (double) phase->tokens,
+                    events[j].name);
+            }
+        }
+        line[len < sizeof(line) ? len - 1 : sizeof(line) - 1] = 0;
+        print_warning("%s", line);
+    }
+    for (i = 0; i != num_counters; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    counters->started = 0;
+}
+
+#ifdef TEST_MODE
+#include <stdlib.h>
+#include "../cutil/test.h"
+
+static int
+open_missing_event(struct perf_event_attr* attr) {
+    (void) attr;
+    errno = ENOENT;
+    return -1;
+}
+
+/* The write ends of pipes standing in for the counters, which read
+ * what is written to them. */
+static int test_counter_pipes[num_counters];
+static size_t test_counters_opened;
+
+/* Only the instructions and page faults can be opened. */
+static int
+open_test_event(struct perf_event_attr* attr) {
+    int fds[2];
+    if (!attr->inherit ||
+        (attr->config != PERF_COUNT_HW_INSTRUCTIONS &&
+         attr->type != PERF_TYPE_SOFTWARE)) {
+        errno = EACCES;
+        return -1;
+    }
+    if (pipe(fds)) {
+        return -1;
+    }
+    test_counter_pipes[test_counters_opened++] = fds[1];
+    return fds[0];
+}
+
+/* Make the next read of every open counter give `value`. */
+static int
+set_test_counters(unsigned long long value) {
+    uint64_t values[3];
+    size_t i;
+    values[0] = value;
+    values[1] = 10;
+    values[2] = 10;
+    for (i = 0; i != test_counters_opened; ++i) {
+        if (write(test_counter_pipes[i], values, sizeof(values)) !=
+            (ssize_t) sizeof(values)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Capture what is printed from `counters` until end_counters_capture
+ * is called. */
+static FILE*
+begin_counters_capture(char** text, size_t* len) {
+    FILE* stream = open_memstream(text, len);
+    if (stream) {
+        set_diagnostics_stream(stream);
+    }
+    return stream;
+}
+
+static void
+end_counters_capture(FILE* stream) {
+    flush_diagnostics();
+    set_diagnostics_stream(0);
+    fclose(stream);
+}
+
+TEST(test_counters_missing) {
+    counters counters = COUNTERS_INIT;
+    counter_sample sample;
+    char* text = 0;
+    size_t len;
+    FILE* stream = begin_counters_capture(&text, &len);
+    ASSERT(stream, end);
+    start_counters(&counters, open_missing_event);
+    sample.values[0] = 7;
+    counters_begin(&counters, &sample);
+    counters_end(&counters, &sample, "lex", 10);
+    counters_finish(&counters);
+    end_counters_capture(stream);
+    stream = 0;
+    ASSERT(!counters.started && counters.num_phases == 0, end);
+    ASSERT(sample.values[0] == 7, end);
+    ASSERT(strcmp(text, "Warning: Cannot count cycles, instructions, "
+                  "branch misses, L1D misses, LLC misses, page faults: "
+                  "not supported on this machine\n") == 0, end);
+end:
+    if (stream) {
+        end_counters_capture(stream);
+    }
+    free(text);
+}
+END_TEST
+
+TEST(test_counters_phases) {
+    counters counters = COUNTERS_INIT;
+    counter_sample sample;
+    char* text = 0;
+    size_t len;
+    size_t i;
+    FILE* stream = begin_counters_capture(&text, &len);
+    ASSERT(stream, end);
+    test_counters_opened = 0;
+    start_counters(&counters, open_test_event);
+    ASSERT(counters.started && test_counters_opened == 2, cleanup);
+    /* the same phase twice adds up, and another is kept apart */
+    for (i = 0; i != 2; ++i) {
+        ASSERT(set_test_counters(100 * i) == 0, cleanup);
+        counters_begin(&counters, &sample);
+        ASSERT(set_test_counters(100 * i + 40) == 0, cleanup);
+        counters_end(&counters, &sample, "lex", 4);
+    }
+    ASSERT(set_test_counters(0) == 0, cleanup);
+    counters_begin(&counters, &sample);
+    ASSERT(set_test_counters(5) == 0, cleanup);
+    counters_end(&counters, &sample, "parse", 0);
+    ASSERT(counters.num_phases == 2, cleanup);
+    ASSERT(counters.phases[0].counts[counter_instructions] == 80, cleanup);
+    ASSERT(counters.phases[0].counts[counter_page_faults] == 80, cleanup);
+    ASSERT(counters.phases[0].counts[counter_cycles] == 0, cleanup);
+    ASSERT(counters.phases[0].tokens == 8, cleanup);
+    ASSERT(counters.phases[1].counts[counter_instructions] == 5, cleanup);
+    counters_finish(&counters);
+    end_counters_capture(stream);
+    stream = 0;
+    ASSERT(strcmp(text,
+                  "Warning: Cannot count cycles, branch misses, L1D "
+                  "misses, LLC misses: Permission denied\n"
+                  "Warning: lex: 80 instructions, 80 page faults\n"
+                  "Warning: lex per token: 10.000 instructions, 10.000 "
+                  "page faults\n"
+                  "Warning: parse: 5 instructions, 5 page faults\n") == 0,
+           end);
+cleanup:
+    counters_finish(&counters);
+    for (i = 0; i != test_counters_opened; ++i) {
+        close(test_counter_pipes[i]);
+    }
+end:
+    if (stream) {
+        end_counters_capture(stream);
+    }
+    free(text);
+}
+END_TEST
+
+void test_counters(void) {
+    RUN(test_counters_missing);
+    RUN(test_counters_phases);
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef HEADER_GUARD_COUNTERS_H
+#define HEADER_GUARD_COUNTERS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hardware and software performance counters of the calling thread
+ * and the threads it starts, read with perf_event_open. */
+enum counter {
+    counter_cycles,
+    counter_instructions,
+    counter_branch_misses,
+    counter_l1d_misses,
+    counter_llc_misses,
+    counter_page_faults,
+    num_counters,
+};
+
+/* The counts at the start of a phase. */
+struct counter_sample {
+    unsigned long long values[num_counters];
+};
+typedef struct counter_sample counter_sample;
+
+/* The most phases reported, later ones are dropped. */
+#define MAX_COUNTER_PHASES 16
+
+struct counter_phase {
+    const char* name;
+    unsigned long long counts[num_counters];
+    unsigned long long tokens;
+};
+
+/* The counters of one compile. */
+struct counters {
+    /* -1 for counters that couldn't be opened. */
+    int fds[num_counters];
+    int started;
+    struct counter_phase phases[MAX_COUNTER_PHASES];
+    size_t num_phases;
+};
+typedef struct counters counters;
+/* Counters that count nothing until started. */
+#define COUNTERS_INIT {{0}, 0, {{0, {0}, 0}}, 0}
+
+/* Open the counters of the calling thread.  Counters the kernel or
+ * the machine doesn't provide are left out and reported as such, and
+ * if none can be opened nothing is counted.  Threads the calling
+ * thread starts afterwards are counted too, but only once they have
+ * exited, so a phase that runs threads must join them before it
+ * ends. */
+void counters_start(counters*);
+
+/* Sample the counters at the start of a phase.  Does nothing if the
+ * counters aren't started. */
+void counters_begin(const counters*, counter_sample* sample);
+
+/* Add the counts since `sample` to the phase `name`, which processed
+ * `tokens` tokens.  `name` must outlive the counting. */
+void counters_end(counters*, const counter_sample* sample,
+                  const char* name, size_t tokens);
+
+/* Print the counts of each phase with the instructions per cycle and
+ * the costs per token, then close the counters. */
+void counters_finish(counters*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
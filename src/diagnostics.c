@@ -1,6 +1,11 @@
 #include "diagnostics.h"
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/vec.h"
 #include "fposition.h"
 
 #define WITH_ARG(argument, e)                                        \
@@ -11,42 +16,498 @@
         va_end(arg);                                                 \
     } while (0)
 
+/* The diagnostics reported on one thread since the last flush.
+ * Buffers outlive their threads so flush_diagnostics can still write
+ * what they reported; they are freed by the next flush once their
+ * thread has exited. */
+struct diagnostics_buffer {
+    struct diagnostics_buffer* next;
+    vec_diagnostic diagnostics;
+    int thread_exited;
+};
+
+static FILE* diagnostics_stream;
+static size_t error_limit;
+static size_t errors_written;
+static int write_json;
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Oldest first so the main thread's buffer, which the diagnostics
+ * collected by tasks are reported to, comes first. */
+static struct diagnostics_buffer* buffers;
+static struct diagnostics_buffer** buffers_end = &buffers;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+
+static _Thread_local struct diagnostics_buffer* local_buffer;
+/* Set by capture_diagnostics. */
+static _Thread_local vec_diagnostic* local_capture;
+
 static void
-vprint_error(const char* message, va_list arg) {
-    fputs("Error: ", stderr);
-    vfprintf(stderr, message, arg);
-    fputc('\n', stderr);
+release_buffer(void* data) {
+    struct diagnostics_buffer* buffer = data;
+    pthread_mutex_lock(&buffers_lock);
+    buffer->thread_exited = 1;
+    pthread_mutex_unlock(&buffers_lock);
 }
-void
-print_error(const char* message, ...) {
-    WITH_ARG(message, vprint_error(message, arg));
+
+static void
+create_buffer_key(void) {
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+static struct diagnostics_buffer*
+thread_buffer(void) {
+    struct diagnostics_buffer* buffer = local_buffer;
+    if (buffer) {
+        return buffer;
+    }
+    buffer = rpmalloc(sizeof(struct diagnostics_buffer));
+    if (!buffer) {
+        return 0;
+    }
+    buffer->diagnostics = (vec_diagnostic) VEC_INIT;
+    buffer->thread_exited = 0;
+    pthread_once(&buffer_key_once, create_buffer_key);
+    pthread_setspecific(buffer_key, buffer);
+    pthread_mutex_lock(&buffers_lock);
+    buffer->next = 0;
+    *buffers_end = buffer;
+    buffers_end = &buffer->next;
+    pthread_mutex_unlock(&buffers_lock);
+    local_buffer = buffer;
+    return buffer;
 }
 
 static void
-vprint_warning(const char* message, va_list arg) {
-    fputs("Warning: ", stderr);
-    vfprintf(stderr, message, arg);
-    fputc('\n', stderr);
+destroy_diagnostic(diagnostic* diagnostic) {
+    str_destroy(&diagnostic->fname);
+    str_destroy(&diagnostic->message);
 }
+
 void
-print_warning(const char* message, ...) {
-    WITH_ARG(message, vprint_warning(message, arg));
+destroy_diagnostics(vec_diagnostic* diagnostics) {
+    size_t i;
+    for (i = 0; i != diagnostics->len; ++i) {
+        destroy_diagnostic(&diagnostics->diagnostics[i]);
+    }
+    rpfree(diagnostics->diagnostics);
+    *diagnostics = (vec_diagnostic) VEC_INIT;
+}
+
+static int
+vappend_diagnostic(vec_diagnostic* out, diagnostic_severity severity,
+                   const fposition* fpos, const char* message,
+                   va_list arg) {
+    char buffer[1024];
+    diagnostic diagnostic;
+    diagnostic.severity = severity;
+    diagnostic.fname = (str) STR_INIT;
+    diagnostic.line = fpos ? fpos->line : 0;
+    diagnostic.column = fpos ? fpos->column : 0;
+    diagnostic.message = (str) STR_INIT;
+    vsnprintf(buffer, sizeof(buffer), message, arg);
+    if ((fpos && str_push_s(&diagnostic.fname, fpos->fname)) ||
+        str_push_s(&diagnostic.message, buffer) ||
+        vec_push(out, sizeof(diagnostic), &diagnostic)) {
+        destroy_diagnostic(&diagnostic);
+        return -1;
+    }
+    return 0;
+}
+
+/* Where the calling thread's diagnostics go, null when out of
+ * memory. */
+static vec_diagnostic*
+thread_diagnostics(void) {
+    struct diagnostics_buffer* buffer;
+    if (local_capture) {
+        return local_capture;
+    }
+    buffer = thread_buffer();
+    return buffer ? &buffer->diagnostics : 0;
 }
 
+/* Write a diagnostic that couldn't be buffered straight to `stream`,
+ * formatted on the stack as there is no memory to spare. */
 static void
-print_fpos(const fposition* fpos) {
-    fprintf(stderr, "%s:%d:%d: ", fpos->fname, fpos->line,
-            fpos->column);
+write_unbuffered(FILE* stream, const fposition* fpos, const char* message,
+                 va_list arg) {
+    char buffer[1024];
+    vsnprintf(buffer, sizeof(buffer), message, arg);
+    if (fpos) {
+        fprintf(stream, "%s:%d:%d: ", fpos->fname, fpos->line,
+                fpos->column);
+    }
+    fprintf(stream, "Error: Out of memory while reporting: %s\n", buffer);
+}
+
+static void
+vreport(diagnostic_severity severity, const fposition* fpos,
+        const char* message, va_list arg) {
+    vec_diagnostic* out = thread_diagnostics();
+    va_list copy;
+    va_copy(copy, arg);
+    if (!out || vappend_diagnostic(out, severity, fpos, message, arg)) {
+        /* better out of order than lost */
+        write_unbuffered(stderr, fpos, message, copy);
+    }
+    va_end(copy);
+}
+
+void
+print_error(const char* message, ...) {
+    WITH_ARG(message, vreport(diagnostic_error, 0, message, arg));
+}
+
+void
+print_warning(const char* message, ...) {
+    WITH_ARG(message, vreport(diagnostic_warning, 0, message, arg));
 }
 
 void
 print_error_pos(const fposition* fpos, const char* message, ...) {
-    print_fpos(fpos);
-    WITH_ARG(message, vprint_error(message, arg));
+    WITH_ARG(message, vreport(diagnostic_error, fpos, message, arg));
 }
 
 void
 print_warning_pos(const fposition* fpos, const char* message, ...) {
-    print_fpos(fpos);
-    WITH_ARG(message, vprint_warning(message, arg));
+    WITH_ARG(message, vreport(diagnostic_warning, fpos, message, arg));
+}
+
+int
+format_error_pos(vec_diagnostic* out, const fposition* fpos,
+                 const char* message, ...) {
+    int ret;
+    WITH_ARG(message, ret = vappend_diagnostic(out, diagnostic_error, fpos,
+                                               message, arg));
+    return ret;
+}
+
+void
+report_error_pos(vec_diagnostic* errors, const fposition* fpos,
+                 const char* message, ...) {
+    if (errors) {
+        WITH_ARG(message, vappend_diagnostic(errors, diagnostic_error, fpos,
+                                             message, arg));
+    } else {
+        WITH_ARG(message, vreport(diagnostic_error, fpos, message, arg));
+    }
+}
+
+void
+report_diagnostics(vec_diagnostic* diagnostics) {
+    vec_diagnostic* out = thread_diagnostics();
+    size_t i;
+    for (i = 0; i != diagnostics->len; ++i) {
+        diagnostic* diagnostic = &diagnostics->diagnostics[i];
+        if (!out || vec_push(out, sizeof(*diagnostic), diagnostic)) {
+            fprintf(stderr, "Error: Out of memory while reporting: %s\n",
+                    str_cbegin(&diagnostic->message));
+            destroy_diagnostic(diagnostic);
+        }
+    }
+    /* the buffer owns the strings now */
+    rpfree(diagnostics->diagnostics);
+    *diagnostics = (vec_diagnostic) VEC_INIT;
+}
+
+/* A diagnostic and the order it was reported in. */
+struct sorted_diagnostic {
+    diagnostic* diagnostic;
+    size_t order;
+};
+
+static int
+compare_diagnostics(const void* a_, const void* b_) {
+    const struct sorted_diagnostic* a = a_;
+    const struct sorted_diagnostic* b = b_;
+    const diagnostic* x = a->diagnostic;
+    const diagnostic* y = b->diagnostic;
+    int has_position = x->fname.len != 0;
+    int cmp;
+    if (has_position != (y->fname.len != 0)) {
+        return has_position ? -1 : 1;
+    }
+    if (has_position) {
+        cmp = strcmp(str_cbegin(&x->fname), str_cbegin(&y->fname));
+        if (cmp) {
+            return cmp;
+        }
+        if (x->line != y->line) {
+            return x->line < y->line ? -1 : 1;
+        }
+        if (x->column != y->column) {
+            return x->column < y->column ? -1 : 1;
+        }
+    }
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+static void
+append_json_string(str* out, const char* s) {
+    str_push(out, '"');
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            str_push(out, '\\');
+            str_push(out, (char) c);
+        } else if (c < 0x20) {
+            char escape[8];
+            sprintf(escape, "\\u%04x", c);
+            str_push_s(out, escape);
+        } else {
+            str_push(out, (char) c);
+        }
+    }
+    str_push(out, '"');
+}
+
+static void
+append_diagnostic(str* out, const diagnostic* diagnostic) {
+    const char* severity = diagnostic->severity == diagnostic_error
+                               ? "error" : "warning";
+    char number[32];
+    if (write_json) {
+        str_push_s(out, "{\"severity\":\"");
+        str_push_s(out, severity);
+        str_push(out, '"');
+        if (diagnostic->fname.len) {
+            str_push_s(out, ",\"file\":");
+            append_json_string(out, str_cbegin(&diagnostic->fname));
+            sprintf(number, ",\"line\":%d", diagnostic->line);
+            str_push_s(out, number);
+            sprintf(number, ",\"column\":%d", diagnostic->column);
+            str_push_s(out, number);
+        }
+        str_push_s(out, ",\"message\":");
+        append_json_string(out, str_cbegin(&diagnostic->message));
+        str_push_s(out, "}\n");
+        return;
+    }
+    if (diagnostic->fname.len) {
+        str_push_str(out, &diagnostic->fname);
+        sprintf(number, ":%d:%d: ", diagnostic->line, diagnostic->column);
+        str_push_s(out, number);
+    }
+    str_push_s(out, diagnostic->severity == diagnostic_error ? "Error: "
+                                                             : "Warning: ");
+    str_push_str(out, &diagnostic->message);
+    str_push(out, '\n');
+}
+
+void
+flush_diagnostics(void) {
+    struct diagnostics_buffer** link;
+    struct diagnostics_buffer* buffer;
+    struct sorted_diagnostic* sorted;
+    size_t len = 0, order = 0, suppressed = 0;
+    size_t i;
+    str text = STR_INIT;
+
+    pthread_mutex_lock(&buffers_lock);
+    for (buffer = buffers; buffer; buffer = buffer->next) {
+        len += buffer->diagnostics.len;
+    }
+    sorted = rpmalloc((len ? len : 1) * sizeof(struct sorted_diagnostic));
+    if (!sorted) {
+        pthread_mutex_unlock(&buffers_lock);
+        return;
+    }
+    for (buffer = buffers; buffer; buffer = buffer->next) {
+        for (i = 0; i != buffer->diagnostics.len; ++i) {
+            sorted[order].diagnostic = &buffer->diagnostics.diagnostics[i];
+            sorted[order].order = order;
+            ++order;
+        }
+    }
+    qsort(sorted, len, sizeof(*sorted), compare_diagnostics);
+
+    for (i = 0; i != len; ++i) {
+        const diagnostic* diagnostic = sorted[i].diagnostic;
+        if (diagnostic->severity == diagnostic_error) {
+            if (error_limit && errors_written == error_limit) {
+                ++suppressed;
+                continue;
+            }
+            ++errors_written;
+        }
+        append_diagnostic(&text, diagnostic);
+    }
+    if (suppressed) {
+        diagnostic note;
+        char message[96];
+        sprintf(message, "Reached the limit of %lu errors, %lu more not "
+                "shown", (unsigned long) error_limit,
+                (unsigned long) suppressed);
+        note.severity = diagnostic_error;
+        note.fname = (str) STR_INIT;
+        note.message = (str) STR_INIT;
+        str_push_s(&note.message, message);
+        append_diagnostic(&text, &note);
+        str_destroy(&note.message);
+    }
+    rpfree(sorted);
+
+    /* The buffers of threads that exited can't be reported to any
+     * more. */
+    link = &buffers;
+    while (*link) {
+        buffer = *link;
+        destroy_diagnostics(&buffer->diagnostics);
+        if (buffer->thread_exited) {
+            *link = buffer->next;
+            rpfree(buffer);
+        } else {
+            link = &buffer->next;
+        }
+    }
+    buffers_end = link;
+    pthread_mutex_unlock(&buffers_lock);
+
+    if (text.len) {
+        FILE* stream = diagnostics_stream ? diagnostics_stream : stderr;
+        fwrite(str_cbegin(&text), 1, text.len, stream);
+        fflush(stream);
+    }
+    str_destroy(&text);
+}
+
+vec_diagnostic*
+capture_diagnostics(vec_diagnostic* into) {
+    vec_diagnostic* previous = local_capture;
+    local_capture = into;
+    return previous;
+}
+
+void
+set_diagnostics_stream(FILE* stream) {
+    flush_diagnostics();
+    diagnostics_stream = stream;
+}
+
+void
+configure_diagnostics(size_t limit, int json) {
+    error_limit = limit;
+    errors_written = 0;
+    write_json = json;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+
+/* Report an error at `data` on a thread of its own. */
+static void*
+report_from_thread(void* data) {
+    const fposition* fpos = data;
+    print_error_pos(fpos, "from a thread");
+    return 0;
+}
+
+/* Capture what is flushed until end_capture with the given
+ * settings. */
+static FILE*
+begin_capture(char** text, size_t* len, size_t limit, int json) {
+    FILE* stream = open_memstream(text, len);
+    if (stream) {
+        set_diagnostics_stream(stream);
+        configure_diagnostics(limit, json);
+    }
+    return stream;
+}
+
+static void
+end_capture(FILE* stream) {
+    set_diagnostics_stream(0);
+    configure_diagnostics(0, 0);
+    fclose(stream);
+}
+
+TEST(test_diagnostics_sorted) {
+    fposition late = {"b.shiv", 3, 1};
+    fposition early = {"b.shiv", 1, 7};
+    fposition other = {"a.shiv", 9, 2};
+    vec_diagnostic collected = VEC_INIT;
+    pthread_t thread;
+    char* text = 0;
+    size_t len;
+    FILE* stream = begin_capture(&text, &len, 0, 0);
+    ASSERT(stream, end);
+    print_error("no position");
+    print_warning_pos(&late, "late");
+    ASSERT(format_error_pos(&collected, &early, "early %d", 1) == 0, end);
+    report_diagnostics(&collected);
+    ASSERT(pthread_create(&thread, 0, report_from_thread, &other) == 0,
+           end);
+    pthread_join(thread, 0);
+    end_capture(stream);
+    stream = 0;
+    ASSERT(strcmp(text,
+                  "a.shiv:9:2: Error: from a thread\n"
+                  "b.shiv:1:7: Error: early 1\n"
+                  "b.shiv:3:1: Warning: late\n"
+                  "Error: no position\n") == 0, end);
+end:
+    if (stream) {
+        end_capture(stream);
+    }
+    free(text);
+    destroy_diagnostics(&collected);
+}
+END_TEST
+
+TEST(test_diagnostics_limit_json) {
+    fposition fpos = {"a\"b", 2, 3};
+    char* text = 0;
+    size_t len;
+    FILE* stream = begin_capture(&text, &len, 1, 1);
+    ASSERT(stream, end);
+    print_error_pos(&fpos, "first");
+    print_warning("not an error");
+    print_error("second");
+    print_error("third");
+    end_capture(stream);
+    ASSERT(strcmp(text,
+                  "{\"severity\":\"error\",\"file\":\"a\\\"b\",\"line\":2,"
+                  "\"column\":3,\"message\":\"first\"}\n"
+                  "{\"severity\":\"warning\",\"message\":\"not an "
+                  "error\"}\n"
+                  "{\"severity\":\"error\",\"message\":\"Reached the "
+                  "limit of 1 errors, 2 more not shown\"}\n") == 0, end);
+end:
+    free(text);
+}
+END_TEST
+
+static void
+write_test_unbuffered(FILE* stream, const fposition* fpos,
+                      const char* message, ...) {
+    WITH_ARG(message, write_unbuffered(stream, fpos, message, arg));
+}
+
+/* What is written when there is no memory to report with is still
+ * formatted and keeps its position. */
+TEST(test_diagnostics_unbuffered) {
+    fposition fpos = {"c.shiv", 4, 2};
+    char* text = 0;
+    size_t len;
+    FILE* stream = open_memstream(&text, &len);
+    ASSERT(stream, end);
+    write_test_unbuffered(stream, &fpos, "Unknown name %s in %s", "x", "f");
+    write_test_unbuffered(stream, 0, "%d errors", 3);
+    fclose(stream);
+    ASSERT(strcmp(text, "c.shiv:4:2: Error: Out of memory while "
+                  "reporting: Unknown name x in f\n"
+                  "Error: Out of memory while reporting: 3 errors\n") == 0,
+           end);
+end:
+    free(text);
+}
+END_TEST
+
+void test_diagnostics(void) {
+    RUN(test_diagnostics_sorted);
+    RUN(test_diagnostics_limit_json);
+    RUN(test_diagnostics_unbuffered);
 }
+#endif
@@ -3,10 +3,60 @@
 #ifndef HEADER_GUARD_DIAGNOSTICS_H
 #define HEADER_GUARD_DIAGNOSTICS_H
 
+#include <stddef.h>
+#include <stdio.h>
+#include "../cutil/str.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Diagnostics are collected in a buffer for each thread and only
+ * written by flush_diagnostics, sorted by their position, so that
+ * what several threads report never interleaves and doesn't depend on
+ * timing. */
+
+enum diagnostic_severity {
+    diagnostic_error,
+    diagnostic_warning,
+};
+typedef enum diagnostic_severity diagnostic_severity;
+
+struct diagnostic {
+    diagnostic_severity severity;
+    /* Empty for diagnostics that aren't about a position in a
+     * file. */
+    str fname;
+    int line, column;
+    str message;
+};
+typedef struct diagnostic diagnostic;
+
+struct vec_diagnostic {
+    diagnostic* diagnostics;
+    size_t len, cap;
+};
+typedef struct vec_diagnostic vec_diagnostic;
+
+void destroy_diagnostics(vec_diagnostic*);
+
+/* Write diagnostics to `stream` instead of stderr.  Null resets it
+ * to stderr.  Diagnostics reported before are flushed to the old
+ * stream first. */
+void set_diagnostics_stream(FILE* stream);
+
+/* Stop writing errors once `error_limit` have been written, zero for
+ * no limit, and write each diagnostic as a line of JSON if `json` is
+ * set.  This starts counting errors from zero again. */
+void configure_diagnostics(size_t error_limit, int json);
+
+/* Sort the diagnostics reported on every thread since the last flush
+ * and write them in one go.  Diagnostics with a position come first,
+ * ordered by file, line and column and then by the order they were
+ * reported in, followed by the rest in the order they were reported
+ * in.  No other thread may report diagnostics meanwhile. */
+void flush_diagnostics(void);
+
 void print_error(const char* message, ...);
 void print_warning(const char* message, ...);
 
@@ -16,6 +66,25 @@ void print_error_pos(const struct fposition* fpos,
 void print_warning_pos(const struct fposition* fpos,
                        const char* message, ...);
 
+/* Append what the calling thread reports to `into` instead of its
+ * buffer, until called again with the destination this returns, so
+ * that the diagnostics of one call stay with its results and never
+ * reach the process wide buffers.  Null goes back to the buffer. */
+vec_diagnostic* capture_diagnostics(vec_diagnostic* into);
+
+/* Append an error to `out` instead of reporting it so that errors
+ * found by tasks on multiple threads can be reported in a
+ * deterministic order with report_diagnostics. */
+int format_error_pos(vec_diagnostic* out, const struct fposition* fpos,
+                     const char* message, ...);
+/* Report the diagnostics in `diagnostics` in order, leaving it
+ * empty. */
+void report_diagnostics(vec_diagnostic* diagnostics);
+/* Append the error to `errors` if it isn't null, otherwise report
+ * it. */
+void report_error_pos(vec_diagnostic* errors, const struct fposition* fpos,
+                      const char* message, ...);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,442 @@
+#include "eval.h"
+#include <assert.h>
+#include <limits.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/str.h"
+#include "diagnostics.h"
+#include "parse.h"
+#include "symtab.h"
+
+/* Const declarations referring to each other more deeply than this
+ * are reported instead of risking running out of stack. */
+#define EVAL_MAX_DEPTH 256
+
+enum const_state {
+    const_unevaluated,
+    const_in_progress,
+    const_evaluated,
+    const_failed,
+};
+
+struct const_entry {
+    var_decl* decl;
+    enum const_state state;
+    value value;
+};
+typedef struct const_entry const_entry;
+
+struct eval_context {
+    const_entry* entries;
+    size_t len;
+    symtab table;
+    unsigned long budget;
+    unsigned long step_budget;
+    /* 0 if within budget, 1 if the budget ran out and it hasn't been
+     * reported yet, 2 once reported. */
+    int out_of_budget;
+    /* The declarations currently being evaluated, used to print
+     * cycles. */
+    const_entry* stack[EVAL_MAX_DEPTH];
+    size_t depth;
+};
+typedef struct eval_context eval_context;
+
+static const_entry*
+lookup_const(const eval_context* ctx, const char* name) {
+    size_t i = symtab_lookup(&ctx->table, name);
+    return i == SYMTAB_NOT_FOUND ? 0 : &ctx->entries[i];
+}
+
+static int
+add_const(eval_context* ctx, var_decl* decl) {
+    const char* name = str_cbegin(&decl->name);
+    if (symtab_insert(&ctx->table, name, ctx->len)) {
+        print_error("Redefinition of const %s", name);
+        return -1;
+    }
+    ctx->entries[ctx->len].decl = decl;
+    ctx->entries[ctx->len].state = const_unevaluated;
+    ++ctx->len;
+    return 0;
+}
+
+static void
+report_budget(eval_context* ctx, const char* what, const char* name) {
+    if (ctx->out_of_budget == 1) {
+        print_error("Exceeded the budget of %lu compile time evaluation "
+                    "steps while evaluating %s %s",
+                    ctx->step_budget, what, name);
+        ctx->out_of_budget = 2;
+    }
+}
+
+static void
+report_cycle(const eval_context* ctx, const const_entry* entry) {
+    str chain = STR_INIT;
+    size_t i = ctx->depth;
+    while (ctx->stack[i - 1] != entry) {
+        --i;
+    }
+    for (--i; i != ctx->depth; ++i) {
+        str_push_str(&chain, &ctx->stack[i]->decl->name);
+        str_push_s(&chain, " -> ");
+    }
+    str_push_str(&chain, &entry->decl->name);
+    print_error("Cycle between const declarations: %s",
+                str_cbegin(&chain));
+    str_destroy(&chain);
+}
+
+static int eval_const(eval_context* ctx, const_entry* entry,
+                      value* result);
+
+static int
+eval_expression(eval_context* ctx, const expression_pool* pool,
+                expr_ref ref, value* result) {
+    const expression* expr = &pool->nodes[ref];
+    value first;
+    value second;
+    if (ctx->budget == 0) {
+        if (!ctx->out_of_budget) {
+            ctx->out_of_budget = 1;
+        }
+        return -1;
+    }
+    --ctx->budget;
+
+    switch (expr->type) {
+    case expression_int:
+        {
+            unsigned long long literal = get_expression_int(pool, ref);
+            if (literal > LLONG_MAX) {
+                print_error("Integer literal %llu does not fit in a 64 "
+                            "bit signed integer", literal);
+                return -1;
+            }
+            result->type = value_int;
+            result->data.integer = (long long) literal;
+        }
+        return 0;
+    case expression_float:
+        print_error("Compile time evaluation of floating point numbers "
+                    "is not supported yet");
+        return -1;
+    case expression_name:
+        {
+            const char* name = get_expression_name(pool, ref);
+            const_entry* entry = lookup_const(ctx, name);
+            if (!entry) {
+                print_error("%s is not a compile time constant", name);
+                return -1;
+            }
+            return eval_const(ctx, entry, result);
+        }
+    case expression_assign:
+        print_error("Assignment in a compile time constant");
+        return -1;
+    case expression_call:
+        print_error("Function call in a compile time constant");
+        return -1;
+    case expression_comma:
+        if (eval_expression(ctx, pool, expr->first, &first) ||
+            eval_expression(ctx, pool, expr->second, result)) {
+            return -1;
+        }
+        return 0;
+    case expression_minus:
+    case expression_plus:
+        if (eval_expression(ctx, pool, expr->first, &first) ||
+            eval_expression(ctx, pool, expr->second, &second)) {
+            return -1;
+        }
+        assert(first.type == value_int && second.type == value_int);
+        result->type = value_int;
+        if (expr->type == expression_plus
+                ? __builtin_add_overflow(first.data.integer,
+                                         second.data.integer,
+                                         &result->data.integer)
+                : __builtin_sub_overflow(first.data.integer,
+                                         second.data.integer,
+                                         &result->data.integer)) {
+            print_error("Integer overflow in compile time constant "
+                        "%lld %c %lld", first.data.integer,
+                        expr->type == expression_plus ? '+' : '-',
+                        second.data.integer);
+            return -1;
+        }
+        return 0;
+    }
+    /* shouldn't happen */
+    assert(0);
+    return -1;
+}
+
+static int
+eval_const(eval_context* ctx, const_entry* entry, value* result) {
+    int res;
+    switch (entry->state) {
+    case const_evaluated:
+        *result = entry->value;
+        return 0;
+    case const_failed:
+        return -1;
+    case const_in_progress:
+        report_cycle(ctx, entry);
+        return -1;
+    case const_unevaluated:
+        break;
+    }
+
+    if (ctx->depth == EVAL_MAX_DEPTH) {
+        print_error("Const declarations are nested more than %d deep "
+                    "while evaluating %s", EVAL_MAX_DEPTH,
+                    str_cbegin(&entry->decl->name));
+        entry->state = const_failed;
+        return -1;
+    }
+
+    entry->state = const_in_progress;
+    ctx->stack[ctx->depth++] = entry;
+    res = eval_expression(ctx, &entry->decl->exprs, entry->decl->value,
+                          &entry->value);
+    --ctx->depth;
+    if (res) {
+        report_budget(ctx, "const", str_cbegin(&entry->decl->name));
+        entry->state = const_failed;
+        return -1;
+    }
+    entry->state = const_evaluated;
+    *result = entry->value;
+    return 0;
+}
+
+/* Replace the expression at `ref` with a literal holding `v`.
+ * Negative values are written as `0 - magnitude` as there are no
+ * negative literals.  The nodes of the old expression are left
+ * unused in the pool. */
+static int
+fold(expression_pool* pool, expr_ref ref, const value* v) {
+    expr_ref literal;
+    assert(v->type == value_int);
+    if (v->data.integer >= 0) {
+        literal = add_int_expression(
+            pool, (unsigned long long) v->data.integer);
+        if (literal == EXPR_NONE) {
+            return -1;
+        }
+    } else {
+        expr_ref zero = add_int_expression(pool, 0);
+        expr_ref magnitude = add_int_expression(
+            pool, (unsigned long long) -(v->data.integer + 1) + 1);
+        if (zero == EXPR_NONE || magnitude == EXPR_NONE) {
+            return -1;
+        }
+        literal = add_binary_expression(pool, expression_minus, zero,
+                                        magnitude);
+        if (literal == EXPR_NONE) {
+            return -1;
+        }
+    }
+    pool->nodes[ref] = pool->nodes[literal];
+    return 0;
+}
+
+static int
+eval_default_values(eval_context* ctx, var_decl* fun) {
+    vec_var_decl* params = &fun->type.data.fun_def.params;
+    expression_pool* pool = &fun->exprs;
+    int ret = 0;
+    size_t i;
+    for (i = 0; i != params->len; ++i) {
+        var_decl* param = &params->vars[i];
+        value result;
+        if (param->value == EXPR_NONE) {
+            continue;
+        }
+        if (eval_expression(ctx, pool, param->value, &result)) {
+            report_budget(ctx, "the default value of",
+                          str_cbegin(&param->name));
+            ret = -1;
+        } else if (fold(pool, param->value, &result)) {
+            return -1;
+        }
+    }
+    return ret;
+}
+
+int
+eval_constants(vec_var_decl* toplevels, unsigned long step_budget) {
+    eval_context ctx;
+    size_t num_consts = 0;
+    size_t i;
+    int ret = 0;
+    assert(toplevels);
+
+    for (i = 0; i != toplevels->len; ++i) {
+        if (toplevels->vars[i].type.type == dtype_const_inferred) {
+            ++num_consts;
+        }
+    }
+
+    ctx.len = 0;
+    ctx.budget = step_budget;
+    ctx.step_budget = step_budget;
+    ctx.out_of_budget = 0;
+    ctx.depth = 0;
+    ctx.entries = rpmalloc(sizeof(const_entry) * (num_consts + 1));
+    if (!ctx.entries) {
+        return -1;
+    }
+    if (symtab_init(&ctx.table, num_consts)) {
+        rpfree(ctx.entries);
+        return -1;
+    }
+
+    for (i = 0; i != toplevels->len; ++i) {
+        var_decl* decl = &toplevels->vars[i];
+        if (decl->type.type == dtype_const_inferred) {
+            assert(decl->value != EXPR_NONE);
+            if (add_const(&ctx, decl)) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret) {
+        goto cleanup;
+    }
+
+    for (i = 0; i != ctx.len; ++i) {
+        value result;
+        if (eval_const(&ctx, &ctx.entries[i], &result)) {
+            ret = -1;
+        }
+    }
+
+    for (i = 0; i != toplevels->len; ++i) {
+        var_decl* decl = &toplevels->vars[i];
+        if (decl->type.type == dtype_fun_def &&
+            eval_default_values(&ctx, decl)) {
+            ret = -1;
+        }
+    }
+
+    /* Fold only after everything is evaluated so the evaluator
+     * always sees the expressions as they were written. */
+    for (i = 0; i != ctx.len; ++i) {
+        const_entry* entry = &ctx.entries[i];
+        if (entry->state == const_evaluated &&
+            fold(&entry->decl->exprs, entry->decl->value,
+                 &entry->value)) {
+            ret = -1;
+        }
+    }
+
+cleanup:
+    rpfree(ctx.entries);
+    symtab_destroy(&ctx.table);
+    return ret;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+#include "../cutil/vec.h"
+#include "fiter.h"
+#include "lex.h"
+
+static int
+eval_test_source(const char** file, vec_var_decl* toplevels,
+                 unsigned long step_budget) {
+    vec_token tokens = VEC_INIT;
+    fiter iter;
+    int res;
+    fiter_init(&iter, (FILE*) file, "eval_test");
+    res = lex(&iter, &tokens) || parse(&tokens, toplevels, 0) ||
+          eval_constants(toplevels, step_budget);
+    destroy_tokens(&tokens);
+    return res;
+}
+
+static const char* test_eval_fold_file[] =
+    {"a : const = b - 5;",
+     "b : const = (1 + 2) + c;",
+     "c : const = 5 - (4 - 1);",
+     "f := fun (x : std::i32, y : std::i32 = b + a) -> std::i32 {",
+     "return x + y; }", 0};
+TEST(test_eval_fold) {
+    vec_var_decl toplevels = VEC_INIT;
+    const expression_pool* pool;
+    expr_ref value;
+    ASSERT(eval_test_source(test_eval_fold_file, &toplevels,
+                            EVAL_DEFAULT_STEP_BUDGET) == 0, cleanup);
+    ASSERT(toplevels.len == 4, cleanup);
+    /* a = 5 - 5 */
+    pool = &toplevels.vars[0].exprs;
+    value = toplevels.vars[0].value;
+    ASSERT(pool->nodes[value].type == expression_int, cleanup);
+    ASSERT(get_expression_int(pool, value) == 0, cleanup);
+    pool = &toplevels.vars[1].exprs;
+    value = toplevels.vars[1].value;
+    ASSERT(pool->nodes[value].type == expression_int, cleanup);
+    ASSERT(get_expression_int(pool, value) == 5, cleanup);
+    ASSERT(toplevels.vars[3].type.type == dtype_fun_def, cleanup);
+    ASSERT(toplevels.vars[3].type.data.fun_def.params.len == 2,
+           cleanup);
+    pool = &toplevels.vars[3].exprs;
+    value = toplevels.vars[3].type.data.fun_def.params.vars[1].value;
+    ASSERT(pool->nodes[value].type == expression_int, cleanup);
+    ASSERT(get_expression_int(pool, value) == 5, cleanup);
+cleanup:
+    destroy_var_decls(&toplevels);
+}
+END_TEST
+
+static const char* test_eval_negative_file[] =
+    {"a : const = 1 - 2 - 3;", 0};
+TEST(test_eval_negative) {
+    vec_var_decl toplevels = VEC_INIT;
+    const expression_pool* pool;
+    const expression* value;
+    ASSERT(eval_test_source(test_eval_negative_file, &toplevels,
+                            EVAL_DEFAULT_STEP_BUDGET) == 0, cleanup);
+    pool = &toplevels.vars[0].exprs;
+    value = &pool->nodes[toplevels.vars[0].value];
+    ASSERT(value->type == expression_minus, cleanup);
+    ASSERT(get_expression_int(pool, value->first) == 0, cleanup);
+    ASSERT(get_expression_int(pool, value->second) == 4, cleanup);
+cleanup:
+    destroy_var_decls(&toplevels);
+}
+END_TEST
+
+static const char* test_eval_cycle_file[] =
+    {"a : const = b + 1;",
+     "b : const = c + 1;",
+     "c : const = a;", 0};
+TEST(test_eval_cycle) {
+    vec_var_decl toplevels = VEC_INIT;
+    ASSERT(eval_test_source(test_eval_cycle_file, &toplevels,
+                            EVAL_DEFAULT_STEP_BUDGET) != 0, cleanup);
+cleanup:
+    destroy_var_decls(&toplevels);
+}
+END_TEST
+
+static const char* test_eval_budget_file[] =
+    {"a : const = 1 + 1 + 1 + 1 + 1 + 1;", 0};
+TEST(test_eval_budget) {
+    vec_var_decl toplevels = VEC_INIT;
+    ASSERT(eval_test_source(test_eval_budget_file, &toplevels, 5) != 0,
+           cleanup);
+cleanup:
+    destroy_var_decls(&toplevels);
+}
+END_TEST
+
+void test_eval(void) {
+    RUN(test_eval_fold);
+    RUN(test_eval_negative);
+    RUN(test_eval_cycle);
+    RUN(test_eval_budget);
+}
+
+#endif
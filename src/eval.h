@@ -0,0 +1,40 @@
+#pragma once
+
+#ifndef HEADER_GUARD_EVAL_H
+#define HEADER_GUARD_EVAL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct value {
+    enum value_type {
+        value_int,
+    } type;
+    union {
+        long long integer;
+    } data;
+};
+typedef enum value_type value_type;
+typedef struct value value;
+
+/* The default number of expression nodes the evaluator may visit
+ * before it gives up. */
+#define EVAL_DEFAULT_STEP_BUDGET 1000000
+
+struct vec_var_decl;
+/* Evaluate every `name : const = value` declaration and default
+ * parameter value in `toplevels` at compile time and fold their
+ * expressions into literals.  Each declaration is evaluated at most
+ * once.  Cycles between declarations and running past `step_budget`
+ * evaluation steps are reported as errors. */
+int eval_constants(struct vec_var_decl* toplevels,
+                   unsigned long step_budget);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,45 +1,75 @@
 #include "fiter.h"
 #include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include "diagnostics.h"
 
-#ifndef TEST_MODE
-char fiter_next(fiter* iter) {
-    char c;
-    assert(iter);
-    assert(iter->file);
-    assert(iter->index >= 0 && iter->index < sizeof(iter->buffer));
-    c = iter->buffer[iter->index];
-    if (c != '\0') {
-        if (c == '\n') {
-            ++iter->fpos.line;
-            /* This is a workaround for the columns being always off
-             * by one.  We are at EOL right now.  The *next*
-             * character is BOL and has column 1 as expected. */
-            iter->fpos.column = 0;
-        } else {
-            ++iter->fpos.column;
-        }
-        ++iter->index;
-        if (iter->index >= sizeof(iter->buffer)) {
-            size_t numread;
-            iter->index = 0;
-            numread = fread(iter->buffer, sizeof(char),
-                            sizeof(iter->buffer), iter->file);
-            if (numread < sizeof(iter->buffer)) {
-                /* eof */
-                iter->buffer[numread] = '\0';
-            }
-        }
+static void
+fiter_fill(fiter* iter) {
+    size_t numread;
+    size_t valid;
+    if (iter->file) {
+        numread = fread(iter->buffer, sizeof(char), sizeof(iter->buffer),
+                        iter->file);
+    } else {
+        numread = iter->memory_len < sizeof(iter->buffer)
+            ? iter->memory_len : sizeof(iter->buffer);
+        memcpy(iter->buffer, iter->memory, numread);
+        iter->memory += numread;
+        iter->memory_len -= numread;
+    }
+    if (numread < sizeof(iter->buffer)) {
+        /* eof */
+        iter->buffer[numread] = '\0';
+    }
+    valid = utf8_validate(&iter->utf8, iter->buffer, numread);
+    if (valid != numread ||
+        (numread < sizeof(iter->buffer) && iter->utf8.need)) {
+        /* either an invalid character or the file ends in the
+         * middle of one */
+        iter->invalid = valid;
+    } else {
+        iter->invalid = sizeof(iter->buffer);
     }
-    return c;
+}
+
+#ifndef TEST_MODE
+void fiter_init(fiter* iter, FILE* file, const char* fname) {
+    utf8_state state = UTF8_STATE_INIT;
+    iter->file = file;
+    iter->index = 0;
+    iter->fpos.fname = fname;
+    iter->fpos.line = 1;
+    iter->fpos.column = 1;
+    iter->start = iter->fpos;
+    iter->utf8 = state;
+    iter->failed = 0;
+    iter->memory = 0;
+    iter->memory_len = 0;
+    iter->errors = 0;
+    fiter_fill(iter);
 }
 #else
-/* In testing mode, we define fiter_next very differently.  It will
+/* In testing mode, we define fiter_init very differently.  It will
  * reinterpret the `FILE*` as a `const char* const*` where both are
- * null terminated. */
-char fiter_next(fiter* iter) {
+ * null terminated.  The strings are assumed to be valid UTF-8.
+ * Memory is read as it is outside of testing mode. */
+void fiter_init(fiter* iter, FILE* file, const char* fname) {
+    iter->file = file;
+    iter->index = 0;
+    iter->fpos.fname = fname;
+    iter->fpos.line = 1;
+    iter->fpos.column = 1;
+    iter->invalid = sizeof(iter->buffer);
+    iter->failed = 0;
+    iter->memory = 0;
+    iter->memory_len = 0;
+    iter->errors = 0;
+}
+
+static char
+fiter_next_strings(fiter* iter) {
     char c;
-    assert(iter);
-    assert(iter->file);
 x:
     if (!*(const char* const*)iter->file) {
         return '\0';
@@ -50,6 +80,84 @@ x:
         goto x;
     }
     c = (*(const char* const*)iter->file)[iter->index];
+    if (c == '\n') {
+        ++iter->fpos.line;
+        iter->fpos.column = 0;
+    } else if ((c & 0xC0) != 0x80) {
+        ++iter->fpos.column;
+    }
+    ++iter->index;
+    return c;
+}
+#endif
+
+void fiter_init_memory(fiter* iter, const char* text, size_t len,
+                       const fposition* start) {
+    utf8_state state = UTF8_STATE_INIT;
+    iter->file = 0;
+    iter->index = 0;
+    iter->fpos = *start;
+    iter->start = *start;
+    iter->utf8 = state;
+    iter->failed = 0;
+    iter->memory = text;
+    iter->memory_len = len;
+    iter->memory_begin = text;
+    iter->memory_size = len;
+    iter->errors = 0;
+    fiter_fill(iter);
+}
+
+int fiter_can_rewind(const fiter* iter) {
+    if (!iter->file) {
+        return 1;
+    }
+#ifdef TEST_MODE
+    /* the strings standing in for files can't be read again */
+    return 0;
+#else
+    /* ask the file descriptor so stdio's buffer is left alone */
+    return lseek(fileno(iter->file), 0, SEEK_CUR) != -1;
+#endif
+}
+
+int fiter_rewind(fiter* iter) {
+    if (!fiter_can_rewind(iter)) {
+        return -1;
+    }
+    if (!iter->file) {
+        fposition start = iter->start;
+        fiter_init_memory(iter, iter->memory_begin, iter->memory_size,
+                          &start);
+        return 0;
+    }
+    if (fseek(iter->file, 0, SEEK_SET)) {
+        return -1;
+    }
+    fiter_init(iter, iter->file, iter->start.fname);
+    return 0;
+}
+
+char fiter_next(fiter* iter) {
+    char c;
+    assert(iter);
+    assert(iter->file || iter->memory);
+#ifdef TEST_MODE
+    if (iter->file) {
+        return fiter_next_strings(iter);
+    }
+#endif
+    assert(iter->index >= 0 && iter->index < sizeof(iter->buffer));
+    if (iter->index == iter->invalid) {
+        if (!iter->failed) {
+            fposition fpos = iter->fpos;
+            ++fpos.column;
+            report_error_pos(iter->errors, &fpos, "Invalid UTF-8");
+            iter->failed = 1;
+        }
+        return '\0';
+    }
+    c = iter->buffer[iter->index];
     if (c != '\0') {
         if (c == '\n') {
             ++iter->fpos.line;
@@ -57,13 +165,15 @@ x:
              * by one.  We are at EOL right now.  The *next*
              * character is BOL and has column 1 as expected. */
             iter->fpos.column = 0;
-        } else {
+        } else if ((c & 0xC0) != 0x80) {
+            /* columns count characters, not bytes */
             ++iter->fpos.column;
         }
         ++iter->index;
+        if (iter->index >= sizeof(iter->buffer)) {
+            iter->index = 0;
+            fiter_fill(iter);
+        }
     }
     return c;
 }
-
-
-#endif
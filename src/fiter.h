@@ -4,7 +4,11 @@
 #define HEADER_GUARD_FITER_H
 
 #include <stdio.h>
+#include "../cutil/str.h"
 #include "fposition.h"
+#include "utf8.h"
+
+struct vec_diagnostic;
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,9 +19,40 @@ struct fiter {
     char buffer[1024];
     size_t index;
     fposition fpos;
+    /* The index of the first byte in `buffer` that isn't valid UTF-8
+     * or `sizeof(buffer)` if they all are. */
+    size_t invalid;
+    utf8_state utf8;
+    /* Set once invalid UTF-8 has been reported. */
+    int failed;
+    /* When reading from memory `file` is null and these are the
+     * bytes that haven't been read yet. */
+    const char* memory;
+    size_t memory_len;
+    /* Where reading started, to go back to it. */
+    const char* memory_begin;
+    size_t memory_size;
+    fposition start;
+    /* If not null, errors are appended here instead of printed. */
+    struct vec_diagnostic* errors;
 };
 typedef struct fiter fiter;
 
+/* Start reading `file` from the beginning. */
+void fiter_init(fiter*, FILE* file, const char* fname);
+/* Read `len` bytes at `text` as if they were a file.  The position
+ * of the first byte is after `start`, which is the position the
+ * lexer would be at after reading everything up to `text`. */
+void fiter_init_memory(fiter*, const char* text, size_t len,
+                       const fposition* start);
+/* Whether fiter_rewind can go back to the beginning, which it can't
+ * for pipes and terminals. */
+int fiter_can_rewind(const fiter*);
+/* Start reading again from the beginning.  Returns -1 if the input
+ * can't be read again. */
+int fiter_rewind(fiter*);
+/* Get the next byte or 0 at the end of the file.  Reaching invalid
+ * UTF-8 reports an error and ends the file. */
 char fiter_next(fiter*);
 
 #ifdef __cplusplus
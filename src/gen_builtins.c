@@ -0,0 +1,99 @@
+/* Writes builtin_table.h, a perfect hash table of the types in
+ * builtins.def, by looking for a seed under which no two names land
+ * in the same slot.  Run by the build. */
+#include <stdio.h>
+#include <string.h>
+#include "builtin_hash.h"
+
+static const struct {
+    const char* type;
+    const char* name;
+    int size, alignment, is_signed;
+    const char* element;
+    int lanes;
+} builtins[] = {
+#define BUILTIN(type, name, size, alignment, is_signed, element, lanes) \
+    {#type, name, size, alignment, is_signed, #element, lanes},
+#include "builtins.def"
+#undef BUILTIN
+};
+#define NUM_BUILTINS (sizeof(builtins) / sizeof(*builtins))
+#define MAX_TABLE_SIZE 1024
+
+static int
+try_seed(uint32_t seed, size_t table_size, int* slots) {
+    size_t i;
+    for (i = 0; i != table_size; ++i) {
+        slots[i] = -1;
+    }
+    for (i = 0; i != NUM_BUILTINS; ++i) {
+        const char* name = builtins[i].name;
+        size_t slot = builtin_slot(builtin_hash(seed, name, strlen(name)),
+                                   table_size);
+        if (slots[slot] >= 0) {
+            return -1;
+        }
+        slots[slot] = (int) i;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int slots[MAX_TABLE_SIZE];
+    size_t table_size;
+    uint32_t seed = 0;
+    FILE* out;
+    size_t i;
+    if (argc != 2) {
+        fprintf(stderr, "Usage: gen_builtins OUTPUT\n");
+        return 1;
+    }
+    /* a sparse table keeps the search short */
+    for (table_size = 2; table_size < 2 * NUM_BUILTINS; table_size *= 2) {
+    }
+    for (;;) {
+        for (seed = 1; seed != 100000; ++seed) {
+            if (try_seed(2166136261u ^ seed, table_size, slots) == 0) {
+                break;
+            }
+        }
+        if (seed != 100000) {
+            break;
+        }
+        table_size *= 2;
+        if (table_size > MAX_TABLE_SIZE) {
+            fprintf(stderr, "gen_builtins: no perfect hash found\n");
+            return 1;
+        }
+    }
+
+    out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "/* Generated by gen_builtins from builtins.def. */\n");
+    fprintf(out, "#define BUILTIN_HASH_SEED %#xu\n",
+            (unsigned) (2166136261u ^ seed));
+    fprintf(out, "#define BUILTIN_TABLE_SIZE %lu\n",
+            (unsigned long) table_size);
+    fprintf(out, "static const builtin_type_info "
+                 "builtin_table[BUILTIN_TABLE_SIZE] = {\n");
+    for (i = 0; i != table_size; ++i) {
+        if (slots[i] < 0) {
+            fprintf(out, "    {0, 0, type_unknown, 0, 0, 0, "
+                         "type_unknown, 0},\n");
+        } else {
+            fprintf(out, "    {\"%s\", %lu, %s, %d, %d, %d, %s, %d},\n",
+                    builtins[slots[i]].name,
+                    (unsigned long) strlen(builtins[slots[i]].name),
+                    builtins[slots[i]].type, builtins[slots[i]].size,
+                    builtins[slots[i]].alignment,
+                    builtins[slots[i]].is_signed,
+                    builtins[slots[i]].element,
+                    builtins[slots[i]].lanes);
+        }
+    }
+    fprintf(out, "};\n");
+    return fclose(out) ? 1 : 0;
+}
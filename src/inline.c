@@ -0,0 +1,1441 @@
+#include "inline.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/str.h"
+#include "../cutil/vec.h"
+#include "codegen.h"
+#include "diagnostics.h"
+#include "parse.h"
+#include "symtab.h"
+
+#define NOT_INLINABLE ((size_t) -1)
+#define UNVISITED ((size_t) -1)
+
+/* Which top level functions call which, with one edge per call. */
+struct call_graph {
+    size_t len;
+    /* The callees of declaration `i` are `callees[first_callee[i]]`
+     * up to `callees[first_callee[i + 1]]`. */
+    size_t* first_callee;
+    size_t* callees;
+    /* The number of calls to each declaration. */
+    size_t* call_sites;
+    /* Set for functions calling themselves directly or through
+     * others. */
+    char* recursive;
+    /* Every declaration, callees before their callers unless they
+     * are in the same cycle. */
+    size_t* order;
+};
+typedef struct call_graph call_graph;
+
+/* A variable of the function being inlined and its name in the
+ * caller. */
+struct renaming {
+    const char* name;
+    str fresh;
+};
+
+struct inliner {
+    vec_var_decl* toplevels;
+    symtab names;
+    call_graph graph;
+    /* What inlining each function costs, NOT_INLINABLE if it can't
+     * be. */
+    size_t* costs;
+    int report;
+    /* The function calls are being inlined into. */
+    var_decl* caller;
+    /* The caller's variables in scope. */
+    struct {
+        const char** names;
+        size_t len, cap;
+    } scope;
+    struct {
+        struct renaming* renamings;
+        size_t len, cap;
+    } renamings;
+    /* The number of calls inlined into the caller, which numbers the
+     * variables introduced for them. */
+    unsigned long num_inlined;
+    /* Set while inlining the calls in a statement once calls can no
+     * longer be moved ahead of it. */
+    int moved_past;
+    int failed;
+};
+typedef struct inliner inliner;
+
+static size_t
+lookup_function(const inliner* in, const expression_pool* pool,
+                expr_ref call) {
+    const char* name = get_expression_name(pool, pool->nodes[call].first);
+    size_t index = symtab_lookup(&in->names, name);
+    if (index != SYMTAB_NOT_FOUND &&
+        in->toplevels->vars[index].type.type != dtype_fun_def) {
+        return SYMTAB_NOT_FOUND;
+    }
+    return index;
+}
+
+/* Count the calls in each function body, or record them if
+ * `graph->callees` is set.  The bodies haven't been changed yet so
+ * every call expression in a pool is part of the body. */
+static void
+visit_calls(const inliner* in, call_graph* graph) {
+    size_t edges = 0;
+    size_t i, j;
+    for (i = 0; i != graph->len; ++i) {
+        const var_decl* decl = &in->toplevels->vars[i];
+        graph->first_callee[i] = edges;
+        if (decl->type.type != dtype_fun_def) {
+            continue;
+        }
+        for (j = 0; j != decl->exprs.len; ++j) {
+            size_t callee;
+            if (decl->exprs.nodes[j].type != expression_call) {
+                continue;
+            }
+            callee = lookup_function(in, &decl->exprs, (expr_ref) j);
+            if (callee == SYMTAB_NOT_FOUND) {
+                continue;
+            }
+            if (graph->callees) {
+                graph->callees[edges] = callee;
+                ++graph->call_sites[callee];
+                if (callee == i) {
+                    graph->recursive[i] = 1;
+                }
+            }
+            ++edges;
+        }
+    }
+    graph->first_callee[graph->len] = edges;
+}
+
+/* Find the strongly connected components of the graph with Tarjan's
+ * algorithm, keeping the stack of functions being visited in memory
+ * instead of recursing.  Components are completed callees first,
+ * which gives `order`. */
+static int
+find_components(call_graph* graph) {
+    size_t len = graph->len;
+    size_t* index = rpmalloc(len * sizeof(size_t));
+    size_t* low = rpmalloc(len * sizeof(size_t));
+    size_t* next_edge = rpmalloc(len * sizeof(size_t));
+    size_t* visiting = rpmalloc(len * sizeof(size_t));
+    size_t* stack = rpmalloc(len * sizeof(size_t));
+    char* on_stack = rpcalloc(len, 1);
+    size_t counter = 0, num_stack = 0, num_ordered = 0;
+    size_t root, i;
+    int ret = -1;
+    if (!index || !low || !next_edge || !visiting || !stack || !on_stack) {
+        goto cleanup;
+    }
+    for (i = 0; i != len; ++i) {
+        index[i] = UNVISITED;
+    }
+    for (root = 0; root != len; ++root) {
+        size_t depth = 0;
+        if (index[root] != UNVISITED) {
+            continue;
+        }
+        visiting[depth++] = root;
+        index[root] = low[root] = counter++;
+        next_edge[root] = graph->first_callee[root];
+        stack[num_stack++] = root;
+        on_stack[root] = 1;
+        while (depth) {
+            size_t v = visiting[depth - 1];
+            size_t first;
+            if (next_edge[v] != graph->first_callee[v + 1]) {
+                size_t w = graph->callees[next_edge[v]++];
+                if (index[w] == UNVISITED) {
+                    visiting[depth++] = w;
+                    index[w] = low[w] = counter++;
+                    next_edge[w] = graph->first_callee[w];
+                    stack[num_stack++] = w;
+                    on_stack[w] = 1;
+                } else if (on_stack[w] && index[w] < low[v]) {
+                    low[v] = index[w];
+                }
+                continue;
+            }
+            --depth;
+            if (depth && low[v] < low[visiting[depth - 1]]) {
+                low[visiting[depth - 1]] = low[v];
+            }
+            if (low[v] != index[v]) {
+                continue;
+            }
+            /* v is the first function visited in its component */
+            first = num_ordered;
+            do {
+                size_t w = stack[--num_stack];
+                on_stack[w] = 0;
+                graph->order[num_ordered++] = w;
+            } while (graph->order[num_ordered - 1] != v);
+            if (num_ordered - first > 1) {
+                for (i = first; i != num_ordered; ++i) {
+                    graph->recursive[graph->order[i]] = 1;
+                }
+            }
+        }
+    }
+    assert(num_ordered == len);
+    ret = 0;
+
+cleanup:
+    rpfree(index);
+    rpfree(low);
+    rpfree(next_edge);
+    rpfree(visiting);
+    rpfree(stack);
+    rpfree(on_stack);
+    return ret;
+}
+
+static void
+destroy_call_graph(call_graph* graph) {
+    rpfree(graph->first_callee);
+    rpfree(graph->callees);
+    rpfree(graph->call_sites);
+    rpfree(graph->recursive);
+    rpfree(graph->order);
+}
+
+static int
+build_call_graph(inliner* in) {
+    call_graph* graph = &in->graph;
+    size_t len = in->toplevels->len;
+    graph->len = len;
+    graph->callees = 0;
+    graph->first_callee = rpmalloc((len + 1) * sizeof(size_t));
+    graph->call_sites = rpcalloc(len, sizeof(size_t));
+    graph->recursive = rpcalloc(len, 1);
+    graph->order = rpmalloc(len * sizeof(size_t));
+    if (!graph->first_callee || !graph->call_sites || !graph->recursive ||
+        !graph->order) {
+        return -1;
+    }
+    visit_calls(in, graph);
+    graph->callees = rpmalloc((graph->first_callee[len] + 1) *
+                              sizeof(size_t));
+    if (!graph->callees) {
+        return -1;
+    }
+    visit_calls(in, graph);
+    return find_components(graph);
+}
+
+static size_t
+expression_cost(const expression_pool* pool, expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    switch ((expression_type) expr->type) {
+    case expression_name:
+    case expression_int:
+    case expression_float:
+        return 1;
+    case expression_call:
+        /* the call itself and passing each argument */
+        return 2 + (expr->second == EXPR_NONE
+                        ? 0 : expression_cost(pool, expr->second));
+    case expression_comma:
+    case expression_assign:
+    case expression_minus:
+    case expression_plus:
+        break;
+    }
+    return 1 + expression_cost(pool, expr->first) +
+           expression_cost(pool, expr->second);
+}
+
+/* The result of an inlined call is kept in a variable declared with
+ * the return type, so it has to be a plain name. */
+static int
+returns_name(const fun_def* fun) {
+    return fun->return_type.type == type_name;
+}
+
+/* The size of the body of `decl` if it can be inlined.  Only bodies
+ * that run straight through to a return at the end can be, so the
+ * return value is always the last thing computed. */
+static size_t
+inline_cost(const var_decl* decl) {
+    const fun_def* fun = &decl->type.data.fun_def;
+    size_t cost = 0;
+    size_t i;
+    int is_void;
+    if (!fun->body_parsed || !returns_name(fun)) {
+        return NOT_INLINABLE;
+    }
+    is_void = strcmp(str_cbegin(&fun->return_type.data.name),
+                     "std::void") == 0;
+    for (i = 0; i != fun->stmts.len; ++i) {
+        const statement* stmt = &fun->stmts.stmts[i];
+        switch (stmt->type) {
+        case statement_expression:
+            cost += 1 + expression_cost(&decl->exprs, stmt->data.s_expression);
+            break;
+        case statement_var_decl:
+            cost += 1;
+            if (stmt->data.s_var_decl.value != EXPR_NONE) {
+                cost += expression_cost(&decl->exprs,
+                                        stmt->data.s_var_decl.value);
+            }
+            break;
+        case statement_return:
+            if (i + 1 != fun->stmts.len ||
+                (stmt->data.s_return == EXPR_NONE) != is_void) {
+                return NOT_INLINABLE;
+            }
+            if (!is_void) {
+                cost += expression_cost(&decl->exprs, stmt->data.s_return);
+            }
+            break;
+        case statement_if:
+        case statement_block:
+        case statement_while:
+            return NOT_INLINABLE;
+        }
+    }
+    if (!is_void && (!fun->stmts.len ||
+                     fun->stmts.stmts[fun->stmts.len - 1].type !=
+                         statement_return)) {
+        /* falls off the end */
+        return NOT_INLINABLE;
+    }
+    return cost;
+}
+
+static int
+in_scope(const inliner* in, const char* name) {
+    size_t i = in->scope.len;
+    while (i--) {
+        if (strcmp(in->scope.names[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct shadow_check {
+    const inliner* in;
+    const expression_pool* pool;
+    /* The callee's variables declared so far. */
+    const char** bound;
+    size_t num_bound;
+};
+
+static const char*
+find_shadowed_in(const struct shadow_check* check, expr_ref ref) {
+    const expression* expr = &check->pool->nodes[ref];
+    const char* name;
+    size_t i;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        name = get_expression_name(check->pool, ref);
+        for (i = 0; i != check->num_bound; ++i) {
+            if (strcmp(check->bound[i], name) == 0) {
+                return 0;
+            }
+        }
+        return in_scope(check->in, name) ? name : 0;
+    case expression_int:
+    case expression_float:
+        return 0;
+    case expression_call:
+        name = find_shadowed_in(check, expr->first);
+        if (!name && expr->second != EXPR_NONE) {
+            name = find_shadowed_in(check, expr->second);
+        }
+        return name;
+    case expression_comma:
+    case expression_assign:
+    case expression_minus:
+    case expression_plus:
+        break;
+    }
+    name = find_shadowed_in(check, expr->first);
+    return name ? name : find_shadowed_in(check, expr->second);
+}
+
+/* Find a name the body of `callee` uses for a top level declaration
+ * that a variable of the caller hides at the call.  Sets `failed`
+ * when out of memory. */
+static const char*
+find_shadowed(inliner* in, const var_decl* callee) {
+    const fun_def* fun = &callee->type.data.fun_def;
+    struct shadow_check check;
+    const char* name = 0;
+    size_t i;
+    check.in = in;
+    check.pool = &callee->exprs;
+    check.num_bound = 0;
+    check.bound = rpmalloc((fun->params.len + fun->stmts.len + 1) *
+                           sizeof(const char*));
+    if (!check.bound) {
+        in->failed = 1;
+        return 0;
+    }
+    for (i = 0; i != fun->params.len; ++i) {
+        check.bound[check.num_bound++] = str_cbegin(&fun->params.vars[i].name);
+    }
+    for (i = 0; i != fun->stmts.len && !name; ++i) {
+        const statement* stmt = &fun->stmts.stmts[i];
+        expr_ref ref = stmt->type == statement_var_decl
+                           ? stmt->data.s_var_decl.value
+                     : stmt->type == statement_return
+                           ? stmt->data.s_return
+                           : stmt->data.s_expression;
+        if (ref != EXPR_NONE) {
+            name = find_shadowed_in(&check, ref);
+        }
+        if (stmt->type == statement_var_decl) {
+            check.bound[check.num_bound++] =
+                str_cbegin(&stmt->data.s_var_decl.name);
+        }
+    }
+    rpfree(check.bound);
+    return name;
+}
+
+static void
+report_kept(const inliner* in, const var_decl* callee, const char* reason) {
+    if (in->report) {
+        print_warning_pos(&in->caller->fpos, "Kept the call to %s in %s: %s",
+                          str_cbegin(&callee->name),
+                          str_cbegin(&in->caller->name), reason);
+    }
+}
+
+/* Decide whether to inline `callee` at a call whose value is used if
+ * `value_used` is set. */
+static int
+should_inline(inliner* in, size_t callee, int value_used) {
+    const var_decl* decl = &in->toplevels->vars[callee];
+    const fun_def* fun = &decl->type.data.fun_def;
+    size_t cost = in->costs[callee];
+    size_t limit = in->graph.call_sites[callee] == 1
+                       ? INLINE_COST_SINGLE_CALL : INLINE_COST_ALWAYS;
+    const char* shadowed;
+    char reason[128];
+    if (decl->imported) {
+        report_kept(in, decl, "it is defined in another module");
+        return 0;
+    }
+    if (in->graph.recursive[callee]) {
+        report_kept(in, decl, "it is recursive");
+        return 0;
+    }
+    if (!returns_name(fun)) {
+        report_kept(in, decl, "its return type isn't a plain name");
+        return 0;
+    }
+    if (cost == NOT_INLINABLE) {
+        report_kept(in, decl, "its body doesn't run straight through to "
+                    "a return at the end");
+        return 0;
+    }
+    if (value_used &&
+        strcmp(str_cbegin(&fun->return_type.data.name), "std::void") == 0) {
+        report_kept(in, decl, "it doesn't return a value");
+        return 0;
+    }
+    if (cost > limit) {
+        sprintf(reason, "its cost %lu is over %lu", (unsigned long) cost,
+                (unsigned long) limit);
+        report_kept(in, decl, reason);
+        return 0;
+    }
+    shadowed = find_shadowed(in, decl);
+    if (shadowed) {
+        if (in->report) {
+            print_warning_pos(&in->caller->fpos, "Kept the call to %s in "
+                              "%s: %s is a different variable there",
+                              str_cbegin(&decl->name),
+                              str_cbegin(&in->caller->name), shadowed);
+        }
+        return 0;
+    }
+    if (in->failed) {
+        return 0;
+    }
+    if (in->report) {
+        print_warning_pos(&in->caller->fpos, "Inlined %s into %s (cost %lu)",
+                          str_cbegin(&decl->name),
+                          str_cbegin(&in->caller->name),
+                          (unsigned long) cost);
+    }
+    return 1;
+}
+
+/* Name a variable of the `num_inlined`th inlined call, or its result
+ * if `name` is null.  Names can't contain dots so these never clash
+ * with the program's. */
+static int
+fresh_name(const inliner* in, str* out, const char* name) {
+    char number[32];
+    sprintf(number, "inline.%lu", in->num_inlined);
+    *out = (str) STR_INIT;
+    if (str_push_s(out, number) ||
+        (name && (str_push(out, '.') || str_push_s(out, name)))) {
+        str_destroy(out);
+        return -1;
+    }
+    return 0;
+}
+
+static expr_ref
+copy_expression(inliner* in, const expression_pool* from, expr_ref ref) {
+    expression_pool* pool = &in->caller->exprs;
+    const expression* expr = &from->nodes[ref];
+    expr_ref first, second = EXPR_NONE;
+    expr_ref copy;
+    const char* name;
+    size_t i;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        name = get_expression_name(from, ref);
+        for (i = in->renamings.len; i--;) {
+            if (strcmp(in->renamings.renamings[i].name, name) == 0) {
+                name = str_cbegin(&in->renamings.renamings[i].fresh);
+                break;
+            }
+        }
+        return add_name_expression(pool, name);
+    case expression_int:
+        return add_int_expression(pool, get_expression_int(from, ref));
+    case expression_float:
+        return add_float_expression(pool, get_expression_float(from, ref));
+    case expression_call:
+        first = copy_expression(in, from, expr->first);
+        if (expr->second != EXPR_NONE) {
+            second = copy_expression(in, from, expr->second);
+            if (second == EXPR_NONE) {
+                return EXPR_NONE;
+            }
+        }
+        return first == EXPR_NONE ? EXPR_NONE
+                                  : add_call_expression(pool, first, second);
+    case expression_comma:
+    case expression_assign:
+    case expression_minus:
+    case expression_plus:
+        break;
+    }
+    first = copy_expression(in, from, expr->first);
+    second = copy_expression(in, from, expr->second);
+    if (first == EXPR_NONE || second == EXPR_NONE) {
+        return EXPR_NONE;
+    }
+    copy = add_binary_expression(pool, (expression_type) expr->type, first,
+                                 second);
+    if (copy != EXPR_NONE) {
+        /* a grouped comma is a single argument */
+        pool->nodes[copy].grouped = expr->grouped;
+    }
+    return copy;
+}
+
+/* Add a declaration of a new variable to `stmts`, taking ownership of
+ * `name`. */
+static int
+add_variable(statements* stmts, str* name, const fposition* fpos,
+             const defining_type_expression* type, expr_ref value) {
+    statement stmt;
+    var_decl* var = &stmt.data.s_var_decl;
+    stmt.type = statement_var_decl;
+    var->name = *name;
+    var->fpos = *fpos;
+    var->type.type = type->type;
+    var->value = value;
+    var->exprs = (expression_pool) EXPRESSION_POOL_INIT;
+    var->imported = 0;
+    if (type->type == dtype_name || type->type == dtype_const_name) {
+        if (str_copy_str(&var->type.data.name, &type->data.name)) {
+            str_destroy(name);
+            return -1;
+        }
+    }
+    if (value == EXPR_NONE || vec_push(stmts, sizeof(stmt), &stmt)) {
+        destroy_statement(&stmt);
+        return -1;
+    }
+    return 0;
+}
+
+/* Replace `replace` statements at `at` with `added`. */
+static int
+splice_statements(statements* stmts, size_t at, size_t replace,
+                  statements* added) {
+    size_t len = stmts->len - replace + added->len;
+    if (len > stmts->cap) {
+        statement* grown = rprealloc(stmts->stmts, len * sizeof(statement));
+        if (!grown) {
+            return -1;
+        }
+        stmts->stmts = grown;
+        stmts->cap = len;
+    }
+    memmove(stmts->stmts + at + added->len, stmts->stmts + at + replace,
+            (stmts->len - at - replace) * sizeof(statement));
+    if (added->len) {
+        memcpy(stmts->stmts + at, added->stmts,
+               added->len * sizeof(statement));
+    }
+    stmts->len = len;
+    rpfree(added->stmts);
+    *added = (statements) VEC_INIT;
+    return 0;
+}
+
+static void
+clear_renamings(inliner* in) {
+    size_t i;
+    for (i = 0; i != in->renamings.len; ++i) {
+        str_destroy(&in->renamings.renamings[i].fresh);
+    }
+    in->renamings.len = 0;
+}
+
+static int
+push_renaming(inliner* in, const str* name, const str* fresh) {
+    struct renaming renaming;
+    renaming.name = str_cbegin(name);
+    if (str_copy_str(&renaming.fresh, fresh)) {
+        return -1;
+    }
+    if (vec_push(&in->renamings, sizeof(renaming), &renaming)) {
+        str_destroy(&renaming.fresh);
+        return -1;
+    }
+    return 0;
+}
+
+/* Replace the call `call` in the statement at `*position` with the
+ * body of `callee`.  The arguments become variables declared before
+ * the statement, followed by the body and, if `value_used` is set, a
+ * variable for the result which `*result` is set to refer to.
+ * Otherwise the statement is the call and is replaced.  `*position`
+ * is moved past the statements added.  Returns -1 without changing
+ * anything if the callee returns a type the result can't be declared
+ * with. */
+static int
+expand_call(inliner* in, statements* stmts, size_t* position,
+            expr_ref call, size_t callee, int value_used, expr_ref* result) {
+    const var_decl* decl = &in->toplevels->vars[callee];
+    const fun_def* fun = &decl->type.data.fun_def;
+    const expression_pool* from = &decl->exprs;
+    expr_ref arguments[MAX_CALL_ARGUMENTS];
+    size_t num_arguments = get_call_arguments(&in->caller->exprs, call,
+                                              arguments, MAX_CALL_ARGUMENTS);
+    statements added = VEC_INIT;
+    size_t i, len;
+    str name;
+
+    if (!returns_name(fun)) {
+        return -1;
+    }
+    ++in->num_inlined;
+    clear_renamings(in);
+    for (i = 0; i != fun->params.len; ++i) {
+        const var_decl* param = &fun->params.vars[i];
+        expr_ref value = i < num_arguments
+                             ? arguments[i]
+                             : copy_expression(in, from, param->value);
+        if (fresh_name(in, &name, str_cbegin(&param->name)) ||
+            push_renaming(in, &param->name, &name)) {
+            str_destroy(&name);
+            goto fail;
+        }
+        if (add_variable(&added, &name, &param->fpos, &param->type, value)) {
+            goto fail;
+        }
+    }
+    len = fun->stmts.len;
+    if (len && fun->stmts.stmts[len - 1].type == statement_return) {
+        --len;
+    }
+    for (i = 0; i != len; ++i) {
+        const statement* stmt = &fun->stmts.stmts[i];
+        if (stmt->type == statement_var_decl) {
+            const var_decl* var = &stmt->data.s_var_decl;
+            /* the variable is in scope after its initializer */
+            expr_ref value = var->value == EXPR_NONE
+                                 ? add_int_expression(&in->caller->exprs, 0)
+                                 : copy_expression(in, from, var->value);
+            if (fresh_name(in, &name, str_cbegin(&var->name))) {
+                goto fail;
+            }
+            if (push_renaming(in, &var->name, &name)) {
+                str_destroy(&name);
+                goto fail;
+            }
+            if (add_variable(&added, &name, &var->fpos, &var->type,
+                             value)) {
+                goto fail;
+            }
+        } else {
+            statement copy;
+            assert(stmt->type == statement_expression);
+            copy.type = statement_expression;
+            copy.data.s_expression = copy_expression(in, from,
+                                                     stmt->data.s_expression);
+            if (copy.data.s_expression == EXPR_NONE ||
+                vec_push(&added, sizeof(copy), &copy)) {
+                goto fail;
+            }
+        }
+    }
+    if (len != fun->stmts.len &&
+        fun->stmts.stmts[len].data.s_return != EXPR_NONE) {
+        expr_ref value = copy_expression(in, from,
+                                         fun->stmts.stmts[len].data.s_return);
+        if (value_used) {
+            defining_type_expression type;
+            type.type = dtype_name;
+            type.data.name = fun->return_type.data.name;
+            if (fresh_name(in, &name, 0)) {
+                goto fail;
+            }
+            *result = add_name_expression(&in->caller->exprs,
+                                          str_cbegin(&name));
+            if (*result == EXPR_NONE) {
+                str_destroy(&name);
+                goto fail;
+            }
+            if (add_variable(&added, &name, &decl->fpos, &type, value)) {
+                goto fail;
+            }
+        } else {
+            statement copy;
+            copy.type = statement_expression;
+            copy.data.s_expression = value;
+            if (value == EXPR_NONE || vec_push(&added, sizeof(copy), &copy)) {
+                goto fail;
+            }
+        }
+    }
+    len = added.len;
+    if (splice_statements(stmts, *position, value_used ? 0 : 1, &added)) {
+        goto fail;
+    }
+    *position += len;
+    return 0;
+
+fail:
+    for (i = 0; i != added.len; ++i) {
+        destroy_statement(&added.stmts[i]);
+    }
+    rpfree(added.stmts);
+    in->failed = 1;
+    return -1;
+}
+
+static int
+assigns_variable(const expression_pool* pool, expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    switch ((expression_type) expr->type) {
+    case expression_name:
+    case expression_int:
+    case expression_float:
+        return 0;
+    case expression_call:
+        return expr->second != EXPR_NONE &&
+               assigns_variable(pool, expr->second);
+    case expression_assign:
+        return 1;
+    case expression_comma:
+    case expression_minus:
+    case expression_plus:
+        break;
+    }
+    return assigns_variable(pool, expr->first) ||
+           assigns_variable(pool, expr->second);
+}
+
+/* Inline the calls in the expression `ref` of the statement at
+ * `*position` and return what replaces it.  An inlined call is
+ * evaluated before the statement, so it is only inlined if what is
+ * evaluated before it in the statement can't tell the difference:
+ * literals, the caller's variables and calls inlined before it.
+ * `in->moved_past` is set once anything else has been evaluated. */
+static expr_ref
+inline_calls(inliner* in, statements* stmts, size_t* position,
+             expr_ref ref) {
+    expression* nodes = in->caller->exprs.nodes;
+    const char* name;
+    expr_ref child, result;
+    size_t callee;
+    int moved_past;
+    switch ((expression_type) nodes[ref].type) {
+    case expression_name:
+        name = get_expression_name(&in->caller->exprs, ref);
+        if (!in_scope(in, name) && strncmp(name, "inline.", 7) != 0) {
+            /* a top level variable the callee might change */
+            in->moved_past = 1;
+        }
+        return ref;
+    case expression_int:
+    case expression_float:
+        return ref;
+    case expression_call:
+        moved_past = in->moved_past;
+        if (nodes[ref].second != EXPR_NONE) {
+            child = inline_calls(in, stmts, position, nodes[ref].second);
+            in->caller->exprs.nodes[ref].second = child;
+        }
+        callee = lookup_function(in, &in->caller->exprs, ref);
+        in->moved_past = 1;
+        if (callee == SYMTAB_NOT_FOUND || in->failed) {
+            return ref;
+        }
+        if (moved_past || (in->caller->exprs.nodes[ref].second != EXPR_NONE &&
+                           assigns_variable(&in->caller->exprs,
+                                            in->caller->exprs.nodes[ref]
+                                                .second))) {
+            report_kept(in, &in->toplevels->vars[callee],
+                        "it can't be moved ahead of the rest of the "
+                        "statement");
+            return ref;
+        }
+        if (!should_inline(in, callee, 1) ||
+            expand_call(in, stmts, position, ref, callee, 1, &result)) {
+            return ref;
+        }
+        in->moved_past = 0;
+        return result;
+    case expression_assign:
+        child = inline_calls(in, stmts, position, nodes[ref].second);
+        in->caller->exprs.nodes[ref].second = child;
+        in->moved_past = 1;
+        return ref;
+    case expression_comma:
+    case expression_minus:
+    case expression_plus:
+        break;
+    }
+    child = inline_calls(in, stmts, position, nodes[ref].first);
+    in->caller->exprs.nodes[ref].first = child;
+    child = inline_calls(in, stmts, position,
+                         in->caller->exprs.nodes[ref].second);
+    in->caller->exprs.nodes[ref].second = child;
+    return ref;
+}
+
+/* Inline a call whose value is unused, replacing the statement with
+ * the body.  Returns 1 if the statement was replaced, 0 if it was kept
+ * and -1 if it isn't a call. */
+static int
+inline_call_statement(inliner* in, statements* stmts, size_t* position) {
+    expr_ref call = stmts->stmts[*position].data.s_expression;
+    size_t callee;
+    if (in->caller->exprs.nodes[call].type != expression_call) {
+        return -1;
+    }
+    if (in->caller->exprs.nodes[call].second != EXPR_NONE) {
+        expr_ref arguments = inline_calls(in, stmts, position,
+                                          in->caller->exprs.nodes[call]
+                                              .second);
+        in->caller->exprs.nodes[call].second = arguments;
+    }
+    callee = lookup_function(in, &in->caller->exprs, call);
+    if (callee == SYMTAB_NOT_FOUND || in->failed ||
+        !should_inline(in, callee, 0)) {
+        return 0;
+    }
+    return expand_call(in, stmts, position, call, callee, 0, 0) == 0;
+}
+
+static void
+inline_statements(inliner* in, statements* stmts) {
+    size_t scope = in->scope.len;
+    size_t i = 0;
+    while (i < stmts->len && !in->failed) {
+        statement* stmt = &stmts->stmts[i];
+        expr_ref ref;
+        in->moved_past = 0;
+        switch (stmt->type) {
+        case statement_if:
+            ref = inline_calls(in, stmts, &i, stmt->data.s_if.cond);
+            stmt = &stmts->stmts[i];
+            stmt->data.s_if.cond = ref;
+            inline_statements(in, &stmt->data.s_if.truebranch);
+            inline_statements(in, &stmt->data.s_if.falsebranch);
+            break;
+        case statement_expression:
+            switch (inline_call_statement(in, stmts, &i)) {
+            case 1:
+                /* `i` is at the statement after the body */
+                continue;
+            case 0:
+                break;
+            default:
+                ref = inline_calls(in, stmts, &i,
+                                   stmts->stmts[i].data.s_expression);
+                stmts->stmts[i].data.s_expression = ref;
+                break;
+            }
+            break;
+        case statement_var_decl:
+            if (stmt->data.s_var_decl.value != EXPR_NONE) {
+                ref = inline_calls(in, stmts, &i,
+                                   stmt->data.s_var_decl.value);
+                stmt = &stmts->stmts[i];
+                stmt->data.s_var_decl.value = ref;
+            }
+            /* the variable is in scope after its initializer */
+            {
+                const char* name = str_cbegin(&stmt->data.s_var_decl.name);
+                if (vec_push(&in->scope, sizeof(name), &name)) {
+                    in->failed = 1;
+                }
+            }
+            break;
+        case statement_return:
+            if (stmt->data.s_return != EXPR_NONE) {
+                ref = inline_calls(in, stmts, &i, stmt->data.s_return);
+                stmts->stmts[i].data.s_return = ref;
+            }
+            break;
+        case statement_block:
+            inline_statements(in, &stmt->data.s_block);
+            break;
+        case statement_while:
+            /* The condition is evaluated on every iteration, so calls
+             * in it can't be moved ahead of the loop. */
+            inline_statements(in, &stmt->data.s_while.body);
+            break;
+        }
+        ++i;
+    }
+    in->scope.len = scope;
+}
+
+/* A variable introduced by inlining that always holds a constant. */
+struct constant_variable {
+    const char* name;
+    unsigned long long value;
+    int assigned;
+};
+
+struct simplifier {
+    expression_pool* pool;
+    struct {
+        struct constant_variable* variables;
+        size_t len, cap;
+    } constants;
+    symtab names;
+    /* The declarations removed, destroyed once `names` is no longer
+     * needed as it refers to their names. */
+    statements removed;
+    size_t num_propagated;
+    size_t num_folded;
+};
+
+/* Whether `value` is the same after storing it in `var`. */
+static int
+fits_type(const var_decl* var, unsigned long long value) {
+    size_t size;
+    int is_signed;
+    if (var->type.type == dtype_inferred ||
+        var->type.type == dtype_const_inferred) {
+        return 1;
+    }
+    if (get_int_type(str_cbegin(&var->type.data.name), &size, &is_signed)) {
+        return 0;
+    }
+    if (size == 8) {
+        return 1;
+    }
+    if (is_signed) {
+        long long limit = 1LL << (8 * size - 1);
+        return (long long) value >= -limit && (long long) value < limit;
+    }
+    return value < 1ULL << (8 * size);
+}
+
+static int
+find_constants(struct simplifier* simplifier, const statements* stmts) {
+    size_t i;
+    for (i = 0; i != stmts->len; ++i) {
+        const statement* stmt = &stmts->stmts[i];
+        const var_decl* var = &stmt->data.s_var_decl;
+        struct constant_variable constant;
+        if (stmt->type == statement_block) {
+            if (find_constants(simplifier, &stmt->data.s_block)) {
+                return -1;
+            }
+            continue;
+        }
+        if (stmt->type == statement_if) {
+            if (find_constants(simplifier, &stmt->data.s_if.truebranch) ||
+                find_constants(simplifier, &stmt->data.s_if.falsebranch)) {
+                return -1;
+            }
+            continue;
+        }
+        if (stmt->type == statement_while) {
+            if (find_constants(simplifier, &stmt->data.s_while.body)) {
+                return -1;
+            }
+            continue;
+        }
+        if (stmt->type != statement_var_decl ||
+            strncmp(str_cbegin(&var->name), "inline.", 7) != 0 ||
+            simplifier->pool->nodes[var->value].type != expression_int) {
+            continue;
+        }
+        constant.name = str_cbegin(&var->name);
+        constant.value = get_expression_int(simplifier->pool, var->value);
+        constant.assigned = 0;
+        if (fits_type(var, constant.value) &&
+            vec_push(&simplifier->constants, sizeof(constant), &constant)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static struct constant_variable*
+lookup_constant(struct simplifier* simplifier, const char* name) {
+    size_t index = symtab_lookup(&simplifier->names, name);
+    return index == SYMTAB_NOT_FOUND
+               ? 0 : &simplifier->constants.variables[index];
+}
+
+/* Remove the declarations of the variables that were propagated. */
+static int
+remove_constants(struct simplifier* simplifier, statements* stmts) {
+    size_t i, kept = 0;
+    for (i = 0; i != stmts->len; ++i) {
+        statement* stmt = &stmts->stmts[i];
+        const struct constant_variable* constant = 0;
+        if (stmt->type == statement_block) {
+            if (remove_constants(simplifier, &stmt->data.s_block)) {
+                return -1;
+            }
+        } else if (stmt->type == statement_if) {
+            if (remove_constants(simplifier, &stmt->data.s_if.truebranch) ||
+                remove_constants(simplifier,
+                                 &stmt->data.s_if.falsebranch)) {
+                return -1;
+            }
+        } else if (stmt->type == statement_while) {
+            if (remove_constants(simplifier, &stmt->data.s_while.body)) {
+                return -1;
+            }
+        } else if (stmt->type == statement_var_decl) {
+            constant = lookup_constant(simplifier, str_cbegin(
+                                           &stmt->data.s_var_decl.name));
+        }
+        if (constant && !constant->assigned) {
+            if (vec_push(&simplifier->removed, sizeof(*stmt), stmt)) {
+                return -1;
+            }
+        } else {
+            stmts->stmts[kept++] = *stmt;
+        }
+    }
+    stmts->len = kept;
+    return 0;
+}
+
+/* Replace the variables introduced by inlining that hold constants
+ * with the constants.  The names are unique, so every use in the pool
+ * refers to the same variable. */
+static int
+propagate_constants(struct simplifier* simplifier, statements* stmts) {
+    expression_pool* pool = simplifier->pool;
+    size_t i;
+    int res;
+    simplifier->constants.len = 0;
+    if (find_constants(simplifier, stmts)) {
+        return -1;
+    }
+    if (!simplifier->constants.len) {
+        return 0;
+    }
+    if (symtab_init(&simplifier->names, simplifier->constants.len)) {
+        return -1;
+    }
+    for (i = 0; i != simplifier->constants.len; ++i) {
+        symtab_insert(&simplifier->names,
+                      simplifier->constants.variables[i].name, i);
+    }
+    for (i = 0; i != pool->len; ++i) {
+        const expression* expr = &pool->nodes[i];
+        struct constant_variable* constant;
+        if (expr->type != expression_assign ||
+            pool->nodes[expr->first].type != expression_name) {
+            continue;
+        }
+        constant = lookup_constant(simplifier, get_expression_name(
+                                                   pool, expr->first));
+        if (constant) {
+            constant->assigned = 1;
+        }
+    }
+    for (i = 0; i != pool->len; ++i) {
+        expression* expr = &pool->nodes[i];
+        const struct constant_variable* constant;
+        if (expr->type != expression_name) {
+            continue;
+        }
+        constant = lookup_constant(simplifier,
+                                   get_expression_name(pool, (expr_ref) i));
+        if (constant && !constant->assigned) {
+            /* literals keep their value in place of the operands */
+            expr->type = expression_int;
+            expr->first = (expr_ref) constant->value;
+            expr->second = (expr_ref) (constant->value >> 32);
+            ++simplifier->num_propagated;
+        }
+    }
+    res = remove_constants(simplifier, stmts);
+    symtab_destroy(&simplifier->names);
+    for (i = 0; i != simplifier->removed.len; ++i) {
+        destroy_statement(&simplifier->removed.stmts[i]);
+    }
+    simplifier->removed.len = 0;
+    return res;
+}
+
+/* Fold additions and subtractions of literals, wrapping around like
+ * the generated code does. */
+static void
+fold_expression(struct simplifier* simplifier, expr_ref ref) {
+    expression* expr = &simplifier->pool->nodes[ref];
+    unsigned long long first, second, value;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+    case expression_int:
+    case expression_float:
+        return;
+    case expression_call:
+        if (expr->second != EXPR_NONE) {
+            fold_expression(simplifier, expr->second);
+        }
+        return;
+    case expression_comma:
+    case expression_assign:
+    case expression_minus:
+    case expression_plus:
+        break;
+    }
+    fold_expression(simplifier, expr->first);
+    fold_expression(simplifier, expr->second);
+    if ((expr->type != expression_plus && expr->type != expression_minus) ||
+        simplifier->pool->nodes[expr->first].type != expression_int ||
+        simplifier->pool->nodes[expr->second].type != expression_int) {
+        return;
+    }
+    first = get_expression_int(simplifier->pool, expr->first);
+    second = get_expression_int(simplifier->pool, expr->second);
+    value = expr->type == expression_plus ? first + second : first - second;
+    expr->type = expression_int;
+    expr->first = (expr_ref) value;
+    expr->second = (expr_ref) (value >> 32);
+    ++simplifier->num_folded;
+}
+
+static void
+fold_statements(struct simplifier* simplifier, const statements* stmts) {
+    size_t i;
+    for (i = 0; i != stmts->len; ++i) {
+        const statement* stmt = &stmts->stmts[i];
+        switch (stmt->type) {
+        case statement_if:
+            fold_expression(simplifier, stmt->data.s_if.cond);
+            fold_statements(simplifier, &stmt->data.s_if.truebranch);
+            fold_statements(simplifier, &stmt->data.s_if.falsebranch);
+            break;
+        case statement_expression:
+            fold_expression(simplifier, stmt->data.s_expression);
+            break;
+        case statement_var_decl:
+            if (stmt->data.s_var_decl.value != EXPR_NONE) {
+                fold_expression(simplifier, stmt->data.s_var_decl.value);
+            }
+            break;
+        case statement_return:
+            if (stmt->data.s_return != EXPR_NONE) {
+                fold_expression(simplifier, stmt->data.s_return);
+            }
+            break;
+        case statement_block:
+            fold_statements(simplifier, &stmt->data.s_block);
+            break;
+        case statement_while:
+            fold_expression(simplifier, stmt->data.s_while.cond);
+            fold_statements(simplifier, &stmt->data.s_while.body);
+            break;
+        }
+    }
+}
+
+/* Clean up after inlining into the caller: constant arguments make
+ * constant variables, which make more expressions constant. */
+static int
+simplify(inliner* in) {
+    statements* stmts = &in->caller->type.data.fun_def.stmts;
+    struct simplifier simplifier;
+    size_t propagated;
+    int ret = 0;
+    simplifier.pool = &in->caller->exprs;
+    simplifier.constants.variables = 0;
+    simplifier.constants.len = 0;
+    simplifier.constants.cap = 0;
+    simplifier.removed = (statements) VEC_INIT;
+    simplifier.num_propagated = 0;
+    simplifier.num_folded = 0;
+    do {
+        propagated = simplifier.num_propagated;
+        fold_statements(&simplifier, stmts);
+        if (propagate_constants(&simplifier, stmts)) {
+            ret = -1;
+            break;
+        }
+    } while (simplifier.num_propagated != propagated);
+    rpfree(simplifier.constants.variables);
+    rpfree(simplifier.removed.stmts);
+    if (in->report && (simplifier.num_propagated || simplifier.num_folded)) {
+        print_warning_pos(&in->caller->fpos, "Simplified %s: propagated %lu "
+                          "constants and folded %lu expressions",
+                          str_cbegin(&in->caller->name),
+                          (unsigned long) simplifier.num_propagated,
+                          (unsigned long) simplifier.num_folded);
+    }
+    return ret;
+}
+
+int
+inline_functions(vec_var_decl* toplevels, int report) {
+    inliner in;
+    size_t len = toplevels->len;
+    size_t i, j;
+    int ret = -1;
+    assert(toplevels);
+    if (!len) {
+        return 0;
+    }
+
+    in.toplevels = toplevels;
+    in.report = report;
+    in.caller = 0;
+    in.scope.names = 0;
+    in.scope.len = 0;
+    in.scope.cap = 0;
+    in.renamings.renamings = 0;
+    in.renamings.len = 0;
+    in.renamings.cap = 0;
+    in.failed = 0;
+    in.costs = rpmalloc(len * sizeof(size_t));
+    if (!in.costs) {
+        return -1;
+    }
+    if (symtab_init(&in.names, len)) {
+        rpfree(in.costs);
+        return -1;
+    }
+    for (i = 0; i != len; ++i) {
+        symtab_insert(&in.names, str_cbegin(&toplevels->vars[i].name), i);
+        in.costs[i] = NOT_INLINABLE;
+    }
+    if (build_call_graph(&in)) {
+        goto cleanup;
+    }
+
+    for (i = 0; i != len && !in.failed; ++i) {
+        size_t index = in.graph.order[i];
+        var_decl* decl = &toplevels->vars[index];
+        fun_def* fun = &decl->type.data.fun_def;
+        if (decl->type.type != dtype_fun_def || !fun->body_parsed) {
+            continue;
+        }
+        in.caller = decl;
+        in.num_inlined = 0;
+        in.scope.len = 0;
+        for (j = 0; j != fun->params.len; ++j) {
+            const char* name = str_cbegin(&fun->params.vars[j].name);
+            if (vec_push(&in.scope, sizeof(name), &name)) {
+                in.failed = 1;
+            }
+        }
+        inline_statements(&in, &fun->stmts);
+        if (in.num_inlined && !in.failed && simplify(&in)) {
+            in.failed = 1;
+        }
+        in.costs[index] = inline_cost(decl);
+    }
+    ret = in.failed ? -1 : 0;
+
+cleanup:
+    destroy_call_graph(&in.graph);
+    clear_renamings(&in);
+    rpfree(in.renamings.renamings);
+    rpfree(in.scope.names);
+    rpfree(in.costs);
+    symtab_destroy(&in.names);
+    return ret;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+#include "diagnostics.h"
+#include "eval.h"
+#include "fiter.h"
+#include "lex.h"
+#include "sema.h"
+
+static const char* test_inline_file[] =
+    {"add := fun (a : std::i64, b : std::i64) -> std::i64 {",
+     "return a + b; }",
+     "rec := fun (n : std::i64) -> std::i64 { return rec(n); }",
+     "f := fun () -> std::i64 {",
+     "x := add(1, 2);",
+     "return rec(x); }", 0};
+TEST(test_inline_small_calls) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    const statements* stmts;
+    const expression_pool* pool;
+    fiter iter;
+    fiter_init(&iter, (FILE*) test_inline_file, "inline_test");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    ASSERT(eval_constants(&toplevels, EVAL_DEFAULT_STEP_BUDGET) == 0,
+           cleanup);
+    ASSERT(check_semantics(&toplevels, 1, 1, 0, 0) == 0, cleanup);
+    ASSERT(inline_functions(&toplevels, 0) == 0, cleanup);
+
+    /* add is inlined and folded into `x := 3` but rec isn't */
+    stmts = &toplevels.vars[2].type.data.fun_def.stmts;
+    pool = &toplevels.vars[2].exprs;
+    ASSERT(stmts->len == 2, cleanup);
+    ASSERT(stmts->stmts[0].type == statement_var_decl, cleanup);
+    ASSERT(strcmp(str_cbegin(&stmts->stmts[0].data.s_var_decl.name),
+                  "x") == 0, cleanup);
+    ASSERT(pool->nodes[stmts->stmts[0].data.s_var_decl.value].type ==
+               expression_int, cleanup);
+    ASSERT(get_expression_int(pool, stmts->stmts[0].data.s_var_decl.value) ==
+               3, cleanup);
+    ASSERT(stmts->stmts[1].type == statement_return, cleanup);
+    ASSERT(pool->nodes[stmts->stmts[1].data.s_return].type ==
+               expression_call, cleanup);
+cleanup:
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+}
+END_TEST
+
+static const char* test_inline_report_file[] =
+    {"g : std::i64 = 5;",
+     "add := fun (a : std::i64, b : std::i64) -> std::i64 {",
+     "return a + b; }",
+     "getg := fun () -> std::i64 { return g; }",
+     "rec := fun (n : std::i64) -> std::i64 { return rec(n); }",
+     "ping := fun (n : std::i64) -> std::i64 { return pong(n); }",
+     "pong := fun (n : std::i64) -> std::i64 { return ping(n); }",
+     /* the caller's a and b aren't the callee's */
+     "same := fun (a : std::i64) -> std::i64 {",
+     "b := add(a, 1);",
+     "return b + a; }",
+     /* rec could change g before add would read it */
+     "later := fun () -> std::i64 {",
+     "r := rec(1) + add(g, 2);",
+     "return r; }",
+     "shadow := fun (g : std::i64) -> std::i64 { return getg(); }",
+     "cycle := fun () -> std::i64 { return ping(1); }", 0};
+static const char* test_inline_decisions[] = {
+    "Kept the call to rec in rec: it is recursive",
+    "Kept the call to pong in ping: it is recursive",
+    "Kept the call to ping in pong: it is recursive",
+    "Inlined add into same (cost 3)",
+    "Simplified same: propagated 1 constants and folded 0 expressions",
+    "Kept the call to rec in later: it is recursive",
+    "Kept the call to add in later: it can't be moved ahead of the rest "
+    "of the statement",
+    "Kept the call to getg in shadow: g is a different variable there",
+    "Kept the call to ping in cycle: it is recursive",
+};
+
+/* How many variables named `name` the body `stmts` declares. */
+static size_t
+count_declarations(const statements* stmts, const char* name) {
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i != stmts->len; ++i) {
+        if (stmts->stmts[i].type == statement_var_decl &&
+            strcmp(str_cbegin(&stmts->stmts[i].data.s_var_decl.name),
+                   name) == 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/* Whether `report` has a diagnostic saying `message`. */
+static int
+reported(const vec_diagnostic* report, const char* message) {
+    size_t i;
+    for (i = 0; i != report->len; ++i) {
+        if (strcmp(str_cbegin(&report->diagnostics[i].message),
+                   message) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+TEST(test_inline_report) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_diagnostic report = VEC_INIT;
+    vec_diagnostic* previous = 0;
+    const statements* stmts;
+    fiter iter;
+    size_t i;
+    fiter_init(&iter, (FILE*) test_inline_report_file, "inline_test");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    ASSERT(eval_constants(&toplevels, EVAL_DEFAULT_STEP_BUDGET) == 0,
+           cleanup);
+    ASSERT(check_semantics(&toplevels, 1, 1, 0, 0) == 0, cleanup);
+    previous = capture_diagnostics(&report);
+    ASSERT(inline_functions(&toplevels, 1) == 0, cleanup);
+    capture_diagnostics(previous);
+    previous = 0;
+    ASSERT(report.len == sizeof(test_inline_decisions) /
+                             sizeof(*test_inline_decisions), cleanup);
+    for (i = 0; i != report.len; ++i) {
+        ASSERT(reported(&report, test_inline_decisions[i]), cleanup);
+    }
+
+    /* the parameters of add got names of their own */
+    stmts = &toplevels.vars[6].type.data.fun_def.stmts;
+    ASSERT(stmts->len == 4, cleanup);
+    ASSERT(count_declarations(stmts, "a") == 0, cleanup);
+    ASSERT(count_declarations(stmts, "b") == 1, cleanup);
+    ASSERT(strcmp(str_cbegin(&stmts->stmts[0].data.s_var_decl.name),
+                  "inline.1.a") == 0, cleanup);
+    /* and later still computes rec(1) before add(g, 2) */
+    stmts = &toplevels.vars[7].type.data.fun_def.stmts;
+    ASSERT(stmts->len == 2, cleanup);
+cleanup:
+    if (previous) {
+        capture_diagnostics(previous);
+    }
+    destroy_diagnostics(&report);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+}
+END_TEST
+
+void test_inline(void) {
+    RUN(test_inline_small_calls);
+    RUN(test_inline_report);
+}
+#endif
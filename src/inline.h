@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef HEADER_GUARD_INLINE_H
+#define HEADER_GUARD_INLINE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bodies costing at most this much are inlined into every caller. */
+#define INLINE_COST_ALWAYS 12
+/* Bodies called from a single place are inlined there if they cost at
+ * most this much. */
+#define INLINE_COST_SINGLE_CALL 64
+
+struct vec_var_decl;
+/* Replace calls to small functions in `toplevels` with their bodies.
+ * The call graph is walked callees first so bodies are inlined after
+ * their own calls have been, and functions calling themselves
+ * directly or through others are never inlined.  The body of a call
+ * nested in a larger expression is hoisted ahead of the statement,
+ * so such a call is only inlined if nothing evaluated before it in
+ * that statement could tell the difference.  Each caller is
+ * simplified afterwards by propagating constant arguments and folding
+ * the result.  If `report` is set,
+ * every decision is printed.  `toplevels` must have passed
+ * check_semantics with the bodies checked. */
+int inline_functions(struct vec_var_decl* toplevels, int report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,424 @@
+#include "layout.h"
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+#include "parse.h"
+#include "symtab.h"
+#include "types.h"
+
+/* The structures being laid out, innermost first, to find structures
+ * that contain themselves. */
+struct enclosing {
+    size_t index;
+    const struct enclosing* next;
+};
+
+struct cached_layout {
+    /* The index plus one, or zero if the entry is empty. */
+    size_t key;
+    size_t size;
+    size_t alignment;
+    int failed;
+};
+
+struct layout_context {
+    const vec_var_decl* toplevels;
+    const symtab* names;
+    layout_cache* cache;
+    vec_diagnostic* errors;
+    /* The structure asked for.  Only errors in its own definition are
+     * reported. */
+    size_t root;
+    /* Set when a field turns out to contain the root. */
+    int contains_root;
+    /* The number of times a structure was found inside itself.  A
+     * structure that failed without adding to it failed because of
+     * its own fields, wherever it is. */
+    size_t cycles;
+};
+
+static size_t
+align_up(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static const struct cached_layout*
+find_cached_layout(const layout_cache* cache, size_t index) {
+    size_t i;
+    if (!cache || !cache->cap) {
+        return 0;
+    }
+    for (i = index & (cache->cap - 1); cache->entries[i].key;
+         i = (i + 1) & (cache->cap - 1)) {
+        if (cache->entries[i].key == index + 1) {
+            return &cache->entries[i];
+        }
+    }
+    return 0;
+}
+
+/* Remember the layout of the structure `index`.  The cache is only an
+ * optimization, so running out of memory leaves it as it is. */
+static void
+cache_layout(layout_cache* cache, size_t index, size_t size,
+             size_t alignment, int failed) {
+    struct cached_layout* entry;
+    size_t i;
+    if (!cache) {
+        return;
+    }
+    if ((cache->len + 1) * 2 > cache->cap) {
+        size_t cap = cache->cap ? cache->cap * 2 : 16;
+        struct cached_layout* entries =
+            rpcalloc(cap, sizeof(struct cached_layout));
+        if (!entries) {
+            return;
+        }
+        for (i = 0; i != cache->cap; ++i) {
+            size_t key = cache->entries[i].key;
+            size_t j;
+            if (!key) {
+                continue;
+            }
+            for (j = (key - 1) & (cap - 1); entries[j].key;
+                 j = (j + 1) & (cap - 1)) {
+            }
+            entries[j] = cache->entries[i];
+        }
+        rpfree(cache->entries);
+        cache->entries = entries;
+        cache->cap = cap;
+    }
+    for (i = index & (cache->cap - 1); cache->entries[i].key;
+         i = (i + 1) & (cache->cap - 1)) {
+    }
+    entry = &cache->entries[i];
+    entry->key = index + 1;
+    entry->size = size;
+    entry->alignment = alignment;
+    entry->failed = failed;
+    ++cache->len;
+}
+
+void
+destroy_layout_cache(layout_cache* cache) {
+    rpfree(cache->entries);
+    cache->entries = 0;
+    cache->len = 0;
+    cache->cap = 0;
+}
+
+static int lay_out(struct layout_context* ctx, size_t index,
+                   const struct enclosing* enclosing, struct_layout* out);
+
+static int
+lay_out_field(struct layout_context* ctx, size_t index,
+              const var_decl* field, const struct enclosing* enclosing,
+              field_layout* out) {
+    const var_decl* decl = &ctx->toplevels->vars[index];
+    const char* name = str_cbegin(&field->type.data.name);
+    const builtin_type_info* builtin = find_builtin_type(name,
+                                                         strlen(name));
+    const struct cached_layout* cached;
+    const struct enclosing* outer;
+    struct enclosing here;
+    struct_layout nested;
+    size_t type_index;
+    size_t cycles;
+    if (builtin && builtin->type != type_void) {
+        out->size = builtin->size;
+        out->alignment = builtin->alignment;
+        return 0;
+    }
+    type_index = builtin ? SYMTAB_NOT_FOUND
+                         : symtab_lookup(ctx->names, name);
+    if (type_index == SYMTAB_NOT_FOUND ||
+        ctx->toplevels->vars[type_index].type.type != dtype_struct_def) {
+        if (index == ctx->root) {
+            report_error_pos(ctx->errors, &field->fpos,
+                             "Field %s of %s cannot have type %s",
+                             str_cbegin(&field->name),
+                             str_cbegin(&decl->name), name);
+        }
+        return -1;
+    }
+    for (outer = enclosing; outer; outer = outer->next) {
+        if (outer->index == type_index) {
+            ctx->contains_root |= type_index == ctx->root;
+            ++ctx->cycles;
+            return -1;
+        }
+    }
+    /* Only layouts that don't depend on the enclosing structures are
+     * cached, and a structure that contains itself never gets
+     * one. */
+    cached = find_cached_layout(ctx->cache, type_index);
+    if (cached) {
+        out->size = cached->size;
+        out->alignment = cached->alignment;
+        return cached->failed ? -1 : 0;
+    }
+    here.index = type_index;
+    here.next = enclosing;
+    cycles = ctx->cycles;
+    if (lay_out(ctx, type_index, &here, &nested)) {
+        if (ctx->cycles == cycles) {
+            cache_layout(ctx->cache, type_index, 0, 0, 1);
+        }
+        return -1;
+    }
+    out->size = nested.size;
+    out->alignment = nested.alignment;
+    cache_layout(ctx->cache, type_index, nested.size, nested.alignment, 0);
+    destroy_struct_layout(&nested);
+    return 0;
+}
+
+static int
+lay_out(struct layout_context* ctx, size_t index,
+        const struct enclosing* enclosing, struct_layout* out) {
+    const var_decl* decl = &ctx->toplevels->vars[index];
+    const struct_def* def = &decl->type.data.struct_def;
+    size_t len = def->fields.len;
+    size_t offset, payload, i, j;
+    int ret = 0;
+
+    out->len = len;
+    out->alignment = 1;
+    out->fields = rpmalloc((len + 1) * sizeof(field_layout));
+    out->order = rpmalloc((len + 1) * sizeof(size_t));
+    if (!out->fields || !out->order) {
+        report_error_pos(ctx->errors, &decl->fpos,
+                         "Out of memory while laying out %s",
+                         str_cbegin(&decl->name));
+        destroy_struct_layout(out);
+        return -1;
+    }
+    for (i = 0; i != len; ++i) {
+        const var_decl* field = &def->fields.vars[i];
+        field_layout* layout = &out->fields[i];
+        for (j = 0; j != i && index == ctx->root; ++j) {
+            if (strcmp(str_cbegin(&def->fields.vars[j].name),
+                       str_cbegin(&field->name)) == 0) {
+                report_error_pos(ctx->errors, &field->fpos,
+                                 "Redefinition of field %s in %s",
+                                 str_cbegin(&field->name),
+                                 str_cbegin(&decl->name));
+                ret = -1;
+                break;
+            }
+        }
+        if (index == ctx->root) {
+            ctx->contains_root = 0;
+        }
+        if (lay_out_field(ctx, index, field, enclosing, layout)) {
+            if (index == ctx->root && ctx->contains_root) {
+                report_error_pos(ctx->errors, &field->fpos,
+                                 "%s contains itself through its field "
+                                 "%s", str_cbegin(&decl->name),
+                                 str_cbegin(&field->name));
+            }
+            ret = -1;
+            continue;
+        }
+        if (layout->alignment > out->alignment) {
+            out->alignment = layout->alignment;
+        }
+    }
+    if (ret) {
+        destroy_struct_layout(out);
+        return -1;
+    }
+
+    offset = 0;
+    for (i = 0; i != len; ++i) {
+        offset = align_up(offset, out->fields[i].alignment) +
+                 out->fields[i].size;
+    }
+    out->declared_size = align_up(offset, out->alignment);
+
+    /* A stable insertion sort, as structures have few fields. */
+    for (i = 0; i != len; ++i) {
+        size_t alignment = out->fields[i].alignment;
+        j = i;
+        while (!def->c_layout && j &&
+               out->fields[out->order[j - 1]].alignment < alignment) {
+            out->order[j] = out->order[j - 1];
+            --j;
+        }
+        out->order[j] = i;
+    }
+    offset = 0;
+    payload = 0;
+    for (i = 0; i != len; ++i) {
+        field_layout* field = &out->fields[out->order[i]];
+        field->offset = align_up(offset, field->alignment);
+        offset = field->offset + field->size;
+        payload += field->size;
+    }
+    out->size = align_up(offset, out->alignment);
+    out->padding = out->size - payload;
+    return 0;
+}
+
+int
+layout_struct(const vec_var_decl* toplevels, const symtab* names,
+              layout_cache* cache, size_t index, struct_layout* out,
+              vec_diagnostic* errors) {
+    struct layout_context ctx;
+    struct enclosing root;
+    ctx.toplevels = toplevels;
+    ctx.names = names;
+    ctx.cache = cache;
+    ctx.errors = errors;
+    ctx.root = index;
+    ctx.contains_root = 0;
+    ctx.cycles = 0;
+    root.index = index;
+    root.next = 0;
+    return lay_out(&ctx, index, &root, out);
+}
+
+void
+destroy_struct_layout(struct_layout* layout) {
+    rpfree(layout->fields);
+    rpfree(layout->order);
+    layout->fields = 0;
+    layout->order = 0;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+#include "fiter.h"
+#include "lex.h"
+
+static const char* test_layout_file[] =
+    {"Mixed := struct { a : std::i8; b : std::i64; c : std::i16;",
+     "d : std::i32; e : std::u8; }",
+     "Fixed := struct (c_layout) { a : std::i8; b : std::i64;",
+     "c : std::i16; }",
+     "Outer := struct { flag : std::bool; inner : Fixed; }", 0};
+TEST(test_struct_layout) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    symtab names = {0, 0, 0};
+    struct_layout layout = {0, 0, 0, 0, 0, 0, 0};
+    fiter iter;
+    size_t i;
+    fiter_init(&iter, (FILE*) test_layout_file, "layout_test");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    ASSERT(symtab_init(&names, toplevels.len) == 0, cleanup);
+    for (i = 0; i != toplevels.len; ++i) {
+        symtab_insert(&names, str_cbegin(&toplevels.vars[i].name), i);
+    }
+
+    /* sorted as b, d, c, a, e without padding between them */
+    ASSERT(layout_struct(&toplevels, &names, 0, 0, &layout, 0) == 0,
+           cleanup);
+    ASSERT(layout.size == 16 && layout.alignment == 8, cleanup);
+    ASSERT(layout.declared_size == 32, cleanup);
+    ASSERT(layout.padding == 0, cleanup);
+    ASSERT(layout.fields[1].offset == 0, cleanup);
+    ASSERT(layout.fields[3].offset == 8, cleanup);
+    ASSERT(layout.fields[2].offset == 12, cleanup);
+    ASSERT(layout.fields[0].offset == 14, cleanup);
+    ASSERT(layout.fields[4].offset == 15, cleanup);
+    destroy_struct_layout(&layout);
+
+    /* laid out like C */
+    ASSERT(layout_struct(&toplevels, &names, 0, 1, &layout, 0) == 0,
+           cleanup);
+    ASSERT(layout.size == 24 && layout.declared_size == 24, cleanup);
+    ASSERT(layout.fields[1].offset == 8, cleanup);
+    ASSERT(layout.fields[2].offset == 16, cleanup);
+    ASSERT(layout.padding == 13, cleanup);
+    destroy_struct_layout(&layout);
+
+    ASSERT(layout_struct(&toplevels, &names, 0, 2, &layout, 0) == 0,
+           cleanup);
+    ASSERT(layout.size == 32 && layout.alignment == 8, cleanup);
+    ASSERT(layout.fields[1].offset == 0, cleanup);
+    ASSERT(layout.fields[0].offset == 24, cleanup);
+cleanup:
+    destroy_struct_layout(&layout);
+    symtab_destroy(&names);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+}
+END_TEST
+
+#define TEST_LAYOUT_LEVELS 40
+
+/* Each level holds two of the level below, so laying out the top one
+ * visits 2^40 fields unless each level is laid out once. */
+TEST(test_nested_layout_cache) {
+    char lines[TEST_LAYOUT_LEVELS + 4][64];
+    const char* file[TEST_LAYOUT_LEVELS + 5];
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_diagnostic errors = VEC_INIT;
+    symtab names = {0, 0, 0};
+    layout_cache cache = LAYOUT_CACHE_INIT;
+    struct_layout layout = {0, 0, 0, 0, 0, 0, 0};
+    fiter iter;
+    size_t i;
+    snprintf(lines[0], sizeof(lines[0]), "S0 := struct { a : std::i64; }");
+    for (i = 1; i <= TEST_LAYOUT_LEVELS; ++i) {
+        snprintf(lines[i], sizeof(lines[i]),
+                 "S%lu := struct { x : S%lu; y : S%lu; }",
+                 (unsigned long) i, (unsigned long) i - 1,
+                 (unsigned long) i - 1);
+    }
+    /* a pair of structures that contain each other */
+    snprintf(lines[i++], sizeof(lines[0]), "A := struct { b : B; }");
+    snprintf(lines[i++], sizeof(lines[0]), "B := struct { a : A; }");
+    snprintf(lines[i++], sizeof(lines[0]),
+             "C := struct { a : A; s : S%d; }", TEST_LAYOUT_LEVELS);
+    for (i = 0; i != TEST_LAYOUT_LEVELS + 4; ++i) {
+        file[i] = lines[i];
+    }
+    file[i] = 0;
+    fiter_init(&iter, (FILE*) file, "layout_test");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    ASSERT(symtab_init(&names, toplevels.len) == 0, cleanup);
+    for (i = 0; i != toplevels.len; ++i) {
+        symtab_insert(&names, str_cbegin(&toplevels.vars[i].name), i);
+    }
+
+    ASSERT(layout_struct(&toplevels, &names, &cache, TEST_LAYOUT_LEVELS,
+                         &layout, 0) == 0, cleanup);
+    ASSERT(layout.size == (size_t) 16 << (TEST_LAYOUT_LEVELS - 1),
+           cleanup);
+    ASSERT(layout.fields[1].offset == layout.size / 2, cleanup);
+    ASSERT(cache.len == TEST_LAYOUT_LEVELS, cleanup);
+    destroy_struct_layout(&layout);
+
+    /* whether a structure contains itself isn't cached */
+    ASSERT(layout_struct(&toplevels, &names, &cache, TEST_LAYOUT_LEVELS + 1,
+                         &layout, &errors) == -1, cleanup);
+    ASSERT(layout_struct(&toplevels, &names, &cache, TEST_LAYOUT_LEVELS + 2,
+                         &layout, &errors) == -1, cleanup);
+    ASSERT(errors.len == 2, cleanup);
+    ASSERT(strcmp(str_cbegin(&errors.diagnostics[1].message),
+                  "B contains itself through its field a") == 0, cleanup);
+    ASSERT(layout_struct(&toplevels, &names, &cache, TEST_LAYOUT_LEVELS + 3,
+                         &layout, &errors) == -1, cleanup);
+    ASSERT(errors.len == 2, cleanup);
+cleanup:
+    destroy_struct_layout(&layout);
+    destroy_layout_cache(&cache);
+    destroy_diagnostics(&errors);
+    symtab_destroy(&names);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+}
+END_TEST
+
+void test_layout(void) {
+    RUN(test_struct_layout);
+    RUN(test_nested_layout_cache);
+}
+#endif
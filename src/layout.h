@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef HEADER_GUARD_LAYOUT_H
+#define HEADER_GUARD_LAYOUT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct field_layout {
+    size_t offset;
+    size_t size;
+    size_t alignment;
+};
+typedef struct field_layout field_layout;
+
+/* Where a structure puts its fields.  Unless the structure asks for
+ * the C layout the fields are sorted from the most to the least
+ * aligned, keeping the declaration order among fields aligned the
+ * same, which leaves no padding between them as every size is a
+ * multiple of its alignment. */
+struct struct_layout {
+    size_t size;
+    size_t alignment;
+    /* The bytes of padding between and after the fields. */
+    size_t padding;
+    /* The size with the fields in declaration order, as C would lay
+     * them out. */
+    size_t declared_size;
+    /* Indexed like the fields of the definition. */
+    field_layout* fields;
+    /* The indices of the fields from the lowest offset up. */
+    size_t* order;
+    size_t len;
+};
+typedef struct struct_layout struct_layout;
+
+/* The sizes and alignments of the structures laid out so far by
+ * their index, so that a structure reached through several fields is
+ * laid out once instead of once for each path to it.  It is only
+ * valid for the declarations it was filled from and isn't
+ * thread safe. */
+struct cached_layout;
+struct layout_cache {
+    struct cached_layout* entries;
+    /* `cap` is zero or a power of two. */
+    size_t len, cap;
+};
+typedef struct layout_cache layout_cache;
+#define LAYOUT_CACHE_INIT {0, 0, 0}
+
+void destroy_layout_cache(layout_cache*);
+
+struct vec_var_decl;
+struct symtab;
+struct vec_diagnostic;
+/* Lay out the structure defined by the top level declaration `index`,
+ * whose fields may be builtin types or other structures found through
+ * `names`.  Errors in the definition are appended to `errors`, or
+ * reported if it is null, but errors in the structures it contains
+ * are left to their own definitions.  The structures it contains are
+ * looked up in and added to `cache`, which may be null.  On success
+ * `out` must be destroyed with destroy_struct_layout. */
+int layout_struct(const struct vec_var_decl* toplevels,
+                  const struct symtab* names, layout_cache* cache,
+                  size_t index, struct_layout* out,
+                  struct vec_diagnostic* errors);
+void destroy_struct_layout(struct_layout*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
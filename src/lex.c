@@ -3,17 +3,206 @@
 #include "diagnostics.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include "../cutil/str.h"
 #include "../cutil/vec.h"
 #include "../cutil/rpmalloc.h"
 #include <string.h>
+#include "number.h"
+#include "pool.h"
+#include "trace.h"
+#include "xid.h"
 
-int lex(fiter* fiter, vec_token* tokens) {
+/* Read the rest of the character whose first byte is `c` into
+ * `bytes`.  The input has already been validated so only the length
+ * needs to be worked out.  Fails if invalid UTF-8 cut the character
+ * short. */
+static int
+read_code_point(fiter* fiter, char c, char* bytes, size_t* len,
+                unsigned long* cp) {
+    unsigned char lead = (unsigned char) c;
+    size_t n = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : 1;
+    size_t i;
+    *cp = lead & (0x3F >> n);
+    bytes[0] = c;
+    for (i = 1; i <= n; ++i) {
+        if (!(c = fiter_next(fiter))) {
+            return -1;
+        }
+        bytes[i] = c;
+        *cp = (*cp << 6) | ((unsigned char) c & 0x3F);
+    }
+    *len = n + 1;
+    return 0;
+}
+
+static int
+is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int
+is_hex_digit(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* Whether `c` can be part of a word, counting every byte of a
+ * non-ASCII character. */
+static int
+is_word_byte(char c) {
+    return (unsigned char) c >= 0x80 || isalnum(c) || c == '_';
+}
+
+/* Longer literals are rejected so they can be built on the stack. */
+#define MAX_NUMBER_LENGTH 512
+
+static void
+append_char(char* text, size_t* len, char c) {
+    if (*len < MAX_NUMBER_LENGTH) {
+        text[*len] = c;
+    }
+    ++*len;
+}
+
+/* Lex the number starting with the digit `*c`, leaving the character
+ * after it in `*c`.  Integers are decimal, `0x` hexadecimal or `0b`
+ * binary; a fraction or exponent makes a decimal number a float.  On
+ * an error `tk` is still made into a valid token. */
+static int
+lex_number_value(fiter* fiter, char* c, token* tk) {
+    char text[MAX_NUMBER_LENGTH + 1];
+    size_t len = 0;
+    int is_float = 0;
+    tk->type = token_int;
+    tk->data.integer = 0;
+
+    if (*c == '0') {
+        *c = fiter_next(fiter);
+        if (*c == 'x' || *c == 'X' || *c == 'b' || *c == 'B') {
+            char prefix = *c;
+            unsigned base = (*c == 'x' || *c == 'X') ? 16 : 2;
+            while ((*c = fiter_next(fiter)) &&
+                   (base == 16 ? is_hex_digit(*c)
+                               : *c == '0' || *c == '1')) {
+                append_char(text, &len, *c);
+            }
+            if (len == 0) {
+                report_error_pos(fiter->errors, &tk->fpos,
+                                 "Expected %s digits after 0%c",
+                                 base == 16 ? "hexadecimal" : "binary",
+                                 prefix);
+                return -1;
+            }
+            if (len > MAX_NUMBER_LENGTH ||
+                parse_integer(text, len, base, &tk->data.integer)) {
+                report_error_pos(fiter->errors, &tk->fpos,
+                                 "Integer literal is too large");
+                return -1;
+            }
+            return 0;
+        }
+        append_char(text, &len, '0');
+    }
+    while (is_digit(*c)) {
+        append_char(text, &len, *c);
+        *c = fiter_next(fiter);
+    }
+    if (*c == '.') {
+        is_float = 1;
+        append_char(text, &len, *c);
+        *c = fiter_next(fiter);
+        if (!is_digit(*c)) {
+            report_error_pos(fiter->errors, &tk->fpos,
+                             "Expected digits after the decimal point");
+            return -1;
+        }
+        while (is_digit(*c)) {
+            append_char(text, &len, *c);
+            *c = fiter_next(fiter);
+        }
+    }
+    if (*c == 'e' || *c == 'E') {
+        is_float = 1;
+        append_char(text, &len, *c);
+        *c = fiter_next(fiter);
+        if (*c == '+' || *c == '-') {
+            append_char(text, &len, *c);
+            *c = fiter_next(fiter);
+        }
+        if (!is_digit(*c)) {
+            report_error_pos(fiter->errors, &tk->fpos,
+                             "Expected digits in the exponent");
+            return -1;
+        }
+        while (is_digit(*c)) {
+            append_char(text, &len, *c);
+            *c = fiter_next(fiter);
+        }
+    }
+
+    if (len > MAX_NUMBER_LENGTH) {
+        report_error_pos(fiter->errors, &tk->fpos,
+                         "Number literal is longer than %d characters",
+                         MAX_NUMBER_LENGTH);
+        return -1;
+    }
+    text[len] = '\0';
+    if (is_float) {
+        tk->type = token_float;
+        if (parse_float(text, len, &tk->data.floating)) {
+            report_error_pos(fiter->errors, &tk->fpos,
+                             "Floating point literal is too large");
+            return -1;
+        }
+    } else if (parse_integer(text, len, 10, &tk->data.integer)) {
+        report_error_pos(fiter->errors, &tk->fpos,
+                         "Integer literal is too large");
+        return -1;
+    }
+    return 0;
+}
+
+/* Like lex_number_value, but a number must not run straight into a
+ * word, so `0x1Fg` and `123abc` are errors rather than a number and a
+ * name.  The rest of the word is skipped. */
+static int
+lex_number(fiter* fiter, char* c, token* tk) {
+    int ret = lex_number_value(fiter, c, tk);
+    if (!is_word_byte(*c)) {
+        return ret;
+    }
+    if (ret == 0) {
+        report_error_pos(fiter->errors, &tk->fpos,
+                         "Invalid character %c after a number literal",
+                         (unsigned char) *c < 0x80 ? *c : '?');
+    }
+    while (is_word_byte(*c)) {
+        *c = fiter_next(fiter);
+    }
+    return -1;
+}
+
+static int
+push_bytes(str* s, const char* bytes, size_t len) {
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        if (str_push(s, bytes[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* If `one_declaration` is set, stop after the semicolon or closing
+ * curly that ends a top level declaration. */
+static int
+lex_tokens(fiter* fiter, vec_token* tokens, int one_declaration) {
     int ret = 0;
+    size_t depth = 0;
     char c;
     assert(fiter);
-    assert(fiter->file);
+    assert(fiter->file || fiter->memory);
 
     while (1) {
         token tk;
@@ -21,16 +210,57 @@ int lex(fiter* fiter, vec_token* tokens) {
             break;
         }
 top:
+        if (!c) {
+            /* the last token ran into the end of the file */
+            break;
+        }
         tk.fpos = fiter->fpos;
-        if (isspace(c)) {
-        } else if (isalpha(c)) {
+        if ((unsigned char) c < 0x80 && isspace(c)) {
+        } else if ((unsigned char) c >= 0x80 || isalpha(c) || c == '_') {
+            /* ASCII stays on the fast path; only other characters are
+             * decoded. */
             str s = STR_INIT;
-            if (str_push(&s, c)) {
+            char bytes[4];
+            size_t len;
+            unsigned long cp;
+            if ((unsigned char) c < 0x80) {
+                if (str_push(&s, c)) {
+                    str_destroy(&s);
+                    return -1;
+                }
+            } else if (read_code_point(fiter, c, bytes, &len, &cp)) {
+                str_destroy(&s);
+                return -1;
+            } else if (!is_xid_start(cp)) {
+                report_error_pos(fiter->errors, &tk.fpos,
+                                 "Lexing error on seeing U+%04lX", cp);
+                str_destroy(&s);
+                ret = -1;
+                continue;
+            } else if (push_bytes(&s, bytes, len)) {
                 str_destroy(&s);
                 return -1;
             }
-            while ((c = fiter_next(fiter)) && (isalnum(c) || c == '_')) {
-                if (str_push(&s, c)) {
+            while ((c = fiter_next(fiter))) {
+                if ((unsigned char) c < 0x80) {
+                    if (!isalnum(c) && c != '_') {
+                        break;
+                    }
+                    if (str_push(&s, c)) {
+                        str_destroy(&s);
+                        return -1;
+                    }
+                    continue;
+                }
+                if (read_code_point(fiter, c, bytes, &len, &cp)) {
+                    str_destroy(&s);
+                    return -1;
+                }
+                if (!is_xid_continue(cp)) {
+                    report_error_pos(fiter->errors, &fiter->fpos,
+                                     "Lexing error on seeing U+%04lX", cp);
+                    ret = -1;
+                } else if (push_bytes(&s, bytes, len)) {
                     str_destroy(&s);
                     return -1;
                 }
@@ -44,6 +274,18 @@ top:
             } else if (strcmp(str_cbegin(&s), "return") == 0) {
                 tk.type = token_return;
                 str_destroy(&s);
+            } else if (strcmp(str_cbegin(&s), "const") == 0) {
+                tk.type = token_const;
+                str_destroy(&s);
+            } else if (strcmp(str_cbegin(&s), "while") == 0) {
+                tk.type = token_while;
+                str_destroy(&s);
+            } else if (strcmp(str_cbegin(&s), "if") == 0) {
+                tk.type = token_if;
+                str_destroy(&s);
+            } else if (strcmp(str_cbegin(&s), "else") == 0) {
+                tk.type = token_else;
+                str_destroy(&s);
             } else {
                 tk.type = token_word;
                 tk.data.s = s;
@@ -54,31 +296,53 @@ top:
                 return -1;
             }
             goto top;
+        } else if (isdigit(c)) {
+            if (lex_number(fiter, &c, &tk)) {
+                ret = -1;
+            }
+            if (vec_push(tokens, sizeof(tk), &tk)) {
+                return -1;
+            }
+            goto top;
         } else if (c == '{') {
             tk.type = token_open_curly;
             if (vec_push(tokens, sizeof(tk), &tk)) {
                 return -1;
             }
+            ++depth;
         } else if (c == '}') {
             tk.type = token_close_curly;
             if (vec_push(tokens, sizeof(tk), &tk)) {
                 return -1;
             }
+            if (depth) {
+                --depth;
+            }
+            if (one_declaration && depth == 0) {
+                break;
+            }
         } else if (c == '(') {
             tk.type = token_open_paren;
             if (vec_push(tokens, sizeof(tk), &tk)) {
                 return -1;
             }
+            ++depth;
         } else if (c == ')') {
             tk.type = token_close_paren;
             if (vec_push(tokens, sizeof(tk), &tk)) {
                 return -1;
             }
+            if (depth) {
+                --depth;
+            }
         } else if (c == ';') {
             tk.type = token_semicolon;
             if (vec_push(tokens, sizeof(tk), &tk)) {
                 return -1;
             }
+            if (one_declaration && depth == 0) {
+                break;
+            }
         } else if (c == '+') {
             tk.type = token_plus;
             if (vec_push(tokens, sizeof(tk), &tk)) {
@@ -121,15 +385,191 @@ top:
                 return -1;
             }
         } else {
-            print_error_pos(&fiter->fpos,
-                            "Lexing error on seeing %c", (int)c);
+            report_error_pos(fiter->errors, &fiter->fpos,
+                             "Lexing error on seeing %c", (int)c);
+            ret = -1;
+        }
+    }
+
+    if (fiter->failed) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int lex(fiter* fiter, vec_token* tokens) {
+    return lex_tokens(fiter, tokens, 0);
+}
+
+int lex_declaration(fiter* fiter, vec_token* tokens) {
+    return lex_tokens(fiter, tokens, 1);
+}
+
+struct lex_chunk {
+    const char* text;
+    size_t len;
+    fposition start;
+    vec_token tokens;
+    vec_diagnostic errors;
+    int result;
+    /* Set if the chunk ended early on invalid UTF-8. */
+    int failed;
+    /* Where the tokens go in `*dest` once all chunks are lexed. */
+    token* dest;
+    size_t offset;
+};
+
+static void
+lex_chunk(void* data, size_t task) {
+    struct lex_chunk* chunk = &((struct lex_chunk*) data)[task];
+    unsigned long long start = trace_begin();
+    fiter fiter;
+    fiter_init_memory(&fiter, chunk->text, chunk->len, &chunk->start);
+    fiter.errors = &chunk->errors;
+    chunk->result = lex(&fiter, &chunk->tokens);
+    chunk->failed = fiter.failed;
+    trace_end(start, "lex_chunk", chunk->start.fname, chunk->tokens.len);
+}
+
+/* Move the tokens of a chunk to their place in the result. */
+static void
+copy_chunk(void* data, size_t task) {
+    struct lex_chunk* chunk = &((struct lex_chunk*) data)[task];
+    if (chunk->tokens.len) {
+        memcpy(chunk->dest + chunk->offset, chunk->tokens.tokens,
+               chunk->tokens.len * sizeof(token));
+    }
+    rpfree(chunk->tokens.tokens);
+    chunk->tokens = (vec_token) VEC_INIT;
+}
+
+/* Split `text` into at most `max_chunks` chunks of at least
+ * `min_len` bytes.  Each chunk but the first starts after a newline
+ * so the lexer is in the same state there as at the start of the
+ * file, apart from the position.  The start positions are a prefix
+ * sum of the newlines in the chunks before. */
+static size_t
+split_chunks(struct lex_chunk* chunks, size_t max_chunks,
+             const char* text, size_t len, const char* fname,
+             size_t min_len) {
+    const char* end = text + len;
+    const char* begin = text;
+    size_t size = len / max_chunks > min_len ? len / max_chunks : min_len;
+    size_t num_chunks = 0;
+    fposition fpos;
+    fpos.fname = fname;
+    fpos.line = 1;
+    fpos.column = 1;
+    while (begin != end) {
+        struct lex_chunk* chunk = &chunks[num_chunks++];
+        const char* chunk_end;
+        const char* p;
+        if (num_chunks == max_chunks || (size_t) (end - begin) <= size ||
+            !(chunk_end = memchr(begin + size, '\n',
+                                 end - begin - size))) {
+            chunk_end = end;
+        } else {
+            ++chunk_end;
+        }
+        chunk->text = begin;
+        chunk->len = chunk_end - begin;
+        chunk->start = fpos;
+        chunk->tokens = (vec_token) VEC_INIT;
+        chunk->errors = (vec_diagnostic) VEC_INIT;
+        for (p = begin; (p = memchr(p, '\n', chunk_end - p)); ++p) {
+            ++fpos.line;
+        }
+        /* see fiter_next */
+        fpos.column = 0;
+        begin = chunk_end;
+    }
+    return num_chunks;
+}
+
+static int
+lex_chunks(const char* text, size_t len, const char* fname,
+           vec_token* tokens, size_t num_threads, size_t min_len) {
+    struct lex_chunk* chunks;
+    size_t num_chunks, num_used, total, i;
+    size_t adopted = 0;
+    const char* nul;
+    int ret = 0;
+    assert(tokens);
+
+    /* The lexer stops at a null byte like at the end of the file. */
+    if ((nul = memchr(text, '\0', len))) {
+        len = nul - text;
+    }
+    if (num_threads == 0) {
+        num_threads = default_num_threads();
+    }
+    chunks = rpmalloc(num_threads * sizeof(struct lex_chunk));
+    if (!chunks) {
+        return -1;
+    }
+    num_chunks = split_chunks(chunks, num_threads, text, len, fname,
+                              min_len);
+    run_independent(lex_chunk, chunks, num_chunks, num_threads);
+
+    /* Nothing after invalid UTF-8 is lexed. */
+    total = tokens->len;
+    for (num_used = 0; num_used != num_chunks;) {
+        struct lex_chunk* chunk = &chunks[num_used++];
+        chunk->offset = total;
+        total += chunk->tokens.len;
+        report_diagnostics(&chunk->errors);
+        if (chunk->result) {
             ret = -1;
         }
+        if (chunk->failed) {
+            break;
+        }
     }
 
+    /* Stitch the chunks together in order.  The first chunk's tokens
+     * are already in place if there weren't any tokens before, which
+     * saves copying everything when there is only one chunk. */
+    if (num_used && tokens->len == 0) {
+        rpfree(tokens->tokens);
+        *tokens = chunks[0].tokens;
+        chunks[0].tokens = (vec_token) VEC_INIT;
+        adopted = 1;
+    }
+    if (total > tokens->cap) {
+        token* grown = rprealloc(tokens->tokens, total * sizeof(token));
+        if (!grown) {
+            ret = -1;
+            num_used = adopted;
+        } else {
+            tokens->tokens = grown;
+            tokens->cap = total;
+        }
+    }
+    for (i = adopted; i != num_used; ++i) {
+        chunks[i].dest = tokens->tokens;
+    }
+    run_independent(copy_chunk, chunks + adopted, num_used - adopted,
+                    num_threads);
+    if (num_used != adopted) {
+        tokens->len = total;
+    }
+
+    for (i = 0; i != num_chunks; ++i) {
+        if (chunks[i].tokens.tokens) {
+            destroy_tokens(&chunks[i].tokens);
+        }
+        destroy_diagnostics(&chunks[i].errors);
+    }
+    rpfree(chunks);
     return ret;
 }
 
+int lex_parallel(const char* text, size_t len, const char* fname,
+                 vec_token* tokens, size_t num_threads) {
+    return lex_chunks(text, len, fname, tokens, num_threads,
+                      LEX_CHUNK_MIN);
+}
+
 void destroy_tokens(vec_token* tokens) {
     token* last;
     token* token;
@@ -150,11 +590,7 @@ void destroy_tokens(vec_token* tokens) {
         vec_token tokens = VEC_INIT;                                 \
         size_t i;                                                    \
         fiter iter;                                                  \
-        iter.file = (FILE*)name##_file;                              \
-        iter.index = 0;                                              \
-        iter.fpos.fname = #name;                                     \
-        iter.fpos.line = 1;                                          \
-        iter.fpos.column = 1;                                        \
+        fiter_init(&iter, (FILE*)name##_file, #name);                \
         ASSERT(lex(&iter, &tokens) == 0, cleanup);                   \
         for (i = 0; i != tokens.len; ++i) {                          \
             const token* tk = &tokens.tokens[i];                     \
@@ -244,9 +680,180 @@ stop:
 }
 END_TEST
 
+/* gr\u00f6\u00dfe := _\u03bb1; */
+static const char* test_lex_3_file[] =
+    {"gr\xc3\xb6\xc3\x9f", "e := _\xce\xbb" "1;", 0};
+static token test_lex_3_tokens[] = {
+    {token_word, STR_INIT}, {token_colon}, {token_assign},
+    {token_word, STR_INIT}, {token_semicolon}
+};
+TEST(test_lex_3) {
+    ASSERT(str_push_s(&test_lex_3_tokens[0].data.s,
+                      "gr\xc3\xb6\xc3\x9f" "e") == 0, stop);
+    ASSERT(str_push_s(&test_lex_3_tokens[3].data.s, "_\xce\xbb" "1") == 0,
+           stop);
+    LEX_TEST(test_lex_3);
+stop:
+    str_destroy(&test_lex_3_tokens[0].data.s);
+    str_destroy(&test_lex_3_tokens[3].data.s);
+}
+END_TEST
+
+static int
+same_token(const token* a, const token* b) {
+    if (a->type != b->type || a->fpos.line != b->fpos.line ||
+        a->fpos.column != b->fpos.column) {
+        return 0;
+    }
+    switch (a->type) {
+    case token_word:
+        return strcmp(str_cbegin(&a->data.s), str_cbegin(&b->data.s)) == 0;
+    case token_int:
+        return a->data.integer == b->data.integer;
+    case token_float:
+        return a->data.floating == b->data.floating;
+    default:
+        return 1;
+    }
+}
+
+/* Lex `text` in one go, or in chunks if `num_threads` isn't 0, and
+ * capture the errors. */
+static int
+lex_captured(const char* text, size_t len, vec_token* tokens,
+             size_t num_threads, char** errors) {
+    size_t errors_len;
+    FILE* stream = open_memstream(errors, &errors_len);
+    int res;
+    if (!stream) {
+        return -2;
+    }
+    set_diagnostics_stream(stream);
+    if (num_threads) {
+        res = lex_chunks(text, len, "test", tokens, num_threads, 1);
+    } else {
+        fiter iter;
+        fposition start = {"test", 1, 1};
+        fiter_init_memory(&iter, text, len, &start);
+        res = lex(&iter, tokens);
+    }
+    set_diagnostics_stream(0);
+    fclose(stream);
+    return res;
+}
+
+/* Whether lexing `text` reports `expected` and gives a number and a
+ * semicolon. */
+static int
+lexes_number_error(const char* text, const char* expected) {
+    vec_token tokens = VEC_INIT;
+    char* errors = 0;
+    int res = lex_captured(text, strlen(text), &tokens, 0, &errors);
+    int same = res == -1 && errors && strcmp(errors, expected) == 0 &&
+               tokens.len == 2 &&
+               (tokens.tokens[0].type == token_int ||
+                tokens.tokens[0].type == token_float) &&
+               tokens.tokens[1].type == token_semicolon;
+    free(errors);
+    if (tokens.tokens) {
+        destroy_tokens(&tokens);
+    }
+    return same;
+}
+
+TEST(test_lex_number_suffix) {
+    vec_token tokens = VEC_INIT;
+    char* errors = 0;
+    ASSERT(lexes_number_error("0x1Fg;", "test:1:2: Error: Invalid "
+                              "character g after a number literal\n"),
+           cleanup);
+    ASSERT(lexes_number_error("123abc;", "test:1:2: Error: Invalid "
+                              "character a after a number literal\n"),
+           cleanup);
+    ASSERT(lexes_number_error("0b102;", "test:1:2: Error: Invalid "
+                              "character 2 after a number literal\n"),
+           cleanup);
+    ASSERT(lexes_number_error("1.5f;", "test:1:2: Error: Invalid "
+                              "character f after a number literal\n"),
+           cleanup);
+    ASSERT(lexes_number_error("7_;", "test:1:2: Error: Invalid "
+                              "character _ after a number literal\n"),
+           cleanup);
+    ASSERT(lexes_number_error("12\xce\xbb;", "test:1:2: Error: Invalid "
+                              "character ? after a number literal\n"),
+           cleanup);
+    /* one error for a number that is already wrong */
+    ASSERT(lexes_number_error("0xg;", "test:1:2: Error: Expected "
+                              "hexadecimal digits after 0x\n"), cleanup);
+    ASSERT(lex_captured("0x1F+1e3-2;", 11, &tokens, 0, &errors) == 0,
+           cleanup);
+    ASSERT(errors && errors[0] == '\0', cleanup);
+    ASSERT(tokens.len == 6 && tokens.tokens[0].data.integer == 31 &&
+           tokens.tokens[2].type == token_float, cleanup);
+cleanup:
+    free(errors);
+    if (tokens.tokens) {
+        destroy_tokens(&tokens);
+    }
+}
+END_TEST
+
+/* Split into different numbers of chunks so that many different
+ * lines, including ones with errors, start a chunk. */
+TEST(test_lex_parallel) {
+    str source = STR_INIT;
+    vec_token serial = VEC_INIT;
+    char* serial_errors = 0;
+    size_t num_threads, i;
+    for (i = 0; i != 60; ++i) {
+        char line[128];
+        sprintf(line, "f%lu := fun (a : std::i32, b : std::f64 = %lu.5e3) "
+                "-> std::i32 {\n    return a + 0x%lX - b;\n}\n\n",
+                (unsigned long) i, (unsigned long) i, (unsigned long) i);
+        ASSERT(str_push_s(&source, line) == 0, cleanup);
+        if (i % 7 == 3) {
+            sprintf(line, "gr\xc3\xb6\xc3\x9f" "e%lu := $ 0b;\n",
+                    (unsigned long) i);
+            ASSERT(str_push_s(&source, line) == 0, cleanup);
+        }
+    }
+    ASSERT(str_push_s(&source, "last := 1") == 0, cleanup);
+    ASSERT(lex_captured(str_cbegin(&source), strlen(str_cbegin(&source)),
+                        &serial, 0, &serial_errors) == -1, cleanup);
+    ASSERT(serial.len > 1000, cleanup);
+    for (num_threads = 2; num_threads != 16; ++num_threads) {
+        vec_token parallel = VEC_INIT;
+        char* parallel_errors = 0;
+        int res = lex_captured(str_cbegin(&source),
+                               strlen(str_cbegin(&source)), &parallel,
+                               num_threads, &parallel_errors);
+        int same = res == -1 && parallel.len == serial.len &&
+                   parallel_errors &&
+                   strcmp(parallel_errors, serial_errors) == 0;
+        for (i = 0; same && i != serial.len; ++i) {
+            same = same_token(&parallel.tokens[i], &serial.tokens[i]);
+        }
+        if (parallel.tokens) {
+            destroy_tokens(&parallel);
+        }
+        free(parallel_errors);
+        ASSERT(same, cleanup);
+    }
+cleanup:
+    if (serial.tokens) {
+        destroy_tokens(&serial);
+    }
+    free(serial_errors);
+    str_destroy(&source);
+}
+END_TEST
+
 void test_lex(void) {
     RUN(test_lex_1);
     RUN(test_lex_2);
+    RUN(test_lex_3);
+    RUN(test_lex_number_suffix);
+    RUN(test_lex_parallel);
 }
 
 #endif
@@ -15,7 +15,12 @@ struct token {
         token_close_curly,
         token_close_paren,
         token_colon,
+        token_const,
+        token_else,
+        token_float,
         token_fun,
+        token_if,
+        token_int,
         token_namespace,
         token_open_curly,
         token_open_paren,
@@ -23,6 +28,7 @@ struct token {
         token_right_arrow,
         token_semicolon,
         token_struct,
+        token_while,
         token_word,
 
         /* from widest to tightest: */
@@ -34,6 +40,8 @@ struct token {
     } type;
     union {
         str s;
+        unsigned long long integer;
+        double floating;
     } data;
     fposition fpos;
 };
@@ -50,6 +58,20 @@ void destroy_tokens(vec_token* tokens);
 
 struct fiter;
 int lex(struct fiter*, vec_token* tokens);
+/* Lex up to and including the semicolon or closing curly that ends
+ * the next top level declaration.  Nothing is appended at the end of
+ * the file. */
+int lex_declaration(struct fiter*, vec_token* tokens);
+
+/* Chunks given to a thread by lex_parallel are at least this long. */
+#define LEX_CHUNK_MIN (64 * 1024)
+
+/* Lex the contents of the file `fname`, which are `len` bytes at
+ * `text`, on up to `num_threads` threads (0 picks the number of
+ * processors).  The text is split into chunks at newlines, which no
+ * token spans.  The tokens and errors are the same as lex gives. */
+int lex_parallel(const char* text, size_t len, const char* fname,
+                 vec_token* tokens, size_t num_threads);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,209 @@
+#include "library.h"
+#include "../cutil/rpmalloc.h"
+#include "../cutil/vec.h"
+#include "fiter.h"
+
+int
+initialize_library(void) {
+    return rpmalloc_initialize();
+}
+
+void
+finalize_library_thread(void) {
+    rpmalloc_thread_finalize();
+}
+
+static int
+parse_buffer(const source_buffer* buffer, parsed_buffer* out) {
+    fposition start;
+    fiter iter;
+    vec_diagnostic* previous;
+    int res;
+    out->tokens = (vec_token) VEC_INIT;
+    out->toplevels = (vec_var_decl) VEC_INIT;
+    out->errors = (vec_diagnostic) VEC_INIT;
+    start.fname = buffer->name;
+    start.line = 1;
+    start.column = 1;
+    fiter_init_memory(&iter, buffer->text, buffer->len, &start);
+    /* Everything is reported on this thread as the buffer is lexed
+     * and parsed serially. */
+    previous = capture_diagnostics(&out->errors);
+    res = lex(&iter, &out->tokens);
+    if (res == 0) {
+        res = parse(&out->tokens, &out->toplevels, 0);
+    }
+    capture_diagnostics(previous);
+    return res;
+}
+
+int
+parse_buffers(const source_buffer* buffers, size_t len,
+              parsed_buffer* out) {
+    size_t i;
+    int res = 0;
+    /* threads of the embedding program haven't used the allocator
+     * yet, and this does nothing on those that have */
+    rpmalloc_thread_initialize();
+    for (i = 0; i != len; ++i) {
+        if (parse_buffer(&buffers[i], &out[i])) {
+            res = -1;
+        }
+    }
+    return res;
+}
+
+void
+destroy_parsed_buffers(parsed_buffer* buffers, size_t len) {
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        destroy_var_decls(&buffers[i].toplevels);
+        if (buffers[i].tokens.tokens) {
+            destroy_tokens(&buffers[i].tokens);
+        }
+        destroy_diagnostics(&buffers[i].errors);
+    }
+}
+
+#ifdef TEST_MODE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cutil/test.h"
+#include "pool.h"
+#include "types.h"
+
+static const char test_library_good[] =
+    "x : std::i64 = 1;\n"
+    "f := fun (a : std::i64) -> std::i64 {\n"
+    "    return a + x;\n"
+    "}\n";
+static const char test_library_bad[] = "y := ;\n";
+
+static const source_buffer test_library_buffers[] = {
+    {"good.shiv", test_library_good, sizeof(test_library_good) - 1},
+    {"bad.shiv", test_library_bad, sizeof(test_library_bad) - 1},
+};
+#define TEST_LIBRARY_BUFFERS \
+    (sizeof(test_library_buffers) / sizeof(*test_library_buffers))
+
+/* Whether `parsed` is what test_library_buffers parse into. */
+static int
+parsed_test_buffers(const parsed_buffer* parsed) {
+    return parsed[0].toplevels.len == 2 && parsed[0].errors.len == 0 &&
+           parsed[1].errors.len == 1 &&
+           strcmp(str_cbegin(&parsed[1].errors.diagnostics[0].fname),
+                  "bad.shiv") == 0 &&
+           parsed[1].errors.diagnostics[0].line == 1;
+}
+
+TEST(test_parse_buffers) {
+    parsed_buffer parsed[TEST_LIBRARY_BUFFERS];
+    char* text = 0;
+    size_t len;
+    FILE* stream = open_memstream(&text, &len);
+    memset(parsed, 0, sizeof(parsed));
+    ASSERT(stream, cleanup);
+    set_diagnostics_stream(stream);
+    ASSERT(parse_buffers(test_library_buffers, TEST_LIBRARY_BUFFERS,
+                         parsed) == -1, cleanup);
+    /* the error stays in the results */
+    set_diagnostics_stream(0);
+    fclose(stream);
+    stream = 0;
+    ASSERT(len == 0, cleanup);
+    ASSERT(parsed_test_buffers(parsed), cleanup);
+cleanup:
+    if (stream) {
+        set_diagnostics_stream(0);
+        fclose(stream);
+    }
+    free(text);
+    destroy_parsed_buffers(parsed, TEST_LIBRARY_BUFFERS);
+}
+END_TEST
+
+#define TEST_LIBRARY_TASKS 16
+
+static void
+parse_test_buffers(void* data, size_t task) {
+    parsed_buffer* parsed = data;
+    parse_buffers(test_library_buffers, TEST_LIBRARY_BUFFERS,
+                  &parsed[task * TEST_LIBRARY_BUFFERS]);
+}
+
+TEST(test_parse_buffers_threads) {
+    parsed_buffer parsed[TEST_LIBRARY_TASKS * TEST_LIBRARY_BUFFERS];
+    size_t i;
+    run_independent(parse_test_buffers, parsed, TEST_LIBRARY_TASKS, 4);
+    for (i = 0; i != TEST_LIBRARY_TASKS; ++i) {
+        ASSERT(parsed_test_buffers(&parsed[i * TEST_LIBRARY_BUFFERS]),
+               cleanup);
+    }
+cleanup:
+    destroy_parsed_buffers(parsed, TEST_LIBRARY_TASKS *
+                                   TEST_LIBRARY_BUFFERS);
+}
+END_TEST
+
+/* One embedding program's calls, which run alongside another's. */
+struct test_library_context {
+    parsed_buffer parsed[TEST_LIBRARY_BUFFERS];
+    size_t rounds;
+    int same;
+};
+
+static void*
+parse_in_context(void* data) {
+    struct test_library_context* context = data;
+    size_t i;
+    context->same = 1;
+    for (i = 0; i != context->rounds; ++i) {
+        parse_buffers(test_library_buffers, TEST_LIBRARY_BUFFERS,
+                      context->parsed);
+        context->same &= parsed_test_buffers(context->parsed);
+        destroy_parsed_buffers(context->parsed, TEST_LIBRARY_BUFFERS);
+    }
+    finalize_library_thread();
+    return 0;
+}
+
+/* Two contexts parse while the settings of the diagnostics change
+ * and signatures are interned on this thread, as a compile would. */
+TEST(test_parse_buffers_contexts) {
+    struct test_library_context contexts[2];
+    pthread_t threads[2];
+    type_id params[1];
+    size_t started = 0;
+    size_t i;
+    for (i = 0; i != 2; ++i) {
+        contexts[i].rounds = 200;
+        contexts[i].same = 0;
+    }
+    for (; started != 2; ++started) {
+        if (pthread_create(&threads[started], 0, parse_in_context,
+                           &contexts[started])) {
+            break;
+        }
+    }
+    for (i = 0; i != 200; ++i) {
+        configure_diagnostics(1, (int) (i & 1));
+        params[0] = (type_id) (type_byte + i % 4);
+        intern_signature(type_i64, params, 1, 1);
+    }
+    for (i = 0; i != started; ++i) {
+        pthread_join(threads[i], 0);
+    }
+    configure_diagnostics(0, 0);
+    ASSERT(started == 2, end);
+    ASSERT(contexts[0].same && contexts[1].same, end);
+end:;
+}
+END_TEST
+
+void test_library(void) {
+    RUN(test_parse_buffers);
+    RUN(test_parse_buffers_threads);
+    RUN(test_parse_buffers_contexts);
+}
+#endif
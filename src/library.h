@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef HEADER_GUARD_LIBRARY_H
+#define HEADER_GUARD_LIBRARY_H
+
+#include <stddef.h>
+#include "diagnostics.h"
+#include "lex.h"
+#include "parse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The entry points of libshiv, which lexes and parses source text held
+ * in memory for programs embedding the front end.  Calls keep no state
+ * between them, so any number of threads can parse at once.
+ *
+ * The process-wide state of the compiler isn't reached from here: the
+ * signatures and remembered types of types.h belong to the checks,
+ * which the library doesn't run, and the error limit, JSON output and
+ * stream set by configure_diagnostics only apply to what
+ * flush_diagnostics prints, while a call's diagnostics are captured
+ * on the calling thread straight into its results.  A compile running
+ * alongside doesn't change what a call returns. */
+
+/* Source text to parse.  `name` is what positions refer to, so it
+ * must outlive the results. */
+struct source_buffer {
+    const char* name;
+    const char* text;
+    size_t len;
+};
+typedef struct source_buffer source_buffer;
+
+/* What parsing one buffer gives.  The errors are kept here instead of
+ * being reported, and everything is freed by destroy_parsed_buffers,
+ * which may be called on any thread. */
+struct parsed_buffer {
+    vec_token tokens;
+    vec_var_decl toplevels;
+    vec_diagnostic errors;
+};
+typedef struct parsed_buffer parsed_buffer;
+
+/* Set up the allocator.  Must be called once before any thread uses
+ * the library. */
+int initialize_library(void);
+/* Release the allocator caches of the calling thread, which may have
+ * parsed, before it exits. */
+void finalize_library_thread(void);
+
+/* Lex and parse each of the `len` buffers into the parsed buffer at
+ * the same index of `out`, on the calling thread.  Returns -1 if any
+ * buffer has errors, with its tokens and declarations as far as they
+ * got.  `out` must be destroyed either way. */
+int parse_buffers(const source_buffer* buffers, size_t len,
+                  parsed_buffer* out);
+void destroy_parsed_buffers(parsed_buffer* buffers, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,630 @@
+#include "load.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../cutil/rpmalloc.h"
+#include "pool.h"
+#include "trace.h"
+
+/* The most opens and reads in flight at once. */
+#define RING_ENTRIES 128
+/* The most read by one request. */
+#define MAX_READ (1u << 30)
+
+struct loader {
+    const char* const* paths;
+    size_t len;
+    file_loaded loaded;
+    void* data;
+    int failed;
+};
+
+/* Hand a file to `loaded` unless it already failed. */
+static void
+deliver(struct loader* loader, size_t index, char* text, size_t len,
+        int error) {
+    if (loader->failed) {
+        rpfree(text);
+        return;
+    }
+    if (loader->loaded(loader->data, index, text, len, error)) {
+        loader->failed = 1;
+    }
+}
+
+/* The submission and completion queues shared with the kernel. */
+struct ring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    /* The tail as far as we have filled in entries, of which `queued`
+     * aren't submitted yet. */
+    unsigned tail;
+    unsigned queued;
+};
+
+static void
+close_ring(struct ring* ring) {
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+}
+
+static int
+supports(const struct io_uring_probe* probe, unsigned op) {
+    return op < probe->ops_len &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+/* Set up a ring, -1 if io_uring or the operations we need aren't
+ * available. */
+static int
+open_ring(struct ring* ring) {
+    struct io_uring_params params;
+    struct io_uring_probe* probe;
+    char* sq;
+    char* cq;
+    int ok;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->sq_map = MAP_FAILED;
+    ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    /* opening files needs 5.6 */
+    probe = rpcalloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+    ok = probe &&
+         syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                 probe, 256) == 0 &&
+         supports(probe, IORING_OP_OPENAT) && supports(probe, IORING_OP_READ);
+    rpfree(probe);
+    if (!ok) {
+        close_ring(ring);
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array +
+                        params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(0, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close_ring(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(0, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close_ring(ring);
+        return -1;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+    ring->queued = 0;
+    return 0;
+}
+
+/* Fill in the next submission, which the caller must have room
+ * for. */
+static struct io_uring_sqe*
+next_sqe(struct ring* ring) {
+    unsigned index = ring->tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->tail;
+    ++ring->queued;
+    return sqe;
+}
+
+/* Submit what is queued and, if `wait`, wait for a completion. */
+static int
+enter_ring(struct ring* ring, int wait) {
+    long res;
+    atomic_store_explicit((_Atomic unsigned*) ring->sq_tail, ring->tail,
+                          memory_order_release);
+    do {
+        res = syscall(__NR_io_uring_enter, ring->fd, ring->queued,
+                      wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res < 0) {
+        return -1;
+    }
+    ring->queued -= (unsigned) res;
+    return 0;
+}
+
+struct ring_file {
+    int fd;
+    int error;
+    char* text;
+    size_t len, size;
+};
+
+static void
+queue_read(struct ring* ring, struct ring_file* file, size_t index) {
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    size_t left = file->size - file->len;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = (uintptr_t) (file->text + file->len);
+    sqe->len = left > MAX_READ ? MAX_READ : (unsigned) left;
+    sqe->off = file->len;
+    sqe->user_data = index;
+}
+
+/* Handle the completion of the open or a read of `file`, returning 1
+ * once the file is done. */
+static int
+complete(struct ring* ring, struct ring_file* file, size_t index, int res) {
+    struct stat st;
+    if (file->fd < 0) {
+        if (res < 0) {
+            file->error = -res;
+            return 1;
+        }
+        file->fd = res;
+        /* the inode is cached now that the file is open */
+        if (fstat(file->fd, &st)) {
+            file->error = errno;
+        } else {
+            file->size = (size_t) st.st_size;
+            file->text = rpmalloc(file->size + 1);
+            if (!file->text) {
+                file->error = ENOMEM;
+            } else if (file->size) {
+                queue_read(ring, file, index);
+                return 0;
+            }
+        }
+    } else if (res == -EINTR || res == -EAGAIN) {
+        queue_read(ring, file, index);
+        return 0;
+    } else if (res < 0) {
+        file->error = -res;
+        rpfree(file->text);
+        file->text = 0;
+    } else {
+        file->len += (size_t) res;
+        /* a file cut short is read up to where it ends */
+        if (res != 0 && file->len != file->size) {
+            queue_read(ring, file, index);
+            return 0;
+        }
+    }
+    close(file->fd);
+    file->fd = -1;
+    return 1;
+}
+
+/* After the ring failed, wait for the operations the kernel has
+ * taken, which may still write into the buffers, and release what
+ * the first `len` files hold.  The rest were never submitted.  If
+ * even waiting fails, the buffers of reads in flight are left
+ * alone. */
+static void
+abandon_ring(struct ring* ring, struct ring_file* files, size_t len,
+             unsigned submitted) {
+    int settled = 1;
+    size_t i;
+    while (submitted) {
+        unsigned head, tail;
+        long res;
+        do {
+            res = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                          IORING_ENTER_GETEVENTS, 0, 0);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0) {
+            settled = 0;
+            break;
+        }
+        head = *ring->cq_head;
+        tail = atomic_load_explicit((_Atomic unsigned*) ring->cq_tail,
+                                    memory_order_acquire);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            struct ring_file* file = &files[cqe->user_data];
+            /* an open that completed has to be closed too */
+            if (file->fd < 0 && cqe->res >= 0) {
+                file->fd = cqe->res;
+            }
+            --submitted;
+        }
+        atomic_store_explicit((_Atomic unsigned*) ring->cq_head, head,
+                              memory_order_release);
+    }
+    for (i = 0; i != len; ++i) {
+        if (files[i].fd >= 0) {
+            close(files[i].fd);
+        }
+        if (settled) {
+            rpfree(files[i].text);
+        }
+    }
+}
+
+/* Submit the opens as a batch and each read as soon as its open
+ * completes, passing each file on as its last read completes. */
+static void
+load_with_ring(struct loader* loader, struct ring* ring) {
+    struct ring_file* files = rpcalloc(loader->len, sizeof(*files));
+    size_t* done = rpmalloc(loader->len * sizeof(size_t));
+    size_t next = 0, num_delivered = 0;
+    unsigned in_flight = 0;
+    int res = 0;
+    if (!files || !done) {
+        loader->failed = 1;
+        rpfree(files);
+        rpfree(done);
+        return;
+    }
+    while (num_delivered != loader->len) {
+        size_t num_done = 0, i;
+        unsigned head, tail;
+        /* every file has one operation in flight at a time */
+        while (next != loader->len && in_flight != ring->sq_entries) {
+            struct io_uring_sqe* sqe = next_sqe(ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t) loader->paths[next];
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = next;
+            files[next].fd = -1;
+            ++next;
+            ++in_flight;
+        }
+        if (enter_ring(ring, 1)) {
+            res = -1;
+            break;
+        }
+        head = *ring->cq_head;
+        tail = atomic_load_explicit((_Atomic unsigned*) ring->cq_tail,
+                                    memory_order_acquire);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            size_t index = (size_t) cqe->user_data;
+            --in_flight;
+            if (complete(ring, &files[index], index, cqe->res)) {
+                done[num_done++] = index;
+            } else {
+                ++in_flight;
+            }
+        }
+        atomic_store_explicit((_Atomic unsigned*) ring->cq_head, head,
+                              memory_order_release);
+        /* start the reads before working on what is done */
+        if (ring->queued && enter_ring(ring, 0)) {
+            res = -1;
+            loader->failed = 1;
+        }
+        for (i = 0; i != num_done; ++i) {
+            struct ring_file* file = &files[done[i]];
+            deliver(loader, done[i], file->text, file->len, file->error);
+            file->text = 0;
+            ++num_delivered;
+        }
+        if (res) {
+            break;
+        }
+    }
+    if (res) {
+        loader->failed = 1;
+        abandon_ring(ring, files, next, in_flight - ring->queued);
+    }
+    rpfree(files);
+    rpfree(done);
+}
+
+struct pread_loader {
+    struct loader* loader;
+    atomic_size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ring_file* files;
+    /* The files read so far, in the order they were. */
+    size_t* done;
+    size_t num_done;
+};
+
+static void
+read_whole(const char* path, struct ring_file* file) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st)) {
+        file->error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    file->size = (size_t) st.st_size;
+    file->text = rpmalloc(file->size + 1);
+    if (!file->text) {
+        file->error = ENOMEM;
+        close(fd);
+        return;
+    }
+    while (file->len != file->size) {
+        ssize_t got = pread(fd, file->text + file->len,
+                            file->size - file->len, (off_t) file->len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            file->error = errno;
+            rpfree(file->text);
+            file->text = 0;
+        }
+        if (got <= 0) {
+            break;
+        }
+        file->len += (size_t) got;
+    }
+    close(fd);
+}
+
+static void
+read_files(struct pread_loader* state) {
+    while (1) {
+        size_t index = atomic_fetch_add(&state->next, 1);
+        unsigned long long start = trace_begin();
+        if (index >= state->loader->len) {
+            break;
+        }
+        read_whole(state->loader->paths[index], &state->files[index]);
+        trace_end(start, "read", state->loader->paths[index], 0);
+        pthread_mutex_lock(&state->lock);
+        state->done[state->num_done++] = index;
+        pthread_cond_signal(&state->cond);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+static void*
+pread_worker(void* arg) {
+    rpmalloc_thread_initialize();
+    trace_thread_name("loader");
+    read_files(arg);
+    rpmalloc_thread_finalize();
+    return 0;
+}
+
+static int
+load_with_threads(struct loader* loader, size_t num_threads) {
+    struct pread_loader state;
+    pthread_t* threads;
+    size_t num_started = 0, i;
+    if (num_threads == 0) {
+        num_threads = default_num_threads();
+    }
+    if (num_threads > loader->len) {
+        num_threads = loader->len;
+    }
+    state.loader = loader;
+    atomic_init(&state.next, 0);
+    state.files = rpcalloc(loader->len, sizeof(struct ring_file));
+    state.done = rpmalloc(loader->len * sizeof(size_t));
+    state.num_done = 0;
+    threads = rpmalloc(num_threads * sizeof(pthread_t));
+    if (!state.files || !state.done || !threads) {
+        rpfree(state.files);
+        rpfree(state.done);
+        rpfree(threads);
+        return -1;
+    }
+    pthread_mutex_init(&state.lock, 0);
+    pthread_cond_init(&state.cond, 0);
+    for (; num_started != num_threads; ++num_started) {
+        if (pthread_create(&threads[num_started], 0, pread_worker,
+                           &state)) {
+            break;
+        }
+    }
+    if (num_started == 0) {
+        /* read everything here before passing it on, keeping the
+         * allocator of the calling thread */
+        read_files(&state);
+    }
+    for (i = 0; i != loader->len; ++i) {
+        size_t index;
+        pthread_mutex_lock(&state.lock);
+        while (state.num_done == i) {
+            pthread_cond_wait(&state.cond, &state.lock);
+        }
+        index = state.done[i];
+        pthread_mutex_unlock(&state.lock);
+        deliver(loader, index, state.files[index].text,
+                state.files[index].len, state.files[index].error);
+    }
+    for (i = 0; i != num_started; ++i) {
+        pthread_join(threads[i], 0);
+    }
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    rpfree(state.files);
+    rpfree(state.done);
+    rpfree(threads);
+    return 0;
+}
+
+int
+load_files(const char* const* paths, size_t len, size_t num_threads,
+           int flags, file_loaded loaded, void* data) {
+    struct loader loader;
+    struct ring ring;
+    loader.paths = paths;
+    loader.len = len;
+    loader.loaded = loaded;
+    loader.data = data;
+    loader.failed = 0;
+    if (len == 0) {
+        return 0;
+    }
+    if (!(flags & load_no_io_uring) && open_ring(&ring) == 0) {
+        load_with_ring(&loader, &ring);
+        close_ring(&ring);
+    } else if (load_with_threads(&loader, num_threads)) {
+        return -1;
+    }
+    return loader.failed ? -1 : 0;
+}
+
+#ifdef TEST_MODE
+#include <stdio.h>
+#include "../cutil/test.h"
+
+#define TEST_LOAD_FILES 4
+
+struct test_load {
+    const char* expected[TEST_LOAD_FILES];
+    int seen[TEST_LOAD_FILES];
+    int wrong;
+    /* Fail once this many files were passed on. */
+    size_t fail_after;
+    size_t num_loaded;
+};
+
+static int
+test_file_loaded(void* data, size_t index, char* text, size_t len,
+                 int error) {
+    struct test_load* test = data;
+    const char* expected = test->expected[index];
+    if (++test->seen[index] != 1 ||
+        (expected ? !text || len != strlen(expected) ||
+                        memcmp(text, expected, len) != 0
+                  : text || error != ENOENT)) {
+        test->wrong = 1;
+    }
+    rpfree(text);
+    return ++test->num_loaded == test->fail_after;
+}
+
+/* Every file is passed on once with its contents or why it can't be
+ * read, and whatever is left once the callback fails is freed. */
+static int
+check_load(const char* const* paths, const char* const* contents,
+           int flags, size_t num_threads) {
+    struct test_load test;
+    size_t i;
+    memset(&test, 0, sizeof(test));
+    memcpy(test.expected, contents, sizeof(test.expected));
+    if (load_files(paths, TEST_LOAD_FILES, num_threads, flags,
+                   test_file_loaded, &test) != 0 ||
+        test.wrong) {
+        return -1;
+    }
+    for (i = 0; i != TEST_LOAD_FILES; ++i) {
+        if (test.seen[i] != 1) {
+            return -1;
+        }
+    }
+    memset(&test, 0, sizeof(test));
+    memcpy(test.expected, contents, sizeof(test.expected));
+    test.fail_after = 1;
+    if (load_files(paths, TEST_LOAD_FILES, num_threads, flags,
+                   test_file_loaded, &test) != -1 ||
+        test.num_loaded != 1 || test.wrong) {
+        return -1;
+    }
+    return 0;
+}
+
+TEST(test_load_files) {
+    char root[] = "/tmp/shiv_load_XXXXXX";
+    char paths[TEST_LOAD_FILES][sizeof(root) + 8];
+    const char* path_list[TEST_LOAD_FILES];
+    const char* contents[TEST_LOAD_FILES] = {
+        "a := 1;\n", "", "b := fun () -> std::i64 {\n    return 2;\n}\n", 0,
+    };
+    size_t i;
+    memset(paths, 0, sizeof(paths));
+    ASSERT(mkdtemp(root), end);
+    for (i = 0; i != TEST_LOAD_FILES; ++i) {
+        FILE* file;
+        snprintf(paths[i], sizeof(paths[i]), "%s/%lu.shiv", root,
+                 (unsigned long) i);
+        path_list[i] = paths[i];
+        if (!contents[i]) {
+            /* missing */
+            continue;
+        }
+        file = fopen(paths[i], "w");
+        ASSERT(file, cleanup);
+        fputs(contents[i], file);
+        ASSERT(fclose(file) == 0, cleanup);
+    }
+    /* io_uring falls back to pread where the kernel lacks it */
+    ASSERT(check_load(path_list, contents, 0, 0) == 0, cleanup);
+    ASSERT(check_load(path_list, contents, load_no_io_uring, 1) == 0,
+           cleanup);
+    ASSERT(check_load(path_list, contents, load_no_io_uring, 3) == 0,
+           cleanup);
+cleanup:
+    for (i = 0; i != TEST_LOAD_FILES; ++i) {
+        remove(paths[i]);
+    }
+    rmdir(root);
+end:;
+}
+END_TEST
+
+void test_load(void) {
+    RUN(test_load_files);
+}
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef HEADER_GUARD_LOAD_H
+#define HEADER_GUARD_LOAD_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called with the contents of the file `index`, which are `len` bytes
+ * at `text` and have to be freed with rpfree, or with a null `text`
+ * and the errno value `error` if the file can't be read.  Returns
+ * nonzero to have the files not loaded yet freed instead of
+ * passed on. */
+typedef int (*file_loaded)(void* data, size_t index, char* text,
+                           size_t len, int error);
+
+enum load_flags {
+    /* Always read the files with pread on a pool of threads. */
+    load_no_io_uring = 1,
+};
+
+/* Read the `len` files `paths` and call `loaded` on the calling
+ * thread for each file as soon as it has been read, in the order the
+ * reads finish, so the caller can work on one file while the others
+ * are read.  The opens and reads are submitted to io_uring in
+ * batches, or if it isn't available the files are read with pread on
+ * up to `num_threads` threads (0 picks the number of processors).
+ * Returns -1 if `loaded` failed. */
+int load_files(const char* const* paths, size_t len, size_t num_threads,
+               int flags, file_loaded loaded, void* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,79 +1,19 @@
 #include "../cutil/rpmalloc.h"
 #include <stdio.h>
 
-#ifndef TEST_MODE
+#if !defined(TEST_MODE) && !defined(BENCH_MODE)
 
 #include <string.h>
-#include "../cutil/vec.h"
-#include "../cutil/str.h"
-#include "../cutil/stack_trace.h"
 #include "arguments.h"
+#include "compile.h"
 #include "diagnostics.h"
-#include "fiter.h"
-#include "lex.h"
-#include "parse.h"
-
-static void dump_tokens(vec_token *tokens) {
-    token* token;
-    for (token = tokens->tokens; token != tokens->tokens + tokens->len;
-         ++token) {
-        switch (token->type) {
-        case token_word:
-            print_warning_pos(&token->fpos, "%s",
-                              str_cbegin(&token->data.s));
-            break;
-        case token_fun:
-            print_warning_pos(&token->fpos, "fun");
-            break;
-        case token_struct:
-            print_warning_pos(&token->fpos, "struct");
-            break;
-        case token_return:
-            print_warning_pos(&token->fpos, "return");
-            break;
-        case token_namespace:
-            print_warning_pos(&token->fpos, "::");
-            break;
-        case token_colon:
-            print_warning_pos(&token->fpos, ":");
-            break;
-        case token_plus:
-            print_warning_pos(&token->fpos, "+");
-            break;
-        case token_minus:
-            print_warning_pos(&token->fpos, "-");
-            break;
-        case token_semicolon:
-            print_warning_pos(&token->fpos, ";");
-            break;
-        case token_open_curly:
-            print_warning_pos(&token->fpos, "{");
-            break;
-        case token_close_curly:
-            print_warning_pos(&token->fpos, "}");
-            break;
-        case token_open_paren:
-            print_warning_pos(&token->fpos, "(");
-            break;
-        case token_close_paren:
-            print_warning_pos(&token->fpos, ")");
-            break;
-        case token_comma:
-            print_warning_pos(&token->fpos, ",");
-            break;
-        case token_right_arrow:
-            print_warning_pos(&token->fpos, "->");
-            break;
-        case token_assign:
-            print_warning_pos(&token->fpos, "=");
-            break;
-        }
-    }
-}
+#include "server.h"
+#include "types.h"
+#include "watch.h"
 
 int main(int argc, char** argv) {
-    fiter fiter;
     arguments args;
+    int res;
     if (rpmalloc_initialize()) {
         return 1;
     }
@@ -81,63 +21,44 @@ int main(int argc, char** argv) {
     --argc;
     ++argv;
 
-    if (parse_arguments(&args, argc, argv)) {
-        rpmalloc_finalize();
-        return 1;
-    }
-
-    fiter.file = fopen(args.file, "r");
-    if (!fiter.file) {
-        print_error("Cannot open file: %s", args.file);
-        rpmalloc_finalize();
-        return 1;
-    }
-    memset(fiter.buffer, 0, sizeof(fiter.buffer));
-    fiter.index = 0;
-    fiter.fpos.fname = args.file;
-    fiter.fpos.line = 1;
-    fiter.fpos.column = 1;
-    {
-        size_t numread = fread(fiter.buffer, sizeof(char),
-                               sizeof(fiter.buffer), fiter.file);
-        if (numread < sizeof(fiter.buffer)) {
-            fiter.buffer[numread] = '\0';
+    if (argc >= 1 && strcmp(argv[0], "--server") == 0) {
+        if (argc != 2) {
+            print_error("Usage: shiv --server SOCKET");
+            res = 1;
+        } else {
+            res = run_server(argv[1]) ? 1 : 0;
         }
-    }
-
-    {
-        vec_var_decl toplevels = VEC_INIT;
-        vec_token tokens = VEC_INIT;
-        int res;
-
-        res = lex(&fiter, &tokens);
-        fclose(fiter.file);
-        if (args.dump_tokens) {
-            dump_tokens(&tokens);
+    } else if (argc >= 1 && strcmp(argv[0], "--connect") == 0) {
+        if (argc < 2) {
+            print_error("Usage: shiv --connect SOCKET [ARGUMENTS]");
+            res = 1;
+        } else {
+            res = run_client(argv[1], argc - 2, argv + 2);
         }
-        if (res) {
-            destroy_tokens(&tokens);
-            STACK_TRACE_PRINT();
-            return 1;
+    } else if (argc >= 1 && strcmp(argv[0], "--watch") == 0) {
+        if (argc < 2) {
+            print_error("Usage: shiv --watch DIRECTORY [ARGUMENTS]");
+            res = 1;
+        } else {
+            res = run_watch(argv[1], argc - 2, argv + 2) ? 1 : 0;
         }
-
-        res = parse(&tokens, &toplevels);
-        destroy_tokens(&tokens);
-        if (res) {
-            destroy_var_decls(&toplevels);
-            STACK_TRACE_PRINT();
-            return 1;
-        }
-
-        destroy_var_decls(&toplevels);
+    } else if (parse_arguments(&args, argc, argv)) {
+        res = 1;
+    } else {
+        res = compile(&args);
     }
 
+    flush_diagnostics();
+    release_types();
     rpmalloc_finalize();
 
-    return 0;
+    return res;
 }
 
-#else
+#elif defined(TEST_MODE)
+
+#include "diagnostics.h"
+#include "types.h"
 
 int failures = 0;
 int successes = 0;
@@ -152,10 +73,49 @@ int successes_assert = 0;
 int main(void) {
     rpmalloc_initialize();
     run(test_lex);
+    run(test_eval);
+    run(test_number);
+    run(test_inline);
+    run(test_vectorize);
+    run(test_types);
+    run(test_layout);
+    run(test_object);
+    run(test_codegen);
+    run(test_diagnostics);
+    run(test_library);
+    run(test_server);
+    run(test_watch);
+    run(test_load);
+    run(test_utf8);
+    run(test_pool);
+    run(test_trace);
+    run(test_counters);
+    run(test_compile);
+    run(test_module);
+    flush_diagnostics();
+    release_types();
     printf("%d of %d succeeded.\n", successes, failures + successes);
     printf("%d assertions succeeded.\n", successes_assert);
     rpmalloc_finalize();
     return failures;
 }
 
+#else
+
+#define run(bench)                                                   \
+    do {                                                             \
+        void bench();                                                \
+        printf("%s:\n", #bench);                                     \
+        bench();                                                     \
+    } while (0)
+
+int main(void) {
+    rpmalloc_initialize();
+    run(bench_number);
+    run(bench_object);
+    run(bench_codegen);
+    rpmalloc_finalize();
+    return 0;
+}
+
 #endif
@@ -0,0 +1,782 @@
+#include "module.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/str.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+#include "object.h"
+#include "parse.h"
+#include "pool.h"
+#include "symtab.h"
+
+/* An interface is a header followed by the declarations, then the
+ * parameters of all functions and finally the strings, each ending
+ * in a nul.  Strings are referred to by their offset and offset 0 is
+ * the empty string.  Every record is aligned to 8 bytes so the
+ * interface can be used where it is mapped. */
+
+static const char interface_magic[8] = {'S', 'H', 'I', 'V', 'I', 0, 0, 1};
+
+struct interface_header {
+    char magic[8];
+    /* A hash of everything after the header. */
+    uint64_t stamp;
+    uint32_t source;
+    uint32_t num_decls;
+    uint32_t num_params;
+    uint32_t strings_len;
+};
+
+enum interface_value {
+    interface_no_value,
+    /* `value` */
+    interface_literal,
+    /* 0 - `value`, how eval folds negative numbers */
+    interface_negated,
+};
+
+struct interface_decl {
+    uint32_t name;
+    /* The type of a variable or the return type of a function, 0 if
+     * it is inferred. */
+    uint32_t type;
+    int32_t line, column;
+    uint32_t first_param, num_params;
+    /* a defining_type_expression type */
+    uint8_t kind;
+    /* an interface_value */
+    uint8_t value_kind;
+    uint8_t padding[6];
+    uint64_t value;
+};
+
+struct interface_param {
+    uint32_t name;
+    uint32_t type;
+    int32_t line, column;
+    uint8_t value_kind;
+    uint8_t padding[7];
+    uint64_t value;
+};
+
+struct mapped_interface {
+    const char* path;
+    const unsigned char* data;
+    size_t len;
+    vec_var_decl decls;
+    /* Why the interface couldn't be loaded, null if it could. */
+    const char* error;
+};
+
+static uint64_t
+hash_bytes(const unsigned char* bytes, size_t len) {
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct interface_writer {
+    byte_buffer decls;
+    byte_buffer params;
+    byte_buffer strings;
+    /* offsets of the strings already added */
+    symtab offsets;
+};
+
+static uint32_t
+add_string(struct interface_writer* writer, const char* s, int* failed) {
+    size_t offset;
+    if (!*s) {
+        return 0;
+    }
+    offset = symtab_lookup(&writer->offsets, s);
+    if (offset != SYMTAB_NOT_FOUND) {
+        return (uint32_t) offset;
+    }
+    offset = writer->strings.len;
+    if (offset > UINT32_MAX ||
+        append_bytes(&writer->strings, s, strlen(s) + 1)) {
+        *failed = 1;
+        return 0;
+    }
+    symtab_insert(&writer->offsets, s, offset);
+    return (uint32_t) offset;
+}
+
+/* Find the value of a folded literal. */
+static int
+literal_value(const expression_pool* pool, expr_ref ref, uint8_t* kind,
+              uint64_t* value) {
+    const expression* expr;
+    if (ref == EXPR_NONE) {
+        *kind = interface_no_value;
+        *value = 0;
+        return 0;
+    }
+    expr = &pool->nodes[ref];
+    if (expr->type == expression_int) {
+        *kind = interface_literal;
+        *value = get_expression_int(pool, ref);
+        return 0;
+    }
+    if (expr->type == expression_minus &&
+        pool->nodes[expr->first].type == expression_int &&
+        get_expression_int(pool, expr->first) == 0 &&
+        pool->nodes[expr->second].type == expression_int) {
+        *kind = interface_negated;
+        *value = get_expression_int(pool, expr->second);
+        return 0;
+    }
+    return -1;
+}
+
+static int
+add_decl(struct interface_writer* writer, const var_decl* decl) {
+    struct interface_decl record;
+    int failed = 0;
+    memset(&record, 0, sizeof(record));
+    record.name = add_string(writer, str_cbegin(&decl->name), &failed);
+    record.line = decl->fpos.line;
+    record.column = decl->fpos.column;
+    record.kind = (uint8_t) decl->type.type;
+    switch (decl->type.type) {
+    case dtype_name:
+    case dtype_const_name:
+        record.type = add_string(writer, str_cbegin(&decl->type.data.name),
+                                 &failed);
+        break;
+    case dtype_const_inferred:
+        if (literal_value(&decl->exprs, decl->value, &record.value_kind,
+                          &record.value) ||
+            record.value_kind == interface_no_value) {
+            print_error_pos(&decl->fpos, "The value of %s hasn't been "
+                            "evaluated", str_cbegin(&decl->name));
+            return -1;
+        }
+        break;
+    case dtype_fun_def:
+        {
+            const fun_def* fun = &decl->type.data.fun_def;
+            size_t i;
+            record.type = add_string(
+                writer, str_cbegin(&fun->return_type.data.name), &failed);
+            record.first_param = (uint32_t) (writer->params.len /
+                                             sizeof(struct interface_param));
+            record.num_params = (uint32_t) fun->params.len;
+            for (i = 0; i != fun->params.len; ++i) {
+                const var_decl* param = &fun->params.vars[i];
+                struct interface_param param_record;
+                memset(&param_record, 0, sizeof(param_record));
+                param_record.name = add_string(
+                    writer, str_cbegin(&param->name), &failed);
+                param_record.type = add_string(
+                    writer, str_cbegin(&param->type.data.name), &failed);
+                param_record.line = param->fpos.line;
+                param_record.column = param->fpos.column;
+                if (literal_value(&decl->exprs, param->value,
+                                  &param_record.value_kind,
+                                  &param_record.value)) {
+                    print_error_pos(&param->fpos, "The default value of %s "
+                                    "hasn't been evaluated",
+                                    str_cbegin(&param->name));
+                    return -1;
+                }
+                if (append_bytes(&writer->params, &param_record,
+                                 sizeof(param_record))) {
+                    return -1;
+                }
+            }
+        }
+        break;
+    default:
+        /* the initial value of a variable isn't part of its
+         * interface */
+        break;
+    }
+    if (failed) {
+        return -1;
+    }
+    return append_bytes(&writer->decls, &record, sizeof(record));
+}
+
+/* Returns 1 if `path` already holds `len` bytes equal to `bytes`. */
+static int
+is_unchanged(const char* path, const unsigned char* bytes, size_t len) {
+    struct stat st;
+    void* data;
+    int same = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == len) {
+        data = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            same = memcmp(data, bytes, len) == 0;
+            munmap(data, len);
+        }
+    }
+    close(fd);
+    return same;
+}
+
+/* Replace `path` by renaming a new file over it so that importers
+ * mapping it never see it half written. */
+static int
+replace_file(const char* path, const unsigned char* bytes, size_t len) {
+    str temporary = STR_INIT;
+    FILE* file;
+    int ret = 0;
+    if (str_push_s(&temporary, path) || str_push_s(&temporary, ".tmp")) {
+        str_destroy(&temporary);
+        return -1;
+    }
+    file = fopen(str_cbegin(&temporary), "wb");
+    if (!file) {
+        print_error("Cannot open output file: %s", path);
+        str_destroy(&temporary);
+        return -1;
+    }
+    if (fwrite(bytes, 1, len, file) != len) {
+        ret = -1;
+    }
+    if (fclose(file)) {
+        ret = -1;
+    }
+    if (ret == 0 && rename(str_cbegin(&temporary), path)) {
+        ret = -1;
+    }
+    if (ret) {
+        print_error("Cannot write output file: %s", path);
+        remove(str_cbegin(&temporary));
+    }
+    str_destroy(&temporary);
+    return ret;
+}
+
+int
+write_interface(const vec_var_decl* toplevels, const char* source,
+                const char* path) {
+    struct interface_writer writer;
+    struct interface_header header;
+    byte_buffer out = BYTE_BUFFER_INIT;
+    size_t num_strings = 1;
+    size_t i;
+    int failed = 0;
+    int ret = -1;
+
+    for (i = 0; i != toplevels->len; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        num_strings += 2;
+        if (decl->type.type == dtype_fun_def) {
+            num_strings += 2 * decl->type.data.fun_def.params.len;
+        }
+    }
+    writer.decls = (byte_buffer) BYTE_BUFFER_INIT;
+    writer.params = (byte_buffer) BYTE_BUFFER_INIT;
+    writer.strings = (byte_buffer) BYTE_BUFFER_INIT;
+    if (symtab_init(&writer.offsets, num_strings)) {
+        return -1;
+    }
+    if (append_bytes(&writer.strings, "", 1)) {
+        goto cleanup;
+    }
+
+    memcpy(header.magic, interface_magic, sizeof(header.magic));
+    header.source = add_string(&writer, source, &failed);
+    header.num_decls = 0;
+    for (i = 0; i != toplevels->len && !failed; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        /* structures are only used within their file so far */
+        if (decl->imported || decl->type.type == dtype_pointer ||
+            decl->type.type == dtype_const_pointer ||
+            decl->type.type == dtype_struct_def) {
+            continue;
+        }
+        if (add_decl(&writer, decl)) {
+            failed = 1;
+        }
+        ++header.num_decls;
+    }
+    if (failed || writer.strings.len > UINT32_MAX) {
+        goto cleanup;
+    }
+    header.num_params = (uint32_t) (writer.params.len /
+                                    sizeof(struct interface_param));
+    header.strings_len = (uint32_t) writer.strings.len;
+
+    if (append_bytes(&out, &header, sizeof(header)) ||
+        append_bytes(&out, writer.decls.bytes, writer.decls.len) ||
+        append_bytes(&out, writer.params.bytes, writer.params.len) ||
+        append_bytes(&out, writer.strings.bytes, writer.strings.len)) {
+        goto cleanup;
+    }
+    header.stamp = hash_bytes(out.bytes + sizeof(header),
+                              out.len - sizeof(header));
+    memcpy(out.bytes, &header, sizeof(header));
+
+    ret = is_unchanged(path, out.bytes, out.len)
+              ? 0 : replace_file(path, out.bytes, out.len);
+
+cleanup:
+    destroy_byte_buffer(&out);
+    destroy_byte_buffer(&writer.decls);
+    destroy_byte_buffer(&writer.params);
+    destroy_byte_buffer(&writer.strings);
+    symtab_destroy(&writer.offsets);
+    return ret;
+}
+
+int
+read_interface_stamp(const char* path, unsigned long long* stamp) {
+    struct interface_header header;
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+    if (fd < 0) {
+        return -1;
+    }
+    n = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+    if (n != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, interface_magic, sizeof(header.magic)) != 0) {
+        return -1;
+    }
+    *stamp = header.stamp;
+    return 0;
+}
+
+static int
+add_literal(expression_pool* pool, uint8_t kind, uint64_t value,
+            expr_ref* ref) {
+    if (kind == interface_no_value) {
+        *ref = EXPR_NONE;
+        return 0;
+    }
+    *ref = add_int_expression(pool, value);
+    if (*ref != EXPR_NONE && kind == interface_negated) {
+        expr_ref zero = add_int_expression(pool, 0);
+        *ref = zero == EXPR_NONE
+                   ? EXPR_NONE
+                   : add_binary_expression(pool, expression_minus, zero,
+                                           *ref);
+    }
+    return *ref == EXPR_NONE ? -1 : 0;
+}
+
+static int
+load_params(const struct mapped_interface* mapped,
+            const struct interface_decl* record, var_decl* decl) {
+    const struct interface_header* header =
+        (const struct interface_header*) mapped->data;
+    const struct interface_param* records =
+        (const struct interface_param*) (
+            mapped->data + sizeof(*header) +
+            header->num_decls * sizeof(struct interface_decl));
+    const char* strings = (const char*) (records + header->num_params);
+    fun_def* fun = &decl->type.data.fun_def;
+    uint32_t i;
+    for (i = 0; i != record->num_params; ++i) {
+        const struct interface_param* param_record =
+            &records[record->first_param + i];
+        var_decl param;
+        param.name = (str) STR_INIT;
+        param.fpos.fname = decl->fpos.fname;
+        param.fpos.line = param_record->line;
+        param.fpos.column = param_record->column;
+        param.type.type = dtype_name;
+        param.type.data.name = (str) STR_INIT;
+        param.exprs = (expression_pool) EXPRESSION_POOL_INIT;
+        param.imported = 0;
+        if (add_literal(&decl->exprs, param_record->value_kind,
+                        param_record->value, &param.value) ||
+            vec_push(&fun->params, sizeof(param), &param)) {
+            return -1;
+        }
+        /* filled in place so destroying the declaration frees it */
+        if (str_push_s(&fun->params.vars[i].name,
+                       strings + param_record->name) ||
+            str_push_s(&fun->params.vars[i].type.data.name,
+                       strings + param_record->type)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Append the declaration `record` to the interface's
+ * declarations. */
+static int
+load_decl(struct mapped_interface* mapped,
+          const struct interface_decl* record) {
+    const struct interface_header* header =
+        (const struct interface_header*) mapped->data;
+    const char* strings = (const char*) mapped->data + mapped->len -
+                          header->strings_len;
+    var_decl skeleton;
+    var_decl* decl;
+    skeleton.name = (str) STR_INIT;
+    skeleton.fpos.fname = strings + header->source;
+    skeleton.fpos.line = record->line;
+    skeleton.fpos.column = record->column;
+    skeleton.type.type = dtype_inferred;
+    skeleton.value = EXPR_NONE;
+    skeleton.exprs = (expression_pool) EXPRESSION_POOL_INIT;
+    skeleton.imported = 1;
+    if (vec_push(&mapped->decls, sizeof(skeleton), &skeleton)) {
+        return -1;
+    }
+    decl = &mapped->decls.vars[mapped->decls.len - 1];
+    if (str_push_s(&decl->name, strings + record->name)) {
+        return -1;
+    }
+    switch (record->kind) {
+    case dtype_name:
+    case dtype_const_name:
+        decl->type.data.name = (str) STR_INIT;
+        decl->type.type = record->kind;
+        if (str_push_s(&decl->type.data.name, strings + record->type)) {
+            return -1;
+        }
+        break;
+    case dtype_fun_def:
+        {
+            fun_def* fun = &decl->type.data.fun_def;
+            fun->name = (str) STR_INIT;
+            fun->params = (vec_var_decl) VEC_INIT;
+            fun->return_type.type = type_name;
+            fun->return_type.data.name = (str) STR_INIT;
+            fun->stmts = (statements) VEC_INIT;
+            fun->body_begin = 0;
+            fun->body_end = 0;
+            /* there is no body to parse */
+            fun->body_parsed = 1;
+            decl->type.type = dtype_fun_def;
+            if (str_copy_str(&fun->name, &decl->name) ||
+                str_push_s(&fun->return_type.data.name,
+                           strings + record->type) ||
+                load_params(mapped, record, decl)) {
+                return -1;
+            }
+        }
+        break;
+    default:
+        decl->type.type = record->kind;
+        break;
+    }
+    return add_literal(&decl->exprs, record->value_kind, record->value,
+                       &decl->value);
+}
+
+static int
+is_valid_string(const struct interface_header* header, uint32_t offset) {
+    return offset < header->strings_len;
+}
+
+static int
+is_valid_value(uint8_t kind) {
+    return kind == interface_no_value || kind == interface_literal ||
+           kind == interface_negated;
+}
+
+/* Check everything load_decl relies on. */
+static const char*
+validate_interface(const unsigned char* data, size_t len) {
+    const struct interface_header* header =
+        (const struct interface_header*) data;
+    const struct interface_decl* decls;
+    const struct interface_param* params;
+    const char* strings;
+    uint64_t size;
+    uint32_t i;
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, interface_magic, sizeof(header->magic)) != 0) {
+        return "Not a shiv interface";
+    }
+    size = sizeof(*header) +
+           (uint64_t) header->num_decls * sizeof(struct interface_decl) +
+           (uint64_t) header->num_params * sizeof(struct interface_param) +
+           header->strings_len;
+    if (size != len || header->strings_len == 0 ||
+        hash_bytes(data + sizeof(*header), len - sizeof(*header)) !=
+            header->stamp) {
+        return "Corrupt interface";
+    }
+    decls = (const struct interface_decl*) (header + 1);
+    params = (const struct interface_param*) (decls + header->num_decls);
+    strings = (const char*) (params + header->num_params);
+    if (strings[header->strings_len - 1] != 0 ||
+        !is_valid_string(header, header->source)) {
+        return "Corrupt interface";
+    }
+    for (i = 0; i != header->num_decls; ++i) {
+        const struct interface_decl* decl = &decls[i];
+        int kind_ok;
+        switch (decl->kind) {
+        case dtype_inferred:
+        case dtype_const_inferred:
+        case dtype_name:
+        case dtype_const_name:
+        case dtype_fun_def:
+            kind_ok = 1;
+            break;
+        default:
+            kind_ok = 0;
+            break;
+        }
+        if (!kind_ok || !is_valid_string(header, decl->name) ||
+            !strings[decl->name] || !is_valid_string(header, decl->type) ||
+            !is_valid_value(decl->value_kind) ||
+            (uint64_t) decl->first_param + decl->num_params >
+                header->num_params) {
+            return "Corrupt interface";
+        }
+    }
+    for (i = 0; i != header->num_params; ++i) {
+        if (!is_valid_string(header, params[i].name) ||
+            !is_valid_string(header, params[i].type) ||
+            !is_valid_value(params[i].value_kind)) {
+            return "Corrupt interface";
+        }
+    }
+    return 0;
+}
+
+static void
+load_interface(void* data, size_t task) {
+    struct mapped_interface* mapped =
+        &((struct mapped_interface*) data)[task];
+    const struct interface_header* header;
+    const struct interface_decl* decls;
+    struct stat st;
+    void* map;
+    uint32_t i;
+    int fd = open(mapped->path, O_RDONLY);
+    if (fd < 0) {
+        mapped->error = "Cannot open interface";
+        return;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        mapped->error = "Cannot read interface";
+        return;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        mapped->error = "Not a shiv interface";
+        return;
+    }
+    map = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        mapped->error = "Cannot read interface";
+        return;
+    }
+    mapped->data = map;
+    mapped->len = (size_t) st.st_size;
+    mapped->error = validate_interface(mapped->data, mapped->len);
+    if (mapped->error) {
+        return;
+    }
+    header = (const struct interface_header*) mapped->data;
+    decls = (const struct interface_decl*) (header + 1);
+    for (i = 0; i != header->num_decls; ++i) {
+        if (load_decl(mapped, &decls[i])) {
+            mapped->error = "Out of memory while loading interface";
+            return;
+        }
+    }
+}
+
+/* Move the declarations of every interface into `toplevels`. */
+static int
+add_imported(module_interfaces* interfaces, vec_var_decl* toplevels) {
+    size_t total = toplevels->len;
+    size_t i, j;
+    symtab names;
+    int ret = 0;
+    for (i = 0; i != interfaces->len; ++i) {
+        total += interfaces->interfaces[i].decls.len;
+    }
+    /* the names in the table must not move */
+    if (total > toplevels->cap) {
+        var_decl* grown = rprealloc(toplevels->vars,
+                                    total * sizeof(var_decl));
+        if (!grown) {
+            return -1;
+        }
+        toplevels->vars = grown;
+        toplevels->cap = total;
+    }
+    if (symtab_init(&names, total)) {
+        return -1;
+    }
+    for (i = 0; i != toplevels->len; ++i) {
+        symtab_insert(&names, str_cbegin(&toplevels->vars[i].name), i);
+    }
+    for (i = 0; i != interfaces->len; ++i) {
+        vec_var_decl* decls = &interfaces->interfaces[i].decls;
+        for (j = 0; j != decls->len; ++j) {
+            var_decl* decl = &decls->vars[j];
+            size_t other = symtab_lookup(&names, str_cbegin(&decl->name));
+            if (other != SYMTAB_NOT_FOUND) {
+                print_error_pos(&decl->fpos, "%s is also declared in %s",
+                                str_cbegin(&decl->name),
+                                toplevels->vars[other].fpos.fname);
+                ret = -1;
+                continue;
+            }
+            toplevels->vars[toplevels->len] = *decl;
+            /* owned by `toplevels` now */
+            decl->name = (str) STR_INIT;
+            decl->type.type = dtype_inferred;
+            decl->exprs = (expression_pool) EXPRESSION_POOL_INIT;
+            symtab_insert(&names,
+                          str_cbegin(&toplevels->vars[toplevels->len].name),
+                          toplevels->len);
+            ++toplevels->len;
+        }
+        destroy_var_decls(decls);
+        *decls = (vec_var_decl) VEC_INIT;
+    }
+    symtab_destroy(&names);
+    return ret;
+}
+
+int
+load_interfaces(const char* const* paths, size_t len, size_t num_threads,
+                module_interfaces* interfaces, vec_var_decl* toplevels) {
+    size_t i;
+    int ret = 0;
+    interfaces->len = 0;
+    interfaces->interfaces = 0;
+    if (!len) {
+        return 0;
+    }
+    interfaces->interfaces = rpmalloc(len * sizeof(struct mapped_interface));
+    if (!interfaces->interfaces) {
+        return -1;
+    }
+    interfaces->len = len;
+    for (i = 0; i != len; ++i) {
+        struct mapped_interface* mapped = &interfaces->interfaces[i];
+        mapped->path = paths[i];
+        mapped->data = 0;
+        mapped->len = 0;
+        mapped->decls = (vec_var_decl) VEC_INIT;
+        mapped->error = 0;
+    }
+    run_independent(load_interface, interfaces->interfaces, len,
+                    num_threads);
+    for (i = 0; i != len; ++i) {
+        const struct mapped_interface* mapped = &interfaces->interfaces[i];
+        if (mapped->error) {
+            print_error("%s: %s", mapped->error, mapped->path);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = add_imported(interfaces, toplevels);
+    }
+    return ret;
+}
+
+void
+unload_interfaces(module_interfaces* interfaces) {
+    size_t i;
+    for (i = 0; i != interfaces->len; ++i) {
+        struct mapped_interface* mapped = &interfaces->interfaces[i];
+        destroy_var_decls(&mapped->decls);
+        if (mapped->data) {
+            munmap((void*) mapped->data, mapped->len);
+        }
+    }
+    rpfree(interfaces->interfaces);
+    interfaces->interfaces = 0;
+    interfaces->len = 0;
+}
+
+#ifdef TEST_MODE
+#include <stdlib.h>
+#include "../cutil/test.h"
+#include "eval.h"
+#include "fiter.h"
+#include "lex.h"
+
+static const char* test_module_file[] =
+    {"m::low : const = 1 - 4;",
+     "m::count : std::u8 = 7;",
+     "m::add := fun (a : std::i32, b : std::i32 = m::low) -> std::i32 {",
+     "return a + b; }", 0};
+TEST(test_interface_round_trip) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_var_decl imported = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    module_interfaces interfaces = {0, 0};
+    char path[] = "/tmp/shiv_interface_XXXXXX";
+    const char* paths[1];
+    const fun_def* fun;
+    struct stat before, after;
+    unsigned long long stamp;
+    fiter iter;
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0, cleanup);
+    close(fd);
+    paths[0] = path;
+    fiter_init(&iter, (FILE*) test_module_file, "m.shiv");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    ASSERT(eval_constants(&toplevels, EVAL_DEFAULT_STEP_BUDGET) == 0,
+           cleanup);
+    ASSERT(write_interface(&toplevels, "m.shiv", path) == 0, cleanup);
+    ASSERT(read_interface_stamp(path, &stamp) == 0, cleanup);
+
+    /* writing the same interface again leaves the file alone */
+    ASSERT(stat(path, &before) == 0, cleanup);
+    ASSERT(write_interface(&toplevels, "m.shiv", path) == 0, cleanup);
+    ASSERT(stat(path, &after) == 0, cleanup);
+    ASSERT(before.st_ino == after.st_ino, cleanup);
+
+    ASSERT(load_interfaces(paths, 1, 1, &interfaces, &imported) == 0,
+           cleanup);
+    ASSERT(imported.len == 3, cleanup);
+    ASSERT(imported.vars[0].imported, cleanup);
+    ASSERT(strcmp(imported.vars[0].fpos.fname, "m.shiv") == 0, cleanup);
+    ASSERT(imported.vars[0].type.type == dtype_const_inferred, cleanup);
+    ASSERT(imported.vars[0].exprs.nodes[imported.vars[0].value].type ==
+               expression_minus, cleanup);
+    ASSERT(strcmp(str_cbegin(&imported.vars[1].type.data.name),
+                  "std::u8") == 0, cleanup);
+    ASSERT(imported.vars[1].value == EXPR_NONE, cleanup);
+    fun = &imported.vars[2].type.data.fun_def;
+    ASSERT(imported.vars[2].type.type == dtype_fun_def, cleanup);
+    ASSERT(strcmp(str_cbegin(&imported.vars[2].name), "m::add") == 0,
+           cleanup);
+    ASSERT(fun->params.len == 2 && fun->body_parsed, cleanup);
+    ASSERT(strcmp(str_cbegin(&fun->params.vars[1].type.data.name),
+                  "std::i32") == 0, cleanup);
+    ASSERT(imported.vars[2].exprs.nodes[fun->params.vars[1].value].type ==
+               expression_minus, cleanup);
+cleanup:
+    destroy_var_decls(&imported);
+    unload_interfaces(&interfaces);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    remove(path);
+}
+END_TEST
+
+void test_module(void) {
+    RUN(test_interface_round_trip);
+}
+#endif
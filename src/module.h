@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef HEADER_GUARD_MODULE_H
+#define HEADER_GUARD_MODULE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interfaces are named after the source file with this extension in
+ * place of .shiv. */
+#define INTERFACE_EXTENSION ".shivi"
+/* The most interfaces one compilation can import. */
+#define MAX_IMPORTS 64
+
+struct vec_var_decl;
+
+/* Write the signatures and types of the declarations in `toplevels`
+ * defined by `source` to the interface file `path`.  Bodies and the
+ * initial values of variables are left out, so the interface only
+ * changes when something an importer can see does.  If `path`
+ * already holds the same interface it isn't touched, so whatever
+ * depends on it by modification time isn't rebuilt. */
+int write_interface(const struct vec_var_decl* toplevels,
+                    const char* source, const char* path);
+
+/* Read the stamp identifying the contents of the interface `path`
+ * without loading it. */
+int read_interface_stamp(const char* path, unsigned long long* stamp);
+
+struct mapped_interface;
+/* Interfaces mapped into memory.  The declarations loaded from them
+ * point at their file names, so they have to stay mapped until those
+ * are destroyed. */
+struct module_interfaces {
+    struct mapped_interface* interfaces;
+    size_t len;
+};
+typedef struct module_interfaces module_interfaces;
+
+/* Map the `len` interfaces `paths` on up to `num_threads` threads and
+ * append the declarations in them to `toplevels`, marked as imported,
+ * in the order of `paths`.  Names declared twice are errors. */
+int load_interfaces(const char* const* paths, size_t len,
+                    size_t num_threads, module_interfaces* interfaces,
+                    struct vec_var_decl* toplevels);
+void unload_interfaces(module_interfaces*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
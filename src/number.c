@@ -0,0 +1,397 @@
+#include "number.h"
+#include <assert.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* strtod reads the decimal separator from the locale, so the slow path
+ * of parse_float switches the calling thread to this one. */
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+static locale_t c_locale;
+
+static void
+create_c_locale(void) {
+    c_locale = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+}
+
+static double
+strtod_c(const char* text) {
+    locale_t previous;
+    double value;
+    pthread_once(&c_locale_once, create_c_locale);
+    if (!c_locale) {
+        return strtod(text, 0);
+    }
+    previous = uselocale(c_locale);
+    value = strtod(text, 0);
+    uselocale(previous);
+    return value;
+}
+
+static int
+is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static unsigned
+digit_value(char c) {
+    if (is_digit(c)) {
+        return (unsigned) (c - '0');
+    }
+    if (c >= 'a' && c <= 'f') {
+        return (unsigned) (c - 'a' + 10);
+    }
+    assert(c >= 'A' && c <= 'F');
+    return (unsigned) (c - 'A' + 10);
+}
+
+/* Convert 8 ASCII digits at once by combining pairs of digits, then
+ * pairs of pairs, then pairs of those. */
+static unsigned long long
+eight_digits(const char* digits) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    unsigned long long word;
+    memcpy(&word, digits, sizeof(word));
+    word = ((word & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    word = ((word & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((word & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+#else
+    unsigned long long value = 0;
+    size_t i;
+    for (i = 0; i != 8; ++i) {
+        value = value * 10 + (unsigned) (digits[i] - '0');
+    }
+    return value;
+#endif
+}
+
+/* `*value = *value * 10^len + digits` */
+static int
+accumulate_decimal(const char* digits, size_t len,
+                   unsigned long long* value) {
+    unsigned long long v = *value;
+    size_t i = 0;
+    for (; len - i >= 8; i += 8) {
+        if (__builtin_mul_overflow(v, 100000000ULL, &v) ||
+            __builtin_add_overflow(v, eight_digits(digits + i), &v)) {
+            return -1;
+        }
+    }
+    for (; i != len; ++i) {
+        if (__builtin_mul_overflow(v, 10ULL, &v) ||
+            __builtin_add_overflow(v, (unsigned) (digits[i] - '0'), &v)) {
+            return -1;
+        }
+    }
+    *value = v;
+    return 0;
+}
+
+int
+parse_integer(const char* digits, size_t len, unsigned base,
+              unsigned long long* value) {
+    unsigned shift = base == 16 ? 4 : 1;
+    unsigned long long v = 0;
+    size_t i;
+    assert(base == 2 || base == 10 || base == 16);
+    if (base == 10) {
+        *value = 0;
+        return accumulate_decimal(digits, len, value);
+    }
+    for (i = 0; i != len; ++i) {
+        if (v >> (64 - shift)) {
+            return -1;
+        }
+        v = (v << shift) | digit_value(digits[i]);
+    }
+    *value = v;
+    return 0;
+}
+
+/* Every power of ten up to 1e22 is exactly representable. */
+static const double exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+int
+parse_float(const char* text, size_t len, double* value) {
+    const char* integer;
+    const char* fraction = 0;
+    size_t integer_len = 0;
+    size_t fraction_len = 0;
+    long exponent = 0;
+    unsigned long long mantissa = 0;
+    size_t i = 0;
+
+    while (i != len && text[i] == '0') {
+        ++i;
+    }
+    integer = text + i;
+    while (i != len && is_digit(text[i])) {
+        ++i;
+        ++integer_len;
+    }
+    if (i != len && text[i] == '.') {
+        fraction = text + ++i;
+        while (i != len && is_digit(text[i])) {
+            ++i;
+            ++fraction_len;
+        }
+    }
+    if (i != len && (text[i] == 'e' || text[i] == 'E')) {
+        int negative = 0;
+        ++i;
+        if (text[i] == '+' || text[i] == '-') {
+            negative = text[i] == '-';
+            ++i;
+        }
+        for (; i != len; ++i) {
+            /* anything this big is zero or infinity anyway */
+            if (exponent < 100000) {
+                exponent = exponent * 10 + (text[i] - '0');
+            }
+        }
+        if (negative) {
+            exponent = -exponent;
+        }
+    }
+    if (integer_len == 0) {
+        /* leading zeros of the fraction aren't significant */
+        while (fraction_len && *fraction == '0') {
+            ++fraction;
+            --fraction_len;
+            --exponent;
+        }
+    }
+
+    /* Clinger's fast path: if the digits and the power of ten are
+     * both exact doubles, a single rounding gives the right answer.
+     * 19 digits always fit in 64 bits. */
+    if (integer_len + fraction_len <= 19) {
+        long e10 = exponent - (long) fraction_len;
+        accumulate_decimal(integer, integer_len, &mantissa);
+        accumulate_decimal(fraction, fraction_len, &mantissa);
+        if (mantissa == 0) {
+            *value = 0;
+            return 0;
+        }
+        if (mantissa <= (1ULL << 53) && e10 >= -22 && e10 <= 22) {
+            double m = (double) mantissa;
+            *value = e10 < 0 ? m / exact_powers_of_ten[-e10]
+                             : m * exact_powers_of_ten[e10];
+            return 0;
+        }
+    }
+
+    /* strtod is correctly rounded but much slower. */
+    *value = strtod_c(text);
+    return isinf(*value) ? -1 : 0;
+}
+
+#ifdef TEST_MODE
+#include <stdio.h>
+#include "../cutil/test.h"
+
+TEST(test_parse_integer) {
+    unsigned long long value;
+    ASSERT(parse_integer("18446744073709551615", 20, 10, &value) == 0,
+           end);
+    ASSERT(value == 18446744073709551615ULL, end);
+    ASSERT(parse_integer("18446744073709551616", 20, 10, &value) != 0,
+           end);
+    ASSERT(parse_integer("000000000000000000000042", 24, 10, &value) == 0,
+           end);
+    ASSERT(value == 42, end);
+    ASSERT(parse_integer("FFffFFffFFffFFff", 16, 16, &value) == 0, end);
+    ASSERT(value == ~0ULL, end);
+    ASSERT(parse_integer("10000000000000000", 17, 16, &value) != 0, end);
+    ASSERT(parse_integer("101", 3, 2, &value) == 0, end);
+    ASSERT(value == 5, end);
+end:;
+}
+END_TEST
+
+/* Both sides of the fast path must agree with strtod. */
+static const char* const test_parse_float_inputs[] = {
+    "0.0", "1.5", "3.141592653589793", "1e22", "1e23", "0.1",
+    "123456789012345678901234567890", "9007199254740993",
+    "2.2250738585072011e-308", "4.9e-324", "1.7976931348623157e308",
+    "0.000000000000000000000000000000000000001", "7e-10", "1E+2",
+};
+TEST(test_parse_float) {
+    size_t i;
+    double value;
+    for (i = 0; i != sizeof(test_parse_float_inputs) /
+                    sizeof(*test_parse_float_inputs); ++i) {
+        const char* input = test_parse_float_inputs[i];
+        ASSERT(parse_float(input, strlen(input), &value) == 0, end);
+        ASSERT(value == strtod(input, 0), end);
+    }
+    ASSERT(parse_float("1e309", 5, &value) != 0, end);
+end:;
+}
+END_TEST
+
+/* A locale that writes 1,5 must not change how 1.5e300 is read. */
+TEST(test_parse_float_locale) {
+    static const char* const comma_locales[] = {
+        "de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR.utf8",
+    };
+    size_t i;
+    double value;
+    for (i = 0; i != sizeof(comma_locales) / sizeof(*comma_locales); ++i) {
+        if (setlocale(LC_NUMERIC, comma_locales[i])) {
+            break;
+        }
+    }
+    if (i == sizeof(comma_locales) / sizeof(*comma_locales)) {
+        goto end;
+    }
+    ASSERT(parse_float("1.5e300", 7, &value) == 0, restore);
+    ASSERT(value == 1.5e300, restore);
+restore:
+    setlocale(LC_NUMERIC, "C");
+end:;
+}
+END_TEST
+
+void test_number(void) {
+    RUN(test_parse_integer);
+    RUN(test_parse_float);
+    RUN(test_parse_float_locale);
+}
+#endif
+
+#ifdef BENCH_MODE
+#include <stdio.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/str.h"
+#include "../cutil/vec.h"
+#include "fiter.h"
+#include "lex.h"
+#include "pool.h"
+
+#define BENCH_LITERALS 500000
+#define BENCH_LITERAL_SIZE 32
+
+static unsigned long long
+bench_random(unsigned long long* state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 11;
+}
+
+static unsigned long long
+naive_decimal(const char* digits, size_t len) {
+    unsigned long long value = 0;
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        value = value * 10 + (unsigned) (digits[i] - '0');
+    }
+    return value;
+}
+
+static void
+bench_print(const char* what, unsigned long long nanoseconds,
+            size_t count) {
+    printf("%-32s %8.1f ms %8.1f ns each\n", what, nanoseconds / 1e6,
+           (double) nanoseconds / (double) count);
+}
+
+/* Convert a table of large integers and floats on their own and then
+ * lex a source file made of them. */
+void bench_number(void) {
+    char (*ints)[BENCH_LITERAL_SIZE] =
+        rpmalloc(BENCH_LITERALS * BENCH_LITERAL_SIZE);
+    char (*floats)[BENCH_LITERAL_SIZE] =
+        rpmalloc(BENCH_LITERALS * BENCH_LITERAL_SIZE);
+    unsigned long long state = 1;
+    unsigned long long sum = 0;
+    double fsum = 0;
+    unsigned long long start;
+    size_t mismatches = 0;
+    size_t i;
+    str source = STR_INIT;
+    vec_token tokens = VEC_INIT;
+    fiter iter;
+    FILE* file;
+
+    if (!ints || !floats) {
+        goto cleanup;
+    }
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        sprintf(ints[i], "%llu", bench_random(&state));
+        sprintf(floats[i], "%.*g", (int) (bench_random(&state) % 17) + 1,
+                (double) bench_random(&state) /
+                    (double) (bench_random(&state) % 1000000 + 1));
+    }
+
+    start = now_nanoseconds();
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        sum += naive_decimal(ints[i], strlen(ints[i]));
+    }
+    bench_print("integers, one digit at a time", now_nanoseconds() - start,
+                BENCH_LITERALS);
+    start = now_nanoseconds();
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        unsigned long long value;
+        parse_integer(ints[i], strlen(ints[i]), 10, &value);
+        sum -= value;
+    }
+    bench_print("integers, parse_integer", now_nanoseconds() - start,
+                BENCH_LITERALS);
+
+    start = now_nanoseconds();
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        fsum += strtod(floats[i], 0);
+    }
+    bench_print("floats, strtod", now_nanoseconds() - start,
+                BENCH_LITERALS);
+    start = now_nanoseconds();
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        double value;
+        parse_float(floats[i], strlen(floats[i]), &value);
+        fsum -= value;
+    }
+    bench_print("floats, parse_float", now_nanoseconds() - start,
+                BENCH_LITERALS);
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        double value;
+        parse_float(floats[i], strlen(floats[i]), &value);
+        if (value != strtod(floats[i], 0)) {
+            ++mismatches;
+        }
+    }
+    printf("%llu %g %lu floats rounded differently from strtod\n", sum,
+           fsum, (unsigned long) mismatches);
+
+    for (i = 0; i != BENCH_LITERALS; ++i) {
+        char line[2 * BENCH_LITERAL_SIZE + 64];
+        sprintf(line, "i%lu : const = %s;\nf%lu : std::f64 = %s;\n",
+                (unsigned long) i, ints[i], (unsigned long) i, floats[i]);
+        if (str_push_s(&source, line)) {
+            goto cleanup;
+        }
+    }
+    file = fmemopen((void*) str_cbegin(&source), strlen(str_cbegin(&source)),
+                    "r");
+    if (!file) {
+        goto cleanup;
+    }
+    fiter_init(&iter, file, "bench");
+    start = now_nanoseconds();
+    lex(&iter, &tokens);
+    bench_print("lexing the literal table", now_nanoseconds() - start,
+                2 * BENCH_LITERALS);
+    fclose(file);
+    destroy_tokens(&tokens);
+
+cleanup:
+    str_destroy(&source);
+    rpfree(ints);
+    rpfree(floats);
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#ifndef HEADER_GUARD_NUMBER_H
+#define HEADER_GUARD_NUMBER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Convert the `len` digits at `digits` in `base` (2, 10 or 16).
+ * Decimal digits are converted 8 at a time.  Returns -1 if the value
+ * doesn't fit. */
+int parse_integer(const char* digits, size_t len, unsigned base,
+                  unsigned long long* value);
+
+/* Convert a decimal floating point literal: digits, optionally
+ * followed by a fraction and an exponent.  `text` must be null
+ * terminated.  The result is correctly rounded.  Returns -1 if it is
+ * too large to be represented. */
+int parse_float(const char* text, size_t len, double* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,497 @@
+#include "object.h"
+#include <assert.h>
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+
+int
+append_bytes(byte_buffer* buffer, const void* bytes, size_t len) {
+    if (!len) {
+        return 0;
+    }
+    if (buffer->cap - buffer->len < len) {
+        size_t cap = buffer->cap ? buffer->cap : 256;
+        unsigned char* grown;
+        while (cap - buffer->len < len) {
+            cap *= 2;
+        }
+        grown = rprealloc(buffer->bytes, cap);
+        if (!grown) {
+            return -1;
+        }
+        buffer->bytes = grown;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->bytes + buffer->len, bytes, len);
+    buffer->len += len;
+    return 0;
+}
+
+void
+destroy_byte_buffer(byte_buffer* buffer) {
+    rpfree(buffer->bytes);
+}
+
+void
+init_object_file(object_file* object, const char* source_name) {
+    object->source_name = source_name;
+    object->text = (byte_buffer) BYTE_BUFFER_INIT;
+    object->data = (byte_buffer) BYTE_BUFFER_INIT;
+    object->symbols.symbols = 0;
+    object->symbols.len = 0;
+    object->symbols.cap = 0;
+    object->relocations.relocations = 0;
+    object->relocations.len = 0;
+    object->relocations.cap = 0;
+}
+
+void
+destroy_object_file(object_file* object) {
+    size_t i;
+    for (i = 0; i != object->symbols.len; ++i) {
+        str_destroy(&object->symbols.symbols[i].name);
+    }
+    rpfree(object->symbols.symbols);
+    rpfree(object->relocations.relocations);
+    destroy_byte_buffer(&object->text);
+    destroy_byte_buffer(&object->data);
+}
+
+int
+mangle_name(str* out, const char* name) {
+    const char* part;
+    if (!strstr(name, "::")) {
+        return str_push_s(out, name);
+    }
+    if (str_push_s(out, "_ZN")) {
+        return -1;
+    }
+    for (part = name; part;) {
+        const char* end = strstr(part, "::");
+        size_t len = end ? (size_t) (end - part) : strlen(part);
+        char length[24];
+        sprintf(length, "%lu", (unsigned long) len);
+        if (str_push_s(out, length)) {
+            return -1;
+        }
+        for (; len; --len) {
+            if (str_push(out, *part++)) {
+                return -1;
+            }
+        }
+        part = end ? end + 2 : 0;
+    }
+    return str_push(out, 'E');
+}
+
+long
+add_object_symbol(object_file* object, const char* name,
+                  object_section section, int is_function, uint64_t value,
+                  uint64_t size) {
+    object_symbol symbol;
+    symbol.name = (str) STR_INIT;
+    symbol.section = section;
+    symbol.is_function = is_function;
+    symbol.value = value;
+    symbol.size = size;
+    if (mangle_name(&symbol.name, name) ||
+        vec_push(&object->symbols, sizeof(symbol), &symbol)) {
+        str_destroy(&symbol.name);
+        return -1;
+    }
+    return (long) object->symbols.len - 1;
+}
+
+int
+add_object_relocation(object_file* object, uint64_t offset,
+                      uint32_t symbol, uint32_t type, int64_t addend) {
+    object_relocation relocation;
+    relocation.offset = offset;
+    relocation.symbol = symbol;
+    relocation.type = type;
+    relocation.addend = addend;
+    return vec_push(&object->relocations, sizeof(relocation), &relocation);
+}
+
+enum {
+    section_null,
+    section_text,
+    section_data,
+    section_symtab,
+    section_strtab,
+    section_rela_text,
+    section_note_gnu_stack,
+    section_shstrtab,
+    num_sections,
+};
+
+static const char* const section_names[num_sections] = {
+    "", ".text", ".data", ".symtab", ".strtab", ".rela.text",
+    ".note.GNU-stack", ".shstrtab",
+};
+
+/* The file name symbol and one symbol for each of .text and .data
+ * come before the symbols of the object. */
+#define LOCAL_SYMBOLS 4
+
+static int
+pad_to(byte_buffer* out, size_t base, size_t alignment) {
+    static const unsigned char zeros[16];
+    size_t padding = (alignment - (out->len - base) % alignment) %
+                     alignment;
+    assert(alignment <= sizeof(zeros));
+    return append_bytes(out, zeros, padding);
+}
+
+static int
+append_symbol(byte_buffer* out, uint32_t name, unsigned char info,
+              uint16_t section, uint64_t value, uint64_t size) {
+    Elf64_Sym sym;
+    memset(&sym, 0, sizeof(sym));
+    sym.st_name = name;
+    sym.st_info = info;
+    sym.st_other = STV_DEFAULT;
+    sym.st_shndx = section;
+    sym.st_value = value;
+    sym.st_size = size;
+    return append_bytes(out, &sym, sizeof(sym));
+}
+
+/* The sections are laid out in order after the ELF header, each
+ * aligned for its contents, followed by the section headers.  The
+ * structures are written as they are in memory, which is right for
+ * the little endian hosts this targets. */
+int
+write_elf(const object_file* object, byte_buffer* out) {
+    static const uint16_t symbol_sections[] = {
+        SHN_UNDEF, section_text, section_data,
+    };
+    Elf64_Shdr headers[num_sections];
+    uint32_t shstrtab_names[num_sections];
+    byte_buffer strtab = BYTE_BUFFER_INIT;
+    byte_buffer shstrtab = BYTE_BUFFER_INIT;
+    Elf64_Ehdr ehdr;
+    const char* file_name;
+    size_t base = out->len;
+    size_t i;
+    int ret = -1;
+
+    memset(headers, 0, sizeof(headers));
+    for (i = 0; i != num_sections; ++i) {
+        shstrtab_names[i] = (uint32_t) shstrtab.len;
+        if (append_bytes(&shstrtab, section_names[i],
+                         strlen(section_names[i]) + 1)) {
+            goto cleanup;
+        }
+    }
+    file_name = object->source_name ? strrchr(object->source_name, '/')
+                                     : 0;
+    file_name = file_name ? file_name + 1
+              : object->source_name ? object->source_name : "";
+    if (append_bytes(&strtab, "", 1) ||
+        append_bytes(&strtab, file_name, strlen(file_name) + 1)) {
+        goto cleanup;
+    }
+
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = num_sections;
+    ehdr.e_shstrndx = section_shstrtab;
+    if (append_bytes(out, &ehdr, sizeof(ehdr))) {
+        goto cleanup;
+    }
+
+    if (pad_to(out, base, 16)) {
+        goto cleanup;
+    }
+    headers[section_text].sh_type = SHT_PROGBITS;
+    headers[section_text].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    headers[section_text].sh_offset = out->len - base;
+    headers[section_text].sh_size = object->text.len;
+    headers[section_text].sh_addralign = 16;
+    if (append_bytes(out, object->text.bytes, object->text.len) ||
+        pad_to(out, base, 8)) {
+        goto cleanup;
+    }
+    headers[section_data].sh_type = SHT_PROGBITS;
+    headers[section_data].sh_flags = SHF_ALLOC | SHF_WRITE;
+    headers[section_data].sh_offset = out->len - base;
+    headers[section_data].sh_size = object->data.len;
+    headers[section_data].sh_addralign = 8;
+    if (append_bytes(out, object->data.bytes, object->data.len) ||
+        pad_to(out, base, 8)) {
+        goto cleanup;
+    }
+
+    headers[section_symtab].sh_type = SHT_SYMTAB;
+    headers[section_symtab].sh_offset = out->len - base;
+    headers[section_symtab].sh_link = section_strtab;
+    headers[section_symtab].sh_info = LOCAL_SYMBOLS;
+    headers[section_symtab].sh_addralign = 8;
+    headers[section_symtab].sh_entsize = sizeof(Elf64_Sym);
+    if (append_symbol(out, 0, 0, SHN_UNDEF, 0, 0) ||
+        append_symbol(out, 1, ELF64_ST_INFO(STB_LOCAL, STT_FILE), SHN_ABS,
+                      0, 0) ||
+        append_symbol(out, 0, ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+                      section_text, 0, 0) ||
+        append_symbol(out, 0, ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+                      section_data, 0, 0)) {
+        goto cleanup;
+    }
+    for (i = 0; i != object->symbols.len; ++i) {
+        const object_symbol* symbol = &object->symbols.symbols[i];
+        const char* name = str_cbegin(&symbol->name);
+        uint32_t name_offset = (uint32_t) strtab.len;
+        unsigned char type = symbol->is_function ? STT_FUNC
+                           : symbol->section == object_undefined
+                               ? STT_NOTYPE : STT_OBJECT;
+        if (append_bytes(&strtab, name, strlen(name) + 1) ||
+            append_symbol(out, name_offset,
+                          ELF64_ST_INFO(STB_GLOBAL, type),
+                          symbol_sections[symbol->section],
+                          symbol->value, symbol->size)) {
+            goto cleanup;
+        }
+    }
+    headers[section_symtab].sh_size =
+        out->len - base - headers[section_symtab].sh_offset;
+
+    headers[section_strtab].sh_type = SHT_STRTAB;
+    headers[section_strtab].sh_offset = out->len - base;
+    headers[section_strtab].sh_size = strtab.len;
+    headers[section_strtab].sh_addralign = 1;
+    if (append_bytes(out, strtab.bytes, strtab.len) ||
+        pad_to(out, base, 8)) {
+        goto cleanup;
+    }
+
+    headers[section_rela_text].sh_type = SHT_RELA;
+    headers[section_rela_text].sh_flags = SHF_INFO_LINK;
+    headers[section_rela_text].sh_offset = out->len - base;
+    headers[section_rela_text].sh_size =
+        object->relocations.len * sizeof(Elf64_Rela);
+    headers[section_rela_text].sh_link = section_symtab;
+    headers[section_rela_text].sh_info = section_text;
+    headers[section_rela_text].sh_addralign = 8;
+    headers[section_rela_text].sh_entsize = sizeof(Elf64_Rela);
+    for (i = 0; i != object->relocations.len; ++i) {
+        const object_relocation* relocation =
+            &object->relocations.relocations[i];
+        Elf64_Rela rela;
+        rela.r_offset = relocation->offset;
+        rela.r_info = ELF64_R_INFO(relocation->symbol + LOCAL_SYMBOLS,
+                                   relocation->type);
+        rela.r_addend = relocation->addend;
+        if (append_bytes(out, &rela, sizeof(rela))) {
+            goto cleanup;
+        }
+    }
+
+    /* An empty .note.GNU-stack tells the linker the stack doesn't
+     * need to be executable. */
+    headers[section_note_gnu_stack].sh_type = SHT_PROGBITS;
+    headers[section_note_gnu_stack].sh_offset = out->len - base;
+    headers[section_note_gnu_stack].sh_addralign = 1;
+
+    headers[section_shstrtab].sh_type = SHT_STRTAB;
+    headers[section_shstrtab].sh_offset = out->len - base;
+    headers[section_shstrtab].sh_size = shstrtab.len;
+    headers[section_shstrtab].sh_addralign = 1;
+    if (append_bytes(out, shstrtab.bytes, shstrtab.len) ||
+        pad_to(out, base, 8)) {
+        goto cleanup;
+    }
+
+    for (i = 0; i != num_sections; ++i) {
+        headers[i].sh_name = shstrtab_names[i];
+    }
+    ehdr.e_shoff = out->len - base;
+    memcpy(out->bytes + base, &ehdr, sizeof(ehdr));
+    if (append_bytes(out, headers, sizeof(headers))) {
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    destroy_byte_buffer(&strtab);
+    destroy_byte_buffer(&shstrtab);
+    if (ret) {
+        out->len = base;
+    }
+    return ret;
+}
+
+int
+write_elf_file(const object_file* object, const char* path) {
+    byte_buffer buffer = BYTE_BUFFER_INIT;
+    FILE* file;
+    int ret = 0;
+    if (write_elf(object, &buffer)) {
+        destroy_byte_buffer(&buffer);
+        return -1;
+    }
+    file = fopen(path, "wb");
+    if (!file) {
+        print_error("Cannot open output file: %s", path);
+        destroy_byte_buffer(&buffer);
+        return -1;
+    }
+    if (fwrite(buffer.bytes, 1, buffer.len, file) != buffer.len) {
+        ret = -1;
+    }
+    if (fclose(file)) {
+        ret = -1;
+    }
+    if (ret) {
+        print_error("Cannot write output file: %s", path);
+    }
+    destroy_byte_buffer(&buffer);
+    return ret;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+
+TEST(test_mangle_name) {
+    str name = STR_INIT;
+    ASSERT(mangle_name(&name, "addition::add_two_ints") == 0, end);
+    ASSERT(strcmp(str_cbegin(&name), "_ZN8addition12add_two_intsE") == 0,
+           end);
+    str_destroy(&name);
+    ASSERT(mangle_name(&name, "main") == 0, end);
+    ASSERT(strcmp(str_cbegin(&name), "main") == 0, end);
+end:
+    str_destroy(&name);
+}
+END_TEST
+
+/* A call from one function to another in another namespace. */
+TEST(test_write_elf) {
+    static const unsigned char text[] = {
+        0xe8, 0, 0, 0, 0,       /* call a::b */
+        0xc3,                   /* ret */
+    };
+    object_file object;
+    byte_buffer out = BYTE_BUFFER_INIT;
+    const Elf64_Ehdr* ehdr;
+    const Elf64_Shdr* headers;
+    const Elf64_Sym* symbols;
+    const Elf64_Rela* rela;
+    const char* strtab;
+    init_object_file(&object, "dir/test.shiv");
+    ASSERT(append_bytes(&object.text, text, sizeof(text)) == 0, end);
+    ASSERT(add_object_symbol(&object, "f", object_text, 1, 0,
+                             sizeof(text)) == 0, end);
+    ASSERT(add_object_symbol(&object, "a::b", object_undefined, 1, 0,
+                             0) == 1, end);
+    ASSERT(add_object_relocation(&object, 1, 1, R_X86_64_PLT32, -4) == 0,
+           end);
+    ASSERT(write_elf(&object, &out) == 0, end);
+
+    ehdr = (const Elf64_Ehdr*) out.bytes;
+    ASSERT(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) == 0, end);
+    ASSERT(ehdr->e_type == ET_REL && ehdr->e_machine == EM_X86_64, end);
+    ASSERT(ehdr->e_shnum == num_sections, end);
+    ASSERT(ehdr->e_shoff + num_sections * sizeof(Elf64_Shdr) == out.len,
+           end);
+    headers = (const Elf64_Shdr*) (out.bytes + ehdr->e_shoff);
+    ASSERT(headers[section_text].sh_size == sizeof(text), end);
+    ASSERT(memcmp(out.bytes + headers[section_text].sh_offset, text,
+                  sizeof(text)) == 0, end);
+    ASSERT(headers[section_symtab].sh_size ==
+               (LOCAL_SYMBOLS + 2) * sizeof(Elf64_Sym), end);
+
+    symbols = (const Elf64_Sym*) (out.bytes +
+                                  headers[section_symtab].sh_offset);
+    strtab = (const char*) out.bytes + headers[section_strtab].sh_offset;
+    ASSERT(strcmp(strtab + symbols[1].st_name, "test.shiv") == 0, end);
+    ASSERT(strcmp(strtab + symbols[LOCAL_SYMBOLS].st_name, "f") == 0, end);
+    ASSERT(symbols[LOCAL_SYMBOLS].st_shndx == section_text, end);
+    ASSERT(strcmp(strtab + symbols[LOCAL_SYMBOLS + 1].st_name,
+                  "_ZN1a1bE") == 0, end);
+    ASSERT(symbols[LOCAL_SYMBOLS + 1].st_shndx == SHN_UNDEF, end);
+
+    ASSERT(headers[section_rela_text].sh_size == sizeof(Elf64_Rela), end);
+    rela = (const Elf64_Rela*) (out.bytes +
+                                headers[section_rela_text].sh_offset);
+    ASSERT(rela->r_offset == 1, end);
+    ASSERT(ELF64_R_SYM(rela->r_info) == LOCAL_SYMBOLS + 1, end);
+    ASSERT(ELF64_R_TYPE(rela->r_info) == R_X86_64_PLT32, end);
+    ASSERT(rela->r_addend == -4, end);
+end:
+    destroy_byte_buffer(&out);
+    destroy_object_file(&object);
+}
+END_TEST
+
+void test_object(void) {
+    RUN(test_mangle_name);
+    RUN(test_write_elf);
+}
+#endif
+
+#ifdef BENCH_MODE
+#include "pool.h"
+
+#define BENCH_FUNCTIONS 200000
+#define BENCH_FUNCTION_SIZE 64
+#define BENCH_ROUNDS 10
+
+/* Lay out an object shaped like generated code, with a call from each
+ * function to the next, and report how fast it is written. */
+void bench_object(void) {
+    object_file object;
+    byte_buffer out = BYTE_BUFFER_INIT;
+    unsigned char code[BENCH_FUNCTION_SIZE];
+    unsigned long long start, elapsed;
+    size_t written = 0;
+    size_t i;
+    char name[64];
+
+    memset(code, 0x90, sizeof(code));
+    code[0] = 0xe8;
+    init_object_file(&object, "bench.shiv");
+    for (i = 0; i != BENCH_FUNCTIONS; ++i) {
+        sprintf(name, "bench::function_%lu", (unsigned long) i);
+        if (append_bytes(&object.text, code, sizeof(code)) ||
+            add_object_symbol(&object, name, object_text, 1,
+                              i * BENCH_FUNCTION_SIZE,
+                              BENCH_FUNCTION_SIZE) < 0 ||
+            add_object_relocation(&object, i * BENCH_FUNCTION_SIZE + 1,
+                                  (uint32_t) ((i + 1) % BENCH_FUNCTIONS),
+                                  R_X86_64_PLT32, -4)) {
+            printf("out of memory\n");
+            goto cleanup;
+        }
+    }
+
+    start = now_nanoseconds();
+    for (i = 0; i != BENCH_ROUNDS; ++i) {
+        out.len = 0;
+        if (write_elf(&object, &out)) {
+            printf("out of memory\n");
+            goto cleanup;
+        }
+        written += out.len;
+    }
+    elapsed = now_nanoseconds() - start;
+    printf("%-32s %8.1f ms %8.1f MB/s\n", "write_elf", elapsed / 1e6,
+           (double) written / 1e6 / ((double) elapsed / 1e9));
+
+cleanup:
+    destroy_byte_buffer(&out);
+    destroy_object_file(&object);
+}
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef HEADER_GUARD_OBJECT_H
+#define HEADER_GUARD_OBJECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../cutil/str.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct byte_buffer {
+    unsigned char* bytes;
+    size_t len, cap;
+};
+typedef struct byte_buffer byte_buffer;
+#define BYTE_BUFFER_INIT {0, 0, 0}
+
+int append_bytes(byte_buffer*, const void* bytes, size_t len);
+void destroy_byte_buffer(byte_buffer*);
+
+enum object_section {
+    object_undefined,
+    object_text,
+    object_data,
+};
+typedef enum object_section object_section;
+
+struct object_symbol {
+    /* the mangled name */
+    str name;
+    object_section section;
+    int is_function;
+    uint64_t value;
+    uint64_t size;
+};
+typedef struct object_symbol object_symbol;
+
+/* A relocation of the text section.  `type` is an R_X86_64_*
+ * constant from <elf.h>. */
+struct object_relocation {
+    uint64_t offset;
+    uint32_t symbol;
+    uint32_t type;
+    int64_t addend;
+};
+typedef struct object_relocation object_relocation;
+
+/* The contents of a relocatable object.  Relocations refer to
+ * symbols by their index in `symbols`. */
+struct object_file {
+    const char* source_name;
+    byte_buffer text;
+    byte_buffer data;
+    struct {
+        object_symbol* symbols;
+        size_t len, cap;
+    } symbols;
+    struct {
+        object_relocation* relocations;
+        size_t len, cap;
+    } relocations;
+};
+typedef struct object_file object_file;
+
+void init_object_file(object_file*, const char* source_name);
+void destroy_object_file(object_file*);
+
+/* Add a symbol named `name`, mangling names with namespaces like C++
+ * does so `a::b` becomes `_ZN1a1bE`.  Returns its index or -1. */
+long add_object_symbol(object_file*, const char* name,
+                       object_section section, int is_function,
+                       uint64_t value, uint64_t size);
+
+int add_object_relocation(object_file*, uint64_t offset, uint32_t symbol,
+                          uint32_t type, int64_t addend);
+
+/* Append `name` mangled to `out`. */
+int mangle_name(str* out, const char* name);
+
+/* Lay out `object` as an x86-64 ELF64 relocatable object with
+ * .text, .data, .symtab, .strtab, .rela.text and .note.GNU-stack
+ * sections and append it to `out`. */
+int write_elf(const object_file* object, byte_buffer* out);
+
+/* Write `object` to the file at `path`. */
+int write_elf_file(const object_file* object, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
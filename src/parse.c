@@ -2,25 +2,149 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "../cutil/rpmalloc.h"
 #include "../cutil/vec.h"
 #include "diagnostics.h"
 #include "lex.h"
+#include "trace.h"
+#include "types.h"
 
-static void
-destroy_expression(expression* expression) {
-    assert(expression);
-    switch (expression->type) {
-    case expression_plus:
-        assert(expression->data.binary.first);
-        destroy_expression(expression->data.binary.first);
-        rpfree(expression->data.binary.first);
-
-        assert(expression->data.binary.second);
-        destroy_expression(expression->data.binary.second);
-        rpfree(expression->data.binary.second);
-        break;
+static expr_ref
+add_expression(expression_pool* pool, expression_type type,
+               expr_ref first, expr_ref second) {
+    expression* node;
+    if (pool->len == pool->cap) {
+        uint32_t cap = pool->cap ? pool->cap * 2 : 16;
+        expression* nodes;
+        if (cap >= EXPR_NONE) {
+            return EXPR_NONE;
+        }
+        nodes = rprealloc(pool->nodes, cap * sizeof(expression));
+        if (!nodes) {
+            return EXPR_NONE;
+        }
+        pool->nodes = nodes;
+        pool->cap = cap;
     }
+    node = &pool->nodes[pool->len];
+    node->type = (uint16_t) type;
+    node->grouped = 0;
+    node->first = first;
+    node->second = second;
+    return pool->len++;
+}
+
+expr_ref
+add_binary_expression(expression_pool* pool, expression_type type,
+                      expr_ref first, expr_ref second) {
+    assert(type >= expression_comma);
+    return add_expression(pool, type, first, second);
+}
+
+expr_ref
+add_name_expression(expression_pool* pool, const char* name) {
+    size_t len = strlen(name) + 1;
+    uint32_t offset = pool->names_len;
+    if (len > UINT32_MAX - offset) {
+        return EXPR_NONE;
+    }
+    if (pool->names_cap - offset < len) {
+        size_t cap = pool->names_cap ? pool->names_cap : 64;
+        char* names;
+        while (cap - offset < len) {
+            cap *= 2;
+        }
+        if (cap > UINT32_MAX) {
+            cap = UINT32_MAX;
+        }
+        names = rprealloc(pool->names, cap);
+        if (!names) {
+            return EXPR_NONE;
+        }
+        pool->names = names;
+        pool->names_cap = (uint32_t) cap;
+    }
+    memcpy(pool->names + offset, name, len);
+    pool->names_len += (uint32_t) len;
+    return add_expression(pool, expression_name, offset, 0);
+}
+
+expr_ref
+add_int_expression(expression_pool* pool, unsigned long long value) {
+    return add_expression(pool, expression_int, (expr_ref) value,
+                          (expr_ref) (value >> 32));
+}
+
+expr_ref
+add_float_expression(expression_pool* pool, double value) {
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return add_expression(pool, expression_float, (expr_ref) bits,
+                          (expr_ref) (bits >> 32));
+}
+
+expr_ref
+add_call_expression(expression_pool* pool, expr_ref name,
+                    expr_ref arguments) {
+    assert(pool->nodes[name].type == expression_name);
+    return add_expression(pool, expression_call, name, arguments);
+}
+
+const char*
+get_expression_name(const expression_pool* pool, expr_ref ref) {
+    assert(pool->nodes[ref].type == expression_name);
+    return pool->names + pool->nodes[ref].first;
+}
+
+unsigned long long
+get_expression_int(const expression_pool* pool, expr_ref ref) {
+    const expression* node = &pool->nodes[ref];
+    assert(node->type == expression_int);
+    return (unsigned long long) node->second << 32 | node->first;
+}
+
+double
+get_expression_float(const expression_pool* pool, expr_ref ref) {
+    const expression* node = &pool->nodes[ref];
+    unsigned long long bits =
+        (unsigned long long) node->second << 32 | node->first;
+    double value;
+    assert(node->type == expression_float);
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static size_t
+collect_arguments(const expression_pool* pool, expr_ref ref,
+                  expr_ref* arguments, size_t max, size_t len) {
+    const expression* node = &pool->nodes[ref];
+    /* a comma in parentheses is a single argument */
+    if (node->type == expression_comma && !node->grouped) {
+        len = collect_arguments(pool, node->first, arguments, max, len);
+        return collect_arguments(pool, node->second, arguments, max, len);
+    }
+    if (len < max) {
+        arguments[len] = ref;
+    }
+    return len + 1;
+}
+
+size_t
+get_call_arguments(const expression_pool* pool, expr_ref call,
+                   expr_ref* arguments, size_t max) {
+    const expression* node = &pool->nodes[call];
+    assert(node->type == expression_call);
+    if (node->second == EXPR_NONE) {
+        return 0;
+    }
+    return collect_arguments(pool, node->second, arguments, max, 0);
+}
+
+void
+destroy_expression_pool(expression_pool* pool) {
+    rpfree(pool->nodes);
+    rpfree(pool->names);
 }
 
 static void
@@ -44,6 +168,9 @@ static void destroy_statements(statements*);
 static void
 destroy_defining_type_expression(defining_type_expression* dtype) {
     switch (dtype->type) {
+    case dtype_inferred:
+    case dtype_const_inferred:
+        break;
     case dtype_pointer:
     case dtype_const_pointer:
         destroy_type_expression(dtype->data.next_type);
@@ -58,6 +185,9 @@ destroy_defining_type_expression(defining_type_expression* dtype) {
         destroy_type_expression(&dtype->data.fun_def.return_type);
         destroy_statements(&dtype->data.fun_def.stmts);
         break;
+    case dtype_struct_def:
+        destroy_var_decls(&dtype->data.struct_def.fields);
+        break;
     }
 }
 
@@ -65,6 +195,29 @@ static void
 destroy_var_decl(var_decl* vd) {
     str_destroy(&vd->name);
     destroy_defining_type_expression(&vd->type);
+    destroy_expression_pool(&vd->exprs);
+}
+
+void
+destroy_statement(statement* stmt) {
+    switch (stmt->type) {
+    case statement_if:
+        destroy_statements(&stmt->data.s_if.truebranch);
+        destroy_statements(&stmt->data.s_if.falsebranch);
+        break;
+    case statement_expression:
+    case statement_return:
+        break;
+    case statement_var_decl:
+        destroy_var_decl(&stmt->data.s_var_decl);
+        break;
+    case statement_block:
+        destroy_statements(&stmt->data.s_block);
+        break;
+    case statement_while:
+        destroy_statements(&stmt->data.s_while.body);
+        break;
+    }
 }
 
 static void
@@ -75,19 +228,7 @@ destroy_statements(statements* statements) {
     if (!statements->stmts) { return; }
     last = statements->stmts + statements->len;
     for (stmt = statements->stmts; stmt != last; ++stmt) {
-        switch (stmt->type) {
-        case statement_if:
-            destroy_expression(&stmt->data.s_if.cond);
-            destroy_statements(&stmt->data.s_if.truebranch);
-            destroy_statements(&stmt->data.s_if.falsebranch);
-            break;
-        case statement_expression:
-            destroy_expression(&stmt->data.s_expression);
-            break;
-        case statement_var_decl:
-            destroy_var_decl(&stmt->data.s_var_decl);
-            break;
-        }
+        destroy_statement(stmt);
     }
     rpfree(statements->stmts);
 }
@@ -154,11 +295,42 @@ top:
     if (*tk == last || (*tk)->type != token_namespace) {
         return 0;
     }
-    str_push_s(str, "::");
+    if (str_push_s(str, "::")) {
+        return -1;
+    }
     ++*tk;
     goto top;
 }
 
+/* Parse the name of a type.  Builtin types are looked up straight
+ * from their tokens so their name is pushed in one piece rather than
+ * built up a word at a time. */
+static int
+parse_type_name(str* name, token** tk, token* last) {
+    const token* t = *tk;
+    char key[32];
+    if (last - t >= 3 && t[0].type == token_word &&
+        t[1].type == token_namespace && t[2].type == token_word &&
+        (last - t == 3 || t[3].type != token_namespace)) {
+        const char* space = str_cbegin(&t[0].data.s);
+        const char* word = str_cbegin(&t[2].data.s);
+        size_t space_len = strlen(space);
+        size_t word_len = strlen(word);
+        const builtin_type_info* builtin;
+        if (space_len + 2 + word_len <= sizeof(key)) {
+            memcpy(key, space, space_len);
+            memcpy(key + space_len, "::", 2);
+            memcpy(key + space_len + 2, word, word_len);
+            builtin = find_builtin_type(key, space_len + 2 + word_len);
+            if (builtin) {
+                *tk += 3;
+                return str_push_s(name, builtin->name);
+            }
+        }
+    }
+    return parse_namespaced_word(name, tk, last);
+}
+
 static int
 parse_colon(token** tk, token* last) {
     if (assertattoken(*tk, last, token_colon, "colon")) {
@@ -169,12 +341,17 @@ parse_colon(token** tk, token* last) {
 }
 
 static int
-parse_params(token** tk, token* last) {
+parse_expression(token** tk, token* last, token_type escape_type,
+                 expression_pool* pool, expr_ref* expr);
+
+static int
+parse_params(token** tk, token* last, expression_pool* pool,
+             vec_var_decl* params) {
 top:
     if (*tk == last) {
-        erroreof(&tk[-1]->fpos, "list of parameters, a closing "
-                                "parenthesis, and then a function "
-                                "body.");
+        erroreof(&(*tk)[-1].fpos, "list of parameters, a closing "
+                                  "parenthesis, and then a function "
+                                  "body.");
         return -1;
     }
     if ((*tk)->type == token_close_paren) {
@@ -182,26 +359,35 @@ top:
     }
 nextparam:
     {
-        str paramname = STR_INIT;
-        str type = STR_INIT;
-        if (parse_namespaced_word(&paramname, tk, last)) {
-            str_destroy(&paramname);
-            return -1;
+        var_decl param;
+        param.name = (str) STR_INIT;
+        param.type.type = dtype_name;
+        param.type.data.name = (str) STR_INIT;
+        param.value = EXPR_NONE;
+        param.exprs = (expression_pool) EXPRESSION_POOL_INIT;
+        param.imported = 0;
+        if (*tk != last) {
+            param.fpos = (*tk)->fpos;
         }
-        if (assertattoken(*tk, last, token_colon, "colon")) {
-            str_destroy(&paramname);
+        if (parse_namespaced_word(&param.name, tk, last) ||
+            parse_colon(tk, last) ||
+            parse_type_name(&param.type.data.name, tk, last)) {
+            destroy_var_decl(&param);
             return -1;
         }
-        ++*tk;
-        if (parse_namespaced_word(&type, tk, last)) {
-            str_destroy(&type);
-            str_destroy(&paramname);
+        if (*tk != last && (*tk)->type == token_assign) {
+            /* default value */
+            ++*tk;
+            if (parse_expression(tk, last, token_comma, pool,
+                                 &param.value)) {
+                destroy_var_decl(&param);
+                return -1;
+            }
+        }
+        if (vec_push(params, sizeof(param), &param)) {
+            destroy_var_decl(&param);
             return -1;
         }
-        printf("Parameter %s of %s.\n", str_cbegin(&paramname),
-               str_cbegin(&type));
-        str_destroy(&type);
-        str_destroy(&paramname);
         if (*tk == last || (*tk)->type == token_close_paren) {
             goto top;
         }
@@ -214,16 +400,32 @@ nextparam:
     }
 }
 
+static int
+precedence(int type) {
+    switch (type) {
+    case token_comma:
+        return 0;
+    case token_assign:
+        return 1;
+    case token_minus:
+    case token_plus:
+        return 2;
+    default:
+        /* shouldn't happen */
+        abort();
+    }
+}
+
 static int
 is_x_wider_than(token_type x, expression_type y) {
     assert(x >= token_comma);
     if (y < expression_comma) {
         return 1;
     }
-    if (x < y) {
+    if (precedence(x) < precedence(y)) {
         return 1;
     }
-    if (y > x) {
+    if (precedence(x) > precedence(y)) {
         return 0;
     }
     switch (x) {
@@ -243,54 +445,84 @@ is_x_wider_than(token_type x, expression_type y) {
     }
 }
 
-static int
-parse_expression(token** tk, token* last, token_type escape_type,
-                 expression** expr);
-
 static int
 parse_sub_expression(token** tk, token* last, token_type escape_type,
-                     expression** expr) {
+                     expression_pool* pool, expr_ref* expr) {
     if (*tk == last) {
         goto last;
     }
     switch ((*tk)->type) {
     case token_word:
-        (*expr)->type = expression_name;
-        if (str_copy_str(&(*expr)->data.name, &(*tk)->data.s)) {
-            return -1;
-        }
-        break;
-    case token_open_paren:
         {
-            expression* embedded = rpmalloc(sizeof(expression));
-            if (!embedded) {
+            str name = STR_INIT;
+            if (parse_namespaced_word(&name, tk, last)) {
+                str_destroy(&name);
                 return -1;
             }
-            ++*tk;
-            if (parse_expression(tk, last, token_close_paren,
-                                 &embedded)) {
-                destroy_expression(embedded);
-                rpfree(embedded);
+            *expr = add_name_expression(pool, str_cbegin(&name));
+            str_destroy(&name);
+            if (*expr == EXPR_NONE) {
                 return -1;
             }
-            destroy_expression(embedded);
-            rpfree(embedded);
-            assert((*tk)->type == token_close_paren);
+        }
+        if (*tk != last && (*tk)->type == token_open_paren) {
+            expr_ref arguments = EXPR_NONE;
             ++*tk;
+            if (*tk != last && (*tk)->type != token_close_paren &&
+                parse_expression(tk, last, token_close_paren, pool,
+                                 &arguments)) {
+                return -1;
+            }
+            if (assertattoken(*tk, last, token_close_paren,
+                              "closing parenthesis")) {
+                return -1;
+            }
+            *expr = add_call_expression(pool, *expr, arguments);
+            if (*expr == EXPR_NONE) {
+                return -1;
+            }
+            if (get_call_arguments(pool, *expr, 0, 0) >
+                MAX_CALL_ARGUMENTS) {
+                print_error_pos(&(*tk)->fpos, "Calls can have at most %d "
+                                "arguments", MAX_CALL_ARGUMENTS);
+                return -1;
+            }
+            break;
+        }
+        /* parse_namespaced_word already went past the name */
+        goto check_last;
+    case token_int:
+        *expr = add_int_expression(pool, (*tk)->data.integer);
+        if (*expr == EXPR_NONE) {
+            return -1;
         }
         break;
-    case token_close_paren:
-    case token_close_curly:
-    case token_semicolon:
-        if (escape_type == (*tk)->type) {
-            return 0;
+    case token_float:
+        *expr = add_float_expression(pool, (*tk)->data.floating);
+        if (*expr == EXPR_NONE) {
+            return -1;
+        }
+        break;
+    case token_open_paren:
+        ++*tk;
+        if (parse_expression(tk, last, token_close_paren, pool, expr) ||
+            assertattoken(*tk, last, token_close_paren,
+                          "closing parenthesis")) {
+            return -1;
+        }
+        /* keep operators after the parentheses from reaching in */
+        pool->nodes[*expr].grouped = 1;
+        break;
+    default:
+        if ((*tk)->type == escape_type) {
+            errortoken(&(*tk)->fpos, "expression");
+        } else {
+            print_error_pos(&(*tk)->fpos, "Unexpected token");
         }
-        // fall through
-    case token_return:
-        print_error_pos(&(*tk)->fpos, "Unexpected token");
         return -1;
     }
     ++*tk;
+check_last:
     if (*tk == last) {
         const char* mes;
 last:
@@ -304,6 +536,9 @@ last:
         case token_semicolon:
             mes = "semicolon";
             break;
+        case token_comma:
+            mes = "comma";
+            break;
         default:
             abort();
         }
@@ -313,92 +548,292 @@ last:
     return 0;
 }
 
+/* Parse an expression ending in `escape_type` into `pool`.  The
+ * token at `escape_type` is not consumed.  Nodes added before a
+ * failure are left in the pool unused. */
 static int
 parse_expression(token** tk, token* last, token_type escape_type,
-                 expression** expr) {
-    if (parse_sub_expression(tk, last, escape_type, expr)) {
+                 expression_pool* pool, expr_ref* expr) {
+    if (parse_sub_expression(tk, last, escape_type, pool, expr)) {
         return -1;
     }
     /* binary operator */
-    while ((*tk)->type >= token_comma) {
+    while ((*tk)->type >= token_comma && (*tk)->type != escape_type) {
         /* left associating (<=):
          * a - b - c == (a - b) - c */
         /* right associating (<):
          * a = b = c == a = (b = c) */
-        expression** iter = expr;
         token_type type = (*tk)->type;
+        /* the operator whose second operand is being replaced */
+        expr_ref parent = EXPR_NONE;
+        expr_ref node = *expr;
+        expr_ref second;
+        expr_ref bin;
         ++*tk;
         if (*tk == last) {
             erroreof(&(*tk)[-1].fpos, "expression");
             return -1;
         }
-        while (!is_x_wider_than(type, (*iter)->type)) {
-            iter = &(*iter)->data.binary.second;
+        while (!pool->nodes[node].grouped &&
+               !is_x_wider_than(type,
+                                (expression_type) pool->nodes[node].type)) {
+            parent = node;
+            node = pool->nodes[node].second;
         }
-        {
-            expression* bin = rpmalloc(sizeof(expression));
-            if (!bin) {
-                return -1;
-            }
-            bin->data.binary.second = rpmalloc(sizeof(expression));
-            if (!bin->data.binary.second) {
-                rpfree(bin);
+        if (parse_sub_expression(tk, last, escape_type, pool, &second)) {
+            return -1;
+        }
+        bin = add_binary_expression(pool, (expression_type) type, node,
+                                    second);
+        if (bin == EXPR_NONE) {
+            return -1;
+        }
+        if (parent == EXPR_NONE) {
+            *expr = bin;
+        } else {
+            pool->nodes[parent].second = bin;
+        }
+    }
+    return 0;
+}
+
+/* Parse the part of a variable declaration after the colon up to and
+ * including the semicolon:
+ *
+ *     @varname : @typename;
+ *     @varname : @typename = @value;
+ *     @varname : const = @value;
+ *     @varname := @value;
+ *
+ * The value is stored in `vd`, which is destroyed by the caller on
+ * failure. */
+static int
+parse_var_decl_rest(var_decl* vd, token** tk, token* last,
+                    expression_pool* pool) {
+    if (*tk == last) {
+        erroreof(&(*tk)[-1].fpos, "type");
+        return -1;
+    }
+    if ((*tk)->type == token_const) {
+        vd->type.type = dtype_const_inferred;
+        ++*tk;
+        if (assertattoken(*tk, last, token_assign, "equals sign")) {
+            return -1;
+        }
+    } else if ((*tk)->type == token_assign) {
+        vd->type.type = dtype_inferred;
+    } else {
+        vd->type.type = dtype_name;
+        vd->type.data.name = (str) STR_INIT;
+        if (parse_type_name(&vd->type.data.name, tk, last)) {
+            return -1;
+        }
+    }
+    if (*tk != last && (*tk)->type == token_assign) {
+        ++*tk;
+        if (parse_expression(tk, last, token_semicolon, pool, &vd->value)) {
+            return -1;
+        }
+    }
+    if (assertattoken(*tk, last, token_semicolon, "semicolon")) {
+        return -1;
+    }
+    ++*tk;
+    return 0;
+}
+
+static int
+parse_statements(token** tk, token* last, expression_pool* pool,
+                 statements* stmts);
+
+/* Parse the condition of an if or while statement and the opening
+ * curly after it:
+ *
+ *     (@condition) {
+ */
+static int
+parse_condition(token** tk, token* last, expression_pool* pool,
+                expr_ref* cond) {
+    if (assertattoken(*tk, last, token_open_paren, "opening parenthesis")) {
+        return -1;
+    }
+    ++*tk;
+    if (parse_expression(tk, last, token_close_paren, pool, cond) ||
+        assertattoken(*tk, last, token_close_paren, "closing parenthesis")) {
+        return -1;
+    }
+    ++*tk;
+    if (assertattoken(*tk, last, token_open_curly, "opening curly")) {
+        return -1;
+    }
+    ++*tk;
+    return 0;
+}
+
+static int
+parse_statement(token** tk, token* last, expression_pool* pool,
+                statement* stmt);
+
+/* Parse an if statement after the `if` and its else clause if there
+ * is one.  `else if` is an if statement that is the whole else
+ * clause. */
+static int
+parse_if(token** tk, token* last, expression_pool* pool, statement* stmt) {
+    stmt->type = statement_if;
+    stmt->data.s_if.truebranch = (statements) VEC_INIT;
+    stmt->data.s_if.falsebranch = (statements) VEC_INIT;
+    if (parse_condition(tk, last, pool, &stmt->data.s_if.cond) ||
+        parse_statements(tk, last, pool, &stmt->data.s_if.truebranch)) {
+        goto fail;
+    }
+    if (*tk == last || (*tk)->type != token_else) {
+        return 0;
+    }
+    ++*tk;
+    if (*tk != last && (*tk)->type == token_if) {
+        statement nested;
+        ++*tk;
+        if (parse_if(tk, last, pool, &nested)) {
+            goto fail;
+        }
+        if (vec_push(&stmt->data.s_if.falsebranch, sizeof(nested),
+                     &nested)) {
+            destroy_statement(&nested);
+            goto fail;
+        }
+        return 0;
+    }
+    if (assertattoken(*tk, last, token_open_curly, "opening curly")) {
+        goto fail;
+    }
+    ++*tk;
+    if (parse_statements(tk, last, pool, &stmt->data.s_if.falsebranch)) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    destroy_statement(stmt);
+    return -1;
+}
+
+static int
+parse_statement(token** tk, token* last, expression_pool* pool,
+                statement* stmt) {
+    switch ((*tk)->type) {
+    case token_open_curly:
+        ++*tk;
+        stmt->type = statement_block;
+        stmt->data.s_block = (statements) VEC_INIT;
+        if (parse_statements(tk, last, pool, &stmt->data.s_block)) {
+            destroy_statements(&stmt->data.s_block);
+            return -1;
+        }
+        return 0;
+    case token_if:
+        ++*tk;
+        return parse_if(tk, last, pool, stmt);
+    case token_while:
+        stmt->type = statement_while;
+        stmt->data.s_while.fpos = (*tk)->fpos;
+        ++*tk;
+        stmt->data.s_while.body = (statements) VEC_INIT;
+        if (parse_condition(tk, last, pool, &stmt->data.s_while.cond)) {
+            return -1;
+        }
+        if (parse_statements(tk, last, pool, &stmt->data.s_while.body)) {
+            destroy_statements(&stmt->data.s_while.body);
+            return -1;
+        }
+        return 0;
+    case token_return:
+        ++*tk;
+        stmt->type = statement_return;
+        stmt->data.s_return = EXPR_NONE;
+        if (*tk != last && (*tk)->type != token_semicolon) {
+            if (parse_expression(tk, last, token_semicolon, pool,
+                            &stmt->data.s_return)) {
                 return -1;
             }
-            bin->type = (expression_type) type;
-            bin->data.binary.first = *iter;
-            if (parse_sub_expression(tk, last, escape_type,
-                                     &bin->data.binary.second)) {
-                rpfree(bin->data.binary.second);
-                rpfree(bin);
-                destroy_expression(*expr);
+        }
+        break;
+    case token_word:
+        if (*tk + 1 != last && (*tk)[1].type == token_colon) {
+            var_decl* vd = &stmt->data.s_var_decl;
+            stmt->type = statement_var_decl;
+            vd->name = (str) STR_INIT;
+            vd->type.type = dtype_inferred;
+            vd->value = EXPR_NONE;
+            vd->exprs = (expression_pool) EXPRESSION_POOL_INIT;
+            vd->imported = 0;
+            vd->fpos = (*tk)->fpos;
+            if (parse_word(&vd->name, tk, last) ||
+                parse_colon(tk, last) ||
+                parse_var_decl_rest(vd, tk, last, pool)) {
+                destroy_var_decl(vd);
                 return -1;
             }
-            /* wait to publish so that cleanup is easier */
-            *iter = bin;
+            return 0;
         }
+        /* fall through */
+    default:
+        stmt->type = statement_expression;
+        if (parse_expression(tk, last, token_semicolon, pool,
+                        &stmt->data.s_expression)) {
+            return -1;
+        }
+        break;
+    }
+    if (assertattoken(*tk, last, token_semicolon, "semicolon")) {
+        destroy_statement(stmt);
+        return -1;
     }
+    ++*tk;
     return 0;
 }
 
+/* Parse statements up to and including the closing curly. */
 static int
-parse_statements(token** tk, token* last) {
-    for (; *tk != last; ++*tk) {
+parse_statements(token** tk, token* last, expression_pool* pool,
+                 statements* stmts) {
+    while (1) {
+        statement stmt;
+        if (*tk == last) {
+            erroreof(&(*tk)[-1].fpos, "closing curly");
+            return -1;
+        }
         switch ((*tk)->type) {
         case token_close_curly:
             /* go past close curly */
             ++*tk;
             return 0;
-        case token_open_curly:
+        case token_semicolon:
+            /* empty statement */
             ++*tk;
-            parse_statements(tk, last);
-            if (assertattoken(*tk, last, token_close_curly,
-                              "closing curly")) {
-                return -1;
-            }
+            continue;
+        default:
             break;
-        case token_return:
+        }
+        if (parse_statement(tk, last, pool, &stmt)) {
+            return -1;
+        }
+        if (vec_push(stmts, sizeof(stmt), &stmt)) {
+            destroy_statement(&stmt);
+            return -1;
+        }
+    }
+}
+
+/* Go past the closing curly matching the one before `*tk`. */
+static int
+skip_body(token** tk, token* last) {
+    size_t depth = 1;
+    for (; *tk != last; ++*tk) {
+        if ((*tk)->type == token_open_curly) {
+            ++depth;
+        } else if ((*tk)->type == token_close_curly && --depth == 0) {
             ++*tk;
-            {
-                expression* expr = rpmalloc(sizeof(expression));
-                if (!expr) {
-                    return -1;
-                }
-                if (parse_expression(tk, last, token_semicolon,
-                                     &expr)) {
-                    destroy_expression(expr);
-                    rpfree(expr);
-                    return -1;
-                }
-                assert(*tk - 1 < last);
-                assert((*tk)[-1].type == token_semicolon);
-                destroy_expression(expr);
-                rpfree(expr);
-            }
-            if (assertattoken(*tk, last, token_semicolon,
-                              "semicolon")) {
-                return -1;
-            }
+            return 0;
         }
     }
     erroreof(&(*tk)[-1].fpos, "closing curly");
@@ -406,14 +841,15 @@ parse_statements(token** tk, token* last) {
 }
 
 static int
-parse_fun(const str* name, token** tk, token* last) {
+parse_fun(token** tk, token* last, var_decl* vd, int flags) {
+    fun_def* fun = &vd->type.data.fun_def;
     /* after fun word is '\($param*\) (\-\> $type)? \{ $statement* \}' */
     if (assertattoken(*tk, last, token_open_paren,
                       "opening parenthesis")) {
         return -1;
     }
     ++*tk;
-    if (parse_params(tk, last)) {
+    if (parse_params(tk, last, &vd->exprs, &fun->params)) {
         return -1;
     }
     if (assertattoken(*tk, last, token_close_paren,
@@ -426,107 +862,223 @@ parse_fun(const str* name, token** tk, token* last) {
         return -1;
     }
     if ((*tk)->type == token_right_arrow) {
-        str return_type = STR_INIT;
+        str* return_type = &fun->return_type.data.name;
         ++*tk;
         if (*tk == last) {
             erroreof(&(*tk)[-1].fpos,
                      "type to point to then the function body");
             return -1;
         }
-        if (parse_namespaced_word(&return_type, tk, last)) {
+        str_destroy(return_type);
+        if (parse_type_name(return_type, tk, last)) {
             return -1;
         }
-        printf("Return type: %s\n", str_cbegin(&return_type));
-        str_destroy(&return_type);
     }
     if (assertattoken(*tk, last, token_open_curly, "opening curly")) {
         return -1;
     }
     ++*tk;
-    if (parse_statements(tk, last)) {
+    fun->body_begin = *tk;
+    if (flags & parse_lazy_bodies) {
+        if (skip_body(tk, last)) {
+            return -1;
+        }
+        fun->body_end = *tk - 1;
+        return 0;
+    }
+    if (parse_statements(tk, last, &vd->exprs, &fun->stmts)) {
         return -1;
     }
+    fun->body_end = *tk - 1;
+    fun->body_parsed = 1;
+    return 0;
+}
+
+int
+parse_fun_body(var_decl* decl) {
+    fun_def* fun;
+    token* tk;
+    unsigned long long start;
+    uint32_t exprs_len, names_len;
+    int res;
+    assert(decl);
+    assert(decl->type.type == dtype_fun_def);
+    fun = &decl->type.data.fun_def;
+    if (fun->body_parsed) {
+        return 0;
+    }
+    exprs_len = decl->exprs.len;
+    names_len = decl->exprs.names_len;
+    tk = fun->body_begin;
+    start = trace_begin();
+    /* The body is known to end at `body_end` so it can't run out of
+     * tokens. */
+    res = parse_statements(&tk, fun->body_end + 1, &decl->exprs,
+                           &fun->stmts);
+    trace_end(start, "parse_fun_body", str_cbegin(&decl->name),
+              tk - fun->body_begin);
+    if (res) {
+        /* Leave the declaration as it was so that parsing the body
+         * again doesn't add to what this got through. */
+        destroy_statements(&fun->stmts);
+        fun->stmts = (statements) VEC_INIT;
+        decl->exprs.len = exprs_len;
+        decl->exprs.names_len = names_len;
+        return -1;
+    }
+    assert(tk == fun->body_end + 1);
+    fun->body_parsed = 1;
     return 0;
 }
 
 static int
-parse_struct(const str* name, token** tk, token* last) {
+parse_struct_attribute(token** tk, token* last, struct_def* def) {
+    if (assertattoken(*tk, last, token_word, "attribute")) {
+        return -1;
+    }
+    if (strcmp(str_cbegin(&(*tk)->data.s), "c_layout") != 0) {
+        print_error_pos(&(*tk)->fpos, "Unknown structure attribute %s",
+                        str_cbegin(&(*tk)->data.s));
+        return -1;
+    }
+    def->c_layout = 1;
+    ++*tk;
+    if (assertattoken(*tk, last, token_close_paren,
+                      "closing parenthesis")) {
+        return -1;
+    }
+    ++*tk;
     return 0;
 }
 
-int
-parse(const vec_token* tokens, vec_var_decl* statements) {
-    token* tk;
-    token* last;
-    assert(tokens);
-    assert(statements);
-    last = tokens->tokens + tokens->len;
-    for (tk = tokens->tokens; tk != last; ++tk) {
-        str name = STR_INIT;
-        if (parse_namespaced_word(&name, &tk, last)) {
-            str_destroy(&name);
+static int
+parse_struct(token** tk, token* last, var_decl* vd) {
+    struct_def* def = &vd->type.data.struct_def;
+    vd->type.type = dtype_struct_def;
+    def->fields = (vec_var_decl) VEC_INIT;
+    def->c_layout = 0;
+    /* after struct word is '(\(c_layout\))? \{ ($name : $type;)* \}' */
+    if (*tk != last && (*tk)->type == token_open_paren) {
+        ++*tk;
+        if (parse_struct_attribute(tk, last, def)) {
             return -1;
         }
-        if (parse_colon(&tk, last)) {
-            str_destroy(&name);
+    }
+    if (assertattoken(*tk, last, token_open_curly, "opening curly")) {
+        return -1;
+    }
+    ++*tk;
+    while (1) {
+        var_decl field;
+        if (*tk == last) {
+            erroreof(&(*tk)[-1].fpos, "closing curly");
             return -1;
         }
-        if (tk == last) {
-            erroreof(&tk[-1].fpos, "type");
-            str_destroy(&name);
-            return -1;
+        if ((*tk)->type == token_close_curly) {
+            ++*tk;
+            return 0;
+        }
+        if ((*tk)->type == token_semicolon) {
+            ++*tk;
+            continue;
         }
-        if (tk->type != token_assign) {
-            fputs("UNSUPPORTED RIGHT NOW\n", stderr);
+        field.name = (str) STR_INIT;
+        field.type.type = dtype_name;
+        field.type.data.name = (str) STR_INIT;
+        field.value = EXPR_NONE;
+        field.exprs = (expression_pool) EXPRESSION_POOL_INIT;
+        field.imported = 0;
+        field.fpos = (*tk)->fpos;
+        if (parse_word(&field.name, tk, last) ||
+            parse_colon(tk, last) ||
+            parse_type_name(&field.type.data.name, tk, last) ||
+            assertattoken(*tk, last, token_semicolon, "semicolon")) {
+            destroy_var_decl(&field);
             return -1;
         }
-        ++tk;
-        if (tk == last) {
-            erroreof(&tk[-1].fpos, "value, a function definition, or "
-                                   "a type definition.");
+        ++*tk;
+        if (vec_push(&def->fields, sizeof(field), &field)) {
+            destroy_var_decl(&field);
+            return -1;
         }
+    }
+}
+
+static int
+parse_toplevel(token** tk, token* last, var_decl* vd, int flags) {
+    if (parse_namespaced_word(&vd->name, tk, last)) {
+        return -1;
+    }
+    if (parse_colon(tk, last)) {
+        return -1;
+    }
+    if (*tk == last) {
+        erroreof(&(*tk)[-1].fpos, "type");
+        return -1;
+    }
+    if ((*tk)->type == token_assign && *tk + 1 != last) {
         /* we are defining an untyped variable or a named type. */
-        if (tk->type == token_fun) {
-            printf("Defining fun %s\n", str_cbegin(&name));
-            ++tk;
-            if (parse_fun(&name, &tk, last)) {
-                str_destroy(&name);
+        if ((*tk)[1].type == token_fun) {
+            fun_def* fun_def = &vd->type.data.fun_def;
+            *tk += 2;
+            vd->type.type = dtype_fun_def;
+            fun_def->name = (str) STR_INIT;
+            fun_def->params = (vec_var_decl) VEC_INIT;
+            fun_def->return_type.type = type_name;
+            fun_def->return_type.data.name = (str) STR_INIT;
+            fun_def->stmts = (statements) VEC_INIT;
+            fun_def->body_begin = 0;
+            fun_def->body_end = 0;
+            fun_def->body_parsed = 0;
+            if (str_copy_str(&fun_def->name, &vd->name) ||
+                str_push_s(&fun_def->return_type.data.name,
+                           "std::void")) {
                 return -1;
             }
-            /* counter iteration */
-            --tk;
-            continue;
-        } else if (tk->type == token_struct) {
-            ++tk;
-            if (parse_struct(&name, &tk, last)) {
-                str_destroy(&name);
-                return -1;
+            {
+                const token* begin = *tk;
+                unsigned long long start = trace_begin();
+                int res = parse_fun(tk, last, vd, flags);
+                trace_end(start, "parse_fun", str_cbegin(&vd->name),
+                          *tk - begin);
+                return res;
             }
-        } else if (tk->type == token_word) {
-            str type = STR_INIT;
+        } else if ((*tk)[1].type == token_struct) {
+            *tk += 2;
+            return parse_struct(tk, last, vd);
+        }
+    }
+    return parse_var_decl_rest(vd, tk, last, &vd->exprs);
+}
+
+int
+parse(const vec_token* tokens, vec_var_decl* toplevels, int flags) {
+    token* tk;
+    token* last;
+    assert(tokens);
+    assert(toplevels);
+    last = tokens->tokens + tokens->len;
+    tk = tokens->tokens;
+    while (tk != last) {
+        var_decl vd;
+        if (tk->type == token_semicolon) {
             ++tk;
-            if (parse_namespaced_word(&type, &tk, last)) {
-                str_destroy(&type);
-                str_destroy(&name);
-                return -1;
-            }
-            if (tk == last) {
-                erroreof(&tk[-1].fpos, "semicolon");
-                str_destroy(&type);
-                str_destroy(&name);
-                return -1;
-            }
-            if (tk->type != token_semicolon) {
-                print_error_pos(&tk->fpos, "Expected a semicolon");
-                str_destroy(&type);
-                str_destroy(&name);
-                return -1;
-            }
-            /* NOT DONE */
-            assert(0);
-            str_destroy(&type);
+            continue;
+        }
+        vd.name = (str) STR_INIT;
+        vd.type.type = dtype_inferred;
+        vd.value = EXPR_NONE;
+        vd.exprs = (expression_pool) EXPRESSION_POOL_INIT;
+        vd.imported = 0;
+        vd.fpos = tk->fpos;
+        if (parse_toplevel(&tk, last, &vd, flags)) {
+            destroy_var_decl(&vd);
+            return -1;
+        }
+        if (vec_push(toplevels, sizeof(vd), &vd)) {
+            destroy_var_decl(&vd);
+            return -1;
         }
-        str_destroy(&name);
     }
     return 0;
 }
@@ -4,33 +4,82 @@
 #define HEADER_GUARD_PARSE_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "../cutil/str.h"
+#include "fposition.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-struct expression {
-    enum expression_type {
-        expression_name,
-
-        /* from widest to tightest: */
-        expression_comma = 1000,
-        expression_assign,
-        expression_minus,
-        expression_plus,
-    } type;
-    union {
-        struct {
-            struct expression* first;
-            struct expression* second;
-        } binary;
-        str name;
-    } data;
+/* Expressions live in an expression_pool and refer to each other by
+ * their index in it. */
+typedef uint32_t expr_ref;
+#define EXPR_NONE ((expr_ref) -1)
+
+enum expression_type {
+    expression_name,
+    expression_int,
+    expression_float,
+    /* `first` is the name of the function and `second` its
+     * arguments separated by commas or EXPR_NONE if there are
+     * none. */
+    expression_call,
+
+    /* from widest to tightest: */
+    expression_comma = 1000,
+    expression_assign,
+    expression_minus,
+    expression_plus,
 };
 typedef enum expression_type expression_type;
+
+struct expression {
+    /* an expression_type */
+    uint16_t type;
+    /* Set if the expression was written in parentheses. */
+    uint16_t grouped;
+    /* The operands of binary expressions.  Names store the offset of
+     * the name in the pool's `names` and literals store the low and
+     * high halves of their value. */
+    expr_ref first;
+    expr_ref second;
+};
 typedef struct expression expression;
 
+struct expression_pool {
+    expression* nodes;
+    uint32_t len, cap;
+    /* the null terminated names of name expressions */
+    char* names;
+    uint32_t names_len, names_cap;
+};
+typedef struct expression_pool expression_pool;
+#define EXPRESSION_POOL_INIT {0, 0, 0, 0, 0, 0}
+
+/* Add an expression to `pool`.  These return EXPR_NONE when out of
+ * memory. */
+expr_ref add_binary_expression(expression_pool*, expression_type,
+                               expr_ref first, expr_ref second);
+expr_ref add_name_expression(expression_pool*, const char* name);
+expr_ref add_int_expression(expression_pool*, unsigned long long);
+expr_ref add_float_expression(expression_pool*, double);
+expr_ref add_call_expression(expression_pool*, expr_ref name,
+                             expr_ref arguments);
+
+const char* get_expression_name(const expression_pool*, expr_ref);
+unsigned long long get_expression_int(const expression_pool*, expr_ref);
+double get_expression_float(const expression_pool*, expr_ref);
+/* The parser rejects calls with more arguments than this. */
+#define MAX_CALL_ARGUMENTS 256
+
+/* Store up to `max` arguments of `call` in `arguments` and return how
+ * many there are. */
+size_t get_call_arguments(const expression_pool*, expr_ref call,
+                          expr_ref* arguments, size_t max);
+
+void destroy_expression_pool(expression_pool*);
+
 struct type_expression {
     enum {
         type_pointer = 2,
@@ -59,8 +108,36 @@ struct vec_var_decl {
 };
 typedef struct vec_var_decl vec_var_decl;
 
+struct fun_def {
+    str name;
+    vec_var_decl params;
+    type_expression return_type;
+    statements stmts;
+    /* When parsing with parse_lazy_bodies, `stmts` is only filled in
+     * by parse_fun_body.  Until then these are the tokens from after
+     * the opening curly to the matching closing curly. */
+    struct token* body_begin;
+    struct token* body_end;
+    int body_parsed;
+};
+typedef struct fun_def fun_def;
+
+struct struct_def {
+    /* Each field has a dtype_name type and no value. */
+    vec_var_decl fields;
+    /* Set by the c_layout attribute to lay the fields out in the
+     * order they are declared, as C does, instead of reordering them
+     * to save padding. */
+    int c_layout;
+};
+typedef struct struct_def struct_def;
+
 struct defining_type_expression {
     enum {
+        /* name := value */
+        dtype_inferred = 0,
+        /* name : const = value */
+        dtype_const_inferred = 1,
         dtype_pointer = 2,
         dtype_const_pointer = 3,
         dtype_name = 4,
@@ -68,26 +145,32 @@ struct defining_type_expression {
         /* dtype_fun_ptr = 6, */
         /* dtype_const_fun_ptr = 7, */
         dtype_fun_def = 8,
-        /* dtype_struct_def = 9, */
+        dtype_struct_def = 9,
     } type;
     union {
         struct type_expression* next_type;
         str name;
-        struct {
-            str name;
-            vec_var_decl params;
-            type_expression return_type;
-            statements stmts;
-        } fun_def;
-        /* struct { */
-        /* } struct_def; */
+        fun_def fun_def;
+        struct_def struct_def;
     } data;
 };
 typedef struct defining_type_expression defining_type_expression;
 
 struct var_decl {
     str name;
+    fposition fpos;
     defining_type_expression type;
+    /* The initializer or default value, EXPR_NONE if there isn't
+     * one. */
+    expr_ref value;
+    /* Only used by top level declarations.  Every expression in the
+     * declaration, including those in its parameters and body, is
+     * stored here. */
+    expression_pool exprs;
+    /* Only used by top level declarations.  Set for declarations
+     * loaded from a module interface, which are defined by another
+     * object and have no body to check. */
+    int imported;
 };
 typedef struct var_decl var_decl;
 
@@ -96,23 +179,46 @@ struct statement {
         statement_if,
         statement_expression,
         statement_var_decl,
+        statement_return,
+        statement_block,
+        statement_while,
     } type;
     union {
         struct {
-            expression cond;
+            expr_ref cond;
             statements truebranch;
             statements falsebranch;
         } s_if;
-        expression s_expression;
+        expr_ref s_expression;
         var_decl s_var_decl;
+        /* EXPR_NONE for `return;` */
+        expr_ref s_return;
+        statements s_block;
+        struct {
+            expr_ref cond;
+            statements body;
+            /* where `while` is written */
+            fposition fpos;
+        } s_while;
     } data;
 };
 typedef struct statement statement;
 
 void destroy_var_decls(vec_var_decl*);
+void destroy_statement(statement*);
+
+enum parse_flags {
+    /* Only find the extent of function bodies instead of parsing
+     * them.  The tokens must then outlive the syntax tree. */
+    parse_lazy_bodies = 1,
+};
 
 struct vec_token;
-int parse(const struct vec_token*, vec_var_decl*);
+int parse(const struct vec_token*, vec_var_decl*, int flags);
+
+/* Parse the body of the function `decl` if it hasn't been parsed
+ * yet. */
+int parse_fun_body(struct var_decl* decl);
 
 #ifdef __cplusplus
 }
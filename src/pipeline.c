@@ -0,0 +1,195 @@
+#include "pipeline.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/stack_trace.h"
+#include "../cutil/vec.h"
+#include "fiter.h"
+#include "lex.h"
+#include "parse.h"
+#include "pool.h"
+#include "trace.h"
+
+struct batch {
+    vec_token tokens;
+    int lex_failed;
+};
+
+/* A single producer single consumer queue.  Only the lexer writes
+ * `tail` and only the parser writes `head`, so each side only has to
+ * publish its own index.  They live on separate cache lines so the
+ * two threads don't fight over one. */
+struct token_ring {
+    struct batch slots[PIPELINE_RING_SIZE];
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    /* Set by the parser when it gives up so the lexer stops. */
+    _Alignas(64) atomic_int stop;
+};
+
+struct lexer_thread {
+    struct token_ring* ring;
+    fiter* fiter;
+    unsigned long long wait;
+};
+
+static void
+release_batch(struct batch* batch) {
+    if (batch->tokens.tokens) {
+        destroy_tokens(&batch->tokens);
+    }
+}
+
+static int
+ring_push(struct token_ring* ring, const struct batch* batch,
+          unsigned long long* wait) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) ==
+        PIPELINE_RING_SIZE) {
+        unsigned long long start = now_nanoseconds();
+        while (tail - atomic_load_explicit(&ring->head,
+                                           memory_order_acquire) ==
+               PIPELINE_RING_SIZE) {
+            if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) {
+                return -1;
+            }
+            sched_yield();
+        }
+        *wait += now_nanoseconds() - start;
+    }
+    ring->slots[tail & (PIPELINE_RING_SIZE - 1)] = *batch;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+static void
+ring_pop(struct token_ring* ring, struct batch* batch,
+         unsigned long long* wait) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        unsigned long long start = now_nanoseconds();
+        while (atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+               head) {
+            sched_yield();
+        }
+        *wait += now_nanoseconds() - start;
+    }
+    *batch = ring->slots[head & (PIPELINE_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void*
+lexer_main(void* arg) {
+    struct lexer_thread* lexer = arg;
+    rpmalloc_thread_initialize();
+    trace_thread_name("lexer");
+    while (1) {
+        struct batch batch;
+        int done;
+        unsigned long long start = trace_begin();
+        batch.tokens = (vec_token) VEC_INIT;
+        batch.lex_failed = lex_declaration(lexer->fiter, &batch.tokens) != 0;
+        trace_end(start, "lex", 0, batch.tokens.len);
+        /* An empty batch tells the parser it reached the end. */
+        done = batch.tokens.len == 0 || batch.lex_failed;
+        if (ring_push(lexer->ring, &batch, &lexer->wait)) {
+            release_batch(&batch);
+            break;
+        }
+        if (done) {
+            break;
+        }
+    }
+    rpmalloc_thread_finalize();
+    return 0;
+}
+
+void
+destroy_token_batches(token_batches* batches) {
+    size_t i;
+    for (i = 0; i != batches->len; ++i) {
+        destroy_tokens(&batches->batches[i]);
+    }
+    rpfree(batches->batches);
+}
+
+int
+lex_and_parse_pipelined(fiter* fiter, vec_var_decl* toplevels, int flags,
+                        token_batches* keep, struct pipeline_times* times) {
+    struct token_ring* ring;
+    struct lexer_thread lexer;
+    pthread_t thread;
+    unsigned long long parser_wait = 0;
+    int ret = 0;
+    assert(fiter);
+    assert(toplevels);
+    assert(keep);
+
+    ring = rpmalloc(sizeof(struct token_ring));
+    if (!ring) {
+        return -1;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->stop, 0);
+    lexer.ring = ring;
+    lexer.fiter = fiter;
+    lexer.wait = 0;
+    if (pthread_create(&thread, 0, lexer_main, &lexer)) {
+        rpfree(ring);
+        return -1;
+    }
+
+    while (1) {
+        struct batch batch;
+        unsigned long long start;
+        int res;
+        ring_pop(ring, &batch, &parser_wait);
+        if (batch.lex_failed) {
+            release_batch(&batch);
+            STACK_TRACE_PRINT();
+            ret = -1;
+            break;
+        }
+        if (batch.tokens.len == 0) {
+            release_batch(&batch);
+            break;
+        }
+        start = trace_begin();
+        res = parse(&batch.tokens, toplevels, flags);
+        trace_end(start, "parse", 0, batch.tokens.len);
+        if (res) {
+            release_batch(&batch);
+            STACK_TRACE_PRINT();
+            ret = -1;
+            break;
+        }
+        if (!(flags & parse_lazy_bodies)) {
+            release_batch(&batch);
+        } else if (vec_push(keep, sizeof(batch.tokens), &batch.tokens)) {
+            release_batch(&batch);
+            ret = -1;
+            break;
+        }
+    }
+
+    /* Unblock the lexer if it is waiting for space, then throw away
+     * whatever it got to before stopping. */
+    atomic_store_explicit(&ring->stop, 1, memory_order_relaxed);
+    pthread_join(thread, 0);
+    while (atomic_load_explicit(&ring->head, memory_order_relaxed) !=
+           atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+        struct batch batch;
+        ring_pop(ring, &batch, &parser_wait);
+        release_batch(&batch);
+    }
+    rpfree(ring);
+
+    if (times) {
+        times->parser_wait = parser_wait;
+        times->lexer_wait = lexer.wait;
+    }
+    return ret;
+}
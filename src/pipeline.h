@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef HEADER_GUARD_PIPELINE_H
+#define HEADER_GUARD_PIPELINE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The number of declarations the lexer can get ahead of the
+ * parser.  Must be a power of two. */
+#define PIPELINE_RING_SIZE 64
+
+/* The tokens of each declaration, kept alive for lazily parsed
+ * bodies. */
+struct token_batches {
+    struct vec_token* batches;
+    size_t len, cap;
+};
+typedef struct token_batches token_batches;
+
+void destroy_token_batches(token_batches*);
+
+struct pipeline_times {
+    /* How long the parser waited for the lexer. */
+    unsigned long long parser_wait;
+    /* How long the lexer waited for the parser to make space. */
+    unsigned long long lexer_wait;
+};
+
+struct fiter;
+struct vec_var_decl;
+/* Lex on a separate thread while parsing on this one.  The lexer
+ * hands over the tokens of one declaration at a time through a ring
+ * of PIPELINE_RING_SIZE slots.  If `flags` has parse_lazy_bodies the
+ * tokens are moved into `keep`, otherwise they are destroyed once
+ * parsed. */
+int lex_and_parse_pipelined(struct fiter*, struct vec_var_decl* toplevels,
+                            int flags, token_batches* keep,
+                            struct pipeline_times* times);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,323 @@
+#include "pool.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "../cutil/rpmalloc.h"
+#include "trace.h"
+
+/* The tasks a worker has ready to run.  The owner pushes and pops at
+ * the bottom and thieves take from the top, so the owner works on
+ * the tasks it made ready most recently while thieves take the
+ * oldest ones. */
+struct deque {
+    pthread_mutex_t lock;
+    size_t* tasks;
+    size_t top, bottom;
+};
+
+struct pool_state {
+    const task_graph* graph;
+    struct deque* deques;
+    atomic_size_t* pending;
+    atomic_size_t completed;
+    size_t num_workers;
+};
+
+struct worker {
+    struct pool_state* state;
+    size_t index;
+};
+
+unsigned long long
+now_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL +
+           (unsigned long long) ts.tv_nsec;
+}
+
+size_t
+default_num_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t) n : 1;
+}
+
+static void
+deque_push(struct deque* deque, size_t task) {
+    pthread_mutex_lock(&deque->lock);
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int
+deque_pop(struct deque* deque, size_t* task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top != deque->bottom) {
+        *task = deque->tasks[--deque->bottom];
+        found = 1;
+    }
+    if (deque->top == deque->bottom) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int
+deque_steal(struct deque* deque, size_t* task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top != deque->bottom) {
+        *task = deque->tasks[deque->top++];
+        found = 1;
+    }
+    if (deque->top == deque->bottom) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int
+find_task(struct pool_state* state, size_t self, size_t* task) {
+    size_t i;
+    if (deque_pop(&state->deques[self], task)) {
+        return 1;
+    }
+    for (i = 1; i != state->num_workers; ++i) {
+        size_t victim = (self + i) % state->num_workers;
+        if (deque_steal(&state->deques[victim], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+work(struct pool_state* state, size_t self) {
+    const task_graph* graph = state->graph;
+    while (atomic_load(&state->completed) != graph->len) {
+        size_t task;
+        size_t i;
+        unsigned long long start;
+        if (!find_task(state, self, &task)) {
+            sched_yield();
+            continue;
+        }
+
+        start = graph->nanoseconds ? now_nanoseconds() : 0;
+        graph->run(graph->data, task);
+        if (graph->nanoseconds) {
+            graph->nanoseconds[task] = now_nanoseconds() - start;
+        }
+
+        for (i = graph->succ_begin[task];
+             i != graph->succ_begin[task + 1]; ++i) {
+            size_t succ = graph->succ[i];
+            if (atomic_fetch_sub(&state->pending[succ], 1) == 1) {
+                deque_push(&state->deques[self], succ);
+            }
+        }
+        atomic_fetch_add(&state->completed, 1);
+    }
+}
+
+static void*
+worker_main(void* arg) {
+    struct worker* worker = arg;
+    rpmalloc_thread_initialize();
+    trace_thread_name("worker");
+    work(worker->state, worker->index);
+    rpmalloc_thread_finalize();
+    return 0;
+}
+
+int
+run_task_graph(const task_graph* graph, size_t num_threads) {
+    struct pool_state state;
+    struct worker* workers = 0;
+    pthread_t* threads = 0;
+    size_t num_started = 0;
+    size_t num_roots = 0;
+    size_t i;
+    int ret = -1;
+    assert(graph);
+    assert(graph->run);
+
+    if (graph->len == 0) {
+        return 0;
+    }
+    if (num_threads == 0) {
+        num_threads = default_num_threads();
+    }
+    if (num_threads > graph->len) {
+        num_threads = graph->len;
+    }
+
+    state.graph = graph;
+    state.num_workers = num_threads;
+    atomic_init(&state.completed, 0);
+    state.pending = rpmalloc(graph->len * sizeof(atomic_size_t));
+    state.deques = rpcalloc(num_threads, sizeof(struct deque));
+    workers = rpmalloc(num_threads * sizeof(struct worker));
+    threads = rpmalloc(num_threads * sizeof(pthread_t));
+    if (!state.pending || !state.deques || !workers || !threads) {
+        goto cleanup;
+    }
+    for (i = 0; i != num_threads; ++i) {
+        /* Every task is pushed exactly once so one deque can never
+         * hold more than all of them. */
+        state.deques[i].tasks = rpmalloc(graph->len * sizeof(size_t));
+        if (!state.deques[i].tasks) {
+            goto cleanup;
+        }
+        pthread_mutex_init(&state.deques[i].lock, 0);
+    }
+
+    /* Deal the tasks without dependencies out round robin. */
+    for (i = 0; i != graph->len; ++i) {
+        atomic_init(&state.pending[i], graph->num_deps[i]);
+        if (graph->num_deps[i] == 0) {
+            struct deque* deque = &state.deques[num_roots++ % num_threads];
+            deque->tasks[deque->bottom++] = i;
+        }
+    }
+    assert(num_roots != 0);
+
+    for (i = 0; i != num_threads; ++i) {
+        workers[i].state = &state;
+        workers[i].index = i;
+    }
+    for (num_started = 1; num_started < num_threads; ++num_started) {
+        if (pthread_create(&threads[num_started], 0, worker_main,
+                           &workers[num_started])) {
+            break;
+        }
+    }
+    /* The calling thread is worker zero.  If some threads failed to
+     * start their tasks will be stolen by the ones that did. */
+    work(&state, 0);
+    for (i = 1; i < num_started; ++i) {
+        pthread_join(threads[i], 0);
+    }
+    ret = 0;
+
+cleanup:
+    if (state.deques) {
+        for (i = 0; i != num_threads; ++i) {
+            if (state.deques[i].tasks) {
+                pthread_mutex_destroy(&state.deques[i].lock);
+                rpfree(state.deques[i].tasks);
+            }
+        }
+    }
+    rpfree(state.deques);
+    rpfree(state.pending);
+    rpfree(workers);
+    rpfree(threads);
+    return ret;
+}
+
+void
+run_independent(void (*run)(void*, size_t), void* data, size_t len,
+                size_t num_threads) {
+    size_t* zeros = rpcalloc(len + 1, sizeof(size_t));
+    task_graph graph;
+    size_t i;
+    graph.len = len;
+    graph.run = run;
+    graph.data = data;
+    graph.num_deps = zeros;
+    graph.succ_begin = zeros;
+    graph.succ = 0;
+    graph.nanoseconds = 0;
+    if (!zeros || run_task_graph(&graph, num_threads)) {
+        for (i = 0; i != len; ++i) {
+            run(data, i);
+        }
+    }
+    rpfree(zeros);
+}
+
+#ifdef TEST_MODE
+#include <string.h>
+#include "../cutil/test.h"
+
+#define TEST_POOL_TASKS 256
+
+struct test_graph {
+    /* Task `i` depends on `i / 2` and `i / 3`, so there are many
+     * ready at once. */
+    size_t num_deps[TEST_POOL_TASKS];
+    size_t succ_begin[TEST_POOL_TASKS + 1];
+    size_t succ[2 * TEST_POOL_TASKS];
+    atomic_size_t finished;
+    size_t order[TEST_POOL_TASKS];
+    atomic_int runs[TEST_POOL_TASKS];
+};
+
+static void
+run_test_task(void* data, size_t task) {
+    struct test_graph* graph = data;
+    atomic_fetch_add(&graph->runs[task], 1);
+    graph->order[task] = atomic_fetch_add(&graph->finished, 1);
+}
+
+static void
+build_test_graph(struct test_graph* graph) {
+    size_t fill[TEST_POOL_TASKS];
+    size_t i;
+    memset(graph->succ_begin, 0, sizeof(graph->succ_begin));
+    for (i = 0; i != TEST_POOL_TASKS; ++i) {
+        graph->num_deps[i] = i == 0 ? 0 : 2;
+        atomic_init(&graph->runs[i], 0);
+        if (i != 0) {
+            ++graph->succ_begin[i / 2 + 1];
+            ++graph->succ_begin[i / 3 + 1];
+        }
+    }
+    for (i = 0; i != TEST_POOL_TASKS; ++i) {
+        graph->succ_begin[i + 1] += graph->succ_begin[i];
+        fill[i] = graph->succ_begin[i];
+    }
+    for (i = 1; i != TEST_POOL_TASKS; ++i) {
+        graph->succ[fill[i / 2]++] = i;
+        graph->succ[fill[i / 3]++] = i;
+    }
+    atomic_init(&graph->finished, 0);
+}
+
+/* Every task runs once, after the tasks it depends on, on any number
+ * of threads. */
+TEST(test_task_graph_order) {
+    static struct test_graph graph;
+    task_graph tasks;
+    size_t num_threads, i;
+    for (num_threads = 1; num_threads <= 8; num_threads *= 2) {
+        build_test_graph(&graph);
+        tasks.len = TEST_POOL_TASKS;
+        tasks.run = run_test_task;
+        tasks.data = &graph;
+        tasks.num_deps = graph.num_deps;
+        tasks.succ_begin = graph.succ_begin;
+        tasks.succ = graph.succ;
+        tasks.nanoseconds = 0;
+        ASSERT(run_task_graph(&tasks, num_threads) == 0, end);
+        for (i = 0; i != TEST_POOL_TASKS; ++i) {
+            ASSERT(atomic_load(&graph.runs[i]) == 1, end);
+            ASSERT(i == 0 || (graph.order[i / 2] < graph.order[i] &&
+                              graph.order[i / 3] < graph.order[i]), end);
+        }
+    }
+end:;
+}
+END_TEST
+
+void test_pool(void) {
+    RUN(test_task_graph_order);
+}
+#endif
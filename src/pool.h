@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef HEADER_GUARD_POOL_H
+#define HEADER_GUARD_POOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A set of tasks and the order they have to run in.  Task `i` may
+ * only start once all `num_deps[i]` tasks listing it as a successor
+ * have finished.  The successors of task `i` are
+ * `succ[succ_begin[i]]` to `succ[succ_begin[i + 1]]`. */
+struct task_graph {
+    size_t len;
+    void (*run)(void* data, size_t task);
+    void* data;
+    const size_t* num_deps;
+    const size_t* succ_begin;
+    const size_t* succ;
+    /* If not null, filled with the time each task took. */
+    unsigned long long* nanoseconds;
+};
+typedef struct task_graph task_graph;
+
+/* The number of threads to use when the user doesn't specify. */
+size_t default_num_threads(void);
+
+/* Run all the tasks in `graph` on `num_threads` threads (including
+ * the calling thread).  Each thread keeps its own queue of ready
+ * tasks and steals from the other threads when it runs out.  The
+ * graph must be acyclic. */
+int run_task_graph(const task_graph* graph, size_t num_threads);
+
+/* Run `len` tasks that don't depend on each other, on this thread
+ * alone if the pool can't be started. */
+void run_independent(void (*run)(void* data, size_t task), void* data,
+                     size_t len, size_t num_threads);
+
+unsigned long long now_nanoseconds(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1291 @@
+#include "sema.h"
+#include <assert.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "../cutil/str.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+#include "layout.h"
+#include "lex.h"
+#include "parse.h"
+#include "pool.h"
+#include "symtab.h"
+#include "trace.h"
+#include "types.h"
+
+/* Tasks `0` to `len` check the signature of the declaration with the
+ * same index and tasks `len` to `2 * len` check the bodies. */
+struct sema_context {
+    vec_var_decl* toplevels;
+    symtab names;
+    /* Written by the signature task of each declaration and read by
+     * the body tasks that depend on it. */
+    char* signature_ok;
+    /* The errors found by each task. */
+    vec_diagnostic* errors;
+    /* Set by body tasks that failed to parse the function body. */
+    char* parse_failed;
+    /* The type of each declaration, written by its signature task,
+     * and the types in each body, written by its body task. */
+    type_tables* types;
+    /* Set by body tasks that recalled their types. */
+    char* recalled;
+    int check_bodies;
+};
+typedef struct sema_context sema_context;
+
+typedef void (*name_visitor)(void* data, const char* name);
+
+/* Visit the names in a body that hasn't been parsed yet. */
+static void
+visit_token_names(const token* tk, const token* last,
+                  name_visitor visit, void* data) {
+    while (tk != last) {
+        str name = STR_INIT;
+        if (tk->type != token_word) {
+            ++tk;
+            continue;
+        }
+        str_push_str(&name, &tk->data.s);
+        ++tk;
+        while (tk != last && tk->type == token_namespace &&
+               tk + 1 != last && tk[1].type == token_word) {
+            str_push_s(&name, "::");
+            str_push_str(&name, &tk[1].data.s);
+            tk += 2;
+        }
+        visit(data, str_cbegin(&name));
+        str_destroy(&name);
+    }
+}
+
+/* Every expression of a declaration is in its pool, so instead of
+ * walking the syntax tree this scans the names stored in the pool.
+ * That includes the body if it has been parsed and expressions
+ * replaced by constant folding, which can only add dependencies that
+ * aren't needed. */
+static void
+visit_decl_names(const var_decl* decl, int visit_body,
+                 name_visitor visit, void* data) {
+    const char* name = decl->exprs.names;
+    const char* end = name + decl->exprs.names_len;
+    for (; name != end; name += strlen(name) + 1) {
+        visit(data, name);
+    }
+    if (visit_body && decl->type.type == dtype_fun_def &&
+        !decl->type.data.fun_def.body_parsed) {
+        const fun_def* fun = &decl->type.data.fun_def;
+        visit_token_names(fun->body_begin, fun->body_end, visit, data);
+    }
+}
+
+static int
+check_type_name(const sema_context* ctx, vec_diagnostic* errors,
+                const fposition* fpos, const str* type, int allow_void) {
+    const char* name = str_cbegin(type);
+    type_id id = lookup_builtin_type(name);
+    if (id == type_unknown) {
+        size_t index = symtab_lookup(&ctx->names, name);
+        if (index != SYMTAB_NOT_FOUND &&
+            ctx->toplevels->vars[index].type.type == dtype_struct_def) {
+            format_error_pos(errors, fpos, "Variables and functions "
+                             "cannot have the structure type %s yet",
+                             name);
+        } else {
+            format_error_pos(errors, fpos, "Unknown type %s", name);
+        }
+        return -1;
+    }
+    if (!allow_void && id == type_void) {
+        format_error_pos(errors, fpos, "Variables cannot have type %s",
+                         name);
+        return -1;
+    }
+    return 0;
+}
+
+/* The type of a literal, or of an expression of literals and
+ * constants, as initializers of globals and the values of constants
+ * are after eval_constants. */
+static type_id
+literal_type(const sema_context* ctx, const expression_pool* pool,
+             expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    const var_decl* decl;
+    type_id first, second;
+    size_t index;
+    switch ((expression_type) expr->type) {
+    case expression_int:
+        return type_int_literal;
+    case expression_float:
+        return type_float_literal;
+    case expression_name:
+        index = symtab_lookup(&ctx->names, get_expression_name(pool, ref));
+        if (index == SYMTAB_NOT_FOUND) {
+            return type_unknown;
+        }
+        decl = &ctx->toplevels->vars[index];
+        if (decl->type.type != dtype_const_inferred ||
+            decl->value == EXPR_NONE) {
+            return type_unknown;
+        }
+        return literal_type(ctx, &decl->exprs, decl->value);
+    case expression_minus:
+    case expression_plus:
+        first = literal_type(ctx, pool, expr->first);
+        second = literal_type(ctx, pool, expr->second);
+        if (first == type_unknown || second == type_unknown) {
+            return type_unknown;
+        }
+        return first == type_float_literal || second == type_float_literal
+                   ? type_float_literal : type_int_literal;
+    default:
+        return type_unknown;
+    }
+}
+
+/* Variables initialized with a literal hold the widest type of its
+ * kind. */
+static type_id
+default_type(type_id type) {
+    return type == type_int_literal ? type_i64
+         : type == type_float_literal ? type_f64 : type;
+}
+
+/* The type of a function with a valid signature. */
+static type_id
+signature_type(const fun_def* fun) {
+    type_id* params = rpmalloc((fun->params.len + 1) * sizeof(type_id));
+    size_t required = 0;
+    size_t i;
+    type_id type;
+    if (!params) {
+        return type_unknown;
+    }
+    for (i = 0; i != fun->params.len; ++i) {
+        params[i] = lookup_builtin_type(
+            str_cbegin(&fun->params.vars[i].type.data.name));
+        if (fun->params.vars[i].value == EXPR_NONE) {
+            required = i + 1;
+        }
+    }
+    type = intern_signature(
+        lookup_builtin_type(str_cbegin(&fun->return_type.data.name)),
+        params, fun->params.len, required);
+    rpfree(params);
+    return type;
+}
+
+static type_id
+declaration_type(const sema_context* ctx, const var_decl* decl) {
+    switch (decl->type.type) {
+    case dtype_fun_def:
+        return signature_type(&decl->type.data.fun_def);
+    case dtype_name:
+    case dtype_const_name:
+        return lookup_builtin_type(str_cbegin(&decl->type.data.name));
+    case dtype_inferred:
+        return decl->value == EXPR_NONE
+                   ? type_unknown
+                   : default_type(literal_type(ctx, &decl->exprs,
+                                               decl->value));
+    case dtype_const_inferred:
+        return decl->value == EXPR_NONE
+                   ? type_unknown
+                   : literal_type(ctx, &decl->exprs, decl->value);
+    default:
+        return type_unknown;
+    }
+}
+
+static void
+check_signature(sema_context* ctx, size_t index,
+                vec_diagnostic* errors) {
+    const var_decl* decl = &ctx->toplevels->vars[index];
+    int ok = 1;
+    if (decl->type.type == dtype_fun_def) {
+        const fun_def* fun = &decl->type.data.fun_def;
+        int seen_default = 0;
+        size_t i, j;
+        for (i = 0; i != fun->params.len; ++i) {
+            const var_decl* param = &fun->params.vars[i];
+            if (check_type_name(ctx, errors, &param->fpos,
+                                &param->type.data.name, 0)) {
+                ok = 0;
+            }
+            for (j = 0; j != i; ++j) {
+                if (strcmp(str_cbegin(&fun->params.vars[j].name),
+                           str_cbegin(&param->name)) == 0) {
+                    format_error_pos(errors, &param->fpos,
+                                     "Redefinition of parameter %s",
+                                     str_cbegin(&param->name));
+                    ok = 0;
+                }
+            }
+            if (param->value != EXPR_NONE) {
+                seen_default = 1;
+            } else if (seen_default) {
+                format_error_pos(errors, &param->fpos,
+                                 "Parameter %s must have a default "
+                                 "value as it follows a parameter "
+                                 "with one",
+                                 str_cbegin(&param->name));
+                ok = 0;
+            }
+        }
+        if (check_type_name(ctx, errors, &decl->fpos,
+                            &fun->return_type.data.name, 1)) {
+            ok = 0;
+        }
+    } else if (decl->type.type == dtype_name) {
+        if (check_type_name(ctx, errors, &decl->fpos,
+                            &decl->type.data.name, 0)) {
+            ok = 0;
+        }
+    } else if (decl->type.type == dtype_struct_def) {
+        /* signatures are checked on several threads, so each has its
+         * own cache */
+        layout_cache cache = LAYOUT_CACHE_INIT;
+        struct_layout layout;
+        if (layout_struct(ctx->toplevels, &ctx->names, &cache, index,
+                          &layout, errors)) {
+            ok = 0;
+        } else {
+            destroy_struct_layout(&layout);
+        }
+        destroy_layout_cache(&cache);
+    }
+    ctx->signature_ok[index] = ok;
+    ctx->types->declarations[index] = ok ? declaration_type(ctx, decl)
+                                         : type_unknown;
+}
+
+struct local {
+    const char* name;
+    int is_const;
+    type_id type;
+};
+
+struct body_checker {
+    const sema_context* ctx;
+    const var_decl* decl;
+    /* the expressions of `decl` */
+    const expression_pool* pool;
+    vec_diagnostic* errors;
+    /* Where the type of each expression and local is recorded. */
+    expression_types* types;
+    size_t locals_cap;
+    /* What the function being checked returns. */
+    type_id return_type;
+    /* The variables in scope, innermost last. */
+    struct {
+        struct local* locals;
+        size_t len, cap;
+    } scope;
+};
+typedef struct body_checker body_checker;
+
+static const struct local*
+lookup_local(const body_checker* checker, const char* name) {
+    size_t i = checker->scope.len;
+    while (i--) {
+        if (strcmp(checker->scope.locals[i].name, name) == 0) {
+            return &checker->scope.locals[i];
+        }
+    }
+    return 0;
+}
+
+static void
+check_name(void* data, const char* name) {
+    body_checker* checker = data;
+    if (lookup_local(checker, name)) {
+        return;
+    }
+    if (symtab_lookup(&checker->ctx->names, name) == SYMTAB_NOT_FOUND) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Unknown name %s in %s", name,
+                         str_cbegin(&checker->decl->name));
+    }
+}
+
+/* The type of the top level declaration `index`, type_unknown if its
+ * signature was broken. */
+static type_id
+toplevel_type(const body_checker* checker, size_t index) {
+    return checker->ctx->signature_ok[index]
+               ? checker->ctx->types->declarations[index] : type_unknown;
+}
+
+static type_id
+name_type(body_checker* checker, const char* name) {
+    const struct local* local = lookup_local(checker, name);
+    size_t index;
+    if (local) {
+        return local->type;
+    }
+    index = symtab_lookup(&checker->ctx->names, name);
+    if (index == SYMTAB_NOT_FOUND) {
+        check_name(checker, name);
+        return type_unknown;
+    }
+    if (checker->ctx->toplevels->vars[index].type.type ==
+        dtype_struct_def) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "The structure %s is not a value in %s", name,
+                         str_cbegin(&checker->decl->name));
+        return type_unknown;
+    }
+    return toplevel_type(checker, index);
+}
+
+/* Report `message` with the names of the types `first` and `second`
+ * and then the name of the function being checked filling in its %s.
+ * If `second` is type_unknown the message only names `first`. */
+static void
+type_error(body_checker* checker, const char* message, type_id first,
+           type_id second) {
+    str first_name = STR_INIT;
+    str second_name = STR_INIT;
+    if (format_type(&first_name, first) ||
+        (second != type_unknown && format_type(&second_name, second))) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Out of memory while checking %s",
+                         str_cbegin(&checker->decl->name));
+    } else if (second == type_unknown) {
+        format_error_pos(checker->errors, &checker->decl->fpos, message,
+                         str_cbegin(&first_name),
+                         str_cbegin(&checker->decl->name));
+    } else {
+        format_error_pos(checker->errors, &checker->decl->fpos, message,
+                         str_cbegin(&first_name), str_cbegin(&second_name),
+                         str_cbegin(&checker->decl->name));
+    }
+    str_destroy(&first_name);
+    str_destroy(&second_name);
+}
+
+static int
+literal_fits(unsigned long long value, type_id type) {
+    switch (type) {
+    case type_bool:
+        return value <= 1;
+    case type_byte:
+    case type_u8:
+        return value <= 0xFF;
+    case type_i8:
+        return value <= 0x7F;
+    case type_i16:
+        return value <= 0x7FFF;
+    case type_u16:
+        return value <= 0xFFFF;
+    case type_i32:
+        return value <= 0x7FFFFFFF;
+    case type_u32:
+        return value <= 0xFFFFFFFF;
+    case type_i64:
+        return value <= 0x7FFFFFFFFFFFFFFF;
+    default:
+        return 1;
+    }
+}
+
+/* Check that `ref`, of type `from`, can be used where a `to` is
+ * expected.  Literals convert to any type that can hold them and
+ * nothing else converts implicitly. */
+static void
+check_conversion(body_checker* checker, expr_ref ref, type_id from,
+                 type_id to) {
+    if (from == type_unknown || to == type_unknown || from == to ||
+        to == type_int_literal || to == type_float_literal) {
+        return;
+    }
+    if (from == type_int_literal &&
+        (is_integer_type(to) || is_float_type(to))) {
+        if (checker->pool->nodes[ref].type == expression_int &&
+            !literal_fits(get_expression_int(checker->pool, ref), to)) {
+            type_error(checker, "The literal does not fit in %s in %s",
+                       to, type_unknown);
+        }
+        return;
+    }
+    if (from == type_float_literal && is_float_type(to)) {
+        return;
+    }
+    type_error(checker, "Cannot convert %s to %s in %s", from, to);
+}
+
+/* The type of adding or subtracting a `first` and a `second`. */
+static type_id
+arithmetic_type(body_checker* checker, type_id first, type_id second) {
+    if (first == type_unknown || second == type_unknown) {
+        return type_unknown;
+    }
+    if (is_vector_type(first) || is_vector_type(second)) {
+        /* lane by lane, so only between vectors of the same type */
+        if (first != second) {
+            type_error(checker, "Mismatched types %s and %s in %s", first,
+                       second);
+            return type_unknown;
+        }
+        return first;
+    }
+    if (!is_integer_type(first) && !is_float_type(first)) {
+        type_error(checker, "Cannot add or subtract %s and %s in %s",
+                   first, second);
+        return type_unknown;
+    }
+    if (!is_integer_type(second) && !is_float_type(second)) {
+        type_error(checker, "Cannot add or subtract %s and %s in %s",
+                   first, second);
+        return type_unknown;
+    }
+    if (first == second) {
+        return first;
+    }
+    if (first == type_int_literal ||
+        (first == type_float_literal && is_float_type(second))) {
+        return second;
+    }
+    if (second == type_int_literal ||
+        (second == type_float_literal && is_float_type(first))) {
+        return first;
+    }
+    type_error(checker, "Mismatched types %s and %s in %s", first, second);
+    return type_unknown;
+}
+
+/* Returns the type of the variable assigned to. */
+static type_id
+check_assignment(body_checker* checker, expr_ref target) {
+    const char* name;
+    const struct local* local;
+    size_t index;
+    const var_decl* decl;
+    if (checker->pool->nodes[target].type != expression_name) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Can only assign to variables in %s",
+                         str_cbegin(&checker->decl->name));
+        return type_unknown;
+    }
+    name = get_expression_name(checker->pool, target);
+    local = lookup_local(checker, name);
+    if (local) {
+        if (local->is_const) {
+            goto constant;
+        }
+        return local->type;
+    }
+    index = symtab_lookup(&checker->ctx->names, name);
+    /* Unknown names are reported by check_name and declarations
+     * with broken signatures have already been reported. */
+    if (index == SYMTAB_NOT_FOUND || !checker->ctx->signature_ok[index]) {
+        return type_unknown;
+    }
+    decl = &checker->ctx->toplevels->vars[index];
+    if (decl->type.type == dtype_name ||
+        decl->type.type == dtype_inferred) {
+        return toplevel_type(checker, index);
+    }
+constant:
+    format_error_pos(checker->errors, &checker->decl->fpos,
+                     "Cannot assign to constant %s in %s", name,
+                     str_cbegin(&checker->decl->name));
+    return type_unknown;
+}
+
+static type_id check_expression(body_checker* checker, expr_ref ref);
+
+/* The type of calling `function` with `arguments` of `types`. */
+static type_id
+check_builtin_call(body_checker* checker, builtin_function function,
+                   const char* name, const expr_ref* arguments,
+                   const type_id* types, size_t num_arguments) {
+    size_t num_params = function == builtin_lane ? 2 : 3;
+    const builtin_type_info* vector;
+    const expression* lane;
+    if (num_arguments != num_params) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "%s takes %lu arguments but got %lu in %s", name,
+                         (unsigned long) num_params,
+                         (unsigned long) num_arguments,
+                         str_cbegin(&checker->decl->name));
+        return type_unknown;
+    }
+    if (types[0] == type_unknown) {
+        return type_unknown;
+    }
+    if (!is_vector_type(types[0])) {
+        type_error(checker, "The first argument of std::lane and "
+                   "std::with_lane must be a vector, not %s, in %s",
+                   types[0], type_unknown);
+        return type_unknown;
+    }
+    vector = get_builtin_type(types[0]);
+    lane = &checker->pool->nodes[arguments[1]];
+    if (lane->type != expression_int ||
+        get_expression_int(checker->pool, arguments[1]) >= vector->lanes) {
+        type_error(checker, "The lane must be an integer literal less "
+                   "than the number of lanes of %s in %s", types[0],
+                   type_unknown);
+        return type_unknown;
+    }
+    if (function == builtin_lane) {
+        return vector->element;
+    }
+    check_conversion(checker, arguments[2], types[2], vector->element);
+    return types[0];
+}
+
+static type_id
+check_call(body_checker* checker, expr_ref call) {
+    expr_ref arguments[MAX_CALL_ARGUMENTS];
+    type_id types[MAX_CALL_ARGUMENTS];
+    size_t num_arguments = get_call_arguments(checker->pool, call, arguments,
+                                              MAX_CALL_ARGUMENTS);
+    const char* name = get_expression_name(checker->pool,
+                                           checker->pool->nodes[call].first);
+    const signature* sig;
+    type_id type;
+    size_t index, i;
+    for (i = 0; i != num_arguments; ++i) {
+        types[i] = check_expression(checker, arguments[i]);
+    }
+    if (lookup_local(checker, name)) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Cannot call the variable %s in %s", name,
+                         str_cbegin(&checker->decl->name));
+        return type_unknown;
+    }
+    if (lookup_builtin_function(name) != builtin_not_a_function) {
+        return check_builtin_call(checker, lookup_builtin_function(name),
+                                  name, arguments, types, num_arguments);
+    }
+    index = symtab_lookup(&checker->ctx->names, name);
+    if (index == SYMTAB_NOT_FOUND) {
+        check_name(checker, name);
+        return type_unknown;
+    }
+    if (!checker->ctx->signature_ok[index]) {
+        return type_unknown;
+    }
+    if (checker->ctx->toplevels->vars[index].type.type != dtype_fun_def) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Cannot call %s in %s as it is not a function",
+                         name, str_cbegin(&checker->decl->name));
+        return type_unknown;
+    }
+    type = toplevel_type(checker, index);
+    if (type < type_first_signature) {
+        return type_unknown;
+    }
+    sig = get_signature(type);
+    if (num_arguments > sig->num_params) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Too many arguments to %s in %s: expected "
+                         "at most %lu but got %lu",
+                         name, str_cbegin(&checker->decl->name),
+                         (unsigned long) sig->num_params,
+                         (unsigned long) num_arguments);
+    } else if (num_arguments < sig->num_required) {
+        format_error_pos(checker->errors, &checker->decl->fpos,
+                         "Too few arguments to %s in %s: expected "
+                         "at least %lu but got %lu",
+                         name, str_cbegin(&checker->decl->name),
+                         (unsigned long) sig->num_required,
+                         (unsigned long) num_arguments);
+    } else {
+        for (i = 0; i != num_arguments; ++i) {
+            check_conversion(checker, arguments[i], types[i],
+                             sig->params[i]);
+        }
+    }
+    return sig->return_type;
+}
+
+static type_id
+check_expression(body_checker* checker, expr_ref ref) {
+    const expression* expr = &checker->pool->nodes[ref];
+    type_id type = type_unknown;
+    type_id first;
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        type = name_type(checker, get_expression_name(checker->pool, ref));
+        break;
+    case expression_int:
+        type = type_int_literal;
+        break;
+    case expression_float:
+        type = type_float_literal;
+        break;
+    case expression_call:
+        type = check_call(checker, ref);
+        break;
+    case expression_assign:
+        type = check_assignment(checker, expr->first);
+        check_expression(checker, expr->first);
+        check_conversion(checker, expr->second,
+                         check_expression(checker, expr->second), type);
+        break;
+    case expression_comma:
+        check_expression(checker, expr->first);
+        type = check_expression(checker, expr->second);
+        break;
+    case expression_minus:
+    case expression_plus:
+        first = check_expression(checker, expr->first);
+        type = arithmetic_type(checker, first,
+                               check_expression(checker, expr->second));
+        break;
+    }
+    if (ref < checker->types->len) {
+        checker->types->types[ref] = type;
+    }
+    return type;
+}
+
+static int
+declare_local(body_checker* checker, const var_decl* var, type_id type) {
+    struct local local;
+    expression_types* types = checker->types;
+    if (types->num_locals == checker->locals_cap) {
+        size_t cap = checker->locals_cap ? checker->locals_cap * 2 : 16;
+        type_id* grown = rprealloc(types->locals, cap * sizeof(type_id));
+        if (!grown) {
+            return -1;
+        }
+        types->locals = grown;
+        checker->locals_cap = cap;
+    }
+    types->locals[types->num_locals++] = type;
+    local.name = str_cbegin(&var->name);
+    local.is_const = var->type.type == dtype_const_inferred;
+    local.type = type;
+    return vec_push(&checker->scope, sizeof(local), &local);
+}
+
+/* Check that `cond` is something `if` and `while` can test. */
+static void
+check_condition(body_checker* checker, expr_ref cond) {
+    type_id type = check_expression(checker, cond);
+    if (type != type_unknown && !is_integer_type(type)) {
+        type_error(checker, "Conditions must be integers but got %s "
+                   "in %s", type, type_unknown);
+    }
+}
+
+static int
+check_statements(body_checker* checker, const statements* stmts) {
+    size_t scope_start = checker->scope.len;
+    size_t i;
+    for (i = 0; i != stmts->len; ++i) {
+        const statement* stmt = &stmts->stmts[i];
+        switch (stmt->type) {
+        case statement_if:
+            check_condition(checker, stmt->data.s_if.cond);
+            if (check_statements(checker, &stmt->data.s_if.truebranch) ||
+                check_statements(checker,
+                                 &stmt->data.s_if.falsebranch)) {
+                return -1;
+            }
+            break;
+        case statement_expression:
+            check_expression(checker, stmt->data.s_expression);
+            break;
+        case statement_var_decl:
+            {
+                const var_decl* var = &stmt->data.s_var_decl;
+                const struct local* shadowed;
+                type_id type = type_unknown;
+                type_id value = type_unknown;
+                int declared = var->type.type == dtype_name ||
+                               var->type.type == dtype_const_name;
+                if (declared &&
+                    check_type_name(checker->ctx, checker->errors,
+                                    &var->fpos,
+                                    &var->type.data.name, 0) == 0) {
+                    type = lookup_builtin_type(
+                        str_cbegin(&var->type.data.name));
+                }
+                if (var->value != EXPR_NONE) {
+                    /* the variable isn't in scope in its own
+                     * initializer */
+                    value = check_expression(checker, var->value);
+                }
+                if (declared) {
+                    check_conversion(checker, var->value, value, type);
+                } else if (value == type_void) {
+                    type_error(checker, "Cannot initialize a variable "
+                               "with %s in %s", value, type_unknown);
+                } else {
+                    /* constants keep the type of their literal while
+                     * variables hold the default type for it */
+                    type = var->type.type == dtype_const_inferred
+                               ? value : default_type(value);
+                }
+                shadowed = lookup_local(checker, str_cbegin(&var->name));
+                if (shadowed &&
+                    (size_t) (shadowed - checker->scope.locals) >=
+                        scope_start) {
+                    format_error_pos(checker->errors, &var->fpos,
+                                     "Redefinition of %s",
+                                     str_cbegin(&var->name));
+                }
+                if (declare_local(checker, var, type)) {
+                    return -1;
+                }
+            }
+            break;
+        case statement_return:
+            if (stmt->data.s_return != EXPR_NONE) {
+                type_id type = check_expression(checker,
+                                                stmt->data.s_return);
+                if (checker->return_type == type_void &&
+                    type != type_unknown) {
+                    type_error(checker, "Cannot return %s from a function "
+                               "returning %s in %s", type, type_void);
+                } else {
+                    check_conversion(checker, stmt->data.s_return, type,
+                                     checker->return_type);
+                }
+            } else if (checker->return_type != type_void &&
+                       checker->return_type != type_unknown) {
+                type_error(checker, "Cannot return nothing from a "
+                           "function returning %s in %s",
+                           checker->return_type, type_unknown);
+            }
+            break;
+        case statement_block:
+            if (check_statements(checker, &stmt->data.s_block)) {
+                return -1;
+            }
+            break;
+        case statement_while:
+            check_condition(checker, stmt->data.s_while.cond);
+            if (check_statements(checker, &stmt->data.s_while.body)) {
+                return -1;
+            }
+            break;
+        }
+    }
+    checker->scope.len = scope_start;
+    return 0;
+}
+
+static unsigned long long
+stamp_bytes(unsigned long long stamp, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        stamp = (stamp ^ bytes[i]) * 1099511628211ULL;
+    }
+    return stamp;
+}
+
+static unsigned long long
+stamp_string(unsigned long long stamp, const str* s) {
+    return stamp_bytes(stamp, str_cbegin(s), strlen(str_cbegin(s)) + 1);
+}
+
+static unsigned long long stamp_statements(unsigned long long stamp,
+                                           const statements* stmts);
+
+static unsigned long long
+stamp_var_decl(unsigned long long stamp, const var_decl* var) {
+    int type = var->type.type;
+    stamp = stamp_string(stamp, &var->name);
+    stamp = stamp_bytes(stamp, &type, sizeof(type));
+    if (type == dtype_name || type == dtype_const_name) {
+        stamp = stamp_string(stamp, &var->type.data.name);
+    }
+    return stamp_bytes(stamp, &var->value, sizeof(var->value));
+}
+
+static unsigned long long
+stamp_statements(unsigned long long stamp, const statements* stmts) {
+    size_t i;
+    for (i = 0; i != stmts->len; ++i) {
+        const statement* stmt = &stmts->stmts[i];
+        int type = stmt->type;
+        stamp = stamp_bytes(stamp, &type, sizeof(type));
+        switch (stmt->type) {
+        case statement_if:
+            stamp = stamp_bytes(stamp, &stmt->data.s_if.cond,
+                                sizeof(expr_ref));
+            stamp = stamp_statements(stamp, &stmt->data.s_if.truebranch);
+            stamp = stamp_statements(stamp, &stmt->data.s_if.falsebranch);
+            break;
+        case statement_expression:
+            stamp = stamp_bytes(stamp, &stmt->data.s_expression,
+                                sizeof(expr_ref));
+            break;
+        case statement_var_decl:
+            stamp = stamp_var_decl(stamp, &stmt->data.s_var_decl);
+            break;
+        case statement_return:
+            stamp = stamp_bytes(stamp, &stmt->data.s_return,
+                                sizeof(expr_ref));
+            break;
+        case statement_block:
+            stamp = stamp_statements(stamp, &stmt->data.s_block);
+            break;
+        case statement_while:
+            stamp = stamp_bytes(stamp, &stmt->data.s_while.cond,
+                                sizeof(expr_ref));
+            stamp = stamp_statements(stamp, &stmt->data.s_while.body);
+            break;
+        }
+        /* close the statement so nesting can't be confused with
+         * sequence */
+        stamp = stamp_bytes(stamp, "", 1);
+    }
+    return stamp;
+}
+
+/* Identify everything about `decl` that its check looks at except the
+ * other declarations.  The expressions are hashed as they are laid
+ * out in the pool, which only ever changes with the source. */
+static unsigned long long
+body_stamp(const var_decl* decl) {
+    const expression_pool* pool = &decl->exprs;
+    unsigned long long stamp = stamp_var_decl(14695981039346656037ULL,
+                                              decl);
+    stamp = stamp_bytes(stamp, pool->nodes, pool->len * sizeof(expression));
+    stamp = stamp_bytes(stamp, pool->names, pool->names_len);
+    if (decl->type.type == dtype_fun_def) {
+        const fun_def* fun = &decl->type.data.fun_def;
+        size_t i;
+        for (i = 0; i != fun->params.len; ++i) {
+            stamp = stamp_var_decl(stamp, &fun->params.vars[i]);
+        }
+        stamp = stamp_string(stamp, &fun->return_type.data.name);
+        stamp = stamp_statements(stamp, &fun->stmts);
+    }
+    return stamp;
+}
+
+struct deps_stamper {
+    const sema_context* ctx;
+    unsigned long long stamp;
+};
+
+static void
+stamp_dependency(void* data, const char* name) {
+    struct deps_stamper* stamper = data;
+    size_t index = symtab_lookup(&stamper->ctx->names, name);
+    unsigned long long stamp = stamp_bytes(stamper->stamp, name,
+                                           strlen(name) + 1);
+    if (index != SYMTAB_NOT_FOUND) {
+        const var_decl* decl = &stamper->ctx->toplevels->vars[index];
+        int type = decl->type.type;
+        type_id signature = stamper->ctx->signature_ok[index]
+            ? stamper->ctx->types->declarations[index] : type_unknown;
+        stamp = stamp_bytes(stamp, &type, sizeof(type));
+        stamp = stamp_bytes(stamp, &signature, sizeof(signature));
+    }
+    stamper->stamp = stamp;
+}
+
+/* Identify the signatures of the declarations `decl` names, which are
+ * what its types depend on besides itself.  Function types are
+ * interned for the life of the process, so equal signatures give
+ * equal stamps across compilations. */
+static unsigned long long
+deps_stamp(const sema_context* ctx, const var_decl* decl) {
+    struct deps_stamper stamper;
+    stamper.ctx = ctx;
+    stamper.stamp = 14695981039346656037ULL;
+    visit_decl_names(decl, 0, stamp_dependency, &stamper);
+    return stamper.stamp;
+}
+
+/* Returns -1 if the body failed to parse. */
+static int
+check_body(sema_context* ctx, size_t index, vec_diagnostic* errors) {
+    body_checker checker;
+    var_decl* decl = &ctx->toplevels->vars[index];
+    expression_types* types = &ctx->types->bodies[index];
+    unsigned long long start, body = 0, deps = 0;
+    size_t num_errors = errors->len;
+    int remember = remembering_types();
+    checker.ctx = ctx;
+    checker.decl = decl;
+    checker.pool = &decl->exprs;
+    checker.errors = errors;
+    checker.types = types;
+    checker.locals_cap = 0;
+    checker.return_type = type_unknown;
+    checker.scope.locals = 0;
+    checker.scope.len = 0;
+    checker.scope.cap = 0;
+    start = trace_begin();
+
+    if (decl->imported) {
+        /* checked when its module was compiled */
+        trace_end(start, "check_body", str_cbegin(&decl->name), 0);
+        return 0;
+    }
+    if (decl->type.type == dtype_fun_def && ctx->check_bodies &&
+        parse_fun_body(decl)) {
+        return -1;
+    }
+    if (remember) {
+        body = body_stamp(decl);
+        deps = deps_stamp(ctx, decl);
+        if (recall_types(str_cbegin(&decl->name), body, deps, types) == 0) {
+            ctx->recalled[index] = 1;
+            trace_end(start, "check_body", str_cbegin(&decl->name), 0);
+            return 0;
+        }
+    }
+    types->types = rpcalloc(decl->exprs.len + 1, sizeof(type_id));
+    if (!types->types) {
+        goto oom;
+    }
+    types->len = decl->exprs.len;
+    if (decl->value != EXPR_NONE) {
+        check_conversion(&checker, decl->value,
+                         check_expression(&checker, decl->value),
+                         ctx->signature_ok[index]
+                             ? ctx->types->declarations[index]
+                             : type_unknown);
+    }
+    if (decl->type.type == dtype_fun_def && ctx->check_bodies) {
+        fun_def* fun = &decl->type.data.fun_def;
+        size_t i;
+        checker.return_type = lookup_builtin_type(
+            str_cbegin(&fun->return_type.data.name));
+        for (i = 0; i != fun->params.len; ++i) {
+            const var_decl* param = &fun->params.vars[i];
+            type_id type = lookup_builtin_type(
+                str_cbegin(&param->type.data.name));
+            if (param->value != EXPR_NONE) {
+                /* the parameters aren't in scope in default values */
+                check_conversion(&checker, param->value,
+                                 check_expression(&checker, param->value),
+                                 type);
+            }
+            if (declare_local(&checker, param, type)) {
+                goto oom;
+            }
+        }
+        if (check_statements(&checker, &fun->stmts)) {
+            goto oom;
+        }
+    }
+    if (remember && errors->len == num_errors) {
+        store_types(str_cbegin(&decl->name), body, deps, types);
+    }
+    rpfree(checker.scope.locals);
+    trace_end(start, "check_body", str_cbegin(&decl->name), 0);
+    return 0;
+
+oom:
+    format_error_pos(checker.errors, &decl->fpos,
+                     "Out of memory while checking %s",
+                     str_cbegin(&decl->name));
+    rpfree(checker.scope.locals);
+    trace_end(start, "check_body", str_cbegin(&decl->name), 0);
+    return 0;
+}
+
+static void
+run_task(void* data, size_t task) {
+    sema_context* ctx = data;
+    size_t len = ctx->toplevels->len;
+    if (task < len) {
+        unsigned long long start = trace_begin();
+        check_signature(ctx, task, &ctx->errors[task]);
+        trace_end(start, "check_signature",
+                  str_cbegin(&ctx->toplevels->vars[task].name), 0);
+    } else if (check_body(ctx, task - len, &ctx->errors[task])) {
+        ctx->parse_failed[task - len] = 1;
+    }
+}
+
+struct edge {
+    size_t from, to;
+};
+
+struct graph_builder {
+    const sema_context* ctx;
+    size_t decl;
+    /* stamp[j] == decl + 1 if decl already depends on j */
+    size_t* stamp;
+    struct {
+        struct edge* edges;
+        size_t len, cap;
+    } edges;
+    int failed;
+};
+
+static void
+add_dependency(void* data, const char* name) {
+    struct graph_builder* builder = data;
+    size_t len = builder->ctx->toplevels->len;
+    size_t index = symtab_lookup(&builder->ctx->names, name);
+    struct edge edge;
+    if (index == SYMTAB_NOT_FOUND || index == builder->decl ||
+        builder->stamp[index] == builder->decl + 1) {
+        return;
+    }
+    builder->stamp[index] = builder->decl + 1;
+    edge.from = index;
+    edge.to = len + builder->decl;
+    if (vec_push(&builder->edges, sizeof(edge), &edge)) {
+        builder->failed = 1;
+    }
+}
+
+/* Each body depends on its own signature and the signatures of the
+ * top level declarations it names. */
+static int
+build_graph(const sema_context* ctx, task_graph* graph) {
+    struct graph_builder builder;
+    size_t len = ctx->toplevels->len;
+    size_t* num_deps = rpcalloc(2 * len, sizeof(size_t));
+    size_t* succ_begin = rpcalloc(2 * len + 1, sizeof(size_t));
+    size_t* succ = 0;
+    size_t* fill = 0;
+    size_t i;
+
+    builder.ctx = ctx;
+    builder.stamp = rpcalloc(len, sizeof(size_t));
+    builder.edges.edges = 0;
+    builder.edges.len = 0;
+    builder.edges.cap = 0;
+    builder.failed = 0;
+    if (!num_deps || !succ_begin || !builder.stamp) {
+        goto fail;
+    }
+    for (i = 0; i != len; ++i) {
+        struct edge edge;
+        edge.from = i;
+        edge.to = len + i;
+        if (vec_push(&builder.edges, sizeof(edge), &edge)) {
+            goto fail;
+        }
+        builder.decl = i;
+        visit_decl_names(&ctx->toplevels->vars[i], ctx->check_bodies,
+                         add_dependency, &builder);
+        if (builder.failed) {
+            goto fail;
+        }
+    }
+
+    /* convert the edge list to compressed rows */
+    for (i = 0; i != builder.edges.len; ++i) {
+        ++num_deps[builder.edges.edges[i].to];
+        ++succ_begin[builder.edges.edges[i].from + 1];
+    }
+    for (i = 0; i != 2 * len; ++i) {
+        succ_begin[i + 1] += succ_begin[i];
+    }
+    succ = rpmalloc((builder.edges.len + 1) * sizeof(size_t));
+    fill = rpmalloc(2 * len * sizeof(size_t));
+    if (!succ || !fill) {
+        goto fail;
+    }
+    memcpy(fill, succ_begin, 2 * len * sizeof(size_t));
+    for (i = 0; i != builder.edges.len; ++i) {
+        succ[fill[builder.edges.edges[i].from]++] =
+            builder.edges.edges[i].to;
+    }
+
+    rpfree(fill);
+    rpfree(builder.stamp);
+    rpfree(builder.edges.edges);
+    graph->len = 2 * len;
+    graph->num_deps = num_deps;
+    graph->succ_begin = succ_begin;
+    graph->succ = succ;
+    return 0;
+
+fail:
+    rpfree(fill);
+    rpfree(succ);
+    rpfree(builder.stamp);
+    rpfree(builder.edges.edges);
+    rpfree(num_deps);
+    rpfree(succ_begin);
+    return -1;
+}
+
+int
+check_semantics(vec_var_decl* toplevels, size_t num_threads,
+                int check_bodies, int dump_times, type_tables* types) {
+    sema_context ctx;
+    task_graph graph;
+    type_tables discarded;
+    size_t len = toplevels->len;
+    size_t i;
+    int ret = 0;
+
+    ctx.types = types ? types : &discarded;
+    if (init_type_tables(ctx.types, len)) {
+        return -1;
+    }
+    if (len == 0) {
+        goto cleanup_types;
+    }
+
+    ctx.toplevels = toplevels;
+    ctx.check_bodies = check_bodies;
+    if (symtab_init(&ctx.names, len)) {
+        ret = -1;
+        goto cleanup_types;
+    }
+    for (i = 0; i != len; ++i) {
+        const var_decl* decl = &toplevels->vars[i];
+        if (symtab_insert(&ctx.names, str_cbegin(&decl->name), i)) {
+            print_error_pos(&decl->fpos, "Redefinition of %s",
+                            str_cbegin(&decl->name));
+            ret = -1;
+        }
+    }
+    if (ret) {
+        symtab_destroy(&ctx.names);
+        goto cleanup_types;
+    }
+
+    ctx.signature_ok = rpcalloc(len, 1);
+    ctx.errors = rpcalloc(2 * len, sizeof(vec_diagnostic));
+    ctx.parse_failed = rpcalloc(len, 1);
+    ctx.recalled = rpcalloc(len, 1);
+    graph.nanoseconds = dump_times
+        ? rpcalloc(2 * len, sizeof(unsigned long long)) : 0;
+    if (!ctx.signature_ok || !ctx.errors || !ctx.parse_failed ||
+        !ctx.recalled ||
+        (dump_times && !graph.nanoseconds) ||
+        build_graph(&ctx, &graph)) {
+        ret = -1;
+        goto cleanup_context;
+    }
+    graph.run = run_task;
+    graph.data = &ctx;
+
+    if (run_task_graph(&graph, num_threads)) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    for (i = 0; i != len; ++i) {
+        if (ctx.parse_failed[i]) {
+            ret = -1;
+        }
+        ctx.types->num_recalled += ctx.recalled[i];
+    }
+    for (i = 0; i != 2 * len; ++i) {
+        if (ctx.errors[i].len) {
+            report_diagnostics(&ctx.errors[i]);
+            ret = -1;
+        }
+    }
+
+    if (dump_times) {
+        for (i = 0; i != 2 * len; ++i) {
+            print_warning("%s of %s took %llu ns",
+                          i < len ? "Signature" : "Body",
+                          str_cbegin(&toplevels->vars[i % len].name),
+                          graph.nanoseconds[i]);
+        }
+    }
+
+cleanup:
+    rpfree((void*) graph.num_deps);
+    rpfree((void*) graph.succ_begin);
+    rpfree((void*) graph.succ);
+cleanup_context:
+    if (ctx.errors) {
+        for (i = 0; i != 2 * len; ++i) {
+            destroy_diagnostics(&ctx.errors[i]);
+        }
+    }
+    rpfree(ctx.errors);
+    rpfree(ctx.signature_ok);
+    rpfree(ctx.parse_failed);
+    rpfree(ctx.recalled);
+    rpfree(graph.nanoseconds);
+    symtab_destroy(&ctx.names);
+cleanup_types:
+    if (!types) {
+        destroy_type_tables(&discarded);
+    }
+    return ret;
+}
+
+struct body_checks {
+    sema_context ctx;
+    type_tables types;
+};
+
+body_checks*
+begin_body_checks(vec_var_decl* toplevels) {
+    body_checks* checks = rpmalloc(sizeof(body_checks));
+    sema_context* ctx;
+    size_t len = toplevels->len;
+    size_t i;
+    if (!checks) {
+        return 0;
+    }
+    ctx = &checks->ctx;
+    ctx->toplevels = toplevels;
+    ctx->check_bodies = 1;
+    ctx->errors = 0;
+    ctx->parse_failed = 0;
+    ctx->types = &checks->types;
+    ctx->signature_ok = rpcalloc(len + 1, 1);
+    ctx->recalled = rpcalloc(len + 1, 1);
+    if (!ctx->signature_ok || !ctx->recalled ||
+        init_type_tables(ctx->types, len)) {
+        rpfree(ctx->signature_ok);
+        rpfree(ctx->recalled);
+        rpfree(checks);
+        return 0;
+    }
+    if (symtab_init(&ctx->names, len)) {
+        destroy_type_tables(ctx->types);
+        rpfree(ctx->signature_ok);
+        rpfree(ctx->recalled);
+        rpfree(checks);
+        return 0;
+    }
+    for (i = 0; i != len; ++i) {
+        /* The signature errors have already been reported. */
+        vec_diagnostic errors = VEC_INIT;
+        symtab_insert(&ctx->names, str_cbegin(&toplevels->vars[i].name),
+                      i);
+        check_signature(ctx, i, &errors);
+        destroy_diagnostics(&errors);
+    }
+    return checks;
+}
+
+int
+check_one_body(body_checks* checks, size_t index) {
+    vec_diagnostic errors = VEC_INIT;
+    int ret = 0;
+    assert(index < checks->ctx.toplevels->len);
+    if (check_body(&checks->ctx, index, &errors)) {
+        ret = -1;
+    }
+    /* the body is about to be destroyed */
+    destroy_expression_types(&checks->types.bodies[index]);
+    if (errors.len) {
+        report_diagnostics(&errors);
+        ret = -1;
+    }
+    return ret;
+}
+
+void
+end_body_checks(body_checks* checks) {
+    if (!checks) {
+        return;
+    }
+    symtab_destroy(&checks->ctx.names);
+    destroy_type_tables(&checks->types);
+    rpfree(checks->ctx.signature_ok);
+    rpfree(checks->ctx.recalled);
+    rpfree(checks);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#ifndef HEADER_GUARD_SEMA_H
+#define HEADER_GUARD_SEMA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vec_var_decl;
+struct type_tables;
+/* Check that the names and types used by `toplevels` refer to
+ * something and that the types of expressions match where they are
+ * used.  The signature of every declaration is checked first, then
+ * each body is checked as soon as the signatures it refers to are
+ * done.  Function bodies that haven't been parsed yet are parsed by
+ * the task checking them.  If `check_bodies` is not set only the
+ * signatures and initializers are checked.  The checks run on
+ * `num_threads` threads (zero picks a default) but errors are always
+ * printed in declaration order.  If `dump_times` is set, the time
+ * spent on each check is printed.  The types computed are stored in
+ * `types` if it isn't null, which must then be destroyed with
+ * destroy_type_tables. */
+int check_semantics(struct vec_var_decl* toplevels, size_t num_threads,
+                    int check_bodies, int dump_times,
+                    struct type_tables* types);
+
+/* Checks function bodies one at a time so they don't all need to be
+ * in memory at once.  `toplevels` must have passed check_semantics
+ * without `check_bodies` and must outlive the checks.  A body can be
+ * moved into its declaration right before checking it and destroyed
+ * right after. */
+typedef struct body_checks body_checks;
+body_checks* begin_body_checks(struct vec_var_decl* toplevels);
+/* Check the body of the declaration at `index` and print any
+ * errors. */
+int check_one_body(body_checks*, size_t index);
+void end_body_checks(body_checks*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
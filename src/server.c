@@ -0,0 +1,779 @@
+#include "server.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../cutil/rpmalloc.h"
+#include "arguments.h"
+#include "compile.h"
+#include "diagnostics.h"
+#include "module.h"
+#include "pool.h"
+#include "types.h"
+
+/* A request is a count of words followed by each word prefixed by its
+ * length.  The first word is the client's working directory and the
+ * rest are its arguments.  The reply is the exit status followed by
+ * the length prefixed diagnostics. */
+#define MAX_REQUEST_WORDS 4096
+#define MAX_WORD_LEN 65536
+
+struct cache_entry {
+    /* The working directory and arguments, each terminated by a nul.
+     * Null if the slot is empty. */
+    char* key;
+    size_t key_len;
+    size_t hash;
+    /* the file the result was computed from */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    /* the combined stamps of the imported interfaces */
+    unsigned long long imports_stamp;
+    int status;
+    char* output;
+    size_t output_len;
+};
+
+struct server {
+    /* open addressing table of results */
+    struct cache_entry* entries;
+    size_t len, cap;
+    unsigned long requests, hits, misses;
+    unsigned long long total_nanoseconds;
+};
+
+static int
+write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, void* data, size_t len) {
+    char* p = data;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static int
+write_word(int fd, const char* data, size_t len) {
+    unsigned int len32 = (unsigned int) len;
+    return write_all(fd, &len32, sizeof(len32)) ||
+           write_all(fd, data, len);
+}
+
+/* Read the words of a request into `words` and their contents into a
+ * single block at `*buffer`. */
+static int
+read_request(int fd, char*** words, size_t* num_words, char** buffer) {
+    unsigned int count;
+    unsigned int* lens = 0;
+    size_t total = 0;
+    size_t i;
+    *words = 0;
+    *buffer = 0;
+    if (read_all(fd, &count, sizeof(count)) || count == 0 ||
+        count > MAX_REQUEST_WORDS) {
+        return -1;
+    }
+    lens = rpmalloc(count * sizeof(unsigned int));
+    *words = rpmalloc(count * sizeof(char*));
+    if (!lens || !*words) {
+        goto fail;
+    }
+    /* Words are read one at a time so the buffer is grown as we go;
+     * record the offsets and fix up the pointers at the end. */
+    for (i = 0; i != count; ++i) {
+        char* grown;
+        if (read_all(fd, &lens[i], sizeof(lens[i])) ||
+            lens[i] > MAX_WORD_LEN) {
+            goto fail;
+        }
+        grown = rprealloc(*buffer, total + lens[i] + 1);
+        if (!grown) {
+            goto fail;
+        }
+        *buffer = grown;
+        if (read_all(fd, *buffer + total, lens[i])) {
+            goto fail;
+        }
+        (*buffer)[total + lens[i]] = '\0';
+        total += lens[i] + 1;
+    }
+    total = 0;
+    for (i = 0; i != count; ++i) {
+        (*words)[i] = *buffer + total;
+        total += lens[i] + 1;
+    }
+    *num_words = count;
+    rpfree(lens);
+    return 0;
+
+fail:
+    rpfree(lens);
+    rpfree(*words);
+    rpfree(*buffer);
+    *words = 0;
+    *buffer = 0;
+    return -1;
+}
+
+static size_t
+hash_key(const char* key, size_t len) {
+    /* FNV-1a */
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t) hash;
+}
+
+static struct cache_entry*
+cache_slot(struct server* server, const char* key, size_t key_len,
+           size_t hash) {
+    size_t i = hash & (server->cap - 1);
+    while (server->entries[i].key &&
+           (server->entries[i].hash != hash ||
+            server->entries[i].key_len != key_len ||
+            memcmp(server->entries[i].key, key, key_len) != 0)) {
+        i = (i + 1) & (server->cap - 1);
+    }
+    return &server->entries[i];
+}
+
+static int
+cache_grow(struct server* server) {
+    struct cache_entry* old = server->entries;
+    size_t old_cap = server->cap;
+    size_t i;
+    server->cap = old_cap ? old_cap * 2 : 64;
+    server->entries = rpcalloc(server->cap, sizeof(struct cache_entry));
+    if (!server->entries) {
+        server->entries = old;
+        server->cap = old_cap;
+        return -1;
+    }
+    for (i = 0; i != old_cap; ++i) {
+        if (old[i].key) {
+            *cache_slot(server, old[i].key, old[i].key_len,
+                        old[i].hash) = old[i];
+        }
+    }
+    rpfree(old);
+    return 0;
+}
+
+/* Combine the stamps of the interfaces `args` imports.  Rewriting an
+ * interface without changing it keeps its stamp, so the files
+ * importing it stay cached. */
+static int
+imports_stamp(const arguments* args, unsigned long long* stamp) {
+    size_t i;
+    *stamp = 0;
+    for (i = 0; i != args->num_imports; ++i) {
+        unsigned long long import;
+        if (read_interface_stamp(args->imports[i], &import)) {
+            return -1;
+        }
+        *stamp = (*stamp ^ import) * 1099511628211ULL;
+    }
+    return 0;
+}
+
+static int
+is_fresh(const struct cache_entry* entry, const struct stat* st,
+         unsigned long long imports) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+           entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           entry->imports_stamp == imports;
+}
+
+/* Compile with diagnostics captured into `*output`. */
+static int
+compile_captured(const arguments* args, char** output,
+                 size_t* output_len) {
+    FILE* stream = open_memstream(output, output_len);
+    int status;
+    if (!stream) {
+        return -1;
+    }
+    set_diagnostics_stream(stream);
+    status = compile(args);
+    set_diagnostics_stream(0);
+    fclose(stream);
+    return status;
+}
+
+static int
+store_result(struct server* server, struct cache_entry* slot,
+             const char* key, size_t key_len, size_t hash,
+             const struct stat* st, unsigned long long imports,
+             int status, const char* output, size_t output_len) {
+    if (!slot->key) {
+        if ((server->len + 1) * 2 > server->cap) {
+            if (cache_grow(server)) {
+                return -1;
+            }
+            slot = cache_slot(server, key, key_len, hash);
+        }
+        slot->key = rpmalloc(key_len);
+        if (!slot->key) {
+            return -1;
+        }
+        memcpy(slot->key, key, key_len);
+        slot->key_len = key_len;
+        slot->hash = hash;
+        slot->output = 0;
+        ++server->len;
+    }
+    rpfree(slot->output);
+    slot->output = rpmalloc(output_len + 1);
+    if (!slot->output) {
+        slot->output_len = 0;
+        /* never matches a file so it is recompiled next time */
+        slot->size = -1;
+        return -1;
+    }
+    memcpy(slot->output, output, output_len);
+    slot->output_len = output_len;
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtim;
+    slot->imports_stamp = imports;
+    slot->status = status;
+    return 0;
+}
+
+static int
+reply(int fd, int status, const char* output, size_t output_len) {
+    return write_all(fd, &status, sizeof(status)) ||
+           write_word(fd, output, output_len);
+}
+
+static int
+reply_stats(struct server* server, int fd) {
+    char buffer[256];
+    int len = snprintf(buffer, sizeof(buffer),
+                       "%lu requests, %lu cache hits, %lu cache misses, "
+                       "%lu files cached, %llu us mean latency\n",
+                       server->requests, server->hits, server->misses,
+                       (unsigned long) server->len,
+                       server->requests
+                           ? server->total_nanoseconds /
+                                 server->requests / 1000
+                           : 0ULL);
+    return reply(fd, 0, buffer, (size_t) len);
+}
+
+/* The paths resolved against the client's working directory for one
+ * request: the file, the trace, the object and the imports. */
+#define MAX_RESOLVED_PATHS (MAX_IMPORTS + 3)
+struct resolved_paths {
+    char* paths[MAX_RESOLVED_PATHS];
+    size_t len;
+};
+
+/* `path` if it is absolute, otherwise `path` in the directory `cwd`
+ * kept in `resolved`.  Null when out of memory. */
+static const char*
+resolve_path(const char* cwd, const char* path,
+             struct resolved_paths* resolved) {
+    size_t cwd_len = strlen(cwd);
+    size_t path_len = strlen(path);
+    char* joined;
+    if (path[0] == '/') {
+        return path;
+    }
+    joined = rpmalloc(cwd_len + path_len + 2);
+    if (!joined) {
+        return 0;
+    }
+    memcpy(joined, cwd, cwd_len);
+    joined[cwd_len] = '/';
+    memcpy(joined + cwd_len + 1, path, path_len + 1);
+    resolved->paths[resolved->len++] = joined;
+    return joined;
+}
+
+/* Point the paths of `args` into the client's working directory so
+ * the server never has to change its own. */
+static int
+resolve_arguments(arguments* args, const char* cwd,
+                  struct resolved_paths* resolved) {
+    size_t i;
+    if (!(args->file = resolve_path(cwd, args->file, resolved))) {
+        return -1;
+    }
+    if (args->trace_file &&
+        !(args->trace_file = resolve_path(cwd, args->trace_file,
+                                          resolved))) {
+        return -1;
+    }
+    if (args->output_file &&
+        !(args->output_file = resolve_path(cwd, args->output_file,
+                                           resolved))) {
+        return -1;
+    }
+    for (i = 0; i != args->num_imports; ++i) {
+        if (!(args->imports[i] = resolve_path(cwd, args->imports[i],
+                                              resolved))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 if the server should shut down. */
+static int
+handle_request(struct server* server, int fd) {
+    char** words;
+    size_t num_words;
+    char* buffer;
+    char* output = 0;
+    size_t output_len = 0;
+    arguments args;
+    struct resolved_paths resolved;
+    struct stat st;
+    unsigned long long start = now_nanoseconds();
+    int status;
+    int parsed;
+    int hit = 0;
+    int ret = 0;
+    size_t i;
+
+    resolved.len = 0;
+    if (read_request(fd, &words, &num_words, &buffer)) {
+        fputs("shiv server: Malformed request\n", stderr);
+        return 0;
+    }
+
+    if (num_words == 2 && strcmp(words[1], SERVER_SHUTDOWN) == 0) {
+        reply(fd, 0, "", 0);
+        ret = 1;
+        goto cleanup;
+    }
+    if (num_words == 2 && strcmp(words[1], SERVER_STATS) == 0) {
+        reply_stats(server, fd);
+        goto cleanup;
+    }
+
+    if (words[0][0] != '/') {
+        const char* message = "Error: The client's working directory "
+                              "must be absolute\n";
+        reply(fd, 1, message, strlen(message));
+        goto cleanup;
+    }
+
+    {
+        FILE* stream = open_memstream(&output, &output_len);
+        if (!stream) {
+            goto cleanup;
+        }
+        set_diagnostics_stream(stream);
+        parsed = parse_arguments(&args, num_words - 1, words + 1) == 0;
+        set_diagnostics_stream(0);
+        fclose(stream);
+    }
+    if (parsed && resolve_arguments(&args, words[0], &resolved)) {
+        goto cleanup;
+    }
+
+    if (parsed) {
+        /* The key is every word including the working directory,
+         * which are laid out contiguously in `buffer`. */
+        const char* key = buffer;
+        size_t key_len = (size_t) (words[num_words - 1] - buffer) +
+                         strlen(words[num_words - 1]) + 1;
+        size_t hash = hash_key(key, key_len);
+        struct cache_entry* slot;
+        unsigned long long imports = 0;
+        /* A trace, object or interface has to be written on every
+         * request so those aren't cached. */
+        int have_stat = !args.trace_file && !args.emit_object &&
+                        !args.emit_interface &&
+                        stat(args.file, &st) == 0 &&
+                        imports_stamp(&args, &imports) == 0;
+
+        free(output);
+        output = 0;
+        output_len = 0;
+
+        if (have_stat && server->cap) {
+            slot = cache_slot(server, key, key_len, hash);
+            if (slot->key && is_fresh(slot, &st, imports)) {
+                hit = 1;
+                status = slot->status;
+                reply(fd, status, slot->output, slot->output_len);
+            }
+        }
+        if (!hit) {
+            status = compile_captured(&args, &output, &output_len);
+            if (status < 0) {
+                goto cleanup;
+            }
+            reply(fd, status, output, output_len);
+            if (have_stat) {
+                if (!server->cap && cache_grow(server)) {
+                    goto cleanup;
+                }
+                slot = cache_slot(server, key, key_len, hash);
+                store_result(server, slot, key, key_len, hash, &st,
+                             imports, status, output, output_len);
+            }
+        }
+        if (hit) {
+            ++server->hits;
+        } else {
+            ++server->misses;
+        }
+    } else {
+        status = 1;
+        reply(fd, status, output, output_len);
+    }
+
+    {
+        unsigned long long elapsed = now_nanoseconds() - start;
+        ++server->requests;
+        server->total_nanoseconds += elapsed;
+        fprintf(stderr,
+                "shiv server: %s %s in %llu us "
+                "(%lu hits, %lu misses, %lu files cached)\n",
+                parsed ? args.file : "request",
+                hit ? "cached" : parsed ? "compiled" : "rejected",
+                elapsed / 1000,
+                server->hits, server->misses,
+                (unsigned long) server->len);
+    }
+
+cleanup:
+    for (i = 0; i != resolved.len; ++i) {
+        rpfree(resolved.paths[i]);
+    }
+    free(output);
+    rpfree(words);
+    rpfree(buffer);
+    return ret;
+}
+
+int
+run_server(const char* path) {
+    struct sockaddr_un addr;
+    struct server server;
+    char cwd[4096];
+    const char* socket_path;
+    struct resolved_paths resolved;
+    int fd;
+    int ret = -1;
+    size_t i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_error("Socket path is too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    /* The socket is removed by its absolute path in case anything
+     * changes the working directory meanwhile. */
+    resolved.len = 0;
+    if (!getcwd(cwd, sizeof(cwd)) ||
+        !(socket_path = resolve_path(cwd, path, &resolved))) {
+        print_error("Cannot get the working directory");
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        print_error("Cannot create socket: %s", strerror(errno));
+        goto fail;
+    }
+    /* a previous server may have left its socket behind */
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+        listen(fd, 64)) {
+        print_error("Cannot listen on %s: %s", path, strerror(errno));
+        close(fd);
+        goto fail;
+    }
+    /* a client hanging up shouldn't kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    server.entries = 0;
+    server.len = 0;
+    server.cap = 0;
+    server.requests = 0;
+    server.hits = 0;
+    server.misses = 0;
+    server.total_nanoseconds = 0;
+    /* the same files come back with few changes between requests */
+    remember_types(1);
+
+    while (1) {
+        int client = accept(fd, 0, 0);
+        int stop;
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("Cannot accept connection: %s", strerror(errno));
+            break;
+        }
+        stop = handle_request(&server, client);
+        close(client);
+        if (stop) {
+            break;
+        }
+    }
+
+    for (i = 0; i != server.cap; ++i) {
+        rpfree(server.entries[i].key);
+        rpfree(server.entries[i].output);
+    }
+    rpfree(server.entries);
+    remember_types(0);
+    close(fd);
+    unlink(socket_path);
+    ret = 0;
+
+fail:
+    for (i = 0; i != resolved.len; ++i) {
+        rpfree(resolved.paths[i]);
+    }
+    return ret;
+}
+
+int
+run_client(const char* path, size_t argc, char** argv) {
+    struct sockaddr_un addr;
+    char cwd[4096];
+    unsigned int count = (unsigned int) argc + 1;
+    unsigned int len;
+    char* output;
+    int status;
+    int fd;
+    size_t i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_error("Socket path is too long: %s", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    if (!getcwd(cwd, sizeof(cwd))) {
+        print_error("Cannot get the working directory");
+        return 1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        print_error("Cannot connect to the compile server at %s", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    if (write_all(fd, &count, sizeof(count)) ||
+        write_word(fd, cwd, strlen(cwd))) {
+        goto broken;
+    }
+    for (i = 0; i != argc; ++i) {
+        if (write_word(fd, argv[i], strlen(argv[i]))) {
+            goto broken;
+        }
+    }
+    if (read_all(fd, &status, sizeof(status)) ||
+        read_all(fd, &len, sizeof(len))) {
+        goto broken;
+    }
+    output = rpmalloc(len + 1);
+    if (!output || read_all(fd, output, len)) {
+        rpfree(output);
+        goto broken;
+    }
+    fwrite(output, 1, len, stderr);
+    rpfree(output);
+    close(fd);
+    return status;
+
+broken:
+    print_error("Lost connection to the compile server");
+    close(fd);
+    return 1;
+}
+
+#ifdef TEST_MODE
+#include <pthread.h>
+#include "../cutil/test.h"
+
+static void*
+serve(void* path) {
+    rpmalloc_thread_initialize();
+    run_server(path);
+    rpmalloc_thread_finalize();
+    return 0;
+}
+
+static int
+connect_to(const char* path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send the request `words` as if from a client in the directory
+ * `words[0]` and return the exit status, -1 if the server doesn't
+ * answer. */
+static int
+send_request(const char* path, size_t num_words, const char** words) {
+    unsigned int count = (unsigned int) num_words;
+    unsigned int len;
+    char output[256];
+    int status = -1;
+    int fd;
+    int tries;
+    size_t i;
+    /* the server may not be listening yet */
+    for (tries = 0; (fd = connect_to(path)) < 0 && tries != 1000;
+         ++tries) {
+        usleep(1000);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (write_all(fd, &count, sizeof(count))) {
+        goto done;
+    }
+    for (i = 0; i != num_words; ++i) {
+        if (write_word(fd, words[i], strlen(words[i]))) {
+            goto done;
+        }
+    }
+    if (read_all(fd, &status, sizeof(status)) ||
+        read_all(fd, &len, sizeof(len)) || len > sizeof(output) ||
+        read_all(fd, output, len)) {
+        status = -1;
+    }
+done:
+    close(fd);
+    return status;
+}
+
+static int
+write_test_file(const char* path, const char* text) {
+    FILE* file = fopen(path, "w");
+    int res;
+    if (!file) {
+        return -1;
+    }
+    res = fputs(text, file) < 0;
+    return fclose(file) || res ? -1 : 0;
+}
+
+/* A server started in s1 compiles a file relative to a client in s2
+ * and removes its own socket, not the one in s2, on shutdown. */
+TEST(test_server_round_trip) {
+    char root[] = "/tmp/shiv_server_XXXXXX";
+    char original[4096], s1[sizeof(root) + 3], s2[sizeof(root) + 3];
+    char source[64], decoy[64], socket_path[64], now[4096];
+    const char* compile_words[3];
+    const char* shutdown_words[2];
+    pthread_t thread;
+    int started = 0;
+    struct stat st;
+    ASSERT(getcwd(original, sizeof(original)), end);
+    ASSERT(mkdtemp(root), end);
+    snprintf(s1, sizeof(s1), "%s/s1", root);
+    snprintf(s2, sizeof(s2), "%s/s2", root);
+    snprintf(source, sizeof(source), "%s/a.shiv", s2);
+    snprintf(decoy, sizeof(decoy), "%s/sock", s2);
+    snprintf(socket_path, sizeof(socket_path), "%s/sock", s1);
+    ASSERT(mkdir(s1, 0700) == 0 && mkdir(s2, 0700) == 0, cleanup);
+    ASSERT(write_test_file(source, "f := fun (a : std::i64) -> std::i64 "
+                                   "{\n    return a;\n}\n") == 0, cleanup);
+    ASSERT(write_test_file(decoy, "") == 0, cleanup);
+
+    ASSERT(chdir(s1) == 0, cleanup);
+    ASSERT(pthread_create(&thread, 0, serve, "sock") == 0, cleanup);
+    started = 1;
+    compile_words[0] = s2;
+    compile_words[1] = "-compiler-parallel-lex";
+    compile_words[2] = "a.shiv";
+    ASSERT(send_request("sock", 3, compile_words) == 0, cleanup);
+    /* the second time comes from the cache */
+    ASSERT(send_request("sock", 3, compile_words) == 0, cleanup);
+    ASSERT(getcwd(now, sizeof(now)) && strcmp(now, s1) == 0, cleanup);
+
+    ASSERT(chdir(s2) == 0, cleanup);
+    shutdown_words[0] = s2;
+    shutdown_words[1] = SERVER_SHUTDOWN;
+    ASSERT(send_request(socket_path, 2, shutdown_words) == 0, cleanup);
+    pthread_join(thread, 0);
+    started = 0;
+    ASSERT(stat(decoy, &st) == 0, cleanup);
+    ASSERT(stat(socket_path, &st) != 0, cleanup);
+cleanup:
+    if (started) {
+        shutdown_words[0] = s2;
+        shutdown_words[1] = SERVER_SHUTDOWN;
+        send_request(socket_path, 2, shutdown_words);
+        pthread_join(thread, 0);
+    }
+    if (chdir(original)) {
+        /* the remaining tests don't use relative paths */
+    }
+    remove(source);
+    remove(decoy);
+    remove(socket_path);
+    rmdir(s1);
+    rmdir(s2);
+    rmdir(root);
+end:;
+}
+END_TEST
+
+void test_server(void) {
+    RUN(test_server_round_trip);
+}
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#ifndef HEADER_GUARD_SERVER_H
+#define HEADER_GUARD_SERVER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Arguments the client can send instead of compiler arguments. */
+#define SERVER_SHUTDOWN "--shutdown"
+#define SERVER_STATS "--stats"
+
+/* Serve compile requests on the unix domain socket at `path` until a
+ * client sends SERVER_SHUTDOWN.  The results of compiling a file are
+ * kept and reused until the file or the arguments change.  Relative
+ * paths in a request are taken from the client's working directory;
+ * the server never changes its own. */
+int run_server(const char* path);
+
+/* Send the arguments to the server at `path`, print its diagnostics
+ * and return its exit status. */
+int run_client(const char* path, size_t argc, char** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,66 @@
+#include "symtab.h"
+#include <assert.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+
+size_t
+hash_name(const char* name) {
+    /* FNV-1a */
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *name; ++name) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211ULL;
+    }
+    return (size_t) hash;
+}
+
+int
+symtab_init(symtab* table, size_t len) {
+    assert(table);
+    /* keep the load factor at or below one half */
+    table->cap = 8;
+    while (table->cap < len * 2) {
+        table->cap *= 2;
+    }
+    table->names = rpcalloc(table->cap, sizeof(const char*));
+    table->values = rpmalloc(table->cap * sizeof(size_t));
+    if (!table->names || !table->values) {
+        symtab_destroy(table);
+        return -1;
+    }
+    return 0;
+}
+
+void
+symtab_destroy(symtab* table) {
+    rpfree(table->names);
+    rpfree(table->values);
+    table->names = 0;
+    table->values = 0;
+}
+
+static size_t
+symtab_slot(const symtab* table, const char* name) {
+    size_t i = hash_name(name) & (table->cap - 1);
+    while (table->names[i] && strcmp(table->names[i], name) != 0) {
+        i = (i + 1) & (table->cap - 1);
+    }
+    return i;
+}
+
+int
+symtab_insert(symtab* table, const char* name, size_t value) {
+    size_t i = symtab_slot(table, name);
+    if (table->names[i]) {
+        return 1;
+    }
+    table->names[i] = name;
+    table->values[i] = value;
+    return 0;
+}
+
+size_t
+symtab_lookup(const symtab* table, const char* name) {
+    size_t i = symtab_slot(table, name);
+    return table->names[i] ? table->values[i] : SYMTAB_NOT_FOUND;
+}
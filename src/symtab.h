@@ -0,0 +1,37 @@
+#pragma once
+
+#ifndef HEADER_GUARD_SYMTAB_H
+#define HEADER_GUARD_SYMTAB_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A fixed capacity hash table mapping names to indexes.  The names
+ * are not copied and must outlive the table. */
+struct symtab {
+    const char** names;
+    size_t* values;
+    size_t cap;
+};
+typedef struct symtab symtab;
+
+#define SYMTAB_NOT_FOUND ((size_t) -1)
+
+/* Make a table able to hold `len` names. */
+int symtab_init(symtab*, size_t len);
+void symtab_destroy(symtab*);
+
+/* Returns 1 if `name` is already in the table. */
+int symtab_insert(symtab*, const char* name, size_t value);
+size_t symtab_lookup(const symtab*, const char* name);
+
+size_t hash_name(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
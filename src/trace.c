@@ -0,0 +1,493 @@
+#include "trace.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../cutil/rpmalloc.h"
+#include "diagnostics.h"
+#include "pool.h"
+
+struct trace_span {
+    unsigned long long start, end;
+    const char* name;
+    uint32_t tokens;
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+/* The most chunks a thread keeps before reusing its oldest. */
+#define TRACE_MAX_CHUNKS (TRACE_BUFFER_SPANS / TRACE_CHUNK_SPANS)
+
+struct trace_chunk {
+    struct trace_chunk* next;
+    size_t len;
+    struct trace_span spans[TRACE_CHUNK_SPANS];
+};
+
+struct trace_buffer {
+    struct trace_buffer* next;
+    long tid;
+    const char* thread_name;
+    /* The number of spans ever recorded, including those lost when
+     * their chunk was reused or couldn't be allocated. */
+    size_t len;
+    /* From the oldest spans to the latest. */
+    struct trace_chunk* first;
+    struct trace_chunk* last;
+    size_t num_chunks;
+};
+
+static atomic_int recording;
+static unsigned long long recording_start;
+/* Bumped when recording starts and stops so threads know that their
+ * `local_buffer` is gone.  Odd while recording. */
+static atomic_uint generation;
+/* The number of threads writing into a buffer, which trace_finish
+ * waits for before freeing them. */
+static atomic_uint writers;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer* buffers;
+
+static _Thread_local struct trace_buffer* local_buffer;
+static _Thread_local unsigned local_generation;
+
+/* The calling thread's buffer, or null if not recording.  Must be
+ * called between incrementing and decrementing `writers`. */
+static struct trace_buffer*
+thread_buffer(void) {
+    unsigned current = atomic_load(&generation);
+    struct trace_buffer* buffer;
+    if (!(current & 1)) {
+        /* trace_finish may be freeing the buffers */
+        return 0;
+    }
+    if (local_generation == current) {
+        return local_buffer;
+    }
+    buffer = rpmalloc(sizeof(struct trace_buffer));
+    if (!buffer) {
+        return 0;
+    }
+    buffer->tid = syscall(SYS_gettid);
+    buffer->thread_name = 0;
+    buffer->len = 0;
+    buffer->first = 0;
+    buffer->last = 0;
+    buffer->num_chunks = 0;
+    pthread_mutex_lock(&buffers_lock);
+    if (atomic_load_explicit(&generation, memory_order_relaxed) !=
+        current) {
+        /* the recording ended in the meantime */
+        pthread_mutex_unlock(&buffers_lock);
+        rpfree(buffer);
+        return 0;
+    }
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_lock);
+    local_buffer = buffer;
+    local_generation = current;
+    return buffer;
+}
+
+/* A chunk with room for another span at the end of `buffer`, or null
+ * if there is no memory for one.  Once the buffer has as many chunks
+ * as it may, the oldest is emptied and reused. */
+static struct trace_chunk*
+next_chunk(struct trace_buffer* buffer) {
+    struct trace_chunk* chunk = 0;
+    if (buffer->num_chunks < TRACE_MAX_CHUNKS) {
+        chunk = rpmalloc(sizeof(struct trace_chunk));
+    }
+    if (chunk) {
+        ++buffer->num_chunks;
+    } else if (buffer->first) {
+        chunk = buffer->first;
+        buffer->first = chunk->next;
+        if (!buffer->first) {
+            buffer->last = 0;
+        }
+    } else {
+        return 0;
+    }
+    chunk->next = 0;
+    chunk->len = 0;
+    if (buffer->last) {
+        buffer->last->next = chunk;
+    } else {
+        buffer->first = chunk;
+    }
+    buffer->last = chunk;
+    return chunk;
+}
+
+/* The number of spans of `buffer` that were recorded and kept. */
+static size_t
+kept_spans(const struct trace_buffer* buffer) {
+    const struct trace_chunk* chunk;
+    size_t kept = 0;
+    for (chunk = buffer->first; chunk; chunk = chunk->next) {
+        kept += chunk->len;
+    }
+    return kept;
+}
+
+static void
+free_buffers(void) {
+    while (buffers) {
+        struct trace_buffer* next = buffers->next;
+        while (buffers->first) {
+            struct trace_chunk* chunk = buffers->first;
+            buffers->first = chunk->next;
+            rpfree(chunk);
+        }
+        rpfree(buffers);
+        buffers = next;
+    }
+}
+
+int
+trace_start(void) {
+    pthread_mutex_lock(&buffers_lock);
+    free_buffers();
+    atomic_fetch_add(&generation, 1);
+    recording_start = now_nanoseconds();
+    atomic_store(&recording, 1);
+    pthread_mutex_unlock(&buffers_lock);
+    return 0;
+}
+
+unsigned long long
+trace_begin(void) {
+    if (!atomic_load_explicit(&recording, memory_order_relaxed)) {
+        return 0;
+    }
+    return now_nanoseconds();
+}
+
+void
+trace_end(unsigned long long start, const char* name, const char* detail,
+          size_t tokens) {
+    struct trace_buffer* buffer;
+    struct trace_chunk* chunk;
+    struct trace_span* span;
+    if (!start) {
+        return;
+    }
+    atomic_fetch_add(&writers, 1);
+    buffer = thread_buffer();
+    if (!buffer) {
+        atomic_fetch_sub(&writers, 1);
+        return;
+    }
+    ++buffer->len;
+    chunk = buffer->last;
+    if (!chunk || chunk->len == TRACE_CHUNK_SPANS) {
+        chunk = next_chunk(buffer);
+        if (!chunk) {
+            atomic_fetch_sub(&writers, 1);
+            return;
+        }
+    }
+    span = &chunk->spans[chunk->len++];
+    span->start = start;
+    span->end = now_nanoseconds();
+    span->name = name;
+    span->tokens = tokens > UINT32_MAX ? UINT32_MAX : (uint32_t) tokens;
+    if (detail) {
+        size_t len = strlen(detail);
+        if (len >= TRACE_DETAIL_SIZE) {
+            /* don't cut a character in half */
+            len = TRACE_DETAIL_SIZE - 1;
+            while (len && (detail[len] & 0xC0) == 0x80) {
+                --len;
+            }
+        }
+        memcpy(span->detail, detail, len);
+        span->detail[len] = '\0';
+    } else {
+        span->detail[0] = '\0';
+    }
+    atomic_fetch_sub(&writers, 1);
+}
+
+void
+trace_thread_name(const char* name) {
+    struct trace_buffer* buffer;
+    if (!atomic_load_explicit(&recording, memory_order_relaxed)) {
+        return;
+    }
+    atomic_fetch_add(&writers, 1);
+    buffer = thread_buffer();
+    if (buffer) {
+        buffer->thread_name = name;
+    }
+    atomic_fetch_sub(&writers, 1);
+}
+
+static void
+write_string(FILE* file, const char* s) {
+    putc('"', file);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            putc('\\', file);
+            putc(c, file);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            putc(c, file);
+        }
+    }
+    putc('"', file);
+}
+
+/* Timestamps are in microseconds since the recording started. */
+static void
+write_span(FILE* file, const struct trace_span* span, long pid, long tid,
+           int first) {
+    fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+    write_string(file, span->name);
+    fprintf(file, ",\"cat\":\"shiv\",\"ph\":\"X\",\"pid\":%ld,"
+            "\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"tokens\":%lu",
+            pid, tid,
+            (span->start - recording_start) / 1000.0,
+            (span->end - span->start) / 1000.0,
+            (unsigned long) span->tokens);
+    if (span->detail[0]) {
+        fputs(",\"detail\":", file);
+        write_string(file, span->detail);
+    }
+    fputs("}}", file);
+}
+
+static void
+write_buffer(FILE* file, const struct trace_buffer* buffer, long pid,
+             int* first) {
+    const struct trace_chunk* chunk;
+    size_t i;
+    if (buffer->thread_name) {
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":",
+                *first ? "" : ",", pid, buffer->tid);
+        write_string(file, buffer->thread_name);
+        fputs("}}", file);
+        *first = 0;
+    }
+    for (chunk = buffer->first; chunk; chunk = chunk->next) {
+        for (i = 0; i != chunk->len; ++i) {
+            write_span(file, &chunk->spans[i], pid, buffer->tid, *first);
+            *first = 0;
+        }
+    }
+}
+
+int
+trace_finish(const char* path) {
+    const struct trace_buffer* buffer;
+    FILE* file;
+    long pid = getpid();
+    int first = 1;
+    int ret = 0;
+
+    atomic_store(&recording, 0);
+    /* A span that began while recording may still end, so stop new
+     * writers and wait for those already writing before the buffers
+     * are read and freed. */
+    atomic_fetch_add(&generation, 1);
+    while (atomic_load(&writers)) {
+        sched_yield();
+    }
+    pthread_mutex_lock(&buffers_lock);
+    file = fopen(path, "w");
+    if (!file) {
+        print_error("Cannot open trace file: %s", path);
+        ret = -1;
+        goto cleanup;
+    }
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    for (buffer = buffers; buffer; buffer = buffer->next) {
+        write_buffer(file, buffer, pid, &first);
+    }
+    fputs("\n]}\n", file);
+    if (fclose(file)) {
+        print_error("Cannot write trace file: %s", path);
+        ret = -1;
+    }
+    for (buffer = buffers; buffer; buffer = buffer->next) {
+        size_t kept = kept_spans(buffer);
+        if (buffer->len > kept) {
+            print_warning("The trace of thread %ld lost %lu of its spans",
+                          buffer->tid,
+                          (unsigned long) (buffer->len - kept));
+        }
+    }
+
+cleanup:
+    free_buffers();
+    pthread_mutex_unlock(&buffers_lock);
+    return ret;
+}
+
+#ifdef TEST_MODE
+#include <stdlib.h>
+#include "../cutil/test.h"
+
+#define TEST_TRACE_TASKS 8
+
+/* 34 bytes and then a character that doesn't fit whole in a
+ * detail. */
+static const char test_trace_long_detail[] =
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\xC3\xA9" "bbbb";
+
+static void
+trace_test_task(void* data, size_t task) {
+    unsigned long long start = trace_begin();
+    (void) data;
+    trace_end(start, "task",
+              task == 0 ? test_trace_long_detail
+              : task == 1 ? "say \"hi\"\\" : 0,
+              task);
+}
+
+/* Read all of the file at `path` into a string the caller frees. */
+static char*
+read_test_trace(const char* path) {
+    char* text = 0;
+    size_t len = 0;
+    size_t read;
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    do {
+        char* bigger = realloc(text, len + 4097);
+        if (!bigger) {
+            free(text);
+            fclose(file);
+            return 0;
+        }
+        text = bigger;
+        read = fread(text + len, 1, 4096, file);
+        len += read;
+    } while (read);
+    text[len] = '\0';
+    fclose(file);
+    return text;
+}
+
+/* The number of times `needle` is in `text`. */
+static size_t
+count_test_matches(const char* text, const char* needle) {
+    size_t count = 0;
+    while ((text = strstr(text, needle))) {
+        ++count;
+        text += strlen(needle);
+    }
+    return count;
+}
+
+/* Record more spans than fit in one chunk on a thread of its own. */
+static void*
+record_test_spans(void* arg) {
+    size_t i;
+    (void) arg;
+    rpmalloc_thread_initialize();
+    trace_thread_name("chunks");
+    for (i = 0; i != 2 * TRACE_CHUNK_SPANS + 3; ++i) {
+        trace_end(trace_begin(), "chunked", 0, 0);
+    }
+    rpmalloc_thread_finalize();
+    return 0;
+}
+
+TEST(test_trace_buffers) {
+    static const char prefix[] =
+        "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char path[] = "/tmp/shiv_trace_XXXXXX";
+    pthread_t thread;
+    char* text = 0;
+    int fd = mkstemp(path);
+    ASSERT(fd >= 0, end);
+    close(fd);
+    ASSERT(trace_start() == 0, cleanup);
+    trace_thread_name("main");
+    run_independent(trace_test_task, 0, TEST_TRACE_TASKS, 4);
+    ASSERT(pthread_create(&thread, 0, record_test_spans, 0) == 0,
+           cleanup);
+    pthread_join(thread, 0);
+    ASSERT(trace_finish(path) == 0, cleanup);
+    /* nothing is recorded once it finished */
+    trace_test_task(0, 0);
+    text = read_test_trace(path);
+    ASSERT(text, cleanup);
+    ASSERT(strncmp(text, prefix, strlen(prefix)) == 0, cleanup);
+    ASSERT(strcmp(text + strlen(text) - 4, "\n]}\n") == 0, cleanup);
+    ASSERT(count_test_matches(text, "{\"name\":\"task\",") ==
+           TEST_TRACE_TASKS, cleanup);
+    ASSERT(count_test_matches(text, "{\"name\":\"chunked\",") ==
+           2 * TRACE_CHUNK_SPANS + 3, cleanup);
+    ASSERT(count_test_matches(text, "\"args\":{\"name\":\"main\"}") == 1,
+           cleanup);
+    /* the pool names its threads */
+    ASSERT(count_test_matches(text, "\"args\":{\"name\":\"worker\"}") >= 1,
+           cleanup);
+    ASSERT(strstr(text, "\"tokens\":7}"), cleanup);
+    ASSERT(strstr(text, "\"detail\":\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"}"),
+           cleanup);
+    ASSERT(strstr(text, "\"detail\":\"say \\\"hi\\\"\\\\\"}"), cleanup);
+cleanup:
+    unlink(path);
+    free(text);
+end:;
+}
+END_TEST
+
+static atomic_int test_trace_stop;
+
+/* End spans as if they had begun before the recording stopped, so
+ * they race with trace_finish freeing the buffers. */
+static void*
+end_late_spans(void* arg) {
+    (void) arg;
+    rpmalloc_thread_initialize();
+    while (!atomic_load(&test_trace_stop)) {
+        trace_end(1, "late", "detail", 0);
+        trace_thread_name("late");
+    }
+    rpmalloc_thread_finalize();
+    return 0;
+}
+
+TEST(test_trace_late_spans) {
+    pthread_t threads[4];
+    size_t started = 0;
+    size_t i;
+    atomic_store(&test_trace_stop, 0);
+    for (; started != sizeof(threads) / sizeof(*threads); ++started) {
+        if (pthread_create(&threads[started], 0, end_late_spans, 0)) {
+            break;
+        }
+    }
+    ASSERT(started, cleanup);
+    for (i = 0; i != 300; ++i) {
+        ASSERT(trace_start() == 0, cleanup);
+        ASSERT(trace_finish("/dev/null") == 0, cleanup);
+    }
+cleanup:
+    atomic_store(&test_trace_stop, 1);
+    for (i = 0; i != started; ++i) {
+        pthread_join(threads[i], 0);
+    }
+}
+END_TEST
+
+void test_trace(void) {
+    RUN(test_trace_buffers);
+    RUN(test_trace_late_spans);
+}
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef HEADER_GUARD_TRACE_H
+#define HEADER_GUARD_TRACE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Each thread keeps its spans in chunks of this many, allocated as it
+ * records them. */
+#define TRACE_CHUNK_SPANS (1 << 9)
+/* The most spans each thread keeps.  Once a thread has recorded more,
+ * its oldest chunk of spans is reused.  Must be a multiple of
+ * TRACE_CHUNK_SPANS. */
+#define TRACE_BUFFER_SPANS (1 << 18)
+/* Details longer than this are truncated. */
+#define TRACE_DETAIL_SIZE 36
+
+/* Start recording spans. */
+int trace_start(void);
+
+/* Stop recording and write every thread's spans to `path` in the
+ * Chrome trace event format, which chrome://tracing and Perfetto
+ * load. */
+int trace_finish(const char* path);
+
+/* Returns the start time of a span, or 0 if not recording. */
+unsigned long long trace_begin(void);
+
+/* Record a span of the calling thread that started at `start`, as
+ * returned by trace_begin.  `name` must outlive the recording while
+ * `detail` is copied and may be null.  Each thread records into its
+ * own buffer so this doesn't take any locks after the thread's
+ * first span. */
+void trace_end(unsigned long long start, const char* name,
+               const char* detail, size_t tokens);
+
+/* Name the calling thread in the trace.  `name` must outlive the
+ * recording. */
+void trace_thread_name(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
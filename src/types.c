@@ -0,0 +1,544 @@
+#include "types.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include "../cutil/rpmalloc.h"
+#include "builtin_hash.h"
+#include "builtin_table.h"
+
+static const char* const builtin_names[type_first_signature] = {
+    [type_unknown] = "<unknown>",
+#define BUILTIN(type, name, size, alignment, is_signed, element, lanes) \
+    [type] = name,
+#include "builtins.def"
+#undef BUILTIN
+    [type_int_literal] = "<integer literal>",
+    [type_float_literal] = "<floating point literal>",
+};
+
+const builtin_type_info*
+find_builtin_type(const char* name, size_t len) {
+    const builtin_type_info* info = &builtin_table[builtin_slot(
+        builtin_hash(BUILTIN_HASH_SEED, name, len), BUILTIN_TABLE_SIZE)];
+    if (info->name_len == len && info->name &&
+        memcmp(info->name, name, len) == 0) {
+        return info;
+    }
+    return 0;
+}
+
+const builtin_type_info*
+get_builtin_type(type_id type) {
+    const char* name;
+    assert(type > type_unknown && type < type_int_literal);
+    name = builtin_names[type];
+    return find_builtin_type(name, strlen(name));
+}
+
+type_id
+lookup_builtin_type(const char* name) {
+    const builtin_type_info* info = find_builtin_type(name, strlen(name));
+    return info ? info->type : type_unknown;
+}
+
+int
+is_integer_type(type_id type) {
+    return (type >= type_byte && type <= type_u64) ||
+           type == type_int_literal;
+}
+
+int
+is_float_type(type_id type) {
+    return type == type_f32 || type == type_f64 ||
+           type == type_float_literal;
+}
+
+int
+is_vector_type(type_id type) {
+    return type >= type_i8x16 && type <= type_f64x4;
+}
+
+builtin_function
+lookup_builtin_function(const char* name) {
+    if (strncmp(name, "std::", 5) != 0) {
+        return builtin_not_a_function;
+    }
+    if (strcmp(name + 5, "lane") == 0) {
+        return builtin_lane;
+    }
+    if (strcmp(name + 5, "with_lane") == 0) {
+        return builtin_with_lane;
+    }
+    return builtin_not_a_function;
+}
+
+/* Signatures are only ever added, so a signature stays where it is
+ * once interned and only the tables pointing at them need the
+ * lock. */
+static pthread_mutex_t signatures_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    /* indexed by type - type_first_signature */
+    signature** signatures;
+    size_t len, cap;
+    /* open addressing table of type ids, 0 for empty slots */
+    type_id* slots;
+    size_t num_slots;
+} signatures;
+
+static size_t
+hash_signature(type_id return_type, const type_id* params,
+               size_t num_params, size_t num_required) {
+    size_t hash = 14695981039346656037ULL;
+    size_t i;
+    hash = (hash ^ return_type) * 1099511628211ULL;
+    hash = (hash ^ num_required) * 1099511628211ULL;
+    for (i = 0; i != num_params; ++i) {
+        hash = (hash ^ params[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int
+same_signature(const signature* sig, type_id return_type,
+               const type_id* params, size_t num_params,
+               size_t num_required) {
+    return sig->return_type == return_type &&
+           sig->num_params == num_params &&
+           sig->num_required == num_required &&
+           memcmp(sig->params, params, num_params * sizeof(type_id)) == 0;
+}
+
+static int
+grow_signature_slots(void) {
+    size_t num_slots = signatures.num_slots ? signatures.num_slots * 2 : 64;
+    type_id* slots = rpcalloc(num_slots, sizeof(type_id));
+    size_t i;
+    if (!slots) {
+        return -1;
+    }
+    for (i = 0; i != signatures.len; ++i) {
+        const signature* sig = signatures.signatures[i];
+        size_t slot = hash_signature(sig->return_type, sig->params,
+                                     sig->num_params, sig->num_required)
+                    & (num_slots - 1);
+        while (slots[slot]) {
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        slots[slot] = (type_id) (type_first_signature + i);
+    }
+    rpfree(signatures.slots);
+    signatures.slots = slots;
+    signatures.num_slots = num_slots;
+    return 0;
+}
+
+type_id
+intern_signature(type_id return_type, const type_id* params,
+                 size_t num_params, size_t num_required) {
+    size_t hash = hash_signature(return_type, params, num_params,
+                                 num_required);
+    signature* sig;
+    size_t slot;
+    type_id type = type_unknown;
+    pthread_mutex_lock(&signatures_lock);
+    if ((signatures.len + 1) * 2 > signatures.num_slots &&
+        grow_signature_slots()) {
+        goto done;
+    }
+    slot = hash & (signatures.num_slots - 1);
+    while (signatures.slots[slot]) {
+        const signature* existing = signatures.signatures[
+            signatures.slots[slot] - type_first_signature];
+        if (same_signature(existing, return_type, params, num_params,
+                           num_required)) {
+            type = signatures.slots[slot];
+            goto done;
+        }
+        slot = (slot + 1) & (signatures.num_slots - 1);
+    }
+    if (signatures.len == signatures.cap) {
+        size_t cap = signatures.cap ? signatures.cap * 2 : 64;
+        signature** grown = rprealloc(signatures.signatures,
+                                      cap * sizeof(signature*));
+        if (!grown) {
+            goto done;
+        }
+        signatures.signatures = grown;
+        signatures.cap = cap;
+    }
+    sig = rpmalloc(sizeof(signature) + num_params * sizeof(type_id));
+    if (!sig) {
+        goto done;
+    }
+    sig->return_type = return_type;
+    sig->num_required = num_required;
+    sig->num_params = num_params;
+    memcpy(sig->params, params, num_params * sizeof(type_id));
+    type = (type_id) (type_first_signature + signatures.len);
+    signatures.signatures[signatures.len++] = sig;
+    signatures.slots[slot] = type;
+done:
+    pthread_mutex_unlock(&signatures_lock);
+    return type;
+}
+
+const signature*
+get_signature(type_id type) {
+    const signature* sig;
+    assert(type >= type_first_signature);
+    pthread_mutex_lock(&signatures_lock);
+    assert(type - type_first_signature < signatures.len);
+    sig = signatures.signatures[type - type_first_signature];
+    pthread_mutex_unlock(&signatures_lock);
+    return sig;
+}
+
+int
+format_type(str* out, type_id type) {
+    const signature* sig;
+    size_t i;
+    if (type < type_first_signature) {
+        return str_push_s(out, builtin_names[type]);
+    }
+    sig = get_signature(type);
+    if (str_push_s(out, "fun (")) {
+        return -1;
+    }
+    for (i = 0; i != sig->num_params; ++i) {
+        if ((i && str_push_s(out, ", ")) ||
+            format_type(out, sig->params[i]) ||
+            (i >= sig->num_required && str_push_s(out, " = ..."))) {
+            return -1;
+        }
+    }
+    return str_push_s(out, ") -> ") || format_type(out, sig->return_type)
+               ? -1 : 0;
+}
+
+int
+init_type_tables(type_tables* tables, size_t len) {
+    tables->declarations = rpcalloc(len + 1, sizeof(type_id));
+    tables->bodies = rpcalloc(len + 1, sizeof(expression_types));
+    tables->len = len;
+    tables->num_recalled = 0;
+    if (!tables->declarations || !tables->bodies) {
+        rpfree(tables->declarations);
+        rpfree(tables->bodies);
+        tables->declarations = 0;
+        tables->bodies = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void
+destroy_expression_types(expression_types* types) {
+    rpfree(types->types);
+    rpfree(types->locals);
+    types->types = 0;
+    types->len = 0;
+    types->locals = 0;
+    types->num_locals = 0;
+}
+
+void
+destroy_type_tables(type_tables* tables) {
+    size_t i;
+    if (tables->bodies) {
+        for (i = 0; i != tables->len; ++i) {
+            destroy_expression_types(&tables->bodies[i]);
+        }
+    }
+    rpfree(tables->declarations);
+    rpfree(tables->bodies);
+    tables->declarations = 0;
+    tables->bodies = 0;
+    tables->len = 0;
+}
+
+static int
+copy_expression_types(expression_types* to, const expression_types* from) {
+    to->types = rpmalloc((from->len + 1) * sizeof(type_id));
+    to->locals = rpmalloc((from->num_locals + 1) * sizeof(type_id));
+    if (!to->types || !to->locals) {
+        rpfree(to->types);
+        rpfree(to->locals);
+        to->types = 0;
+        to->locals = 0;
+        return -1;
+    }
+    memcpy(to->types, from->types, from->len * sizeof(type_id));
+    memcpy(to->locals, from->locals, from->num_locals * sizeof(type_id));
+    to->len = from->len;
+    to->num_locals = from->num_locals;
+    return 0;
+}
+
+/* The remembered types of each function, one per name so editing a
+ * function replaces its old types. */
+struct remembered {
+    struct remembered* next;
+    char* name;
+    unsigned long long body_stamp;
+    unsigned long long deps_stamp;
+    expression_types types;
+};
+#define REMEMBERED_BUCKETS 1024
+
+static pthread_mutex_t remembered_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct remembered** remembered;
+static int remembering;
+
+static size_t
+hash_name(const char* name) {
+    size_t hash = 14695981039346656037ULL;
+    for (; *name; ++name) {
+        hash = (hash ^ (unsigned char) *name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void
+remember_types(int enable) {
+    pthread_mutex_lock(&remembered_lock);
+    remembering = enable;
+    pthread_mutex_unlock(&remembered_lock);
+}
+
+int
+remembering_types(void) {
+    int enabled;
+    pthread_mutex_lock(&remembered_lock);
+    enabled = remembering;
+    pthread_mutex_unlock(&remembered_lock);
+    return enabled;
+}
+
+int
+recall_types(const char* name, unsigned long long body_stamp,
+             unsigned long long deps_stamp, expression_types* out) {
+    const struct remembered* entry;
+    int res = -1;
+    pthread_mutex_lock(&remembered_lock);
+    if (!remembered) {
+        goto done;
+    }
+    entry = remembered[hash_name(name) % REMEMBERED_BUCKETS];
+    while (entry && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    if (entry && entry->body_stamp == body_stamp &&
+        entry->deps_stamp == deps_stamp) {
+        res = copy_expression_types(out, &entry->types);
+    }
+done:
+    pthread_mutex_unlock(&remembered_lock);
+    return res;
+}
+
+void
+store_types(const char* name, unsigned long long body_stamp,
+            unsigned long long deps_stamp, const expression_types* types) {
+    struct remembered** bucket;
+    struct remembered* entry;
+    expression_types copy;
+    pthread_mutex_lock(&remembered_lock);
+    if (!remembering) {
+        goto done;
+    }
+    if (!remembered) {
+        remembered = rpcalloc(REMEMBERED_BUCKETS, sizeof(*remembered));
+        if (!remembered) {
+            goto done;
+        }
+    }
+    if (copy_expression_types(&copy, types)) {
+        goto done;
+    }
+    bucket = &remembered[hash_name(name) % REMEMBERED_BUCKETS];
+    entry = *bucket;
+    while (entry && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    if (!entry) {
+        size_t len = strlen(name);
+        entry = rpmalloc(sizeof(*entry));
+        if (entry) {
+            entry->name = rpmalloc(len + 1);
+        }
+        if (!entry || !entry->name) {
+            rpfree(entry);
+            destroy_expression_types(&copy);
+            goto done;
+        }
+        memcpy(entry->name, name, len + 1);
+        entry->next = *bucket;
+        *bucket = entry;
+    } else {
+        destroy_expression_types(&entry->types);
+    }
+    entry->body_stamp = body_stamp;
+    entry->deps_stamp = deps_stamp;
+    entry->types = copy;
+done:
+    pthread_mutex_unlock(&remembered_lock);
+}
+
+void
+release_types(void) {
+    size_t i;
+    pthread_mutex_lock(&remembered_lock);
+    if (remembered) {
+        for (i = 0; i != REMEMBERED_BUCKETS; ++i) {
+            struct remembered* entry = remembered[i];
+            while (entry) {
+                struct remembered* next = entry->next;
+                destroy_expression_types(&entry->types);
+                rpfree(entry->name);
+                rpfree(entry);
+                entry = next;
+            }
+        }
+        rpfree(remembered);
+        remembered = 0;
+    }
+    pthread_mutex_unlock(&remembered_lock);
+
+    pthread_mutex_lock(&signatures_lock);
+    for (i = 0; i != signatures.len; ++i) {
+        rpfree(signatures.signatures[i]);
+    }
+    rpfree(signatures.signatures);
+    rpfree(signatures.slots);
+    signatures.signatures = 0;
+    signatures.slots = 0;
+    signatures.len = 0;
+    signatures.cap = 0;
+    signatures.num_slots = 0;
+    pthread_mutex_unlock(&signatures_lock);
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+#include "fiter.h"
+#include "lex.h"
+#include "parse.h"
+#include "sema.h"
+
+static const char* test_types_file[] =
+    {"add := fun (a : std::i32, b : std::i32) -> std::i32 {",
+     "return a + b; }",
+     "sub := fun (a : std::i32, b : std::i32) -> std::i32 {",
+     "return a - 1; }", 0};
+TEST(test_expression_types) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    type_tables tables = {0, 0, 0, 0};
+    const signature* sig;
+    expr_ref ret;
+    fiter iter;
+    fiter_init(&iter, (FILE*) test_types_file, "types_test");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    remember_types(1);
+    ASSERT(check_semantics(&toplevels, 1, 1, 0, &tables) == 0, cleanup);
+    ASSERT(tables.num_recalled == 0, cleanup);
+
+    ret = toplevels.vars[0].type.data.fun_def.stmts.stmts[0].data.s_return;
+    ASSERT(tables.bodies[0].types[ret] == type_i32, cleanup);
+    ASSERT(tables.bodies[0].num_locals == 2, cleanup);
+    ASSERT(tables.declarations[0] == tables.declarations[1], cleanup);
+    sig = get_signature(tables.declarations[0]);
+    ASSERT(sig->num_params == 2 && sig->params[1] == type_i32, cleanup);
+
+    /* nothing changed, so the second check recalls both bodies */
+    destroy_type_tables(&tables);
+    ASSERT(check_semantics(&toplevels, 1, 1, 0, &tables) == 0, cleanup);
+    ASSERT(tables.num_recalled == 2, cleanup);
+    ASSERT(tables.bodies[0].types[ret] == type_i32, cleanup);
+cleanup:
+    remember_types(0);
+    destroy_type_tables(&tables);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+}
+END_TEST
+
+TEST(test_builtin_types) {
+    type_id type;
+    for (type = type_void; type != type_int_literal; ++type) {
+        const builtin_type_info* info = get_builtin_type(type);
+        ASSERT(info && info->type == type, end);
+        ASSERT(lookup_builtin_type(builtin_names[type]) == type, end);
+    }
+    ASSERT(get_builtin_type(type_i16)->size == 2, end);
+    ASSERT(get_builtin_type(type_i16)->is_signed, end);
+    ASSERT(get_builtin_type(type_u64)->alignment == 8, end);
+    ASSERT(!get_builtin_type(type_u64)->is_signed, end);
+    ASSERT(find_builtin_type("std::i32", 7) == 0, end);
+    ASSERT(lookup_builtin_type("std::i128") == type_unknown, end);
+    ASSERT(lookup_builtin_type("i32") == type_unknown, end);
+    ASSERT(get_builtin_type(type_f32x8)->size == 32, end);
+    ASSERT(get_builtin_type(type_f32x8)->element == type_f32, end);
+    ASSERT(get_builtin_type(type_u16x8)->lanes == 8, end);
+    ASSERT(is_vector_type(type_i64x2) && !is_vector_type(type_i64), end);
+end:;
+}
+END_TEST
+
+static const char* test_lane_range_file[] =
+    {"f := fun (a : std::i32x4) -> std::i32 {",
+     "return std::lane(a, 4); }", 0};
+static const char* test_lane_variable_file[] =
+    {"f := fun (a : std::i32x4, i : std::i64) -> std::i32 {",
+     "return std::lane(a, i); }", 0};
+static const char* test_mixed_vectors_file[] =
+    {"f := fun (a : std::i32x4, b : std::f32x4) -> std::i32x4 {",
+     "return a + b; }", 0};
+
+/* Whether checking `file` reports exactly one error, which starts
+ * with `message`. */
+static int
+rejects_vectors(const char** file, const char* message) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    vec_diagnostic errors = VEC_INIT;
+    vec_diagnostic* previous = capture_diagnostics(&errors);
+    fiter iter;
+    int res;
+    fiter_init(&iter, (FILE*) file, "vector_test");
+    res = lex(&iter, &tokens) == 0 && parse(&tokens, &toplevels, 0) == 0 &&
+          check_semantics(&toplevels, 1, 1, 0, 0) == -1 &&
+          errors.len == 1 &&
+          strncmp(str_cbegin(&errors.diagnostics[0].message), message,
+                  strlen(message)) == 0;
+    capture_diagnostics(previous);
+    destroy_diagnostics(&errors);
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+    return res;
+}
+
+TEST(test_vector_errors) {
+    ASSERT(rejects_vectors(test_lane_range_file,
+                           "The lane must be an integer literal less "
+                           "than the number of lanes of std::i32x4"),
+           end);
+    ASSERT(rejects_vectors(test_lane_variable_file,
+                           "The lane must be an integer literal"),
+           end);
+    ASSERT(rejects_vectors(test_mixed_vectors_file,
+                           "Mismatched types std::i32x4 and std::f32x4"),
+           end);
+end:;
+}
+END_TEST
+
+void test_types(void) {
+    RUN(test_expression_types);
+    RUN(test_builtin_types);
+    RUN(test_vector_errors);
+}
+#endif
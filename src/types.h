@@ -0,0 +1,180 @@
+#pragma once
+
+#ifndef HEADER_GUARD_TYPES_H
+#define HEADER_GUARD_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../cutil/str.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Types are small numbers so the type checker can keep them in dense
+ * tables beside the syntax tree instead of in it.  The builtin types
+ * come first, then function signatures, which are interned so equal
+ * signatures get the same number for as long as the process runs. */
+typedef uint32_t type_id;
+
+enum builtin_type {
+    /* The type of expressions with errors, which matches everything
+     * so an error isn't reported again by every use. */
+    type_unknown,
+    type_void,
+    type_byte,
+    type_bool,
+    type_i8,
+    type_i16,
+    type_i32,
+    type_i64,
+    type_u8,
+    type_u16,
+    type_u32,
+    type_u64,
+    type_f32,
+    type_f64,
+    type_i8x16,
+    type_i16x8,
+    type_i32x4,
+    type_i64x2,
+    type_u8x16,
+    type_u16x8,
+    type_u32x4,
+    type_u64x2,
+    type_f32x4,
+    type_f64x2,
+    type_i8x32,
+    type_i16x16,
+    type_i32x8,
+    type_i64x4,
+    type_u8x32,
+    type_u16x16,
+    type_u32x8,
+    type_u64x4,
+    type_f32x8,
+    type_f64x4,
+    /* Literals and constants holding them take the type of whatever
+     * they are used as. */
+    type_int_literal,
+    type_float_literal,
+    type_first_signature,
+};
+
+/* What the compiler knows about a builtin type. */
+struct builtin_type_info {
+    const char* name;
+    size_t name_len;
+    type_id type;
+    unsigned char size;
+    unsigned char alignment;
+    unsigned char is_signed;
+    /* The type of each lane of a vector, or the type itself for
+     * scalars. */
+    type_id element;
+    unsigned char lanes;
+};
+typedef struct builtin_type_info builtin_type_info;
+
+/* The builtin type called `name`, which is `len` bytes long, null if
+ * there is none.  This is one probe into a perfect hash table
+ * generated from builtins.def at build time. */
+const builtin_type_info* find_builtin_type(const char* name, size_t len);
+/* The builtin type `type`, which must be one in builtins.def. */
+const builtin_type_info* get_builtin_type(type_id type);
+
+/* The builtin type called `name`, type_unknown if there is none. */
+type_id lookup_builtin_type(const char* name);
+
+int is_integer_type(type_id);
+int is_float_type(type_id);
+int is_vector_type(type_id);
+
+/* The functions the compiler defines on vectors:
+ *
+ *     std::lane(v, i) is lane i of v.
+ *     std::with_lane(v, i, x) is v with lane i replaced by x.
+ *
+ * `i` must be an integer literal. */
+enum builtin_function {
+    builtin_not_a_function,
+    builtin_lane,
+    builtin_with_lane,
+};
+typedef enum builtin_function builtin_function;
+
+builtin_function lookup_builtin_function(const char* name);
+
+/* Append the name of `type` to `out`. */
+int format_type(str* out, type_id type);
+
+struct signature {
+    type_id return_type;
+    /* The number of parameters without a default value. */
+    size_t num_required;
+    size_t num_params;
+    type_id params[1];
+};
+typedef struct signature signature;
+
+/* The type of functions taking `params` and returning
+ * `return_type`.  Returns type_unknown when out of memory.  Safe to
+ * call from multiple threads. */
+type_id intern_signature(type_id return_type, const type_id* params,
+                         size_t num_params, size_t num_required);
+/* The signature of the function type `type`, which stays valid until
+ * release_types. */
+const signature* get_signature(type_id type);
+
+/* The types computed for the expressions of one declaration. */
+struct expression_types {
+    /* Indexed by expr_ref. */
+    type_id* types;
+    uint32_t len;
+    /* The parameters and local variables in the order they are
+     * declared. */
+    type_id* locals;
+    size_t num_locals;
+};
+typedef struct expression_types expression_types;
+
+/* The types of a whole file, indexed like its top level
+ * declarations. */
+struct type_tables {
+    type_id* declarations;
+    expression_types* bodies;
+    size_t len;
+    /* The number of bodies whose types were recalled instead of
+     * checked. */
+    size_t num_recalled;
+};
+typedef struct type_tables type_tables;
+
+int init_type_tables(type_tables*, size_t len);
+void destroy_expression_types(expression_types*);
+void destroy_type_tables(type_tables*);
+
+/* Keep the types of every body checked without errors, so a body
+ * that is checked again, unchanged and with the signatures it uses
+ * unchanged, can have its types recalled instead.  The compile server
+ * turns this on as it sees the same files over and over. */
+void remember_types(int enable);
+int remembering_types(void);
+/* Copy the types remembered for the body of `name` into `out` if
+ * they were remembered with the same stamps.  Returns 0 if they
+ * were. */
+int recall_types(const char* name, unsigned long long body_stamp,
+                 unsigned long long deps_stamp, expression_types* out);
+void store_types(const char* name, unsigned long long body_stamp,
+                 unsigned long long deps_stamp,
+                 const expression_types* types);
+
+/* Free the interned signatures and remembered types.  No type ids of
+ * signatures may be used afterwards. */
+void release_types(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
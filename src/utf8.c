@@ -0,0 +1,182 @@
+#include "utf8.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Skip the ASCII bytes at the start of `text`. */
+static size_t
+skip_ascii(const unsigned char* text, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; len - i >= 16; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (text + i));
+        /* the top bit of every byte */
+        int mask = _mm_movemask_epi8(chunk);
+        if (mask) {
+            return i + (size_t) __builtin_ctz((unsigned) mask);
+        }
+    }
+#else
+    for (; len - i >= 8; i += 8) {
+        unsigned long long word;
+        memcpy(&word, text + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+#endif
+    while (i != len && text[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+size_t
+utf8_validate(utf8_state* state, const char* text, size_t len) {
+    const unsigned char* bytes = (const unsigned char*) text;
+    size_t start = 0;
+    size_t i = 0;
+    while (i != len) {
+        unsigned char c;
+        if (state->need) {
+            c = bytes[i];
+            if (c < state->low || c > state->high) {
+                return start;
+            }
+            --state->need;
+            state->low = 0x80;
+            state->high = 0xBF;
+            ++i;
+            continue;
+        }
+
+        i += skip_ascii(bytes + i, len - i);
+        if (i == len) {
+            break;
+        }
+        /* The ranges exclude overlong encodings, surrogates and
+         * anything past U+10FFFF. */
+        c = bytes[i];
+        start = i;
+        if (c >= 0xC2 && c <= 0xDF) {
+            state->need = 1;
+        } else if (c == 0xE0) {
+            state->need = 2;
+            state->low = 0xA0;
+        } else if (c == 0xED) {
+            state->need = 2;
+            state->high = 0x9F;
+        } else if (c >= 0xE1 && c <= 0xEF) {
+            state->need = 2;
+        } else if (c == 0xF0) {
+            state->need = 3;
+            state->low = 0x90;
+        } else if (c >= 0xF1 && c <= 0xF3) {
+            state->need = 3;
+        } else if (c == 0xF4) {
+            state->need = 3;
+            state->high = 0x8F;
+        } else {
+            return i;
+        }
+        ++i;
+    }
+    return len;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+#include "../cutil/vec.h"
+#include "diagnostics.h"
+#include "fiter.h"
+
+/* Validate `text` in one go from the start of a character. */
+static size_t
+validate(const char* text, size_t len) {
+    utf8_state state = UTF8_STATE_INIT;
+    return utf8_validate(&state, text, len);
+}
+
+TEST(test_utf8_validate) {
+    utf8_state state = UTF8_STATE_INIT;
+    ASSERT(validate("a\xC3\xA9\xE2\x82\xAC\xF4\x8F\xBF\xBF", 10) == 10, end);
+    /* overlong */
+    ASSERT(validate("\xC0\xAF", 2) == 0, end);
+    ASSERT(validate("\xC1\xBF", 2) == 0, end);
+    ASSERT(validate("\xE0\x80\xAF", 3) == 0, end);
+    ASSERT(validate("\xF0\x8F\xBF\xBF", 4) == 0, end);
+    /* surrogates */
+    ASSERT(validate("ab\xED\xA0\x80", 5) == 2, end);
+    ASSERT(validate("\xED\xBF\xBF", 3) == 0, end);
+    /* past U+10FFFF */
+    ASSERT(validate("\xF4\x90\x80\x80", 4) == 0, end);
+    ASSERT(validate("\xF5\x80\x80\x80", 4) == 0, end);
+    /* a stray continuation byte after a run of ASCII */
+    ASSERT(validate("0123456789abcdefghijklmnopqrstuvwxyz\x80", 37) == 36,
+           end);
+
+    /* split between buffers */
+    ASSERT(utf8_validate(&state, "x\xF0\x9F", 3) == 3, end);
+    ASSERT(state.need == 2, end);
+    ASSERT(utf8_validate(&state, "\x98\x80y", 3) == 3, end);
+    ASSERT(state.need == 0, end);
+    /* the second byte of a split character still excludes surrogates,
+     * reported at the start of the next buffer */
+    ASSERT(utf8_validate(&state, "\xED", 1) == 1, end);
+    ASSERT(utf8_validate(&state, "\xA0\x80", 2) == 0, end);
+end:;
+}
+END_TEST
+
+/* Read all of `text` through a fiter, which validates it 1024 bytes at
+ * a time.  Returns how many bytes it got before the end or an error
+ * and sets `*errors` to the number of errors. */
+static size_t
+read_through(const char* text, size_t len, size_t* errors) {
+    vec_diagnostic diagnostics = VEC_INIT;
+    fposition start = {"utf8_test", 1, 1};
+    fiter iter;
+    size_t count = 0;
+    fiter_init_memory(&iter, text, len, &start);
+    iter.errors = &diagnostics;
+    while (fiter_next(&iter)) {
+        ++count;
+    }
+    *errors = diagnostics.len;
+    destroy_diagnostics(&diagnostics);
+    return count;
+}
+
+TEST(test_utf8_buffers) {
+    char text[1100];
+    size_t errors;
+    memset(text, 'a', sizeof(text));
+    /* a character split across the first and second buffer */
+    memcpy(text + 1023, "\xC3\xA9", 2);
+    ASSERT(read_through(text, 1030, &errors) == 1030 && errors == 0, end);
+    memcpy(text + 1022, "\xF0\x9F\x98\x80", 4);
+    ASSERT(read_through(text, 1030, &errors) == 1030 && errors == 0, end);
+    /* invalid across the split, noticed once the second buffer is
+     * read */
+    memset(text, 'a', sizeof(text));
+    memcpy(text + 1023, "\xC3\x28", 2);
+    ASSERT(read_through(text, 1030, &errors) == 1024 && errors == 1, end);
+    /* the file ends in the middle of a character, right at the end
+     * of the first buffer, which is only known once the second is
+     * read, and inside the second */
+    memset(text, 'a', sizeof(text));
+    text[1023] = '\xC3';
+    ASSERT(read_through(text, 1024, &errors) == 1024 && errors == 1, end);
+    text[1023] = 'a';
+    memcpy(text + 1026, "\xE2\x82", 2);
+    ASSERT(read_through(text, 1028, &errors) == 1028 && errors == 1, end);
+end:;
+}
+END_TEST
+
+void test_utf8(void) {
+    RUN(test_utf8_validate);
+    RUN(test_utf8_buffers);
+}
+#endif
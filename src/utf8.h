@@ -0,0 +1,35 @@
+#pragma once
+
+#ifndef HEADER_GUARD_UTF8_H
+#define HEADER_GUARD_UTF8_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How to continue validating a character split between two
+ * buffers. */
+struct utf8_state {
+    /* the number of continuation bytes still expected */
+    unsigned char need;
+    /* the range the next continuation byte has to be in */
+    unsigned char low, high;
+};
+typedef struct utf8_state utf8_state;
+
+#define UTF8_STATE_INIT {0, 0x80, 0xBF}
+
+/* Validate `len` bytes of `text` as UTF-8, continuing from `state`.
+ * Returns the offset of the first byte of the first invalid
+ * character, or `len` if there is none.  A character that started
+ * in an earlier buffer is reported at offset 0.  Runs of ASCII are
+ * skipped 16 bytes at a time. */
+size_t utf8_validate(utf8_state* state, const char* text, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
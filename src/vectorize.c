@@ -0,0 +1,265 @@
+#include "vectorize.h"
+#include <assert.h>
+#include <string.h>
+
+/* Every statement of a vectorizable body assigns a different variable
+ * and the lanes hold two consecutive iterations, so the only values
+ * flowing from one iteration to the next are those of the induction
+ * variables, which each lane can compute ahead, and the partial sums
+ * of the reductions, which are only combined after the loop. */
+
+long
+find_loop_variable(const loop_plan* plan, const char* name) {
+    size_t i;
+    for (i = 0; i != plan->num_variables; ++i) {
+        if (strcmp(plan->variables[i].name, name) == 0) {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+int
+is_loop_invariant(const loop_plan* plan, const expression_pool* pool,
+                  expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    switch ((expression_type) expr->type) {
+    case expression_int:
+        return 1;
+    case expression_name:
+        return find_loop_variable(plan, get_expression_name(pool, ref)) < 0;
+    case expression_minus:
+    case expression_plus:
+        return is_loop_invariant(plan, pool, expr->first) &&
+               is_loop_invariant(plan, pool, expr->second);
+    default:
+        return 0;
+    }
+}
+
+static int
+fail(loop_plan* plan, const char* reason, const char* culprit) {
+    plan->reason = reason;
+    plan->culprit = culprit;
+    return -1;
+}
+
+/* The variable at the bottom of the chain of `+` and `-` on the left
+ * of `ref`, null if there is none. */
+static const char*
+accumulated_name(const expression_pool* pool, expr_ref ref) {
+    const expression* expr = &pool->nodes[ref];
+    while (expr->type == expression_plus || expr->type == expression_minus) {
+        ref = expr->first;
+        expr = &pool->nodes[ref];
+    }
+    return expr->type == expression_name ? get_expression_name(pool, ref)
+                                         : 0;
+}
+
+/* Check that `ref`, which is added to or subtracted from a reduction,
+ * only uses integers, invariants and induction variables, and return
+ * how many registers evaluating it takes. */
+static int
+operand_registers(loop_plan* plan, const expression_pool* pool,
+                  expr_ref ref, size_t* registers) {
+    const expression* expr = &pool->nodes[ref];
+    size_t first, second;
+    long index;
+    if (is_loop_invariant(plan, pool, ref)) {
+        *registers = 1;
+        return 0;
+    }
+    switch ((expression_type) expr->type) {
+    case expression_name:
+        index = find_loop_variable(plan, get_expression_name(pool, ref));
+        assert(index >= 0);
+        if (plan->variables[index].kind == loop_reduction) {
+            return fail(plan, "the reduction %s is read inside the loop",
+                        plan->variables[index].name);
+        }
+        *registers = 1;
+        return 0;
+    case expression_minus:
+    case expression_plus:
+        if (operand_registers(plan, pool, expr->first, &first) ||
+            operand_registers(plan, pool, expr->second, &second)) {
+            return -1;
+        }
+        *registers = first > second + 1 ? first : second + 1;
+        return 0;
+    default:
+        return fail(plan, "%s is not computed with only + and -",
+                    plan->culprit);
+    }
+}
+
+/* Check the operands of the value `ref` assigned to a reduction, from
+ * the innermost out, and return how many temporaries they take. */
+static int
+reduction_registers(loop_plan* plan, const expression_pool* pool,
+                    expr_ref ref, size_t* registers) {
+    const expression* expr = &pool->nodes[ref];
+    size_t operand;
+    if (expr->type == expression_name) {
+        *registers = 0;
+        return 0;
+    }
+    if (reduction_registers(plan, pool, expr->first, registers) ||
+        operand_registers(plan, pool, expr->second, &operand)) {
+        return -1;
+    }
+    if (operand > *registers) {
+        *registers = operand;
+    }
+    return 0;
+}
+
+int
+plan_loop(const expression_pool* pool, const statement* loop,
+          loop_plan* plan) {
+    const statements* body = &loop->data.s_while.body;
+    const expression* cond = &pool->nodes[loop->data.s_while.cond];
+    size_t i, temporaries = 1;
+    unsigned char reg = 0;
+    long counter;
+    assert(loop->type == statement_while);
+    plan->num_variables = 0;
+    plan->culprit = "";
+    if (cond->type != expression_name) {
+        return fail(plan, "the condition is not a variable counting "
+                    "down", "");
+    }
+    if (body->len > MAX_LOOP_VARIABLES) {
+        return fail(plan, "the body has too many statements", "");
+    }
+    /* Find what is assigned first so every operand can be told apart
+     * from invariants. */
+    for (i = 0; i != body->len; ++i) {
+        const statement* stmt = &body->stmts[i];
+        const expression* expr;
+        loop_variable* var = &plan->variables[plan->num_variables];
+        if (stmt->type != statement_expression) {
+            return fail(plan, "the body does more than assign "
+                        "variables", "");
+        }
+        expr = &pool->nodes[stmt->data.s_expression];
+        if (expr->type != expression_assign ||
+            pool->nodes[expr->first].type != expression_name) {
+            return fail(plan, "the body does more than assign "
+                        "variables", "");
+        }
+        var->name = get_expression_name(pool, expr->first);
+        var->value = expr->second;
+        if (find_loop_variable(plan, var->name) >= 0) {
+            return fail(plan, "%s is assigned more than once", var->name);
+        }
+        ++plan->num_variables;
+    }
+    for (i = 0; i != plan->num_variables; ++i) {
+        loop_variable* var = &plan->variables[i];
+        const expression* value = &pool->nodes[var->value];
+        const char* accumulated = accumulated_name(pool, var->value);
+        if (!accumulated || strcmp(accumulated, var->name) != 0 ||
+            pool->nodes[var->value].type == expression_name) {
+            return fail(plan, "%s depends on other iterations without "
+                        "being an induction or reduction variable",
+                        var->name);
+        }
+        if (pool->nodes[value->first].type == expression_name &&
+            is_loop_invariant(plan, pool, value->second)) {
+            var->kind = loop_induction;
+            var->step = value->second;
+            var->subtract = value->type == expression_minus;
+        } else {
+            var->kind = loop_reduction;
+        }
+    }
+    counter = find_loop_variable(plan, get_expression_name(
+                                           pool, loop->data.s_while.cond));
+    if (counter < 0) {
+        return fail(plan, "%s is not changed by the loop",
+                    get_expression_name(pool, loop->data.s_while.cond));
+    }
+    plan->counter = (size_t) counter;
+    if (plan->variables[counter].kind != loop_induction ||
+        !plan->variables[counter].subtract ||
+        pool->nodes[plan->variables[counter].step].type != expression_int ||
+        get_expression_int(pool, plan->variables[counter].step) != 1) {
+        return fail(plan, "%s does not count down by one",
+                    plan->variables[counter].name);
+    }
+    for (i = 0; i != plan->num_variables; ++i) {
+        loop_variable* var = &plan->variables[i];
+        size_t registers;
+        var->reg = reg++;
+        if (var->kind == loop_induction) {
+            var->step_reg = reg++;
+            continue;
+        }
+        plan->culprit = var->name;
+        if (reduction_registers(plan, pool, var->value, &registers)) {
+            return -1;
+        }
+        if (registers > temporaries) {
+            temporaries = registers;
+        }
+    }
+    plan->culprit = "";
+    if (reg + temporaries > MAX_VECTOR_REGISTERS) {
+        return fail(plan, "the loop needs more vector registers than "
+                    "there are", "");
+    }
+    plan->first_temporary = reg;
+    plan->num_registers = (unsigned char) (reg + temporaries);
+    return 0;
+}
+
+#ifdef TEST_MODE
+#include "../cutil/test.h"
+#include "../cutil/vec.h"
+#include "fiter.h"
+#include "lex.h"
+
+static const char* test_vectorize_file[] =
+    {"f := fun (n : std::i64, k : std::i64) -> std::i64 {",
+     "s := 0; i := 0;",
+     "while (n) { i = i + k; s = s + i - 1; n = n - 1; }",
+     "while (n) { s = s + i; i = i + s; n = n - 1; }",
+     "while (n) { n = n - 2; }",
+     "return s; }", 0};
+TEST(test_plan_loop) {
+    vec_var_decl toplevels = VEC_INIT;
+    vec_token tokens = VEC_INIT;
+    const statements* stmts;
+    const expression_pool* pool;
+    loop_plan plan;
+    fiter iter;
+    fiter_init(&iter, (FILE*) test_vectorize_file, "vectorize_test");
+    ASSERT(lex(&iter, &tokens) == 0, cleanup);
+    ASSERT(parse(&tokens, &toplevels, 0) == 0, cleanup);
+    stmts = &toplevels.vars[0].type.data.fun_def.stmts;
+    pool = &toplevels.vars[0].exprs;
+    ASSERT(stmts->len == 6, cleanup);
+
+    ASSERT(plan_loop(pool, &stmts->stmts[2], &plan) == 0, cleanup);
+    ASSERT(plan.num_variables == 3 && plan.counter == 2, cleanup);
+    ASSERT(plan.variables[0].kind == loop_induction, cleanup);
+    ASSERT(plan.variables[1].kind == loop_reduction, cleanup);
+    ASSERT(plan.num_registers == 6, cleanup);
+
+    /* s and i depend on each other's partial sums */
+    ASSERT(plan_loop(pool, &stmts->stmts[3], &plan) == -1, cleanup);
+    ASSERT(strcmp(plan.culprit, "i") == 0, cleanup);
+    ASSERT(plan_loop(pool, &stmts->stmts[4], &plan) == -1, cleanup);
+    ASSERT(strcmp(plan.culprit, "n") == 0, cleanup);
+cleanup:
+    destroy_var_decls(&toplevels);
+    destroy_tokens(&tokens);
+}
+END_TEST
+
+void test_vectorize(void) {
+    RUN(test_plan_loop);
+}
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifndef HEADER_GUARD_VECTORIZE_H
+#define HEADER_GUARD_VECTORIZE_H
+
+#include <stddef.h>
+#include "parse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The number of SSE registers a loop may use. */
+#define MAX_VECTOR_REGISTERS 16
+/* The most statements a vectorized loop body may have. */
+#define MAX_LOOP_VARIABLES 8
+
+enum loop_variable_kind {
+    /* `v = v + step` or `v = v - step` with a step that doesn't change
+     * inside the loop. */
+    loop_induction,
+    /* `v = v + a - b ...` where v isn't read anywhere else in the
+     * loop, so the lanes can sum their iterations separately. */
+    loop_reduction,
+};
+typedef enum loop_variable_kind loop_variable_kind;
+
+struct loop_variable {
+    const char* name;
+    loop_variable_kind kind;
+    /* The value assigned by its statement. */
+    expr_ref value;
+    /* For induction variables, what is added or subtracted in each
+     * iteration. */
+    expr_ref step;
+    int subtract;
+    /* The register holding its value in each lane and, for induction
+     * variables, the one holding the step in each lane. */
+    unsigned char reg;
+    unsigned char step_reg;
+};
+typedef struct loop_variable loop_variable;
+
+/* How to run a `while` loop two iterations at a time. */
+struct loop_plan {
+    /* The variables assigned by the body, one per statement in
+     * order. */
+    loop_variable variables[MAX_LOOP_VARIABLES];
+    size_t num_variables;
+    /* The induction variable in the condition, which counts the
+     * iterations left down to zero. */
+    size_t counter;
+    /* The first register free for temporaries and one past the last
+     * register used. */
+    unsigned char first_temporary;
+    unsigned char num_registers;
+    /* Why the loop can't be vectorized, a format taking `culprit`,
+     * the name of the variable at fault or an empty string. */
+    const char* reason;
+    const char* culprit;
+};
+typedef struct loop_plan loop_plan;
+
+/* Work out whether the `while` loop `loop`, whose expressions are in
+ * `pool`, is a counted loop over induction and reduction variables,
+ * with no dependence between iterations other than through those.
+ * Returns 0 and fills in `plan` if it is, otherwise -1 with the
+ * reason in `plan`.  Everything not assigned by the body is treated
+ * as invariant, which holds because the body may not call
+ * functions. */
+int plan_loop(const expression_pool* pool, const statement* loop,
+              loop_plan* plan);
+
+/* Find the variable `name` in `plan`, -1 if the loop doesn't assign
+ * it. */
+long find_loop_variable(const loop_plan* plan, const char* name);
+
+/* Whether `ref` doesn't change inside the loop of `plan`. */
+int is_loop_invariant(const loop_plan* plan, const expression_pool* pool,
+                      expr_ref ref);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
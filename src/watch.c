@@ -0,0 +1,665 @@
+#include "watch.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../cutil/rpmalloc.h"
+#include "arguments.h"
+#include "compile.h"
+#include "diagnostics.h"
+#include "load.h"
+#include "pool.h"
+
+/* Editors either write the file in place or write a new file and
+ * rename it over the old one. */
+#define WATCH_EVENTS \
+    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+
+struct watched_dir {
+    int wd;
+    char* path;
+};
+
+struct watched_file {
+    char* path;
+    /* The hash of the contents `result` was compiled from. */
+    unsigned long long hash;
+    int status;
+    compiled_file result;
+};
+
+struct watch {
+    arguments args;
+    /* The directory given on the command line. */
+    const char* root;
+    int fd;
+    struct watched_dir* dirs;
+    size_t num_dirs, dirs_cap;
+    struct watched_file* files;
+    size_t num_files, files_cap;
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void
+interrupt(int sig) {
+    (void) sig;
+    interrupted = 1;
+}
+
+static int
+grow(void** items, size_t* cap, size_t len, size_t size) {
+    size_t new_cap;
+    void* grown;
+    if (len != *cap) {
+        return 0;
+    }
+    new_cap = *cap ? *cap * 2 : 16;
+    grown = rprealloc(*items, new_cap * size);
+    if (!grown) {
+        return -1;
+    }
+    *items = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static char*
+join_path(const char* dir, const char* name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = rpmalloc(dir_len + name_len + 2);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+static int
+is_source(const char* name) {
+    size_t len = strlen(name);
+    return len > 5 && strcmp(name + len - 5, ".shiv") == 0;
+}
+
+static unsigned long long
+hash_text(const char* text, size_t len) {
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i != len; ++i) {
+        hash ^= (unsigned char) text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Read all of the file at `path`, null if it can't be read. */
+static char*
+read_text(const char* path, size_t* len) {
+    struct stat st;
+    char* text = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) == 0) {
+        text = rpmalloc((size_t) st.st_size + 1);
+    }
+    *len = 0;
+    while (text && *len != (size_t) st.st_size) {
+        ssize_t got = read(fd, text + *len, (size_t) st.st_size - *len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            /* truncated while reading, an event for the rest follows */
+            break;
+        }
+        *len += (size_t) got;
+    }
+    close(fd);
+    return text;
+}
+
+static long
+find_file(const struct watch* watch, const char* path) {
+    size_t i;
+    for (i = 0; i != watch->num_files; ++i) {
+        if (strcmp(watch->files[i].path, path) == 0) {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+static void
+forget_file(struct watch* watch, size_t index) {
+    struct watched_file* file = &watch->files[index];
+    destroy_compiled_file(&file->result);
+    rpfree(file->path);
+    *file = watch->files[--watch->num_files];
+}
+
+static void
+forget_dir(struct watch* watch, size_t index) {
+    /* fails harmlessly if the directory is gone along with its
+     * watch */
+    inotify_rm_watch(watch->fd, watch->dirs[index].wd);
+    rpfree(watch->dirs[index].path);
+    watch->dirs[index] = watch->dirs[--watch->num_dirs];
+}
+
+/* Stop watching the directory `dir` and the files and directories
+ * under it, which are gone or were moved.  If they were moved within
+ * the tree they are watched again under their new name. */
+static void
+forget_tree(struct watch* watch, const char* dir) {
+    size_t len = strlen(dir);
+    size_t i = 0;
+    while (i != watch->num_files) {
+        const char* path = watch->files[i].path;
+        if (strncmp(path, dir, len) == 0 && path[len] == '/') {
+            forget_file(watch, i);
+        } else {
+            ++i;
+        }
+    }
+    i = 0;
+    while (i != watch->num_dirs) {
+        const char* path = watch->dirs[i].path;
+        if (strncmp(path, dir, len) == 0 &&
+            (path[len] == '/' || path[len] == '\0')) {
+            forget_dir(watch, i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+/* Compile the file at `path`, whose contents are now the `len` bytes
+ * at `text`, again if they changed since it was last compiled.
+ * `since` is when the change was noticed.  Frees `text`. */
+static int
+update_file(struct watch* watch, const char* path, char* text, size_t len,
+            unsigned long long since) {
+    struct watched_file* file;
+    long index = find_file(watch, path);
+    unsigned long long hash;
+    if (!text) {
+        /* gone before we got to it */
+        if (index >= 0) {
+            forget_file(watch, (size_t) index);
+        }
+        return 0;
+    }
+    hash = hash_text(text, len);
+    if (index >= 0) {
+        file = &watch->files[index];
+        if (file->hash == hash) {
+            rpfree(text);
+            fprintf(stderr, "shiv watch: %s unchanged\n", path);
+            return 0;
+        }
+        destroy_compiled_file(&file->result);
+    } else {
+        if (grow((void**) &watch->files, &watch->files_cap,
+                 watch->num_files, sizeof(*watch->files))) {
+            rpfree(text);
+            return -1;
+        }
+        file = &watch->files[watch->num_files];
+        file->path = rpmalloc(strlen(path) + 1);
+        if (!file->path) {
+            rpfree(text);
+            return -1;
+        }
+        strcpy(file->path, path);
+        ++watch->num_files;
+    }
+    file->hash = hash;
+    /* the tokens and declarations point at the file name */
+    watch->args.file = file->path;
+    file->status = compile_text(&watch->args, text, len, &file->result);
+    rpfree(text);
+    fprintf(stderr, "shiv watch: %s %s in %llu us\n", path,
+            file->status ? "failed" : "compiled",
+            (now_nanoseconds() - since) / 1000);
+    return 0;
+}
+
+static int
+refresh_file(struct watch* watch, const char* path,
+             unsigned long long since) {
+    size_t len;
+    char* text = read_text(path, &len);
+    return update_file(watch, path, text, len, since);
+}
+
+/* The sources found while walking a directory tree. */
+struct found_sources {
+    char** paths;
+    size_t len, cap;
+    struct watch* watch;
+    unsigned long long since;
+};
+
+static int
+source_loaded(void* data, size_t index, char* text, size_t len,
+              int error) {
+    struct found_sources* found = data;
+    if (!text) {
+        print_error("Cannot read %s: %s", found->paths[index],
+                    strerror(error));
+    }
+    return update_file(found->watch, found->paths[index], text, len,
+                       found->since);
+}
+
+static long
+find_dir(const struct watch* watch, int wd) {
+    size_t i;
+    for (i = 0; i != watch->num_dirs; ++i) {
+        if (watch->dirs[i].wd == wd) {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+/* Watch the directory `path` and everything under it and add the
+ * sources in it to `found`.  Symbolic links to directories aren't
+ * followed so a link to a parent can't make it go round in
+ * circles. */
+static int
+watch_dir(struct watch* watch, const char* path,
+          struct found_sources* found) {
+    struct dirent* entry;
+    DIR* stream;
+    char* copy;
+    long index;
+    int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        print_error("Cannot watch %s: %s", path, strerror(errno));
+        return -1;
+    }
+    copy = rpmalloc(strlen(path) + 1);
+    if (!copy) {
+        return -1;
+    }
+    strcpy(copy, path);
+    /* inotify gives a directory that is watched already the same
+     * descriptor, which happens when it is scanned again */
+    index = find_dir(watch, wd);
+    if (index >= 0) {
+        rpfree(watch->dirs[index].path);
+        watch->dirs[index].path = copy;
+    } else {
+        if (grow((void**) &watch->dirs, &watch->dirs_cap, watch->num_dirs,
+                 sizeof(*watch->dirs))) {
+            rpfree(copy);
+            return -1;
+        }
+        watch->dirs[watch->num_dirs].wd = wd;
+        watch->dirs[watch->num_dirs].path = copy;
+        ++watch->num_dirs;
+    }
+
+    stream = opendir(path);
+    if (!stream) {
+        print_error("Cannot read directory %s: %s", path, strerror(errno));
+        return -1;
+    }
+    while ((entry = readdir(stream))) {
+        struct stat st;
+        char* child;
+        int res = 0;
+        /* skips . and .. as well as .git and the like */
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        child = join_path(path, entry->d_name);
+        if (!child) {
+            closedir(stream);
+            return -1;
+        }
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            res = watch_dir(watch, child, found);
+        } else if (is_source(entry->d_name)) {
+            if (grow((void**) &found->paths, &found->cap, found->len,
+                     sizeof(char*))) {
+                res = -1;
+            } else {
+                /* freed once the sources are compiled */
+                found->paths[found->len++] = child;
+                child = 0;
+            }
+        }
+        rpfree(child);
+        if (res) {
+            closedir(stream);
+            return -1;
+        }
+    }
+    closedir(stream);
+    return 0;
+}
+
+/* Watch the directory `path` and everything under it and compile the
+ * sources in it, which are read all at once and each compiled as soon
+ * as it has been read. */
+static int
+watch_tree(struct watch* watch, const char* path) {
+    struct found_sources found;
+    size_t i;
+    int res;
+    found.paths = 0;
+    found.len = 0;
+    found.cap = 0;
+    found.watch = watch;
+    found.since = now_nanoseconds();
+    res = watch_dir(watch, path, &found);
+    if (res == 0) {
+        res = load_files((const char* const*) found.paths, found.len,
+                         watch->args.num_threads,
+                         watch->args.no_io_uring ? load_no_io_uring : 0,
+                         source_loaded, &found);
+    }
+    for (i = 0; i != found.len; ++i) {
+        rpfree(found.paths[i]);
+    }
+    rpfree(found.paths);
+    return res;
+}
+
+/* Catch up after inotify dropped events: forget what is gone and
+ * scan the whole tree again, which only compiles the files that
+ * changed. */
+static int
+rescan(struct watch* watch) {
+    struct stat st;
+    size_t i = 0;
+    while (i != watch->num_files) {
+        if (stat(watch->files[i].path, &st)) {
+            forget_file(watch, i);
+        } else {
+            ++i;
+        }
+    }
+    i = 0;
+    while (i != watch->num_dirs) {
+        if (stat(watch->dirs[i].path, &st)) {
+            forget_dir(watch, i);
+        } else {
+            ++i;
+        }
+    }
+    return watch_tree(watch, watch->root);
+}
+
+static int
+handle_event(struct watch* watch, const struct inotify_event* event,
+             unsigned long long since) {
+    long dir = find_dir(watch, event->wd);
+    char* path;
+    int res = 0;
+    if (dir < 0) {
+        return 0;
+    }
+    if (event->mask & IN_IGNORED) {
+        /* the directory itself is gone */
+        rpfree(watch->dirs[dir].path);
+        watch->dirs[dir] = watch->dirs[--watch->num_dirs];
+        return 0;
+    }
+    if (!event->len || event->name[0] == '.') {
+        return 0;
+    }
+    path = join_path(watch->dirs[dir].path, event->name);
+    if (!path) {
+        return -1;
+    }
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            res = watch_tree(watch, path);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            forget_tree(watch, path);
+        }
+    } else if (is_source(event->name)) {
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            long index = find_file(watch, path);
+            if (index >= 0) {
+                forget_file(watch, (size_t) index);
+            }
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            res = refresh_file(watch, path, since);
+        }
+    }
+    rpfree(path);
+    return res;
+}
+
+/* Handle the events read in one go.  Returns -1 on errors. */
+static int
+read_events(struct watch* watch) {
+    union {
+        struct inotify_event event;
+        char bytes[64 * 1024];
+    } buffer;
+    ssize_t len = read(watch->fd, buffer.bytes, sizeof(buffer.bytes));
+    unsigned long long since = now_nanoseconds();
+    ssize_t offset = 0;
+    int res = 0;
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        print_error("Cannot read inotify events: %s", strerror(errno));
+        return -1;
+    }
+    while (res == 0 && offset < len) {
+        const struct inotify_event* event =
+            (const struct inotify_event*) (buffer.bytes + offset);
+        if (event->mask & IN_Q_OVERFLOW) {
+            print_warning("Missed changes, scanning %s again",
+                          watch->root);
+            res = rescan(watch);
+        } else {
+            res = handle_event(watch, event, since);
+        }
+        offset += (ssize_t) (sizeof(*event) + event->len);
+    }
+    flush_diagnostics();
+    return res;
+}
+
+static void
+destroy_watch(struct watch* watch) {
+    size_t i;
+    for (i = 0; i != watch->num_files; ++i) {
+        destroy_compiled_file(&watch->files[i].result);
+        rpfree(watch->files[i].path);
+    }
+    for (i = 0; i != watch->num_dirs; ++i) {
+        rpfree(watch->dirs[i].path);
+    }
+    rpfree(watch->files);
+    rpfree(watch->dirs);
+    close(watch->fd);
+}
+
+int
+run_watch(const char* dir, size_t argc, char** argv) {
+    struct watch watch;
+    struct sigaction action;
+    char** words;
+    int res = -1;
+
+    /* parse the arguments as if the directory were the file */
+    words = rpmalloc((argc + 1) * sizeof(char*));
+    if (!words) {
+        return -1;
+    }
+    memcpy(words, argv, argc * sizeof(char*));
+    words[argc] = (char*) dir;
+    res = parse_arguments(&watch.args, argc + 1, words);
+    rpfree(words);
+    if (res) {
+        return -1;
+    }
+    if (watch.args.output_file || watch.args.stream ||
+        watch.args.trace_file) {
+        print_error("-o, -compiler-stream and -compiler-trace= cannot be "
+                    "used with --watch");
+        return -1;
+    }
+
+    watch.fd = inotify_init1(IN_CLOEXEC);
+    if (watch.fd < 0) {
+        print_error("Cannot use inotify: %s", strerror(errno));
+        return -1;
+    }
+    watch.root = dir;
+    watch.dirs = 0;
+    watch.num_dirs = 0;
+    watch.dirs_cap = 0;
+    watch.files = 0;
+    watch.num_files = 0;
+    watch.files_cap = 0;
+
+    /* stop reading events on ^C so everything is released */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    res = watch_tree(&watch, dir);
+    if (res == 0) {
+        fprintf(stderr, "shiv watch: watching %lu files in %lu "
+                "directories\n", (unsigned long) watch.num_files,
+                (unsigned long) watch.num_dirs);
+    }
+    while (res == 0 && !interrupted) {
+        res = read_events(&watch);
+    }
+    destroy_watch(&watch);
+    return res;
+}
+
+#ifdef TEST_MODE
+#include <stdlib.h>
+#include "../cutil/test.h"
+
+static int
+write_test_file(const char* path, const char* text) {
+    FILE* file = fopen(path, "w");
+    int res;
+    if (!file) {
+        return -1;
+    }
+    res = fputs(text, file) < 0;
+    return fclose(file) || res ? -1 : 0;
+}
+
+static long
+find_dir_path(const struct watch* watch, const char* path) {
+    size_t i;
+    for (i = 0; i != watch->num_dirs; ++i) {
+        if (strcmp(watch->dirs[i].path, path) == 0) {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+static const char test_watch_first[] =
+    "f := fun (a : std::i64) -> std::i64 {\n    return a;\n}\n";
+static const char test_watch_second[] =
+    "g := fun (a : std::i64) -> std::i64 {\n    return a + a;\n}\n";
+
+/* A link back up the tree isn't followed, a renamed directory is
+ * watched under its new name and a rescan catches up with changes
+ * whose events were missed. */
+TEST(test_watch_tree) {
+    char root[] = "/tmp/shiv_watch_XXXXXX";
+    char a[sizeof(root) + 2], b[sizeof(root) + 2];
+    char up[sizeof(root) + 5], old_x[sizeof(root) + 9];
+    char x[sizeof(root) + 9], y[sizeof(root) + 9];
+    char* words[1];
+    struct watch watch;
+    int watching = 0;
+    long index;
+    ASSERT(mkdtemp(root), end);
+    snprintf(a, sizeof(a), "%s/a", root);
+    snprintf(b, sizeof(b), "%s/b", root);
+    snprintf(up, sizeof(up), "%s/a/up", root);
+    snprintf(old_x, sizeof(old_x), "%s/a/x.shiv", root);
+    snprintf(x, sizeof(x), "%s/b/x.shiv", root);
+    snprintf(y, sizeof(y), "%s/b/y.shiv", root);
+    ASSERT(mkdir(a, 0700) == 0, cleanup);
+    ASSERT(write_test_file(old_x, test_watch_first) == 0, cleanup);
+    ASSERT(symlink("..", up) == 0, cleanup);
+
+    words[0] = root;
+    ASSERT(parse_arguments(&watch.args, 1, words) == 0, cleanup);
+    watch.root = root;
+    watch.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    watch.dirs = 0;
+    watch.num_dirs = 0;
+    watch.dirs_cap = 0;
+    watch.files = 0;
+    watch.num_files = 0;
+    watch.files_cap = 0;
+    ASSERT(watch.fd >= 0, cleanup);
+    watching = 1;
+    ASSERT(watch_tree(&watch, root) == 0, cleanup);
+    ASSERT(watch.num_dirs == 2 && watch.num_files == 1, cleanup);
+
+    ASSERT(rename(a, b) == 0, cleanup);
+    ASSERT(read_events(&watch) == 0, cleanup);
+    ASSERT(find_dir_path(&watch, a) < 0, cleanup);
+    ASSERT(find_dir_path(&watch, b) >= 0, cleanup);
+    ASSERT(find_file(&watch, old_x) < 0, cleanup);
+    ASSERT(find_file(&watch, x) >= 0, cleanup);
+    /* events from the renamed directory come under its new name */
+    ASSERT(write_test_file(x, test_watch_second) == 0, cleanup);
+    ASSERT(read_events(&watch) == 0, cleanup);
+    index = find_file(&watch, x);
+    ASSERT(index >= 0, cleanup);
+    ASSERT(watch.files[index].hash ==
+           hash_text(test_watch_second, strlen(test_watch_second)),
+           cleanup);
+    ASSERT(watch.files[index].status == 0, cleanup);
+
+    ASSERT(remove(x) == 0, cleanup);
+    ASSERT(write_test_file(y, test_watch_first) == 0, cleanup);
+    ASSERT(rescan(&watch) == 0, cleanup);
+    ASSERT(watch.num_files == 1 && find_file(&watch, y) >= 0, cleanup);
+    ASSERT(watch.num_dirs == 2, cleanup);
+cleanup:
+    if (watching) {
+        destroy_watch(&watch);
+    }
+    remove(old_x);
+    remove(x);
+    remove(y);
+    remove(up);
+    snprintf(up, sizeof(up), "%s/b/up", root);
+    remove(up);
+    rmdir(a);
+    rmdir(b);
+    rmdir(root);
+end:;
+}
+END_TEST
+
+void test_watch(void) {
+    RUN(test_watch_tree);
+}
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifndef HEADER_GUARD_WATCH_H
+#define HEADER_GUARD_WATCH_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compile every .shiv file under the directory `dir` with the
+ * compiler arguments `argv`, then watch the directory with inotify and
+ * compile each file again whenever its contents change.  The tokens
+ * and declarations of every file are kept, so an event for a file
+ * whose contents hash the same as before does nothing.  Runs until
+ * interrupted. */
+int run_watch(const char* dir, size_t argc, char** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
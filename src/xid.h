@@ -0,0 +1,20 @@
+#pragma once
+
+#ifndef HEADER_GUARD_XID_H
+#define HEADER_GUARD_XID_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Whether the non-ASCII code point `cp` can start an identifier. */
+int is_xid_start(unsigned long cp);
+/* Whether the non-ASCII code point `cp` can continue an
+ * identifier. */
+int is_xid_continue(unsigned long cp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif